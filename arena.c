@@ -0,0 +1,161 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+// Temporaries that live until the end of the command that made them come
+// from a bump allocator and go all at once in arena_reset. Sector and cluster
+// buffers, which a command may need again and again, are handed back to a
+// small pool instead. Both are per thread, like the command output streams.
+typedef struct ArenaChunk {
+
+  struct ArenaChunk* next; // older chunk
+  size_t size;
+  size_t used;
+  uint8_t* data;
+} ArenaChunk_t;
+
+typedef struct {
+
+  uint8_t* data;
+  size_t size;
+} PoolBuffer_t;
+
+static __thread struct {
+
+  ArenaChunk_t* chunks; // newest first
+  PoolBuffer_t idle[BUFFER_POOL_MAX];
+  uint32_t idle_count;
+} arena;
+
+static size_t round_up(size_t size, size_t align) {
+
+  return (size + align - 1) & ~(align - 1);
+}
+
+static ArenaChunk_t* add_chunk(size_t size) {
+
+  ArenaChunk_t* chunk = malloc(sizeof(ArenaChunk_t));
+  uint8_t* data = NULL;
+  if (!chunk || posix_memalign((void**)&data, ARENA_ALIGN, size) != 0) {
+
+    free(chunk);
+    return NULL;
+  }
+  chunk->next = arena.chunks;
+  chunk->size = size;
+  chunk->used = 0;
+  chunk->data = data;
+  arena.chunks = chunk;
+  return chunk;
+}
+
+// Memory valid until the next arena_reset on this thread; never freed alone
+void* arena_alloc(size_t size) {
+
+  size = round_up(size ? size : 1, ARENA_ALIGN);
+  ArenaChunk_t* chunk = arena.chunks;
+  if (!chunk || chunk->size - chunk->used < size) {
+
+    chunk = add_chunk((size > ARENA_CHUNK_BYTES) ? size : ARENA_CHUNK_BYTES);
+    if (!chunk) {
+
+      return NULL;
+    }
+  }
+  void* block = chunk->data + chunk->used;
+  chunk->used += size;
+  return block;
+}
+
+void* arena_calloc(size_t count, size_t size) {
+
+  if (size != 0 && count > SIZE_MAX / size) {
+
+    return NULL;
+  }
+  void* block = arena_alloc(count * size);
+  if (block) {
+
+    memset(block, 0, count * size);
+  }
+  return block;
+}
+
+// Ends a command: everything it took from the arena goes, except one chunk
+// of the usual size kept for the next command
+void arena_reset(void) {
+
+  ArenaChunk_t* keep = NULL;
+  while (arena.chunks) {
+
+    ArenaChunk_t* chunk = arena.chunks;
+    arena.chunks = chunk->next;
+    if (!keep && chunk->size == ARENA_CHUNK_BYTES) {
+
+      keep = chunk;
+      continue;
+    }
+    free(chunk->data);
+    free(chunk);
+  }
+  if (keep) {
+
+    keep->used = 0;
+    keep->next = NULL;
+    arena.chunks = keep;
+  }
+}
+
+// Frees everything the thread holds, for threads that are about to exit
+void arena_release(void) {
+
+  arena_reset();
+  if (arena.chunks) {
+
+    free(arena.chunks->data);
+    free(arena.chunks);
+    arena.chunks = NULL;
+  }
+  for (uint32_t i = 0; i < arena.idle_count; i++) {
+
+    free(arena.idle[i].data);
+  }
+  arena.idle_count = 0;
+}
+
+// A page-aligned buffer of size bytes; hand it back with buffer_give
+uint8_t* buffer_take(size_t size) {
+
+  for (uint32_t i = arena.idle_count; i-- > 0;) {
+
+    if (arena.idle[i].size == size) {
+
+      uint8_t* data = arena.idle[i].data;
+      arena.idle[i] = arena.idle[--arena.idle_count];
+      return data;
+    }
+  }
+  uint8_t* data = NULL;
+  if (posix_memalign((void**)&data, BUFFER_ALIGN, size ? size : 1) != 0) {
+
+    return NULL;
+  }
+  return data;
+}
+
+// size is what the buffer was taken with
+void buffer_give(uint8_t* buffer, size_t size) {
+
+  if (!buffer) {
+
+    return;
+  }
+  if (arena.idle_count == BUFFER_POOL_MAX) {
+
+    // the oldest idle buffer makes room
+    free(arena.idle[0].data);
+    arena.idle[0] = arena.idle[--arena.idle_count];
+  }
+  arena.idle[arena.idle_count++] = (PoolBuffer_t){buffer, size};
+}
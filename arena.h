@@ -0,0 +1,19 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_CHUNK_BYTES (256 * 1024) // a chunk this size survives arena_reset
+#define ARENA_ALIGN 16
+#define BUFFER_ALIGN 4096 // sector and cluster buffers start on a page
+#define BUFFER_POOL_MAX 8 // idle buffers a thread keeps for reuse
+
+void* arena_alloc(size_t size);
+void* arena_calloc(size_t count, size_t size);
+void arena_reset(void);
+void arena_release(void);
+uint8_t* buffer_take(size_t size);
+void buffer_give(uint8_t* buffer, size_t size);
+
+#endif // ARENA_H
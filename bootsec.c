@@ -1,14 +1,15 @@
 #include "bootsec.h"
+#include "directory.h"
+#include "utility.h"
 #include <stdio.h>
 
 int read_boot_sector(FILE* disk, BootSec_t* boot_sec) {
 
-  fseek(disk, 0, SEEK_SET);
-  size_t res = fread(boot_sec, sizeof(BootSec_t), 1, disk);
-  if (res != 1) {
+  if (image_pread(disk, boot_sec, sizeof(BootSec_t), 0) != sizeof(BootSec_t)) {
 
-    fprintf(stderr, "Failed to read boot sector\n");
+    fprintf(cmd_err(), "Failed to read boot sector\n");
     return -1;
   }
+  geometry_select(boot_sec);
   return 0;
 }
@@ -17,16 +17,45 @@ pub fn build(b: *std.Build) void {
     });
 
     const c_files = [_][]const u8{
+        "arena.c",
         "bootsec.c",
+        "build_image.c",
+        "cat.c",
         "cd.c",
+        "crc32c.c",
         "create_disk.c",
+        "defrag.c",
+        "diff.c",
         "directory.c",
+        "dirsort.c",
+        "du.c",
+        "extent.c",
+        "fat.c",
+        "find.c",
         "format_disk.c",
+        "integrity.c",
+        "journal.c",
         "ls.c",
         "main.c",
         "mkdir.c",
+        "overlay.c",
+        "pathindex.c",
+        "populate.c",
+        "prefetch.c",
+        "readahead.c",
+        "rm.c",
+        "scrub.c",
+        "server.c",
+        "shortname.c",
+        "sparse.c",
+        "stamp.c",
         "utility.c",
         "touch.c",
+        "trace.c",
+        "tree.c",
+        "unicode.c",
+        "usage.c",
+        "walk.c",
     };
 
     for (c_files) |file| {
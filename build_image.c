@@ -0,0 +1,965 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bootsec.h"
+#include "directory.h"
+#include "fat.h"
+#include "fsinfo.h"
+#include "shortname.h"
+#include "unicode.h"
+#include "utility.h"
+
+#define BUILD_SECTOR_SIZE 512
+#define BUILD_RSVD_SECTORS 32
+#define BUILD_NUM_FATS 2
+#define BUILD_STREAM_BYTES (1024 * 1024)
+#define BUILD_MIN_HOLE (64 * 1024) // shorter zero runs are written, longer ones skipped
+#define BUILD_MAX_FILE 0xFFFFFFFFULL
+#define BUILD_LINE_MAX 4096
+#define FAT_EOC 0x0FFFFFFF
+#define FAT32_MIN_CLUSTERS 65525 // with fewer, the volume is FAT16 by definition
+
+// One file or directory of the image. Every node owns one contiguous run of
+// clusters, assigned before anything is written.
+typedef struct {
+
+  char* name; // UTF-8, NULL for the root
+  char* source; // host file with the contents, NULL for directories
+  uint8_t is_dir;
+  uint64_t size;
+  uint16_t date;
+  uint16_t time;
+  uint32_t parent;
+  uint32_t* children;
+  uint32_t child_count;
+  uint32_t child_capacity;
+  char short_name[SHORT_NAME_LEN];
+  uint8_t nt_res;
+  uint8_t lfn_slots;
+  uint32_t first_cluster;
+  uint32_t clusters;
+} BuildNode_t;
+
+typedef struct {
+
+  BuildNode_t* nodes;
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t* order; // nodes owning clusters, in cluster order
+  uint32_t order_count;
+  uint32_t cluster_size;
+  uint32_t used_clusters;
+  BootSec_t boot_sec;
+  int failed;
+} Build_t;
+
+// Sequential writer; runs of zeros become holes when the output can seek
+typedef struct {
+
+  int fd;
+  int seekable;
+  uint8_t* buffer;
+  size_t used;
+  uint64_t pending_zeros;
+  uint64_t written;
+  int failed;
+} ImageStream_t;
+
+// UTC, so the same tree gives the same image in every time zone
+static void fat_stamp(time_t when, uint16_t* date, uint16_t* time_of_day) {
+
+  struct tm* t = gmtime(&when);
+  if (!t || t->tm_year < 80) {
+
+    *date = (1 << 5) | 1; // 1980-01-01, the earliest FAT date
+    *time_of_day = 0;
+    return;
+  }
+  *date = ((t->tm_year - 80) << 9) | ((t->tm_mon + 1) << 5) | t->tm_mday;
+  *time_of_day = (t->tm_hour << 11) | (t->tm_min << 5) | (t->tm_sec / 2);
+}
+
+static uint32_t add_node(Build_t* build, uint32_t parent, const char* name, uint8_t is_dir,
+                         uint64_t size, const char* source, time_t mtime) {
+
+  if (build->count == build->capacity) {
+
+    uint32_t capacity = build->capacity ? build->capacity * 2 : 256;
+    BuildNode_t* nodes = realloc(build->nodes, capacity * sizeof(BuildNode_t));
+    if (!nodes) {
+
+      build->failed = 1;
+      return 0;
+    }
+    build->nodes = nodes;
+    build->capacity = capacity;
+  }
+  uint32_t index = build->count;
+  BuildNode_t* node = &build->nodes[index];
+  memset(node, 0, sizeof(BuildNode_t));
+  node->name = name ? strdup(name) : NULL;
+  node->source = source ? strdup(source) : NULL;
+  node->is_dir = is_dir;
+  node->size = size;
+  node->parent = parent;
+  fat_stamp(mtime, &node->date, &node->time);
+  if ((name && !node->name) || (source && !node->source)) {
+
+    free(node->name); // the node is not counted, so free_build will not see it
+    free(node->source);
+    build->failed = 1;
+    return 0;
+  }
+  build->count++;
+
+  if (index != parent) {
+
+    BuildNode_t* dir = &build->nodes[parent];
+    if (dir->child_count == dir->child_capacity) {
+
+      uint32_t capacity = dir->child_capacity ? dir->child_capacity * 2 : 8;
+      uint32_t* children = realloc(dir->children, capacity * sizeof(uint32_t));
+      if (!children) {
+
+        build->failed = 1;
+        return 0;
+      }
+      dir->children = children;
+      dir->child_capacity = capacity;
+    }
+    dir->children[dir->child_count++] = index;
+  }
+  return index;
+}
+
+static int find_child(const Build_t* build, uint32_t dir, const char* name) {
+
+  const BuildNode_t* node = &build->nodes[dir];
+  for (uint32_t i = 0; i < node->child_count; i++) {
+
+    if (utf8_casecmp(build->nodes[node->children[i]].name, name) == 0) {
+
+      return (int)node->children[i];
+    }
+  }
+  return -1;
+}
+
+static int check_name(const char* name) {
+
+  size_t len = strlen(name);
+  if (len == 0 || utf8_to_utf16(name, len, NULL, 0) > MAX_MAME_LEN) {
+
+    fprintf(stderr, "Invalid or too long name: %s\n", name);
+    return 1;
+  }
+  return 0;
+}
+
+static int child_compare(const void* a, const void* b, void* nodes) {
+
+  const BuildNode_t* all = nodes;
+  return strcmp(all[*(const uint32_t*)a].name, all[*(const uint32_t*)b].name);
+}
+
+static void sort_children(Build_t* build, uint32_t dir) {
+
+  BuildNode_t* node = &build->nodes[dir];
+  qsort_r(node->children, node->child_count, sizeof(uint32_t), child_compare, build->nodes);
+}
+
+static void scan_host_dir(Build_t* build, uint32_t dir, const char* path) {
+
+  DIR* handle = opendir(path);
+  if (!handle) {
+
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    build->failed = 1;
+    return;
+  }
+
+  struct dirent* item;
+  while (!build->failed && (item = readdir(handle)) != NULL) {
+
+    if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0) {
+
+      continue;
+    }
+    char child_path[BUILD_LINE_MAX];
+    struct stat st;
+    snprintf(child_path, sizeof(child_path), "%s/%s", path, item->d_name);
+    if (lstat(child_path, &st) != 0 || (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))) {
+
+      continue; // links, devices and sockets have no FAT equivalent
+    }
+    if (check_name(item->d_name) != 0 || find_child(build, dir, item->d_name) >= 0) {
+
+      fprintf(stderr, "Cannot add %s\n", child_path);
+      build->failed = 1;
+      break;
+    }
+    if (S_ISREG(st.st_mode) && (uint64_t)st.st_size > BUILD_MAX_FILE) {
+
+      fprintf(stderr, "%s is too large for FAT32\n", child_path);
+      build->failed = 1;
+      break;
+    }
+    uint32_t child = add_node(build, dir, item->d_name, S_ISDIR(st.st_mode),
+                              S_ISDIR(st.st_mode) ? 0 : st.st_size,
+                              S_ISDIR(st.st_mode) ? NULL : child_path, st.st_mtime);
+    if (!build->failed && S_ISDIR(st.st_mode)) {
+
+      scan_host_dir(build, child, child_path);
+    }
+  }
+  closedir(handle);
+  sort_children(build, dir);
+}
+
+// Walks path from the root, creating missing directories on the way, and
+// returns the directory that will hold its last component
+static int manifest_parent(Build_t* build, char* path, char** leaf, time_t mtime) {
+
+  uint32_t dir = 0;
+  char* component = path;
+  char* slash;
+  while ((slash = strchr(component, '/')) != NULL) {
+
+    *slash = '\0';
+    if (*component != '\0') {
+
+      int child = find_child(build, dir, component);
+      if (child < 0) {
+
+        if (check_name(component) != 0) {
+
+          return -1;
+        }
+        child = add_node(build, dir, component, 1, 0, NULL, mtime);
+      } else if (!build->nodes[child].is_dir) {
+
+        fprintf(stderr, "%s is not a directory\n", component);
+        return -1;
+      }
+      dir = child;
+    }
+    component = slash + 1;
+  }
+  *leaf = component;
+  return (int)dir;
+}
+
+// Manifest lines, fields separated by tabs, '#' starts a comment:
+//   dir   PATH
+//   file  PATH  HOST_FILE
+static void parse_manifest(Build_t* build, const char* manifest) {
+
+  FILE* file = fopen(manifest, "r");
+  struct stat manifest_st;
+  if (!file || fstat(fileno(file), &manifest_st) != 0) {
+
+    fprintf(stderr, "Failed to open manifest %s\n", manifest);
+    build->failed = 1;
+    if (file) {
+
+      fclose(file);
+    }
+    return;
+  }
+
+  char line[BUILD_LINE_MAX];
+  uint32_t line_no = 0;
+  while (!build->failed && fgets(line, sizeof(line), file)) {
+
+    line_no++;
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#') {
+
+      continue;
+    }
+    char* kind = strtok(line, "\t");
+    char* path = strtok(NULL, "\t");
+    char* source = strtok(NULL, "\t");
+    int is_dir = kind && strcmp(kind, "dir") == 0;
+    if (!path || (!is_dir && (!kind || strcmp(kind, "file") != 0 || !source))) {
+
+      fprintf(stderr, "%s:%u: expected 'dir<TAB>PATH' or 'file<TAB>PATH<TAB>HOST_FILE'\n",
+              manifest, line_no);
+      build->failed = 1;
+      break;
+    }
+
+    char* leaf;
+    int dir = manifest_parent(build, path, &leaf, manifest_st.st_mtime);
+    if (dir < 0 || (*leaf == '\0' && !is_dir)) {
+
+      fprintf(stderr, "%s:%u: invalid path\n", manifest, line_no);
+      build->failed = 1;
+      break;
+    }
+    if (*leaf == '\0') {
+
+      continue; // "dir a/b/" named a directory that now exists
+    }
+    int existing = find_child(build, dir, leaf);
+    if (existing >= 0) {
+
+      if (!(is_dir && build->nodes[existing].is_dir)) {
+
+        fprintf(stderr, "%s:%u: %s already exists\n", manifest, line_no, leaf);
+        build->failed = 1;
+      }
+      continue;
+    }
+    if (check_name(leaf) != 0) {
+
+      build->failed = 1;
+      break;
+    }
+    if (is_dir) {
+
+      add_node(build, dir, leaf, 1, 0, NULL, manifest_st.st_mtime);
+      continue;
+    }
+    struct stat st;
+    if (stat(source, &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size > BUILD_MAX_FILE) {
+
+      fprintf(stderr, "%s:%u: cannot use %s\n", manifest, line_no, source);
+      build->failed = 1;
+      break;
+    }
+    add_node(build, dir, leaf, 0, st.st_size, source, st.st_mtime);
+  }
+  fclose(file);
+  for (uint32_t i = 0; i < build->count && !build->failed; i++) {
+
+    if (build->nodes[i].is_dir) {
+
+      sort_children(build, i);
+    }
+  }
+}
+
+// Whether name is a valid 8.3 name as it stands, case aside. Each part must be
+// in a single case so that NTRes can record it without a long name.
+static int fits_short_name(const char* name, char* short_name, uint8_t* nt_res) {
+
+  const char* dot = strrchr(name, '.');
+  size_t base_len = dot ? (size_t)(dot - name) : strlen(name);
+  size_t ext_len = dot ? strlen(dot + 1) : 0;
+  if (base_len == 0 || base_len > 8 || ext_len > 3 || (dot && ext_len == 0)) {
+
+    return 0;
+  }
+
+  memset(short_name, ' ', SHORT_NAME_LEN);
+  *nt_res = 0;
+  for (int part = 0; part < 2; part++) {
+
+    const char* src = part ? (dot ? dot + 1 : "") : name;
+    size_t len = part ? ext_len : base_len;
+    int lower = 0, upper = 0;
+    for (size_t i = 0; i < len; i++) {
+
+      uint8_t c = (uint8_t)src[i];
+      if (c < 0x21 || c >= 0x7F || c == '.' || strchr("\"*+,/:;<=>?[\\]|", c)) {
+
+        return 0;
+      }
+      lower |= (c >= 'a' && c <= 'z');
+      upper |= (c >= 'A' && c <= 'Z');
+      short_name[(part ? 8 : 0) + i] = (c >= 'a' && c <= 'z') ? c - 32 : c;
+    }
+    if (lower && upper) {
+
+      return 0;
+    }
+    if (lower) {
+
+      *nt_res |= part ? NT_RES_LOWER_CASE_EXT : NT_RES_LOWER_CASE_BASE;
+    }
+  }
+  return 1;
+}
+
+static void short_basis(const char* name, char* short_name) {
+
+  memset(short_name, ' ', SHORT_NAME_LEN);
+  const char* dot = strrchr(name, '.');
+  if (dot == name) {
+
+    dot = NULL;
+  }
+  const char* base_end = dot ? dot : name + strlen(name);
+  int i = 0;
+  for (const char* p = name; i < 8 && p < base_end; p++) {
+
+    short_name[i++] = (*p >= 'a' && *p <= 'z') ? *p - 32 : *p;
+  }
+  i = 8;
+  for (const char* p = dot ? dot + 1 : base_end; i < SHORT_NAME_LEN && *p; p++) {
+
+    short_name[i++] = (*p >= 'a' && *p <= 'z') ? *p - 32 : *p;
+  }
+}
+
+// Gives every child of dir its 8.3 name. Exact 8.3 names are claimed first so
+// that generated tails never take them.
+static int assign_short_names(Build_t* build, uint32_t dir) {
+
+  BuildNode_t* node = &build->nodes[dir];
+  ShortNameSet_t names;
+  if (short_name_set_init(&names, node->child_count + 2) != 0) {
+
+    return 1;
+  }
+  short_name_set_add(&names, ".          ");
+  short_name_set_add(&names, "..         ");
+
+  for (uint32_t i = 0; i < node->child_count; i++) {
+
+    BuildNode_t* child = &build->nodes[node->children[i]];
+    if (fits_short_name(child->name, child->short_name, &child->nt_res) &&
+        !short_name_set_contains(&names, child->short_name)) {
+
+      short_name_set_add(&names, child->short_name);
+      child->lfn_slots = 0;
+    } else {
+
+      child->lfn_slots = UINT8_MAX; // needs a long name, see below
+    }
+  }
+
+  int failed = 0;
+  for (uint32_t i = 0; i < node->child_count && !failed; i++) {
+
+    BuildNode_t* child = &build->nodes[node->children[i]];
+    if (child->lfn_slots != UINT8_MAX) {
+
+      continue;
+    }
+    short_basis(child->name, child->short_name);
+    child->nt_res = 0;
+    size_t units = utf8_to_utf16(child->name, strlen(child->name), NULL, 0);
+    child->lfn_slots = (units + 12) / 13;
+    failed = short_name_make_unique(&names, child->name, child->short_name);
+  }
+  short_name_set_free(&names);
+  return failed;
+}
+
+static uint32_t dir_bytes(const Build_t* build, uint32_t dir) {
+
+  const BuildNode_t* node = &build->nodes[dir];
+  uint32_t slots = (dir == 0) ? 0 : 2;
+  for (uint32_t i = 0; i < node->child_count; i++) {
+
+    slots += build->nodes[node->children[i]].lfn_slots + 1;
+  }
+  return slots * sizeof(DIRStr_t);
+}
+
+static int push_order(Build_t* build, uint32_t index) {
+
+  BuildNode_t* node = &build->nodes[index];
+  uint64_t bytes = node->is_dir ? dir_bytes(build, index) : node->size;
+  node->clusters = (bytes + build->cluster_size - 1) / build->cluster_size;
+  if (node->is_dir && node->clusters == 0) {
+
+    node->clusters = 1;
+  }
+  if (node->clusters == 0) {
+
+    return 0; // empty files own no cluster
+  }
+  node->first_cluster = 2 + build->used_clusters;
+  build->used_clusters += node->clusters;
+  build->order[build->order_count++] = index;
+  return 0;
+}
+
+// Depth-first: a directory's clusters are followed by its files and then by
+// each subdirectory in turn, so reading the tree back is one forward sweep
+static void layout_dir(Build_t* build, uint32_t dir) {
+
+  BuildNode_t* node = &build->nodes[dir];
+  for (uint32_t i = 0; i < node->child_count; i++) {
+
+    if (!build->nodes[node->children[i]].is_dir) {
+
+      push_order(build, node->children[i]);
+    }
+  }
+  for (uint32_t i = 0; i < node->child_count; i++) {
+
+    uint32_t child = node->children[i];
+    if (build->nodes[child].is_dir) {
+
+      push_order(build, child);
+      layout_dir(build, child);
+    }
+  }
+}
+
+static uint8_t pick_sec_per_clus(uint64_t bytes) {
+
+  if (bytes <= 260ULL * 1024 * 1024) {
+
+    return 1;
+  }
+  if (bytes <= 8ULL * 1024 * 1024 * 1024) {
+
+    return 8;
+  }
+  if (bytes <= 16ULL * 1024 * 1024 * 1024) {
+
+    return 16;
+  }
+  return (bytes <= 32ULL * 1024 * 1024 * 1024) ? 32 : 64;
+}
+
+static uint32_t fat_sectors(uint32_t tot_sec, uint8_t sec_per_clus) {
+
+  uint64_t tmp1 = (uint64_t)FAT_ELEM_SIZE * (tot_sec - BUILD_RSVD_SECTORS);
+  uint64_t tmp2 = (uint64_t)sec_per_clus * BUILD_SECTOR_SIZE + FAT_ELEM_SIZE * BUILD_NUM_FATS;
+  return tmp1 / tmp2 + 1;
+}
+
+// Same boot sector layout as format_disk, sized either as requested or to
+// the content plus an eighth of slack, and never below FAT32_MIN_CLUSTERS
+static int plan_geometry(Build_t* build, uint64_t requested) {
+
+  uint64_t content = 0;
+  for (uint32_t i = 0; i < build->count; i++) {
+
+    content += build->nodes[i].is_dir ? dir_bytes(build, i) + BUILD_SECTOR_SIZE
+                                      : build->nodes[i].size + BUILD_SECTOR_SIZE;
+  }
+  uint64_t size = requested ? requested : content + content / 8 + 1024 * 1024;
+  if (size / BUILD_SECTOR_SIZE > UINT32_MAX) {
+
+    fprintf(stderr, "Image size is beyond FAT32 limits\n");
+    return 1;
+  }
+
+  BootSec_t* bs = &build->boot_sec;
+  memset(bs, 0, sizeof(BootSec_t));
+  memcpy(bs->BS_jmpBoot, "\xEB\x58\x90", 3);
+  memcpy(bs->BS_OEMName, "MYOSNAME", 8);
+  bs->BPB_BytsPerSec = BUILD_SECTOR_SIZE;
+  bs->BPB_SecPerClus = pick_sec_per_clus(size);
+  bs->BPB_RsvdSecCnt = BUILD_RSVD_SECTORS;
+  bs->BPB_NumFATs = BUILD_NUM_FATS;
+  bs->BPB_Media = 0xF8;
+  bs->BPB_SecPerTrk = 0x3F;
+  bs->BPB_NumHeads = 16;
+  bs->BPB_TotSec32 = size / BUILD_SECTOR_SIZE;
+  bs->BPB_FATSz32 = fat_sectors(bs->BPB_TotSec32, bs->BPB_SecPerClus);
+  bs->BPB_RootClus = 2;
+  bs->BPB_FSInfo = 1;
+  bs->BPB_BkBootSec = 6;
+  bs->BS_DrvNum = 0x80;
+  bs->BS_BootSig = 0x29;
+  memcpy(bs->BS_VOlLab, "NO NAME    ", 11);
+  memcpy(bs->BS_FilSysType, "FAT32   ", 8);
+  memcpy(bs->Signature_word, "\x55\xAA", 2);
+  build->cluster_size = BUILD_SECTOR_SIZE * bs->BPB_SecPerClus;
+
+  // grow until the data area holds enough clusters; the FAT grows with it
+  uint32_t clusters = cluster_count(bs) - 2;
+  while (clusters < FAT32_MIN_CLUSTERS) {
+
+    bs->BPB_TotSec32 += (FAT32_MIN_CLUSTERS - clusters) * bs->BPB_SecPerClus;
+    bs->BPB_FATSz32 = fat_sectors(bs->BPB_TotSec32, bs->BPB_SecPerClus);
+    clusters = cluster_count(bs) - 2;
+  }
+  if (requested && (uint64_t)bs->BPB_TotSec32 * BUILD_SECTOR_SIZE > size) {
+
+    fprintf(stderr, "A FAT32 image needs at least %llu bytes, %llu were requested\n",
+            (unsigned long long)bs->BPB_TotSec32 * BUILD_SECTOR_SIZE,
+            (unsigned long long)requested);
+    return 1;
+  }
+  return 0;
+}
+
+static void stream_flush(ImageStream_t* stream) {
+
+  size_t done = 0;
+  while (done < stream->used && !stream->failed) {
+
+    ssize_t res = write(stream->fd, stream->buffer + done, stream->used - done);
+    if (res <= 0) {
+
+      stream->failed = 1;
+    } else {
+
+      done += res;
+    }
+  }
+  stream->used = 0;
+}
+
+static void stream_put(ImageStream_t* stream, const void* data, size_t size, int zero) {
+
+  const uint8_t* bytes = data;
+  while (size > 0 && !stream->failed) {
+
+    size_t room = BUILD_STREAM_BYTES - stream->used;
+    size_t chunk = (size < room) ? size : room;
+    if (zero) {
+
+      memset(stream->buffer + stream->used, 0, chunk);
+    } else {
+
+      memcpy(stream->buffer + stream->used, bytes, chunk);
+      bytes += chunk;
+    }
+    stream->used += chunk;
+    stream->written += chunk;
+    size -= chunk;
+    if (stream->used == BUILD_STREAM_BYTES) {
+
+      stream_flush(stream);
+    }
+  }
+}
+
+// Long zero runs are skipped on seekable outputs; pipes get real zeros
+static void stream_settle(ImageStream_t* stream) {
+
+  uint64_t zeros = stream->pending_zeros;
+  stream->pending_zeros = 0;
+  if (zeros == 0) {
+
+    return;
+  }
+  if (!stream->seekable || zeros < BUILD_MIN_HOLE) {
+
+    stream_put(stream, NULL, zeros, 1);
+    return;
+  }
+  stream_flush(stream);
+  if (lseek(stream->fd, zeros, SEEK_CUR) < 0) {
+
+    stream->failed = 1;
+  }
+  stream->written += zeros;
+}
+
+static void stream_write(ImageStream_t* stream, const void* data, size_t size) {
+
+  stream_settle(stream);
+  stream_put(stream, data, size, 0);
+}
+
+static void stream_zero(ImageStream_t* stream, uint64_t size) {
+
+  stream->pending_zeros += size;
+}
+
+static void stream_finish(ImageStream_t* stream) {
+
+  if (stream->seekable && stream->pending_zeros >= BUILD_MIN_HOLE) {
+
+    stream_flush(stream);
+    stream->written += stream->pending_zeros;
+    stream->pending_zeros = 0;
+    if (ftruncate(stream->fd, stream->written) != 0) {
+
+      stream->failed = 1;
+    }
+  }
+  stream_settle(stream);
+  stream_flush(stream);
+}
+
+static void emit_reserved(Build_t* build, ImageStream_t* stream) {
+
+  BootSec_t* bs = &build->boot_sec;
+  uint8_t sector[BUILD_SECTOR_SIZE];
+  FSInfo_t fsinfo;
+  memset(&fsinfo, 0, sizeof(fsinfo));
+  fsinfo.FSI_Leadsig = 0x41615252;
+  fsinfo.FSI_StructSig = 0x61417272;
+  fsinfo.FSI_TrailSig = 0xAA550000;
+
+  uint32_t fat_entries = bs->BPB_FATSz32 * (BUILD_SECTOR_SIZE / FAT_ELEM_SIZE);
+  uint32_t data_clusters = (bs->BPB_TotSec32 - BUILD_RSVD_SECTORS -
+                            BUILD_NUM_FATS * bs->BPB_FATSz32) / bs->BPB_SecPerClus;
+  uint32_t usable = (data_clusters < fat_entries - 2) ? data_clusters : fat_entries - 2;
+  fsinfo.FSI_FreeCount = usable - build->used_clusters;
+  fsinfo.FSI_Nxt_Free = 2 + build->used_clusters;
+
+  for (uint32_t i = 0; i < BUILD_RSVD_SECTORS; i++) {
+
+    if (i == 0 || i == bs->BPB_BkBootSec) {
+
+      memset(sector, 0, sizeof(sector));
+      memcpy(sector, bs, sizeof(BootSec_t));
+      stream_write(stream, sector, sizeof(sector));
+    } else if (i == bs->BPB_FSInfo || i == bs->BPB_BkBootSec + bs->BPB_FSInfo) {
+
+      stream_write(stream, &fsinfo, sizeof(fsinfo));
+    } else {
+
+      stream_zero(stream, BUILD_SECTOR_SIZE);
+    }
+  }
+}
+
+// Every node's run is contiguous, so each FAT is a series of ascending
+// counters ending in EOC, generated straight into the stream
+static void emit_fat(Build_t* build, ImageStream_t* stream) {
+
+  uint32_t fat_bytes = build->boot_sec.BPB_FATSz32 * BUILD_SECTOR_SIZE;
+  uint32_t entries[BUILD_SECTOR_SIZE / FAT_ELEM_SIZE];
+  uint32_t per_sector = BUILD_SECTOR_SIZE / FAT_ELEM_SIZE;
+  uint32_t used_entries = 2 + build->used_clusters;
+  uint32_t used_sectors = (used_entries + per_sector - 1) / per_sector;
+
+  uint32_t run = 0; // position in build->order
+  uint32_t cluster = 0;
+  for (uint32_t s = 0; s < used_sectors; s++) {
+
+    for (uint32_t k = 0; k < per_sector; k++, cluster++) {
+
+      if (cluster == 0) {
+
+        entries[k] = 0x0FFFFFF8;
+      } else if (cluster == 1) {
+
+        entries[k] = FAT_EOC;
+      } else if (cluster < used_entries) {
+
+        const BuildNode_t* node = &build->nodes[build->order[run]];
+        uint8_t last = (cluster == node->first_cluster + node->clusters - 1);
+        entries[k] = last ? FAT_EOC : cluster + 1;
+        run += last;
+      } else {
+
+        entries[k] = 0;
+      }
+    }
+    stream_write(stream, entries, sizeof(entries));
+  }
+  stream_zero(stream, fat_bytes - (uint64_t)used_sectors * BUILD_SECTOR_SIZE);
+}
+
+static void fill_short_entry(DIRStr_t* entry, const char* short_name, uint8_t nt_res, uint8_t attr,
+                             uint32_t cluster, uint32_t size, uint16_t date, uint16_t time) {
+
+  memset(entry, 0, sizeof(DIRStr_t));
+  memcpy(entry->DIR_Name, short_name, SHORT_NAME_LEN);
+  entry->DIR_Attr = attr;
+  entry->DIR_NTRes = nt_res;
+  entry->DIR_FstClusHI = (uint16_t)(cluster >> 16);
+  entry->DIR_FstClusLO = (uint16_t)(cluster & 0xFFFF);
+  entry->DIR_FileSize = size;
+  entry->DIR_CrtDate = entry->DIR_WrtDate = entry->DIR_LstAccDate = date;
+  entry->DIR_CrtTime = entry->DIR_WrtTime = time;
+}
+
+static void emit_dir(Build_t* build, ImageStream_t* stream, uint32_t dir, uint8_t* buffer) {
+
+  const BuildNode_t* node = &build->nodes[dir];
+  size_t size = (size_t)node->clusters * build->cluster_size;
+  memset(buffer, 0, size);
+
+  uint32_t offset = 0;
+  if (dir != 0) {
+
+    uint32_t parent_cluster = (node->parent == 0) ? 0 : build->nodes[node->parent].first_cluster;
+    fill_short_entry((DIRStr_t*)buffer, ".          ", 0, ATTR_DIRECTORY, node->first_cluster, 0,
+                     node->date, node->time);
+    fill_short_entry((DIRStr_t*)(buffer + sizeof(DIRStr_t)), "..         ", 0, ATTR_DIRECTORY,
+                     parent_cluster, 0, node->date, node->time);
+    offset = 2 * sizeof(DIRStr_t);
+  }
+  for (uint32_t i = 0; i < node->child_count; i++) {
+
+    const BuildNode_t* child = &build->nodes[node->children[i]];
+    if (child->lfn_slots) {
+
+      offset += write_lfn_entries(child->name, strlen(child->name), buffer + offset,
+                                  child->short_name) *
+                sizeof(LFNStr_t);
+    }
+    fill_short_entry((DIRStr_t*)(buffer + offset), child->short_name, child->nt_res,
+                     child->is_dir ? ATTR_DIRECTORY : ATTR_ARCHIVE, child->first_cluster,
+                     child->is_dir ? 0 : (uint32_t)child->size, child->date, child->time);
+    offset += sizeof(DIRStr_t);
+  }
+  stream_write(stream, buffer, size);
+}
+
+static void emit_file(Build_t* build, ImageStream_t* stream, uint32_t file, uint8_t* buffer) {
+
+  const BuildNode_t* node = &build->nodes[file];
+  int fd = open(node->source, O_RDONLY);
+  if (fd < 0) {
+
+    fprintf(stderr, "Failed to open %s\n", node->source);
+    build->failed = 1;
+    return;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  uint64_t left = node->size;
+  while (left > 0) {
+
+    size_t chunk = (left < BUILD_STREAM_BYTES) ? left : BUILD_STREAM_BYTES;
+    ssize_t res = read(fd, buffer, chunk);
+    if (res <= 0) {
+
+      fprintf(stderr, "%s shrank while the image was built\n", node->source);
+      build->failed = 1;
+      break;
+    }
+    stream_write(stream, buffer, res);
+    left -= res;
+  }
+  close(fd);
+  stream_zero(stream, (uint64_t)node->clusters * build->cluster_size - (node->size - left));
+}
+
+static void free_build(Build_t* build) {
+
+  for (uint32_t i = 0; i < build->count; i++) {
+
+    free(build->nodes[i].name);
+    free(build->nodes[i].source);
+    free(build->nodes[i].children);
+  }
+  free(build->nodes);
+  free(build->order);
+}
+
+// Builds a complete image from a host directory or a manifest in one
+// sequential pass. output may be "-" for stdout; size 0 picks a size that
+// fits the content.
+int build_image(const char* source, const char* output, uint64_t size) {
+
+  Build_t build;
+  memset(&build, 0, sizeof(Build_t));
+  struct stat st;
+  if (stat(source, &st) != 0) {
+
+    fprintf(stderr, "Cannot access %s\n", source);
+    return -1;
+  }
+  add_node(&build, 0, NULL, 1, 0, NULL, st.st_mtime);
+  if (S_ISDIR(st.st_mode)) {
+
+    scan_host_dir(&build, 0, source);
+  } else {
+
+    parse_manifest(&build, source);
+  }
+
+  for (uint32_t i = 0; i < build.count && !build.failed; i++) {
+
+    if (build.nodes[i].is_dir && assign_short_names(&build, i) != 0) {
+
+      fprintf(stderr, "Ran out of short names\n");
+      build.failed = 1;
+    }
+  }
+  build.order = malloc((size_t)(build.count ? build.count : 1) * sizeof(uint32_t));
+  if (build.failed || !build.order || plan_geometry(&build, size) != 0) {
+
+    free_build(&build);
+    return -1;
+  }
+  push_order(&build, 0);
+  layout_dir(&build, 0);
+
+  BootSec_t* bs = &build.boot_sec;
+  uint32_t capacity = cluster_count(bs) - 2;
+  if (build.used_clusters > capacity) {
+
+    fprintf(stderr, "Content needs %u clusters, the image only has %u\n", build.used_clusters,
+            capacity);
+    free_build(&build);
+    return -1;
+  }
+  uint32_t vol_id = 2166136261u;
+  for (uint32_t i = 0; i < build.count; i++) {
+
+    vol_id = (vol_id ^ build.nodes[i].date ^ (build.nodes[i].size << 7)) * 16777619u;
+  }
+  bs->BS_VOlId = vol_id; // reproducible builds: derived from content, not the clock
+
+  ImageStream_t stream = {STDOUT_FILENO, 0, malloc(BUILD_STREAM_BYTES), 0, 0, 0, 0};
+  if (strcmp(output, "-") != 0) {
+
+    stream.fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  }
+  struct stat out_st;
+  stream.seekable = stream.fd >= 0 && fstat(stream.fd, &out_st) == 0 && S_ISREG(out_st.st_mode);
+  uint32_t largest_dir = build.cluster_size;
+  for (uint32_t i = 0; i < build.count; i++) {
+
+    if (build.nodes[i].is_dir && build.nodes[i].clusters * build.cluster_size > largest_dir) {
+
+      largest_dir = build.nodes[i].clusters * build.cluster_size;
+    }
+  }
+  uint8_t* buffer = malloc(largest_dir > BUILD_STREAM_BYTES ? largest_dir : BUILD_STREAM_BYTES);
+  if (stream.fd < 0 || !stream.buffer || !buffer) {
+
+    fprintf(stderr, "Failed to open %s\n", output);
+    free(stream.buffer);
+    free(buffer);
+    free_build(&build);
+    return -1;
+  }
+
+  emit_reserved(&build, &stream);
+  for (uint32_t i = 0; i < BUILD_NUM_FATS; i++) {
+
+    emit_fat(&build, &stream);
+  }
+  for (uint32_t i = 0; i < build.order_count && !build.failed && !stream.failed; i++) {
+
+    uint32_t index = build.order[i];
+    if (build.nodes[index].is_dir) {
+
+      emit_dir(&build, &stream, index, buffer);
+    } else {
+
+      emit_file(&build, &stream, index, buffer);
+    }
+  }
+  uint64_t image_bytes = (uint64_t)bs->BPB_TotSec32 * BUILD_SECTOR_SIZE;
+  stream_zero(&stream, image_bytes - stream.written - stream.pending_zeros);
+  stream_finish(&stream);
+
+  int failed = build.failed || stream.failed;
+  if (stream.fd != STDOUT_FILENO) {
+
+    failed |= fsync(stream.fd) != 0;
+    close(stream.fd);
+  }
+  if (failed) {
+
+    fprintf(stderr, "Failed to build %s\n", output);
+  } else {
+
+    fprintf(stderr, "Built %s: %u entries, %u of %u clusters used, %llu bytes\n", output,
+            build.count - 1, build.used_clusters, capacity, (unsigned long long)image_bytes);
+  }
+  free(stream.buffer);
+  free(buffer);
+  free_build(&build);
+  return failed ? -1 : 0;
+}
@@ -0,0 +1,142 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "bootsec.h"
+#include "directory.h"
+#include "extent.h"
+#include "integrity.h"
+#include "readahead.h"
+#include "utility.h"
+
+#define CAT_CHUNK_BYTES (1024 * 1024)
+
+// Writes length bytes of the file starting at offset to stdout. Every
+// contiguous piece is located with one extent-map search and read in one go,
+// while readahead follows the same map to warm the pieces after it.
+// Output stops before the first cluster that fails its checksum; returns 1 then.
+static int output_range(FILE* disk, BootSec_t* boot_sec, const EntrSt_t* entry, uint64_t offset,
+                        uint64_t length) {
+
+  if (offset >= entry->size) {
+
+    return 0;
+  }
+  if (length > entry->size - offset) {
+
+    length = entry->size - offset;
+  }
+  const ExtentMap_t* map = extent_map_get(disk, boot_sec, entry->cluster);
+  if (!map) {
+
+    return 1;
+  }
+
+  uint16_t sector_size = boot_sec->BPB_BytsPerSec;
+  uint32_t cluster_size = sector_size * boot_sec->BPB_SecPerClus;
+  uint32_t chunk_clusters = CAT_CHUNK_BYTES / cluster_size ? CAT_CHUNK_BYTES / cluster_size : 1;
+  size_t buffer_size = (size_t)chunk_clusters * cluster_size;
+  uint8_t* buffer = buffer_take(buffer_size);
+  if (!buffer) {
+
+    fprintf(cmd_err(), "Memory allocation failed\n");
+    extent_map_put(map);
+    return 1;
+  }
+
+  ExtentCursor_t cursor = {map, 0};
+  Readahead_t ra;
+  readahead_init(&ra, fileno(disk), boot_sec, extent_map_chain_next, &cursor);
+
+  int failed = 0;
+  while (length > 0 && !failed) {
+
+    uint32_t disk_cluster, run_left;
+    if (extent_map_lookup(map, offset / cluster_size, &disk_cluster, &run_left) != 0) {
+
+      fprintf(cmd_err(), "File is shorter than its recorded size\n");
+      failed = 1;
+      break;
+    }
+    uint32_t run = (run_left < chunk_clusters) ? run_left : chunk_clusters;
+    uint32_t skip = offset % cluster_size;
+    uint64_t available = (uint64_t)run * cluster_size - skip;
+    uint64_t take = (available < length) ? available : length;
+    uint32_t covered = (skip + take + cluster_size - 1) / cluster_size;
+    for (uint32_t i = 0; i < covered; i++) {
+
+      readahead_step(&ra, disk_cluster + i);
+    }
+    read_clusters(disk, boot_sec, disk_cluster, run, buffer);
+
+    for (uint32_t i = 0; i < covered; i++) {
+
+      if (integrity_verify(disk_cluster + i, buffer + (size_t)i * cluster_size) != 0) {
+
+        // what comes before the bad cluster is still good
+        take = (i > 0) ? (uint64_t)i * cluster_size - skip : 0;
+        failed = 1;
+        break;
+      }
+    }
+    fwrite(buffer + skip, 1, take, cmd_out());
+    offset += take;
+    length -= take;
+  }
+  fflush(cmd_out());
+  buffer_give(buffer, buffer_size);
+  extent_map_put(map);
+  return failed;
+}
+
+static int lookup_file(FILE* disk, BootSec_t* boot_sec, const char* name, uint32_t current_clus,
+                       EntrSt_t* entry) {
+
+  EntrLoc_t loc;
+  int found = find_dir_entry(disk, boot_sec, current_clus, name, entry, &loc);
+  if (found < 0) {
+
+    fprintf(cmd_err(), "Failed to read directory entries\n");
+    return 1;
+  }
+  if (!found) {
+
+    fprintf(cmd_err(), "%s: No such file\n", name);
+    return 1;
+  }
+  if (entry->attr & ATTR_DIRECTORY) {
+
+    fprintf(cmd_err(), "%s: Is a directory\n", name);
+    return 1;
+  }
+  return 0;
+}
+
+void cat_file(FILE* disk, BootSec_t* boot_sec, const char* name, uint32_t current_clus) {
+
+  EntrSt_t entry;
+  if (lookup_file(disk, boot_sec, name, current_clus, &entry) == 0 &&
+      output_range(disk, boot_sec, &entry, 0, entry.size) != 0) {
+
+    fprintf(cmd_err(), "%s: Read failed\n", name);
+  }
+}
+
+void read_file(FILE* disk, BootSec_t* boot_sec, const char* args, uint32_t current_clus) {
+
+  char name[MAX_NAME_BYTES];
+  unsigned long long offset, length;
+  if (sscanf(args, "%765s %llu %llu", name, &offset, &length) != 3) {
+
+    fprintf(cmd_err(), "Usage: read <file> <offset> <length>\n");
+    return;
+  }
+  EntrSt_t entry;
+  if (lookup_file(disk, boot_sec, name, current_clus, &entry) == 0 &&
+      output_range(disk, boot_sec, &entry, offset, length) != 0) {
+
+    fprintf(cmd_err(), "%s: Read failed\n", name);
+  }
+}
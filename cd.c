@@ -6,13 +6,18 @@
 
 #include "bootsec.h"
 #include "directory.h"
+#include "pathindex.h"
+#include "unicode.h"
+#include "utility.h"
 
 int change_dir(FILE* disk, BootSec_t* boot_sec, const char* path, uint32_t* current_clus) {
 
   char components[256];
   strcpy(components, path);
 
-  char* token = strtok(components, "/");
+  // server sessions change directory concurrently, so no shared tokenizer state
+  char* save;
+  char* token = strtok_r(components, "/", &save);
   uint32_t cluster = *current_clus; // Start from the current directory
 
   // Handle absolute and relative paths
@@ -33,57 +38,67 @@ int change_dir(FILE* disk, BootSec_t* boot_sec, const char* path, uint32_t* curr
 
       if (strncmp(token, "..", 2) == 0) {
 
-        printf("No entry above root directory\n");
-        token = strtok(NULL, "/");
+        fprintf(cmd_out(), "No entry above root directory\n");
+        token = strtok_r(NULL, "/", &save);
         continue;
       } else if (strncmp(token, ".", 1) == 0) {
 
-        token = strtok(NULL, "/");
+        token = strtok_r(NULL, "/", &save);
         continue;
       }
     }
 
-    EntrSt_t* entries = NULL;
-    uint32_t entry_count = 0;
+    DirList_t list;
+    uint32_t index;
     uint8_t found = 0;
     uint8_t is_dir = 0;
 
-    if (read_dir_entries(disk, boot_sec, cluster, &entries, &entry_count) == 1) {
+    // the path index answers for directories it holds without reading them
+    EntrSt_t entry;
+    EntrLoc_t loc;
+    int indexed = path_index_find(cluster, token, &entry, &loc);
+    if (indexed == 1 && (entry.attr & ATTR_DIRECTORY)) {
 
-      fprintf(stderr, "Failed to read directory entries\n");
-      return 1;
-    }
+      cluster = entry.cluster;
+      found = 1;
+      is_dir = 1;
+    } else if (indexed < 0) {
 
-    for (uint32_t i = 0; i < entry_count; i++) {
+      if (dir_list_load(disk, boot_sec, cluster, &list) == 1) {
 
-      if (strcmp(entries[i].name, token) == 0) {
+        fprintf(cmd_err(), "Failed to read directory entries\n");
+        dir_list_free(&list);
+        return 1;
+      }
 
-        if (entries[i].attr & ATTR_DIRECTORY) {
+      if (dir_list_find(&list, token, &index) && (list.attr[index] & ATTR_DIRECTORY)) {
 
-          // Found the next component
-          cluster = entries[i].cluster;
-          found = 1;
-          is_dir = 1;
-          break;
-        }
+        // Found the next component
+        cluster = list.cluster[index];
+        found = 1;
+        is_dir = 1;
       }
-    }
 
-    free(entries);
+      dir_list_free(&list);
+    }
 
     if (!found && !is_dir) {
 
-      fprintf(stderr, "%s is not a directory\n", path);
+      fprintf(cmd_err(), "%s is not a directory\n", path);
       return 1;
     }
 
     if (!found) {
 
-      fprintf(stderr, "Directory for %s is not found\n", path);
+      fprintf(cmd_err(), "Directory for %s is not found\n", path);
       return 1;
     }
+    if (cluster == 0) {
+
+      cluster = boot_sec->BPB_RootClus; // ".." of a directory in root, as the spec writes it
+    }
 
-    token = strtok(NULL, "/");
+    token = strtok_r(NULL, "/", &save);
   }
 
   *current_clus = cluster;
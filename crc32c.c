@@ -0,0 +1,187 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_HAVE_SSE42 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78  // reflected Castagnoli polynomial
+#define CRC32C_LANES_MIN 1024   // below this the lane merge costs more than it saves
+
+typedef uint32_t (*crc32c_fn)(uint32_t state, const uint8_t* data, size_t size);
+
+static uint32_t table[8][256];
+static uint32_t x2n_table[32]; // x^(2^n) modulo the polynomial
+static crc32c_fn kernel;
+static const char* kernel_name;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static uint64_t load64(const uint8_t* data) {
+
+  uint64_t word;
+  memcpy(&word, data, sizeof(word));
+  return word;
+}
+
+// a * b modulo the polynomial, both in reflected bit order
+static uint32_t mult_mod_poly(uint32_t a, uint32_t b) {
+
+  uint32_t product = 0;
+  for (uint32_t m = 1u << 31; m != 0; m >>= 1) {
+
+    if (a & m) {
+
+      product ^= b;
+      if ((a & (m - 1)) == 0) {
+
+        break;
+      }
+    }
+    b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+  }
+  return product;
+}
+
+// x^(8 * bytes): multiplying a raw CRC state by it appends that many zero bytes
+static uint32_t shift_constant(size_t bytes) {
+
+  uint32_t p = 1u << 31; // x^0
+  for (uint32_t k = 3; bytes != 0; bytes >>= 1, k++) {
+
+    if (bytes & 1) {
+
+      p = mult_mod_poly(x2n_table[k & 31], p);
+    }
+  }
+  return p;
+}
+
+// Slicing-by-8: eight table lookups per 64-bit word
+static uint32_t crc32c_sw(uint32_t state, const uint8_t* data, size_t size) {
+
+  while (size > 0 && ((uintptr_t)data & 7) != 0) {
+
+    state = table[0][(state ^ *data++) & 0xFF] ^ (state >> 8);
+    size--;
+  }
+  while (size >= 8) {
+
+    uint64_t word = load64(data) ^ state;
+    state = table[7][word & 0xFF] ^ table[6][(word >> 8) & 0xFF] ^
+            table[5][(word >> 16) & 0xFF] ^ table[4][(word >> 24) & 0xFF] ^
+            table[3][(word >> 32) & 0xFF] ^ table[2][(word >> 40) & 0xFF] ^
+            table[1][(word >> 48) & 0xFF] ^ table[0][word >> 56];
+    data += 8;
+    size -= 8;
+  }
+  while (size > 0) {
+
+    state = table[0][(state ^ *data++) & 0xFF] ^ (state >> 8);
+    size--;
+  }
+  return state;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+// The crc32 instruction has a three cycle latency but one per cycle
+// throughput, so three independent lanes keep it busy. The lane states are
+// merged by shifting each over the bytes that follow it.
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(uint32_t state, const uint8_t* data,
+                                                             size_t size) {
+
+  while (size > 0 && ((uintptr_t)data & 7) != 0) {
+
+    state = _mm_crc32_u8(state, *data++);
+    size--;
+  }
+  if (size >= 3 * CRC32C_LANES_MIN) {
+
+    static __thread size_t cached_lane;
+    static __thread uint32_t cached_shift;
+    size_t lane = (size / 3) & ~(size_t)7;
+    if (lane != cached_lane) {
+
+      cached_lane = lane;
+      cached_shift = shift_constant(lane);
+    }
+
+    uint64_t a = state, b = 0, c = 0;
+    const uint8_t* end = data + lane;
+    for (const uint8_t* p = data; p < end; p += 8) {
+
+      a = _mm_crc32_u64(a, load64(p));
+      b = _mm_crc32_u64(b, load64(p + lane));
+      c = _mm_crc32_u64(c, load64(p + 2 * lane));
+    }
+    state = mult_mod_poly(cached_shift, (uint32_t)a) ^ (uint32_t)b;
+    state = mult_mod_poly(cached_shift, state) ^ (uint32_t)c;
+    data += 3 * lane;
+    size -= 3 * lane;
+  }
+  while (size >= 8) {
+
+    state = (uint32_t)_mm_crc32_u64(state, load64(data));
+    data += 8;
+    size -= 8;
+  }
+  while (size > 0) {
+
+    state = _mm_crc32_u8(state, *data++);
+    size--;
+  }
+  return state;
+}
+#endif
+
+static void crc32c_init(void) {
+
+  for (uint32_t i = 0; i < 256; i++) {
+
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+
+      crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    }
+    table[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256; i++) {
+
+    for (int k = 1; k < 8; k++) {
+
+      table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+    }
+  }
+
+  uint32_t p = 1u << 30; // x^1
+  x2n_table[0] = p;
+  for (int n = 1; n < 32; n++) {
+
+    x2n_table[n] = p = mult_mod_poly(p, p);
+  }
+
+  kernel = crc32c_sw;
+  kernel_name = "slicing-by-8";
+#ifdef CRC32C_HAVE_SSE42
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+
+    kernel = crc32c_hw;
+    kernel_name = "sse4.2";
+  }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t size) {
+
+  pthread_once(&init_once, crc32c_init);
+  return ~kernel(~crc, data, size);
+}
+
+const char* crc32c_kernel(void) {
+
+  pthread_once(&init_once, crc32c_init);
+  return kernel_name;
+}
@@ -0,0 +1,11 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32C (Castagnoli). Start with 0 and feed the previous result to continue.
+uint32_t crc32c(uint32_t crc, const void* data, size_t size);
+const char* crc32c_kernel(void);
+
+#endif // CRC32C_H
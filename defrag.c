@@ -0,0 +1,420 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bootsec.h"
+#include "directory.h"
+#include "extent.h"
+#include "fat.h"
+#include "readahead.h"
+#include "usage.h"
+#include "utility.h"
+
+#define DEFRAG_COMPACT 0x01
+#define DEFRAG_MAX_DEPTH 256
+#define DEFRAG_COPY_BYTES (1024 * 1024) // data moved per read/write pair
+#define DEFRAG_BUCKETS 6
+
+typedef struct {
+
+  char name[MAX_NAME_BYTES];
+  EntrLoc_t loc;
+  uint32_t cluster;
+  uint8_t attr;
+} DefragEntry_t;
+
+typedef struct {
+
+  DefragEntry_t* entries;
+  uint32_t count;
+  uint32_t capacity;
+  int failed;
+} DefragList_t;
+
+typedef struct {
+
+  FILE* disk;
+  BootSec_t* boot_sec;
+  FatView_t fat;
+  FreeBatch_t released;
+  uint8_t* visited;
+  uint8_t* copy_buffer;
+  uint32_t cluster_size;
+  uint32_t next_fit;
+  uint32_t moved_dir; // new first cluster written into the children's ".."
+  uint8_t flags;
+  uint64_t files;
+  uint64_t dirs;
+  uint64_t fragmented;
+  uint64_t extents;
+  uint64_t moved;
+  uint64_t skipped;
+  uint64_t histogram[DEFRAG_BUCKETS];
+} DefragCtx_t;
+
+// Directories the last compaction moved, by old and new first cluster, so
+// that every session standing in one can follow it
+static struct {
+
+  uint32_t* from;
+  uint32_t* to;
+  uint32_t count;
+  uint32_t capacity;
+} moved_dirs = {NULL, NULL, 0, 0};
+
+static int note_moved_dir(uint32_t from, uint32_t to) {
+
+  if (moved_dirs.count == moved_dirs.capacity) {
+
+    uint32_t capacity = moved_dirs.capacity ? moved_dirs.capacity * 2 : 64;
+    uint32_t* grown_from = realloc(moved_dirs.from, capacity * sizeof(uint32_t));
+    if (grown_from) {
+
+      moved_dirs.from = grown_from;
+    }
+    uint32_t* grown_to = realloc(moved_dirs.to, capacity * sizeof(uint32_t));
+    if (grown_to) {
+
+      moved_dirs.to = grown_to;
+    }
+    if (!grown_from || !grown_to) {
+
+      return 1;
+    }
+    moved_dirs.capacity = capacity;
+  }
+  moved_dirs.from[moved_dirs.count] = from;
+  moved_dirs.to[moved_dirs.count++] = to;
+  return 0;
+}
+
+// Where a directory's first cluster is after the last defrag -c. New runs are
+// always taken from free clusters, so a cluster is never both a source and a
+// destination and the answer needs one lookup.
+uint32_t defrag_relocated(uint32_t cluster) {
+
+  for (uint32_t i = 0; i < moved_dirs.count; i++) {
+
+    if (moved_dirs.from[i] == cluster) {
+
+      return moved_dirs.to[i];
+    }
+  }
+  return cluster;
+}
+
+static const char* const bucket_labels[DEFRAG_BUCKETS] = {"1", "2", "3-4", "5-8", "9-16", "17+"};
+
+static uint32_t count_extents(const FatView_t* fat, uint32_t cluster) {
+
+  uint32_t extents = 0;
+  uint32_t prev = 0;
+  uint32_t length = 0;
+  while (cluster >= 2 && cluster < EOC && length++ < fat->count) {
+
+    if (cluster != prev + 1) {
+
+      extents++;
+    }
+    prev = cluster;
+    cluster = fat_view_next(fat, cluster);
+  }
+  return extents;
+}
+
+static uint32_t bucket_of(uint32_t extents) {
+
+  uint32_t bucket = 0;
+  for (uint32_t limit = 1; bucket < DEFRAG_BUCKETS - 1 && extents > limit; limit *= 2) {
+
+    bucket++;
+  }
+  return bucket;
+}
+
+static int collect_entry(const EntrSt_t* entry, const DIRStr_t* raw, const EntrLoc_t* loc,
+                         void* ctx) {
+
+  (void)raw;
+  DefragList_t* list = ctx;
+  if (strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) {
+
+    return 0;
+  }
+  if (list->count == list->capacity) {
+
+    uint32_t capacity = list->capacity ? list->capacity * 2 : 32;
+    DefragEntry_t* grown = realloc(list->entries, capacity * sizeof(DefragEntry_t));
+    if (!grown) {
+
+      list->failed = 1;
+      return 1;
+    }
+    list->entries = grown;
+    list->capacity = capacity;
+  }
+  DefragEntry_t* item = &list->entries[list->count++];
+  strcpy(item->name, entry->name);
+  item->loc = *loc;
+  item->cluster = entry->cluster;
+  item->attr = entry->attr;
+  return 0;
+}
+
+// Next-fit search for length free clusters in a row
+static uint32_t find_free_run(DefragCtx_t* ctx, uint32_t length) {
+
+  uint32_t count = ctx->fat.count;
+  for (uint32_t pass = 0; pass < 2; pass++) {
+
+    uint32_t run = 0;
+    for (uint32_t cluster = (pass == 0) ? ctx->next_fit : 2; cluster < count; cluster++) {
+
+      run = ((ctx->fat.entries[cluster] & 0x0FFFFFFF) == 0) ? run + 1 : 0;
+      if (run == length) {
+
+        ctx->next_fit = cluster + 1;
+        return cluster - length + 1;
+      }
+    }
+  }
+  return 0;
+}
+
+static void set_entry_cluster(DefragCtx_t* ctx, uint32_t dir_cluster, uint32_t offset,
+                              uint32_t cluster) {
+
+  uint16_t sector_size = ctx->boot_sec->BPB_BytsPerSec;
+  uint8_t sector_buffer[sector_size];
+  uint32_t sector = first_sector_of_cluster(ctx->boot_sec, dir_cluster) + offset / sector_size;
+
+  read_sector(ctx->disk, sector, sector_buffer, sector_size);
+  DIRStr_t* dir_entry = (DIRStr_t*)(sector_buffer + offset % sector_size);
+  dir_entry->DIR_FstClusLO = (uint16_t)(cluster & 0xFFFF);
+  dir_entry->DIR_FstClusHI = (uint16_t)((cluster >> 16) & 0xFFFF);
+  write_sector(ctx->disk, sector, sector_buffer, sector_size);
+}
+
+// Copies the chain starting at old_first into length clusters starting at
+// new_first, moving whole source extents in large reads and writes
+static void copy_chain(DefragCtx_t* ctx, uint32_t old_first, uint32_t new_first) {
+
+  uint32_t batch = DEFRAG_COPY_BYTES / ctx->cluster_size;
+  uint32_t dest = new_first;
+  uint32_t cluster = old_first;
+  Readahead_t ra;
+  readahead_init(&ra, fileno(ctx->disk), ctx->boot_sec, fat_view_chain_next, &ctx->fat);
+
+  while (cluster >= 2 && cluster < EOC) {
+
+    readahead_step(&ra, cluster);
+    uint32_t run = 1;
+    uint32_t next = readahead_next(&ra, cluster);
+    while (run < batch && next == cluster + run) {
+
+      readahead_step(&ra, next);
+      run++;
+      next = readahead_next(&ra, next);
+    }
+    read_clusters(ctx->disk, ctx->boot_sec, cluster, run, ctx->copy_buffer);
+    write_clusters(ctx->disk, ctx->boot_sec, dest, run, ctx->copy_buffer);
+    dest += run;
+    cluster = next;
+  }
+}
+
+static int fix_child_parent(const EntrSt_t* entry, const DIRStr_t* raw, const EntrLoc_t* loc,
+                            void* ctx) {
+
+  (void)raw;
+  (void)loc;
+  DefragCtx_t* defrag = ctx;
+  if (!(entry->attr & ATTR_DIRECTORY) || strcmp(entry->name, ".") == 0 ||
+      strcmp(entry->name, "..") == 0 || entry->cluster < 2) {
+
+    return 0;
+  }
+  // ".." is the second slot of the child's first cluster
+  set_entry_cluster(defrag, entry->cluster, sizeof(DIRStr_t), defrag->moved_dir);
+  return 0;
+}
+
+// Moves one chain into a contiguous run. Order keeps the volume consistent at
+// every step: data copy, new FAT chain, directory entry, then the old chain is
+// queued for release.
+static void relocate(DefragCtx_t* ctx, DefragEntry_t* item, uint32_t length) {
+
+  uint32_t new_first = find_free_run(ctx, length);
+  if (new_first == 0 ||
+      ((item->attr & ATTR_DIRECTORY) && note_moved_dir(item->cluster, new_first) != 0)) {
+
+    ctx->skipped++;
+    return;
+  }
+
+  copy_chain(ctx, item->cluster, new_first);
+  for (uint32_t i = 0; i < length; i++) {
+
+    ctx->fat.entries[new_first + i] = (i + 1 < length) ? new_first + i + 1 : 0x0FFFFFFF;
+  }
+  fat_view_write_range(&ctx->fat, ctx->disk, ctx->boot_sec, new_first, new_first + length - 1);
+  set_entry_cluster(ctx, item->loc.cluster, item->loc.offset, new_first);
+
+  if (item->attr & ATTR_DIRECTORY) {
+
+    set_entry_cluster(ctx, new_first, 0, new_first); // "."
+    ctx->moved_dir = new_first;
+    if (walk_dir(ctx->disk, ctx->boot_sec, new_first, fix_child_parent, ctx) != 0) {
+
+      fprintf(cmd_err(), "defrag: failed to update \"..\" below %s\n", item->name);
+    }
+    usage_note_dir_moved(item->cluster, new_first);
+  }
+
+  free_batch_add_chain(&ctx->released, ctx->disk, ctx->boot_sec, item->cluster);
+  item->cluster = new_first;
+  ctx->moved++;
+}
+
+static int test_and_set_visited(DefragCtx_t* ctx, uint32_t cluster) {
+
+  if (cluster >= ctx->fat.count) {
+
+    return 1;
+  }
+  uint8_t bit = 1 << (cluster & 7);
+  int seen = (ctx->visited[cluster >> 3] & bit) != 0;
+  ctx->visited[cluster >> 3] |= bit;
+  return seen;
+}
+
+// Post-order: a directory's children are settled before the directory itself
+// is moved by its parent, so every entry location is read from a chain that
+// is not going to move underneath it. A directory that cannot be read is left
+// alone, and so is its own chain; returns 1 for it.
+static int defrag_dir(DefragCtx_t* ctx, uint32_t dir_cluster, const char* path, uint32_t depth) {
+
+  DefragList_t list = {NULL, 0, 0, 0};
+  if (walk_dir(ctx->disk, ctx->boot_sec, dir_cluster, collect_entry, &list) != 0 || list.failed) {
+
+    fprintf(cmd_err(), "defrag: failed to read %s/\n", path);
+    free(list.entries);
+    return 1;
+  }
+
+  for (uint32_t i = 0; i < list.count; i++) {
+
+    DefragEntry_t* item = &list.entries[i];
+    char child_path[1024];
+    snprintf(child_path, sizeof(child_path), "%s/%s", path, item->name);
+
+    if (item->cluster < 2 || item->cluster >= ctx->fat.count) {
+
+      ctx->files += !(item->attr & ATTR_DIRECTORY);
+      continue;
+    }
+    if (item->attr & ATTR_DIRECTORY) {
+
+      if (test_and_set_visited(ctx, item->cluster) || depth >= DEFRAG_MAX_DEPTH) {
+
+        continue;
+      }
+      ctx->dirs++;
+      if (defrag_dir(ctx, item->cluster, child_path, depth + 1) != 0) {
+
+        continue;
+      }
+    } else {
+
+      ctx->files++;
+    }
+
+    uint32_t extents = count_extents(&ctx->fat, item->cluster);
+    ctx->extents += extents;
+    ctx->histogram[bucket_of(extents)]++;
+    if (extents <= 1) {
+
+      continue;
+    }
+    ctx->fragmented++;
+    if (ctx->flags & DEFRAG_COMPACT) {
+
+      relocate(ctx, item, fat_view_chain_length(&ctx->fat, item->cluster));
+    } else {
+
+      fprintf(cmd_out(), "%6u extents  %s%s\n", extents, child_path,
+              (item->attr & ATTR_DIRECTORY) ? "/" : "");
+    }
+  }
+  free(list.entries);
+  return 0;
+}
+
+// Reports fragmentation, or with -c compacts every chain. A directory that
+// moves takes *current_clus with it; defrag_relocated tells other sessions.
+void defrag(FILE* disk, BootSec_t* boot_sec, const char* args, uint32_t* current_clus) {
+
+  DefragCtx_t ctx;
+  memset(&ctx, 0, sizeof(DefragCtx_t));
+  ctx.disk = disk;
+  ctx.boot_sec = boot_sec;
+  ctx.cluster_size = boot_sec->BPB_BytsPerSec * boot_sec->BPB_SecPerClus;
+  ctx.next_fit = 2;
+
+  while (*args == ' ') {
+
+    args++;
+  }
+  if (strcmp(args, "-c") == 0) {
+
+    ctx.flags |= DEFRAG_COMPACT;
+  } else if (*args != '\0') {
+
+    fprintf(cmd_err(), "Usage: defrag [-c]\n");
+    return;
+  }
+
+  if (fat_view_load(disk, boot_sec, &ctx.fat) != 0) {
+
+    return;
+  }
+  moved_dirs.count = 0;
+  free_batch_init(&ctx.released);
+  ctx.visited = calloc(ctx.fat.count / 8 + 1, 1);
+  uint32_t batch_clusters = DEFRAG_COPY_BYTES / ctx.cluster_size;
+  ctx.copy_buffer = malloc((size_t)(batch_clusters ? batch_clusters : 1) * ctx.cluster_size);
+  if (!ctx.visited || !ctx.copy_buffer) {
+
+    fprintf(cmd_err(), "Memory allocation failed\n");
+  } else {
+
+    // the whole volume is walked from the root: the root itself cannot move
+    test_and_set_visited(&ctx, boot_sec->BPB_RootClus);
+    defrag_dir(&ctx, boot_sec->BPB_RootClus, "", 0);
+  }
+
+  // old chains are only released after every entry points at its new copy
+  uint32_t released = free_batch_flush(&ctx.released, disk, boot_sec, 0);
+  *current_clus = defrag_relocated(*current_clus);
+
+  fprintf(cmd_out(), "%llu files, %llu directories, %llu fragmented (%llu extents)\n",
+          (unsigned long long)ctx.files, (unsigned long long)ctx.dirs,
+          (unsigned long long)ctx.fragmented, (unsigned long long)ctx.extents);
+  fprintf(cmd_out(), "Extents  Chains\n");
+  for (uint32_t i = 0; i < DEFRAG_BUCKETS; i++) {
+
+    fprintf(cmd_out(), "%-7s  %llu\n", bucket_labels[i], (unsigned long long)ctx.histogram[i]);
+  }
+  if (ctx.flags & DEFRAG_COMPACT) {
+
+    fprintf(cmd_out(),
+            "Moved %llu chains, released %u clusters, %llu left for lack of a free run\n",
+            (unsigned long long)ctx.moved, released, (unsigned long long)ctx.skipped);
+  }
+
+  free(ctx.copy_buffer);
+  free(ctx.visited);
+  free_batch_release(&ctx.released);
+  fat_view_free(&ctx.fat);
+}
@@ -0,0 +1,362 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bootsec.h"
+#include "directory.h"
+#include "fat.h"
+#include "journal.h"
+#include "utility.h"
+#include "walk.h"
+
+#define DIFF_BLOCK_BYTES (1024 * 1024)
+#define DIFF_ATTR_MASK (ATTR_DIRECTORY | ATTR_READ_ONLY | ATTR_HIDDEN | ATTR_SYSTEM) // not archive
+
+// One side of the comparison
+typedef struct {
+
+  FILE* disk;
+  BootSec_t boot_sec;
+  FatView_t fat;
+  uint32_t cluster_size;
+  WalkResult_t walk;
+} DiffImage_t;
+
+// A path present on either side; only pairs of equal-sized files need their data read
+typedef struct {
+
+  const WalkEntry_t* a;
+  const WalkEntry_t* b;
+  char kind; // '+', '-', 'M', '?' for data still to compare, '=' when identical
+} DiffItem_t;
+
+typedef struct {
+
+  DiffImage_t* a;
+  DiffImage_t* b;
+  DiffItem_t** pending;
+  uint32_t pending_count;
+  uint32_t next; // taken with an atomic add
+  uint64_t compared;
+  int failed;
+} DiffShared_t;
+
+// Position inside a file's cluster chain
+typedef struct {
+
+  const DiffImage_t* image;
+  uint32_t cluster;
+  uint32_t skip; // bytes of the current cluster already consumed
+} ChainCursor_t;
+
+static int cursor_valid(const ChainCursor_t* cursor) {
+
+  return cursor->cluster >= 2 && cursor->cluster < cursor->image->fat.count;
+}
+
+// Bytes readable in one go from the cursor on, at most max
+static uint64_t cursor_span(const ChainCursor_t* cursor, uint64_t max, off_t* offset) {
+
+  const DiffImage_t* image = cursor->image;
+  *offset = (off_t)first_sector_of_cluster(&image->boot_sec, cursor->cluster) *
+                image->boot_sec.BPB_BytsPerSec +
+            cursor->skip;
+  uint64_t span = image->cluster_size - cursor->skip;
+  uint32_t cluster = cursor->cluster;
+  while (span < max && fat_view_next(&image->fat, cluster) == cluster + 1) {
+
+    cluster++;
+    span += image->cluster_size;
+  }
+  return (span < max) ? span : max;
+}
+
+static void cursor_advance(ChainCursor_t* cursor, uint64_t bytes) {
+
+  bytes += cursor->skip;
+  while (bytes >= cursor->image->cluster_size && cursor_valid(cursor)) {
+
+    cursor->cluster = fat_view_next(&cursor->image->fat, cursor->cluster);
+    bytes -= cursor->image->cluster_size;
+  }
+  cursor->skip = bytes;
+}
+
+// Walks both chains as runs of contiguous clusters, so a file laid out the
+// same way on both sides costs two large reads per block. Returns 1 at the
+// first difference without reading the rest.
+static int chains_differ(const DiffShared_t* shared, const WalkEntry_t* a, const WalkEntry_t* b,
+                         uint8_t* buffer_a, uint8_t* buffer_b, uint64_t* compared) {
+
+  ChainCursor_t cursor_a = {shared->a, a->cluster, 0};
+  ChainCursor_t cursor_b = {shared->b, b->cluster, 0};
+  uint64_t left = a->size;
+  while (left > 0) {
+
+    if (!cursor_valid(&cursor_a) || !cursor_valid(&cursor_b)) {
+
+      return 1; // a chain shorter than its file cannot be trusted to match
+    }
+    off_t offset_a, offset_b;
+    uint64_t size = cursor_span(&cursor_a, (left < DIFF_BLOCK_BYTES) ? left : DIFF_BLOCK_BYTES,
+                                &offset_a);
+    size = cursor_span(&cursor_b, size, &offset_b);
+    if (image_pread(shared->a->disk, buffer_a, size, offset_a) != (ssize_t)size ||
+        image_pread(shared->b->disk, buffer_b, size, offset_b) != (ssize_t)size) {
+
+      return 1;
+    }
+    *compared += size;
+    if (memcmp(buffer_a, buffer_b, size) != 0) {
+
+      return 1;
+    }
+    cursor_advance(&cursor_a, size);
+    cursor_advance(&cursor_b, size);
+    left -= size;
+  }
+  return 0;
+}
+
+static void* diff_worker(void* arg) {
+
+  DiffShared_t* shared = arg;
+  uint8_t* buffer_a = malloc(DIFF_BLOCK_BYTES);
+  uint8_t* buffer_b = malloc(DIFF_BLOCK_BYTES);
+  uint64_t compared = 0;
+  if (!buffer_a || !buffer_b) {
+
+    __atomic_store_n(&shared->failed, 1, __ATOMIC_RELAXED);
+  }
+  while (buffer_a && buffer_b) {
+
+    uint32_t index = __atomic_fetch_add(&shared->next, 1, __ATOMIC_RELAXED);
+    if (index >= shared->pending_count) {
+
+      break;
+    }
+    DiffItem_t* item = shared->pending[index];
+    item->kind = chains_differ(shared, item->a, item->b, buffer_a, buffer_b, &compared) ? 'M' : '=';
+  }
+  __atomic_fetch_add(&shared->compared, compared, __ATOMIC_RELAXED);
+  free(buffer_a);
+  free(buffer_b);
+  return NULL;
+}
+
+static int entry_compare(const void* a, const void* b) {
+
+  return walk_path_compare(((const WalkEntry_t*)a)->path, ((const WalkEntry_t*)b)->path);
+}
+
+static int load_image(DiffImage_t* image, uint32_t nthreads) {
+
+  if (read_boot_sector(image->disk, &image->boot_sec) != 0) {
+
+    return 1;
+  }
+  if (image->boot_sec.BPB_FATSz16 != 0 || image->boot_sec.BPB_FATSz32 == 0 ||
+      image->boot_sec.BPB_BytsPerSec == 0 || image->boot_sec.BPB_SecPerClus == 0) {
+
+    fprintf(cmd_err(), "Not a FAT32 volume\n");
+    return 1;
+  }
+  image->cluster_size = image->boot_sec.BPB_BytsPerSec * image->boot_sec.BPB_SecPerClus;
+  if (fat_view_load(image->disk, &image->boot_sec, &image->fat) != 0) {
+
+    return 1;
+  }
+  if (parallel_walk(image->disk, &image->boot_sec, image->boot_sec.BPB_RootClus, nthreads,
+                    WALK_EMIT_ENTRIES, NULL, NULL, &image->walk) != 0) {
+
+    fat_view_free(&image->fat);
+    return 1;
+  }
+  qsort(image->walk.entries, image->walk.entry_count, sizeof(WalkEntry_t), entry_compare);
+  return 0;
+}
+
+// Pairs the two sorted entry lists by path and settles everything that
+// metadata alone decides
+static DiffItem_t* merge_entries(const DiffImage_t* a, const DiffImage_t* b, uint32_t* count) {
+
+  DiffItem_t* items = malloc(((size_t)a->walk.entry_count + b->walk.entry_count + 1) *
+                             sizeof(DiffItem_t));
+  if (!items) {
+
+    return NULL;
+  }
+  uint32_t i = 0, j = 0, n = 0;
+  while (i < a->walk.entry_count || j < b->walk.entry_count) {
+
+    const WalkEntry_t* entry_a = (i < a->walk.entry_count) ? &a->walk.entries[i] : NULL;
+    const WalkEntry_t* entry_b = (j < b->walk.entry_count) ? &b->walk.entries[j] : NULL;
+    int order = !entry_a ? 1 : !entry_b ? -1 : walk_path_compare(entry_a->path, entry_b->path);
+    DiffItem_t* item = &items[n++];
+    item->a = (order <= 0) ? entry_a : NULL;
+    item->b = (order >= 0) ? entry_b : NULL;
+    i += (order <= 0);
+    j += (order >= 0);
+    if (!item->b) {
+
+      item->kind = '-';
+    } else if (!item->a) {
+
+      item->kind = '+';
+    } else if ((item->a->attr ^ item->b->attr) & DIFF_ATTR_MASK) {
+
+      item->kind = 'M';
+    } else if (item->a->attr & ATTR_DIRECTORY) {
+
+      item->kind = '='; // differences inside show up on the children
+    } else if (item->a->size != item->b->size) {
+
+      item->kind = 'M';
+    } else {
+
+      item->kind = (item->a->size == 0) ? '=' : '?';
+    }
+  }
+  *count = n;
+  return items;
+}
+
+static void print_item(const DiffItem_t* item) {
+
+  const WalkEntry_t* entry = item->a ? item->a : item->b;
+  const char* slash = (entry->attr & ATTR_DIRECTORY) ? "/" : "";
+  if (item->kind != 'M') {
+
+    fprintf(cmd_out(), "%c %s%s\n", item->kind, entry->path, slash);
+  } else if ((item->a->attr ^ item->b->attr) & ATTR_DIRECTORY) {
+
+    fprintf(cmd_out(), "M %s (%s -> %s)\n", entry->path,
+            (item->a->attr & ATTR_DIRECTORY) ? "dir" : "file",
+            (item->b->attr & ATTR_DIRECTORY) ? "dir" : "file");
+  } else if ((item->a->attr ^ item->b->attr) & DIFF_ATTR_MASK) {
+
+    fprintf(cmd_out(), "M %s%s (attributes 0x%02X -> 0x%02X)\n", entry->path, slash, item->a->attr,
+            item->b->attr);
+  } else if (item->a->size != item->b->size) {
+
+    fprintf(cmd_out(), "M %s (size %u -> %u)\n", entry->path, item->a->size, item->b->size);
+  } else {
+
+    fprintf(cmd_out(), "M %s (content)\n", entry->path);
+  }
+}
+
+static void compare_data(DiffShared_t* shared, uint32_t nthreads) {
+
+  if (nthreads > shared->pending_count) {
+
+    nthreads = shared->pending_count ? shared->pending_count : 1;
+  }
+  pthread_t* threads = calloc(nthreads, sizeof(pthread_t));
+  uint32_t started = 1;
+  for (; threads && started < nthreads; started++) {
+
+    if (pthread_create(&threads[started], NULL, diff_worker, shared) != 0) {
+
+      break;
+    }
+  }
+  diff_worker(shared);
+  for (uint32_t i = 1; threads && i < started; i++) {
+
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+}
+
+// Compares the volume with another image: entries by path first, then the
+// data of every file whose metadata matches. Only allocated clusters
+// reachable from the two trees are ever read. "-" marks entries only on
+// this volume, "+" entries only in the other image.
+void diff_image(FILE* disk, BootSec_t* boot_sec, const char* args, uint32_t current_clus) {
+
+  (void)boot_sec;
+  (void)current_clus;
+  uint32_t nthreads = walk_parse_threads(&args);
+  if (*args == '\0') {
+
+    fprintf(cmd_err(), "Usage: diff [-jN] <other_image>\n");
+    return;
+  }
+  journal_sync(disk); // everything below reads the images directly
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  DiffImage_t a, b;
+  memset(&a, 0, sizeof(a));
+  memset(&b, 0, sizeof(b));
+  a.disk = disk;
+  b.disk = fopen(args, "rb");
+  if (!b.disk) {
+
+    fprintf(cmd_err(), "Failed to open %s\n", args);
+    return;
+  }
+  if (load_image(&a, nthreads) != 0) {
+
+    fclose(b.disk);
+    return;
+  }
+  if (load_image(&b, nthreads) != 0) {
+
+    walk_result_free(&a.walk);
+    fat_view_free(&a.fat);
+    fclose(b.disk);
+    return;
+  }
+
+  uint32_t count = 0;
+  DiffItem_t* items = merge_entries(&a, &b, &count);
+  DiffItem_t** pending = items ? malloc(((size_t)count + 1) * sizeof(DiffItem_t*)) : NULL;
+  DiffShared_t shared = {&a, &b, pending, 0, 0, 0, 0};
+  if (!pending) {
+
+    fprintf(cmd_err(), "Memory allocation failed\n");
+  } else {
+
+    for (uint32_t i = 0; i < count; i++) {
+
+      if (items[i].kind == '?') {
+
+        pending[shared.pending_count++] = &items[i];
+      }
+    }
+    compare_data(&shared, nthreads);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint32_t added = 0, removed = 0, changed = 0;
+    for (uint32_t i = 0; i < count; i++) {
+
+      added += items[i].kind == '+';
+      removed += items[i].kind == '-';
+      changed += items[i].kind == 'M';
+      if (items[i].kind != '=') {
+
+        print_item(&items[i]);
+      }
+    }
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(cmd_out(), "%u added, %u removed, %u changed; %.1f MiB of data compared in %.3f s\n",
+            added, removed, changed, shared.compared / (1024.0 * 1024.0), seconds);
+    if (shared.failed) {
+
+      fprintf(cmd_err(), "Some files could not be compared\n");
+    }
+  }
+  fflush(cmd_out());
+  free(pending);
+  free(items);
+  walk_result_free(&a.walk);
+  walk_result_free(&b.walk);
+  fat_view_free(&a.fat);
+  fat_view_free(&b.fat);
+  fclose(b.disk);
+}
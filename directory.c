@@ -2,60 +2,53 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
 #include "bootsec.h"
 #include "directory.h"
+#include "geometry.h"
+#include "integrity.h"
+#include "pathindex.h"
+#include "prefetch.h"
+#include "readahead.h"
+#include "shortname.h"
+#include "unicode.h"
+#include "utility.h"
 
-#define MAX_LFN_ENTRIES 20
-#define MAX_DIR_ENTRIES 1024
+static void process_lfn_entry(DirParser_t* parser, const DIRStr_t* dir_entry, uint32_t cluster,
+                              uint32_t offset) {
 
-static void calculate_sector(FILE* disk, BootSec_t* boot_sec, uint32_t cluster) {
-
-  uint32_t fat_size = (boot_sec->BPB_FATSz32 == 0) ? boot_sec->BPB_FATSz16 : boot_sec->BPB_FATSz32;
-  uint32_t sector = boot_sec->BPB_RsvdSecCnt + (boot_sec->BPB_NumFATs * fat_size);
-  sector += (cluster - 2) * boot_sec->BPB_SecPerClus;
-  fseek(disk, sector * boot_sec->BPB_BytsPerSec, SEEK_SET);
-}
-
-static void process_lfn_entry(DIRStr_t* dir_entry, char** lfn_chunks, uint8_t* lfn_chunk_counter) {
-
-  LFNStr_t* lfn_entry = (LFNStr_t*)dir_entry;
+  const LFNStr_t* lfn_entry = (const LFNStr_t*)dir_entry;
+  uint8_t ord = lfn_entry->LDIR_Ord & LFN_ORD_MASK;
 
   if (lfn_entry->LDIR_Ord & LAST_LONG_ENTRY) {
 
-    *lfn_chunk_counter = 0;
+    // first physical entry of a run carries the highest ordinal
+    parser->lfn_count = 0;
+    parser->lfn_expected = ord;
+    parser->lfn_cluster = cluster;
+    parser->lfn_offset = offset;
+    memset(parser->lfn, 0, sizeof(parser->lfn));
   }
 
-  char lfn_buf[14] = {0};
-  for (int j = 0; j < 5; ++j) {
-
-    lfn_buf[j] = (char)lfn_entry->LDIR_Name1[j];
-  }
-  for (int j = 0; j < 6; ++j) {
+  if (ord == 0 || ord > MAX_LFN_ENTRIES || parser->lfn_expected == 0) {
 
-    lfn_buf[5 + j] = (char)lfn_entry->LDIR_Name2[j];
+    parser->lfn_expected = 0; // orphaned or malformed run, drop it
+    return;
   }
-  for (int j = 0; j < 2; ++j) {
 
-    lfn_buf[11 + j] = (char)lfn_entry->LDIR_Name3[j];
-  }
-  char* lfn_part = malloc(sizeof(lfn_buf) + 1);
-  if (!lfn_part) {
-
-    fprintf(stderr, "Failed with allocate memory\n");
-    exit(EXIT_FAILURE);
-  }
-
-  strcpy(lfn_part, lfn_buf);
-  lfn_chunks[*lfn_chunk_counter] = lfn_part;
-  *lfn_chunk_counter += 1;
+  uint16_t* dst = parser->lfn + (ord - 1) * 13;
+  memcpy(dst, lfn_entry->LDIR_Name1, sizeof(lfn_entry->LDIR_Name1));
+  memcpy(dst + 5, lfn_entry->LDIR_Name2, sizeof(lfn_entry->LDIR_Name2));
+  memcpy(dst + 11, lfn_entry->LDIR_Name3, sizeof(lfn_entry->LDIR_Name3));
+  parser->lfn_count++;
 }
 
-static void process_dir_entry(DIRStr_t* dir_entry, char* name, char* ext) {
+static void process_dir_entry(const DIRStr_t* dir_entry, char* name, char* ext) {
 
-  strncpy(name, (char*)dir_entry->DIR_Name, 8);
+  memcpy(name, dir_entry->DIR_Name, 8);
   name[8] = '\0';
 
-  strncpy(ext, (char*)dir_entry->DIR_Name + 8, 3);
+  memcpy(ext, dir_entry->DIR_Name + 8, 3);
   ext[3] = '\0';
 
   // remove trailing spaces in name and ext
@@ -83,97 +76,484 @@ static void process_dir_entry(DIRStr_t* dir_entry, char* name, char* ext) {
   }
 }
 
-static char* reverse_concatenate(char* array[], uint8_t count) {
+static void decode_lfn(const DirParser_t* parser, char* name) {
+
+  utf16_to_utf8(parser->lfn, parser->lfn_expected * 13, name, MAX_NAME_BYTES);
+}
+
+void dir_parser_init(DirParser_t* parser) {
+
+  parser->lfn_count = 0;
+  parser->lfn_expected = 0;
+}
+
+// Written once and instantiated per cluster size below; with size constant
+// the compiler can unroll the entry loop
+static inline __attribute__((always_inline)) int
+parse_entries(DirParser_t* parser, const uint8_t* buffer, uint32_t size, uint32_t cluster,
+              dir_entry_cb callback, void* ctx) {
+
+  EntrSt_t* entry = &parser->entry;
+
+  for (uint32_t offset = 0; offset < size; offset += sizeof(DIRStr_t)) {
+
+    const DIRStr_t* dir_entry = (const DIRStr_t*)(buffer + offset);
+
+    if (dir_entry->DIR_Name[0] == DIR_ENTRY_END) {
+
+      return 1; // No more entries
+    }
+    if (dir_entry->DIR_Name[0] == DIR_ENTRY_FREE) {
+
+      parser->lfn_expected = 0;
+      continue;
+    }
+    if ((dir_entry->DIR_Attr & ATTR_LFN) == ATTR_LFN) {
+
+      process_lfn_entry(parser, dir_entry, cluster, offset);
+      continue;
+    }
+    if (dir_entry->DIR_Attr & ATTR_VOLUME_ID) {
+
+      parser->lfn_expected = 0;
+      continue;
+    }
+
+    char name[9];
+    process_dir_entry(dir_entry, name, entry->ext);
 
-  // Step 1: Determine the total length of the concatenated string
-  int total_length = 0;
-  for (int i = 0; i < count; ++i) {
+    EntrLoc_t loc = {cluster, offset, cluster, offset, 0};
+    if (parser->lfn_expected && parser->lfn_count == parser->lfn_expected) {
 
-    total_length += strlen(array[i]);
+      decode_lfn(parser, entry->name);
+      loc.lfn_cluster = parser->lfn_cluster;
+      loc.lfn_offset = parser->lfn_offset;
+      loc.lfn_count = parser->lfn_count;
+    } else if (entry->ext[0] != '\0') {
+
+      snprintf(entry->name, sizeof(entry->name), "%s.%s", name, entry->ext);
+    } else {
+
+      strcpy(entry->name, name);
+    }
+    parser->lfn_expected = 0;
+    parser->lfn_count = 0;
+
+    entry->cluster = (dir_entry->DIR_FstClusHI << 16) | dir_entry->DIR_FstClusLO;
+    entry->size = dir_entry->DIR_FileSize;
+    entry->date = dir_entry->DIR_CrtDate;
+    entry->time = dir_entry->DIR_CrtTime;
+    entry->attr = dir_entry->DIR_Attr;
+
+    if (callback(entry, dir_entry, &loc, ctx) != 0) {
+
+      return 1;
+    }
   }
+  return 0;
+}
+
+// A scan loop compiled for one size, and the size it is good for
+typedef struct {
+
+  uint32_t size;
+  int (*parse)(DirParser_t* parser, const uint8_t* buffer, uint32_t cluster,
+               dir_entry_cb callback, void* ctx);
+} ClusterScan_t;
 
-  // Step 2: Allocate memory for the concatenated string
-  char* result = (char*)malloc(total_length + 1);
-  if (result == NULL) {
+typedef struct {
 
-    perror("malloc");
-    exit(1);
+  uint32_t size;
+  uint32_t (*next_free)(const uint8_t* sector_buffer, uint32_t from);
+} SectorScan_t;
+
+#define PARSE_FIXED(size)                                                                          \
+  static int parse_entries_##size(DirParser_t* parser, const uint8_t* buffer, uint32_t cluster,    \
+                                  dir_entry_cb callback, void* ctx) {                              \
+                                                                                                   \
+    return parse_entries(parser, buffer, size, cluster, callback, ctx);                            \
   }
-  result[0] = '\0'; // Initialize the result string
+GEOMETRY_CLUSTER_SIZES(PARSE_FIXED)
+
+// The loops geometry_select picked for the mounted volume. Each is read as one
+// pointer, so a thread never pairs a loop with another size; a size it does
+// not match, such as the second image of a diff, takes the generic loop.
+static const ClusterScan_t* cluster_scan;
+static const SectorScan_t* sector_scan;
+
+int parse_dir_cluster(DirParser_t* parser, const uint8_t* buffer, uint32_t size,
+                      uint32_t cluster, dir_entry_cb callback, void* ctx) {
 
-  // Step 3: Reverse concatenate the strings
-  for (int i = count - 1; i >= 0; --i) {
+  const ClusterScan_t* scan = __atomic_load_n(&cluster_scan, __ATOMIC_ACQUIRE);
+  if (scan && scan->size == size) {
 
-    strcat(result, array[i]);
+    return scan->parse(parser, buffer, cluster, callback, ctx);
   }
+  return parse_entries(parser, buffer, size, cluster, callback, ctx);
+}
+
+typedef struct {
+
+  FILE* disk;
+  BootSec_t* boot_sec;
+} DiskChain_t;
 
-  return result;
+static uint32_t disk_chain_next(void* ctx, uint32_t cluster) {
+
+  DiskChain_t* chain = ctx;
+  return get_next_cluster(chain->disk, cluster, chain->boot_sec->BPB_BytsPerSec,
+                          chain->boot_sec->BPB_RsvdSecCnt);
 }
 
-int read_dir_entries(FILE* disk, BootSec_t* boot_sec, uint32_t cluster, EntrSt_t** entries,
-                     uint32_t* entry_count) {
+// Returns 1 when the directory could not be read to its end, including a
+// cluster that fails its checksum; its entries are not passed on
+int walk_dir(FILE* disk, BootSec_t* boot_sec, uint32_t cluster, dir_entry_cb callback,
+             void* ctx) {
 
-  DIRStr_t dir_entry;
-  *entry_count = 0;
-  char* lfn_name = NULL;
-  char* lfn_chunks[MAX_LFN_ENTRIES] = {0};
-  uint8_t lfn_chunk_counter = 0;
+  uint16_t sector_size = boot_sec->BPB_BytsPerSec;
+  uint32_t cluster_size = sector_size * boot_sec->BPB_SecPerClus;
+  uint8_t* buffer = buffer_take(cluster_size);
+  if (!buffer) {
 
-  calculate_sector(disk, boot_sec, cluster);
+    fprintf(cmd_err(), "Failed to allocate memory\n");
+    return 1;
+  }
 
-  while (fread(&dir_entry, sizeof(DIRStr_t), 1, disk) == 1) {
+  // one cluster buffer and one parser state: memory does not grow with the directory
+  DirParser_t parser;
+  dir_parser_init(&parser);
+  DiskChain_t chain = {disk, boot_sec};
+  Readahead_t ra;
+  readahead_init(&ra, fileno(disk), boot_sec, disk_chain_next, &chain);
 
-    if (dir_entry.DIR_Name[0] == 0) {
+  int failed = 0;
+  while (cluster >= 2 && cluster < EOC) {
 
-      break; // No more entries
+    // clusters warmed by the prefetch thread need neither the image nor the FAT
+    uint32_t next;
+    int warm = prefetch_dir_cluster(cluster, buffer, &next);
+    if (!warm) {
+
+      readahead_step(&ra, cluster);
+      read_clusters(disk, boot_sec, cluster, 1, buffer);
     }
-    if ((dir_entry.DIR_Attr & ATTR_LFN) == ATTR_LFN) {
+    if (integrity_verify(cluster, buffer) != 0) {
 
-      process_lfn_entry(&dir_entry, lfn_chunks, &lfn_chunk_counter);
-      continue;
+      failed = 1;
+      break;
     }
-    if (lfn_chunk_counter > 0) {
+    if (parse_dir_cluster(&parser, buffer, cluster_size, cluster, callback, ctx) != 0) {
 
-      lfn_name = reverse_concatenate(lfn_chunks, lfn_chunk_counter);
-      for (int i = 0; i < lfn_chunk_counter; ++i) {
+      break;
+    }
+    cluster = warm ? next : readahead_next(&ra, cluster);
+  }
 
-        free(lfn_chunks[i]);
-      }
-      lfn_chunk_counter = 0;
+  buffer_give(buffer, cluster_size);
+  return failed;
+}
+
+static int grow_column(void** column, uint32_t capacity, size_t width) {
+
+  void* grown = realloc(*column, capacity * width);
+  if (!grown) {
+
+    return 1;
+  }
+  *column = grown;
+  return 0;
+}
+
+static int list_entry(const EntrSt_t* entry, const DIRStr_t* raw, const EntrLoc_t* loc,
+                      void* ctx) {
+
+  (void)raw;
+  (void)loc;
+  DirList_t* list = ctx;
+  if (list->count == list->capacity) {
+
+    uint32_t capacity = list->capacity ? list->capacity * 2 : 64;
+    if (grow_column((void**)&list->name_off, capacity, sizeof(uint32_t)) ||
+        grow_column((void**)&list->hash, capacity, sizeof(uint32_t)) ||
+        grow_column((void**)&list->cluster, capacity, sizeof(uint32_t)) ||
+        grow_column((void**)&list->size, capacity, sizeof(uint32_t)) ||
+        grow_column((void**)&list->date, capacity, sizeof(uint16_t)) ||
+        grow_column((void**)&list->time, capacity, sizeof(uint16_t)) ||
+        grow_column((void**)&list->attr, capacity, sizeof(uint8_t))) {
+
+      fprintf(cmd_err(), "Failed to allocate memory\n");
+      return 1;
     }
-    char name[9], ext[4];
-    process_dir_entry(&dir_entry, name, ext);
-    (*entries) = realloc((*entries), ((*entry_count) + 1) * sizeof(EntrSt_t));
-    if (!(*entries)) {
+    list->capacity = capacity;
+  }
+
+  size_t len = strlen(entry->name) + 1;
+  if (list->names_len + len > list->names_cap) {
 
-      fprintf(stderr, "Failed to allocate memory\n");
+    size_t cap = list->names_cap ? list->names_cap * 2 : 4096;
+    while (cap < list->names_len + len) {
+
+      cap *= 2;
+    }
+    char* grown = realloc(list->names, cap);
+    if (!grown) {
+
+      fprintf(cmd_err(), "Failed to allocate memory\n");
       return 1;
     }
-    if (lfn_name) {
+    list->names = grown;
+    list->names_cap = cap;
+  }
+  memcpy(list->names + list->names_len, entry->name, len);
+
+  uint32_t i = list->count++;
+  list->name_off[i] = list->names_len;
+  list->hash[i] = utf8_casehash(entry->name);
+  list->cluster[i] = entry->cluster;
+  list->size[i] = entry->size;
+  list->date[i] = entry->date;
+  list->time[i] = entry->time;
+  list->attr[i] = entry->attr;
+  list->names_len += len;
+  return 0;
+}
 
-      strcpy((*entries)[*entry_count].name, lfn_name);
-      free(lfn_name);
-      lfn_name = NULL;
-    } else {
+// Reads every visible entry of a directory into list. On failure the list
+// holds what was read so far and still has to be freed.
+int dir_list_load(FILE* disk, BootSec_t* boot_sec, uint32_t cluster, DirList_t* list) {
 
-      if (ext[0] != '\0') {
+  memset(list, 0, sizeof(*list));
+  return walk_dir(disk, boot_sec, cluster, list_entry, list) != 0;
+}
+
+void dir_list_free(DirList_t* list) {
+
+  free(list->name_off);
+  free(list->hash);
+  free(list->cluster);
+  free(list->size);
+  free(list->date);
+  free(list->time);
+  free(list->attr);
+  free(list->names);
+  memset(list, 0, sizeof(*list));
+}
 
-        char final_name[13];
-        snprintf(final_name, 12, "%s.%s", name, ext);
-        strcpy((*entries)[*entry_count].name, final_name);
-      } else {
+const char* dir_list_name(const DirList_t* list, uint32_t index) {
+
+  return list->names + list->name_off[index];
+}
 
-        strcpy((*entries)[*entry_count].name, name);
+// Case-insensitive lookup: the hash column is scanned first and names are
+// compared only where the hashes agree
+int dir_list_find(const DirList_t* list, const char* name, uint32_t* index) {
+
+  uint32_t hash = utf8_casehash(name);
+  for (uint32_t i = 0; i < list->count; i++) {
+
+    if (list->hash[i] == hash && utf8_casecmp(dir_list_name(list, i), name) == 0) {
+
+      *index = i;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+typedef struct {
+
+  const char* name;
+  EntrSt_t* entry;
+  EntrLoc_t* loc;
+  int found;
+} EntrFind_t;
+
+static int match_entry(const EntrSt_t* entry, const DIRStr_t* raw, const EntrLoc_t* loc,
+                       void* ctx) {
+
+  (void)raw;
+  EntrFind_t* find = ctx;
+  if (utf8_casecmp(entry->name, find->name) != 0) {
+
+    return 0;
+  }
+  *find->entry = *entry;
+  *find->loc = *loc;
+  find->found = 1;
+  return 1;
+}
+
+// 1 found, 0 not there, -1 when the directory could not be read
+int find_dir_entry(FILE* disk, BootSec_t* boot_sec, uint32_t cluster, const char* name,
+                   EntrSt_t* entry, EntrLoc_t* loc) {
+
+  int indexed = path_index_find(cluster, name, entry, loc);
+  if (indexed >= 0) {
+
+    return indexed;
+  }
+  EntrFind_t find = {name, entry, loc, 0};
+  if (walk_dir(disk, boot_sec, cluster, match_entry, &find) != 0 && !find.found) {
+
+    return -1;
+  }
+  return find.found;
+}
+
+// Slots a new entry takes: its LFN run plus the 8.3 entry. Only a name that
+// is a valid 8.3 name as written, and whose 8.3 form is not taken in names
+// (a ~N alias of another entry, say), goes without the run; the run's
+// length counts UTF-16 units.
+uint32_t dir_slots_needed(const char* name, const ShortNameSet_t* names) {
+
+  char short_name[SHORT_NAME_LEN];
+  uint8_t nt_res;
+  if (short_name_from_83(name, short_name, &nt_res) == 0 &&
+      !(names && short_name_set_contains(names, short_name))) {
+
+    return 1;
+  }
+  size_t units = utf8_utf16_fit(name, strlen(name), MAX_MAME_LEN); // as write_lfn_entries cuts it
+  return (units + 12) / 13 + 1;
+}
+
+static inline __attribute__((always_inline)) uint32_t
+next_free_slot(const uint8_t* sector_buffer, uint32_t from, uint32_t sector_size) {
+
+  for (uint32_t offset = from; offset < sector_size; offset += sizeof(DIRStr_t)) {
+
+    uint8_t first = sector_buffer[offset];
+    if (first == DIR_ENTRY_END || first == DIR_ENTRY_FREE) {
+
+      return offset;
+    }
+  }
+  return sector_size;
+}
+
+#define NEXT_FREE_FIXED(size)                                                                      \
+  static uint32_t next_free_slot_##size(const uint8_t* sector_buffer, uint32_t from) {             \
+                                                                                                   \
+    return next_free_slot(sector_buffer, from, size);                                              \
+  }
+GEOMETRY_SECTOR_SIZES(NEXT_FREE_FIXED)
+
+// Offset of the first free or end slot at or after from, or sector_size when
+// the rest of the sector is taken
+uint32_t dir_next_free(const uint8_t* sector_buffer, uint32_t from, uint32_t sector_size) {
+
+  const SectorScan_t* scan = __atomic_load_n(&sector_scan, __ATOMIC_ACQUIRE);
+  if (scan && scan->size == sector_size) {
+
+    return scan->next_free(sector_buffer, from);
+  }
+  return next_free_slot(sector_buffer, from, sector_size);
+}
+
+// Picks the scan loops compiled for this volume's sector and cluster size, once
+// per mount; read_boot_sector calls it
+void geometry_select(const BootSec_t* boot_sec) {
+
+#define CLUSTER_SCAN(size) {size, parse_entries_##size},
+#define SECTOR_SCAN(size) {size, next_free_slot_##size},
+  static const ClusterScan_t cluster_scans[] = {GEOMETRY_CLUSTER_SIZES(CLUSTER_SCAN)};
+  static const SectorScan_t sector_scans[] = {GEOMETRY_SECTOR_SIZES(SECTOR_SCAN)};
+
+  uint32_t sector_size = boot_sec->BPB_BytsPerSec;
+  uint32_t cluster_size = sector_size * boot_sec->BPB_SecPerClus;
+  const ClusterScan_t* picked_cluster = NULL;
+  const SectorScan_t* picked_sector = NULL;
+  for (size_t i = 0; i < sizeof(cluster_scans) / sizeof(cluster_scans[0]); i++) {
+
+    if (cluster_scans[i].size == cluster_size) {
+
+      picked_cluster = &cluster_scans[i];
+    }
+  }
+  for (size_t i = 0; i < sizeof(sector_scans) / sizeof(sector_scans[0]); i++) {
+
+    if (sector_scans[i].size == sector_size) {
+
+      picked_sector = &sector_scans[i];
+    }
+  }
+  __atomic_store_n(&cluster_scan, picked_cluster, __ATOMIC_RELEASE);
+  __atomic_store_n(&sector_scan, picked_sector, __ATOMIC_RELEASE);
+}
+
+// A run of needed free slots starting at offset that fits in this sector. Past
+// the end marker every slot is free, so only the sector bound matters there.
+int dir_slots_fit(const uint8_t* sector_buffer, uint32_t offset, uint32_t sector_size,
+                  uint32_t needed) {
+
+  if (offset + needed * sizeof(DIRStr_t) > sector_size) {
+
+    return 0;
+  }
+  for (uint32_t k = 0; k < needed; k++) {
+
+    uint8_t first = sector_buffer[offset + k * sizeof(DIRStr_t)];
+    if (first == DIR_ENTRY_END) {
+
+      return 1;
+    }
+    if (first != DIR_ENTRY_FREE) {
+
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Turns the free tail of a sector into deleted slots, so that entries placed
+// in later sectors are not hidden behind an end marker
+void dir_seal_tail(uint8_t* sector_buffer, uint32_t offset, uint32_t sector_size) {
+
+  for (; offset < sector_size; offset += sizeof(DIRStr_t)) {
+
+    sector_buffer[offset] = DIR_ENTRY_FREE;
+  }
+}
+
+// Marks the 8.3 entry at loc and every slot of its LFN run as deleted
+void dir_mark_deleted(FILE* disk, BootSec_t* boot_sec, const EntrLoc_t* loc) {
+
+  uint16_t sector_size = boot_sec->BPB_BytsPerSec;
+  uint32_t cluster_size = sector_size * boot_sec->BPB_SecPerClus;
+  short_name_cache_invalidate(); // let the freed 8.3 name be reused
+  uint8_t sector_buffer[sector_size];
+
+  uint32_t cluster = loc->lfn_cluster;
+  uint32_t offset = loc->lfn_offset;
+  uint32_t loaded = 0;
+  for (uint32_t k = 0; k <= loc->lfn_count; k++) {
+
+    uint32_t sector = first_sector_of_cluster(boot_sec, cluster) + offset / sector_size;
+    if (sector != loaded) {
+
+      if (loaded) {
+
+        write_sector(disk, loaded, sector_buffer, sector_size);
+      }
+      read_sector(disk, sector, sector_buffer, sector_size);
+      loaded = sector;
+    }
+    sector_buffer[offset % sector_size] = DIR_ENTRY_FREE;
+
+    offset += sizeof(DIRStr_t);
+    if (offset == cluster_size) {
+
+      // an LFN run may continue in the next cluster of the directory
+      cluster = get_next_cluster(disk, cluster, sector_size, boot_sec->BPB_RsvdSecCnt);
+      offset = 0;
+      if (cluster < 2 || cluster >= EOC) {
+
+        break;
       }
     }
-    (*entries)[*entry_count].cluster = (dir_entry.DIR_FstClusHI << 16) | dir_entry.DIR_FstClusLO;
-    (*entries)[*entry_count].size = dir_entry.DIR_FileSize;
-    (*entries)[*entry_count].date = dir_entry.DIR_CrtDate;
-    (*entries)[*entry_count].time = dir_entry.DIR_CrtTime;
-    (*entries)[*entry_count].attr = dir_entry.DIR_Attr;
-    memcpy((*entries)[*entry_count].ext, ext, 4);
+  }
+  if (loaded) {
 
-    (*entry_count)++;
+    write_sector(disk, loaded, sector_buffer, sector_size);
   }
-  return 0;
 }
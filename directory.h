@@ -5,6 +5,7 @@
 #include <stdio.h>
 
 #include "bootsec.h"
+#include "shortname.h"
 
 #define ATTR_READ_ONLY 0x01
 #define ATTR_HIDDEN 0x02
@@ -14,10 +15,15 @@
 #define ATTR_DIRECTORY 0x10
 #define ATTR_ARCHIVE 0x20
 #define LAST_LONG_ENTRY 0x40
+#define LFN_ORD_MASK 0x1F
 #define EOC 0x0FFFFFF8 // end of cluster
 #define NT_RES_LOWER_CASE_BASE 0x08
 #define NT_RES_LOWER_CASE_EXT 0x10
 #define MAX_MAME_LEN 255
+#define MAX_NAME_BYTES (MAX_MAME_LEN * 3 + 1) // UTF-8 worst case for 255 UTF-16 units
+#define MAX_LFN_ENTRIES 20
+#define DIR_ENTRY_FREE 0xE5
+#define DIR_ENTRY_END 0x00
 
 typedef struct DIRStr {
 
@@ -49,7 +55,7 @@ typedef struct LFNStr {
 
 typedef struct {
 
-  char name[MAX_MAME_LEN];
+  char name[MAX_NAME_BYTES];
   uint32_t cluster;
   uint32_t size;
   uint16_t date;
@@ -58,7 +64,67 @@ typedef struct {
   char ext[4];
 } EntrSt_t;
 
-int read_dir_entries(FILE* disk, BootSec_t* boot_sec, uint32_t cluster, EntrSt_t** entries,
-                     uint32_t* entry_count);
+// On-disk position of a parsed entry: the 8.3 entry itself and the first
+// entry of its LFN run (equal to the 8.3 position when there is no LFN)
+typedef struct {
+
+  uint32_t cluster;
+  uint32_t offset;
+  uint32_t lfn_cluster;
+  uint32_t lfn_offset;
+  uint8_t lfn_count;
+} EntrLoc_t;
+
+// Called once per visible entry; a non-zero return stops the walk
+typedef int (*dir_entry_cb)(const EntrSt_t* entry, const DIRStr_t* raw, const EntrLoc_t* loc,
+                            void* ctx);
+
+// One directory's entries as parallel columns indexed alike; names sit back
+// to back in a single pool and are reached through name_off
+typedef struct {
+
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t* name_off;
+  uint32_t* hash; // utf8_casehash of the name
+  uint32_t* cluster;
+  uint32_t* size;
+  uint16_t* date;
+  uint16_t* time;
+  uint8_t* attr;
+  char* names;
+  size_t names_len;
+  size_t names_cap;
+} DirList_t;
+
+// Incremental parser state, carried across cluster boundaries of one directory
+typedef struct {
+
+  uint16_t lfn[MAX_LFN_ENTRIES * 13];
+  uint8_t lfn_count;
+  uint8_t lfn_expected;
+  uint32_t lfn_cluster;
+  uint32_t lfn_offset;
+  EntrSt_t entry;
+} DirParser_t;
+
+void dir_parser_init(DirParser_t* parser);
+int parse_dir_cluster(DirParser_t* parser, const uint8_t* buffer, uint32_t size,
+                      uint32_t cluster, dir_entry_cb callback, void* ctx);
+int walk_dir(FILE* disk, BootSec_t* boot_sec, uint32_t cluster, dir_entry_cb callback,
+             void* ctx);
+int dir_list_load(FILE* disk, BootSec_t* boot_sec, uint32_t cluster, DirList_t* list);
+void dir_list_free(DirList_t* list);
+const char* dir_list_name(const DirList_t* list, uint32_t index);
+int dir_list_find(const DirList_t* list, const char* name, uint32_t* index);
+int find_dir_entry(FILE* disk, BootSec_t* boot_sec, uint32_t cluster, const char* name,
+                   EntrSt_t* entry, EntrLoc_t* loc);
+uint32_t dir_slots_needed(const char* name, const ShortNameSet_t* names);
+uint32_t dir_next_free(const uint8_t* sector_buffer, uint32_t from, uint32_t sector_size);
+void geometry_select(const BootSec_t* boot_sec);
+int dir_slots_fit(const uint8_t* sector_buffer, uint32_t offset, uint32_t sector_size,
+                  uint32_t needed);
+void dir_seal_tail(uint8_t* sector_buffer, uint32_t offset, uint32_t sector_size);
+void dir_mark_deleted(FILE* disk, BootSec_t* boot_sec, const EntrLoc_t* loc);
 
 #endif // DDIR_STR_H
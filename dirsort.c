@@ -0,0 +1,357 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "dirsort.h"
+#include "unicode.h"
+#include "utility.h"
+
+#define SORT_PARALLEL_MIN (1u << 14) // fewer entries sort faster than threads start
+#define SORT_MAX_THREADS 64
+#define SORT_SMALL_RUN 24 // tie runs this short are insertion sorted
+
+typedef struct {
+
+  uint64_t key;
+  uint32_t index;
+} SortPair_t;
+
+// Case-folded names without their leading dot, back to back; entry i starts
+// at offset[i] and its terminator sits at offset[i + 1] - 1
+typedef struct {
+
+  char* folded;
+  size_t* offset;
+} SortNames_t;
+
+typedef struct {
+
+  const SortNames_t* names;
+  SortPair_t* pairs;
+  SortPair_t* tmp;
+  uint32_t count;
+} SortChunk_t;
+
+typedef struct {
+
+  const SortNames_t* names;
+  const SortPair_t* a;
+  uint32_t a_count;
+  const SortPair_t* b;
+  uint32_t b_count;
+  SortPair_t* out;
+} SortMerge_t;
+
+static int fold_names(const DirList_t* list, SortNames_t* names) {
+
+  // folding can triple a malformed name; pages past the real size are never touched
+  names->folded = arena_alloc(list->names_len * 3 + 1);
+  names->offset = arena_alloc(((size_t)list->count + 1) * sizeof(size_t));
+  if (!names->folded || !names->offset) {
+
+    return 1;
+  }
+  size_t len = 0;
+  for (uint32_t i = 0; i < list->count; i++) {
+
+    const char* name = dir_list_name(list, i);
+    names->offset[i] = len;
+    len += utf8_casefold(name + (name[0] == '.'), names->folded + len) + 1;
+  }
+  names->offset[list->count] = len;
+  return 0;
+}
+
+// Eight folded bytes from depth on, big-endian, zero past the end of the name
+static uint64_t prefix_key(const SortNames_t* names, uint32_t index, size_t depth) {
+
+  const uint8_t* name = (const uint8_t*)names->folded + names->offset[index];
+  size_t len = names->offset[index + 1] - names->offset[index] - 1;
+  uint64_t key = 0;
+  for (size_t i = depth; i < depth + 8; i++) {
+
+    key = (key << 8) | (i < len ? name[i] : 0);
+  }
+  return key;
+}
+
+static int names_compare(const SortNames_t* names, uint32_t a, uint32_t b, size_t depth) {
+
+  return strcmp(names->folded + names->offset[a] + depth, names->folded + names->offset[b] + depth);
+}
+
+// Stable LSD radix sort on the low key_bytes bytes of the keys, one byte per
+// pass. A pass where every key has the same digit is skipped.
+static void radix_sort(SortPair_t* pairs, SortPair_t* tmp, uint32_t count, int key_bytes) {
+
+  if (count < 2) {
+
+    return;
+  }
+  uint32_t hist[8][256];
+  memset(hist, 0, sizeof(hist));
+  for (uint32_t i = 0; i < count; i++) {
+
+    for (int b = 0; b < key_bytes; b++) {
+
+      hist[b][(pairs[i].key >> (8 * b)) & 0xFF]++;
+    }
+  }
+
+  SortPair_t* src = pairs;
+  SortPair_t* dst = tmp;
+  for (int b = 0; b < key_bytes; b++) {
+
+    if (hist[b][(src[0].key >> (8 * b)) & 0xFF] == count) {
+
+      continue;
+    }
+    uint32_t pos[256];
+    uint32_t sum = 0;
+    for (int d = 0; d < 256; d++) {
+
+      pos[d] = sum;
+      sum += hist[b][d];
+    }
+    for (uint32_t i = 0; i < count; i++) {
+
+      dst[pos[(src[i].key >> (8 * b)) & 0xFF]++] = src[i];
+    }
+    SortPair_t* swap = src;
+    src = dst;
+    dst = swap;
+  }
+  if (src != pairs) {
+
+    memcpy(pairs, src, count * sizeof(SortPair_t));
+  }
+}
+
+// The pairs are ordered by the eight name bytes at depth. Runs of equal keys
+// are ordered by the bytes after them, and their keys are put back afterwards
+// so the caller still sees depth keys.
+static void refine_runs(const SortNames_t* names, SortPair_t* pairs, SortPair_t* tmp,
+                        uint32_t count, size_t depth) {
+
+  uint32_t start = 0;
+  while (start < count) {
+
+    uint64_t key = pairs[start].key;
+    uint32_t end = start + 1;
+    while (end < count && pairs[end].key == key) {
+
+      end++;
+    }
+    SortPair_t* run = pairs + start;
+    uint32_t run_count = end - start;
+
+    // a zero last byte means the names ended inside the window: all equal
+    if (run_count > 1 && (key & 0xFF) != 0) {
+
+      if (run_count < SORT_SMALL_RUN) {
+
+        for (uint32_t i = 1; i < run_count; i++) {
+
+          SortPair_t pair = run[i];
+          uint32_t j = i;
+          for (; j > 0 && names_compare(names, pair.index, run[j - 1].index, depth + 8) < 0; j--) {
+
+            run[j] = run[j - 1];
+          }
+          run[j] = pair;
+        }
+      } else {
+
+        for (uint32_t i = 0; i < run_count; i++) {
+
+          run[i].key = prefix_key(names, run[i].index, depth + 8);
+        }
+        radix_sort(run, tmp + start, run_count, 8);
+        refine_runs(names, run, tmp + start, run_count, depth + 8);
+        for (uint32_t i = 0; i < run_count; i++) {
+
+          run[i].key = key;
+        }
+      }
+    }
+    start = end;
+  }
+}
+
+static void sort_names(const SortNames_t* names, SortPair_t* pairs, SortPair_t* tmp,
+                       uint32_t count) {
+
+  for (uint32_t i = 0; i < count; i++) {
+
+    pairs[i].key = prefix_key(names, pairs[i].index, 0);
+  }
+  radix_sort(pairs, tmp, count, 8);
+  refine_runs(names, pairs, tmp, count, 0);
+}
+
+static void* sort_chunk_worker(void* arg) {
+
+  SortChunk_t* chunk = arg;
+  sort_names(chunk->names, chunk->pairs, chunk->tmp, chunk->count);
+  return NULL;
+}
+
+static int pair_less(const SortNames_t* names, const SortPair_t* a, const SortPair_t* b) {
+
+  if (a->key != b->key) {
+
+    return a->key < b->key;
+  }
+  return (a->key & 0xFF) != 0 && names_compare(names, a->index, b->index, 8) < 0;
+}
+
+static void* merge_worker(void* arg) {
+
+  SortMerge_t* merge = arg;
+  uint32_t i = 0, j = 0, k = 0;
+  while (i < merge->a_count && j < merge->b_count) {
+
+    if (pair_less(merge->names, &merge->b[j], &merge->a[i])) {
+
+      merge->out[k++] = merge->b[j++];
+    } else {
+
+      merge->out[k++] = merge->a[i++];
+    }
+  }
+  memcpy(merge->out + k, merge->a + i, (merge->a_count - i) * sizeof(SortPair_t));
+  k += merge->a_count - i;
+  memcpy(merge->out + k, merge->b + j, (merge->b_count - j) * sizeof(SortPair_t));
+  return NULL;
+}
+
+// One thread per task; a task whose thread cannot be started runs here instead
+static void run_tasks(void* (*worker)(void*), void* tasks, size_t task_size, uint32_t count) {
+
+  pthread_t threads[SORT_MAX_THREADS];
+  uint8_t started[SORT_MAX_THREADS];
+  for (uint32_t i = 1; i < count; i++) {
+
+    started[i] = pthread_create(&threads[i], NULL, worker, (char*)tasks + i * task_size) == 0;
+  }
+  worker(tasks);
+  for (uint32_t i = 1; i < count; i++) {
+
+    if (started[i]) {
+
+      pthread_join(threads[i], NULL);
+    } else {
+
+      worker((char*)tasks + i * task_size);
+    }
+  }
+}
+
+// Sorts chunks of the pairs on separate threads, then merges neighbouring
+// chunks pairwise until one run is left. Returns the buffer holding it.
+static SortPair_t* sort_names_parallel(const SortNames_t* names, SortPair_t* pairs,
+                                       SortPair_t* tmp, uint32_t count, uint32_t nthreads) {
+
+  if (nthreads > SORT_MAX_THREADS) {
+
+    nthreads = SORT_MAX_THREADS;
+  }
+  if (count < SORT_PARALLEL_MIN || nthreads < 2) {
+
+    sort_names(names, pairs, tmp, count);
+    return pairs;
+  }
+
+  uint32_t bounds[SORT_MAX_THREADS + 1];
+  SortChunk_t chunks[SORT_MAX_THREADS];
+  for (uint32_t t = 0; t <= nthreads; t++) {
+
+    bounds[t] = (uint64_t)count * t / nthreads;
+  }
+  for (uint32_t t = 0; t < nthreads; t++) {
+
+    chunks[t] = (SortChunk_t){names, pairs + bounds[t], tmp + bounds[t], bounds[t + 1] - bounds[t]};
+  }
+  run_tasks(sort_chunk_worker, chunks, sizeof(SortChunk_t), nthreads);
+
+  SortPair_t* src = pairs;
+  SortPair_t* dst = tmp;
+  uint32_t runs = nthreads;
+  while (runs > 1) {
+
+    SortMerge_t merges[SORT_MAX_THREADS / 2];
+    uint32_t merge_count = 0;
+    for (uint32_t r = 0; r < runs; r += 2) {
+
+      uint32_t lo = bounds[r];
+      uint32_t mid = bounds[(r + 1 < runs) ? r + 1 : runs];
+      uint32_t hi = bounds[(r + 2 < runs) ? r + 2 : runs];
+      merges[merge_count] = (SortMerge_t){names, src + lo, mid - lo, src + mid, hi - mid, dst + lo};
+      bounds[merge_count++] = lo;
+    }
+    bounds[merge_count] = count;
+    run_tasks(merge_worker, merges, sizeof(SortMerge_t), merge_count);
+    runs = merge_count;
+    SortPair_t* swap = src;
+    src = dst;
+    dst = swap;
+  }
+  return src;
+}
+
+static uint64_t field_key(const DirList_t* list, uint8_t order, uint32_t index) {
+
+  switch (order) {
+
+  case DIR_SORT_SIZE:
+    return (uint32_t)~list->size[index];
+  case DIR_SORT_DATE:
+    return (uint32_t)~(((uint32_t)list->date[index] << 16) | list->time[index]);
+  default:
+    return list->cluster[index];
+  }
+}
+
+// Fills result with the entry indices of list in the requested order. Names
+// compare case-insensitively with a leading dot ignored; they also break ties
+// of the other orders. Radix sorts on folded name prefixes do the work, with
+// comparisons only inside runs that share a long prefix.
+int dir_list_sort(const DirList_t* list, uint8_t order, uint32_t nthreads, uint32_t* result) {
+
+  uint32_t count = list->count;
+  if (count == 0) {
+
+    return 0;
+  }
+  SortNames_t names = {NULL, NULL};
+  SortPair_t* pairs = arena_alloc(count * sizeof(SortPair_t));
+  SortPair_t* tmp = arena_alloc(count * sizeof(SortPair_t));
+  int failed = !pairs || !tmp || fold_names(list, &names) != 0;
+  if (!failed) {
+
+    for (uint32_t i = 0; i < count; i++) {
+
+      pairs[i].index = i;
+    }
+    SortPair_t* sorted = sort_names_parallel(&names, pairs, tmp, count, nthreads);
+    if (order != DIR_SORT_NAME) {
+
+      // the pass is stable, so equal values stay in name order
+      for (uint32_t i = 0; i < count; i++) {
+
+        sorted[i].key = field_key(list, order, sorted[i].index);
+      }
+      radix_sort(sorted, (sorted == pairs) ? tmp : pairs, count, 4);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+
+      result[i] = sorted[i].index;
+    }
+  } else {
+
+    fprintf(cmd_err(), "Memory allocation failed\n");
+  }
+  return failed;
+}
@@ -0,0 +1,15 @@
+#ifndef DIRSORT_H
+#define DIRSORT_H
+
+#include <stdint.h>
+
+#include "directory.h"
+
+#define DIR_SORT_NAME 0
+#define DIR_SORT_SIZE 1    // largest first
+#define DIR_SORT_DATE 2    // newest first
+#define DIR_SORT_CLUSTER 3 // disk order
+
+int dir_list_sort(const DirList_t* list, uint8_t order, uint32_t nthreads, uint32_t* result);
+
+#endif // DIRSORT_H
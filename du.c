@@ -0,0 +1,77 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "bootsec.h"
+#include "usage.h"
+#include "utility.h"
+#include "walk.h"
+
+static int depth_compare(const void* a, const void* b) {
+
+  const WalkDir_t* dir_a = (const WalkDir_t*)a;
+  const WalkDir_t* dir_b = (const WalkDir_t*)b;
+  return (dir_a->depth < dir_b->depth) - (dir_a->depth > dir_b->depth);
+}
+
+static int path_compare(const void* a, const void* b) {
+
+  return walk_path_compare(((const WalkDir_t*)a)->path, ((const WalkDir_t*)b)->path);
+}
+
+void du(FILE* disk, BootSec_t* boot_sec, const char* args, uint32_t current_clus) {
+
+  uint32_t nthreads = walk_parse_threads(&args);
+  uint32_t cluster_size = boot_sec->BPB_BytsPerSec * boot_sec->BPB_SecPerClus;
+
+  // the usage table already holds every directory's totals; walk only without it
+  WalkResult_t result;
+  if (usage_subtree(current_clus, &result) != 0 &&
+      parallel_walk(disk, boot_sec, current_clus, nthreads, 0, NULL, NULL, &result) != 0) {
+
+    return;
+  }
+
+  uint32_t max_id = 0;
+  for (uint32_t i = 0; i < result.dir_count; i++) {
+
+    if (result.dirs[i].id > max_id) {
+
+      max_id = result.dirs[i].id;
+    }
+  }
+  uint32_t* index_by_id = arena_alloc((max_id + 1) * sizeof(uint32_t));
+  if (!index_by_id) {
+
+    fprintf(cmd_err(), "Memory allocation failed\n");
+    walk_result_free(&result);
+    return;
+  }
+
+  // deepest directories first, so every child is complete before it is added to its parent
+  qsort(result.dirs, result.dir_count, sizeof(WalkDir_t), depth_compare);
+  memset(index_by_id, 0xff, (max_id + 1) * sizeof(uint32_t)); // UINT32_MAX: no such directory
+  for (uint32_t i = 0; i < result.dir_count; i++) {
+
+    index_by_id[result.dirs[i].id] = i;
+  }
+  for (uint32_t i = 0; i < result.dir_count; i++) {
+
+    WalkDir_t* dir = &result.dirs[i];
+    if (dir->depth > 0 && dir->parent_id <= max_id && index_by_id[dir->parent_id] != UINT32_MAX) {
+
+      result.dirs[index_by_id[dir->parent_id]].clusters += dir->clusters;
+    }
+  }
+
+  qsort(result.dirs, result.dir_count, sizeof(WalkDir_t), path_compare);
+  for (uint32_t i = 0; i < result.dir_count; i++) {
+
+    uint64_t kib = (result.dirs[i].clusters * cluster_size + 1023) / 1024;
+    fprintf(cmd_out(), "%llu\t%s\n", (unsigned long long)kib, result.dirs[i].path);
+  }
+  fflush(cmd_out());
+  walk_result_free(&result);
+}
@@ -0,0 +1,219 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "directory.h"
+#include "extent.h"
+#include "utility.h"
+
+// Small cache of extent maps for recently accessed files, replaced round robin.
+// A map stays alive while the cache or any reader holds a reference to it.
+// Maps are built without the lock; generation tells a builder whether the
+// cache was invalidated meanwhile.
+static struct {
+
+  ExtentMap_t* maps[EXTENT_CACHE_SLOTS];
+  uint32_t next_victim;
+  uint64_t generation;
+  pthread_mutex_t lock;
+} cache = {{NULL}, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+
+// Drops one reference; called with the lock held
+static void map_unref(ExtentMap_t* map) {
+
+  if (map && --map->refs == 0) {
+
+    free(map->extents);
+    free(map);
+  }
+}
+
+static void slot_release(uint32_t slot) {
+
+  map_unref(cache.maps[slot]);
+  cache.maps[slot] = NULL;
+}
+
+// One walk of the chain, folding consecutive clusters into extents
+static int map_build(FILE* disk, BootSec_t* boot_sec, uint32_t first_cluster, ExtentMap_t* map) {
+
+  uint32_t capacity = 8;
+  map->extents = malloc(capacity * sizeof(Extent_t));
+  if (!map->extents) {
+
+    return 1;
+  }
+  map->first_cluster = first_cluster;
+  map->count = 0;
+  map->total_clusters = 0;
+
+  uint32_t limit = (boot_sec->BPB_TotSec32 / boot_sec->BPB_SecPerClus) + 2;
+  uint32_t cluster = first_cluster;
+  while (cluster >= 2 && cluster < EOC && map->total_clusters < limit) {
+
+    Extent_t* last = map->count ? &map->extents[map->count - 1] : NULL;
+    if (last && cluster == last->disk_cluster + last->length) {
+
+      last->length++;
+    } else {
+
+      if (map->count == capacity) {
+
+        capacity *= 2;
+        Extent_t* grown = realloc(map->extents, capacity * sizeof(Extent_t));
+        if (!grown) {
+
+          free(map->extents);
+          return 1;
+        }
+        map->extents = grown;
+      }
+      map->extents[map->count++] = (Extent_t){map->total_clusters, cluster, 1};
+    }
+    map->total_clusters++;
+    cluster = get_next_cluster(disk, cluster, boot_sec->BPB_BytsPerSec, boot_sec->BPB_RsvdSecCnt);
+  }
+  return 0;
+}
+
+static ExtentMap_t* cache_find(uint32_t first_cluster) {
+
+  for (uint32_t i = 0; i < EXTENT_CACHE_SLOTS; i++) {
+
+    if (cache.maps[i] && cache.maps[i]->first_cluster == first_cluster) {
+
+      return cache.maps[i];
+    }
+  }
+  return NULL;
+}
+
+// Returns a referenced map; give it back with extent_map_put. The chain walk
+// runs outside the lock, so readers of other files do not wait behind it.
+const ExtentMap_t* extent_map_get(FILE* disk, BootSec_t* boot_sec, uint32_t first_cluster) {
+
+  if (first_cluster < 2) {
+
+    return NULL;
+  }
+  pthread_mutex_lock(&cache.lock);
+  ExtentMap_t* map = cache_find(first_cluster);
+  if (map) {
+
+    map->refs++;
+    pthread_mutex_unlock(&cache.lock);
+    return map;
+  }
+  uint64_t generation = cache.generation;
+  pthread_mutex_unlock(&cache.lock);
+
+  map = calloc(1, sizeof(ExtentMap_t));
+  if (!map || map_build(disk, boot_sec, first_cluster, map) != 0) {
+
+    free(map);
+    fprintf(cmd_err(), "Failed to build extent map\n");
+    return NULL;
+  }
+  map->refs = 1; // the caller
+
+  pthread_mutex_lock(&cache.lock);
+  ExtentMap_t* raced = cache_find(first_cluster);
+  if (raced) {
+
+    // another reader inserted the same file first; use its map
+    raced->refs++;
+    map_unref(map);
+    map = raced;
+  } else if (generation == cache.generation) {
+
+    map->refs++; // and the cache
+    slot_release(cache.next_victim);
+    cache.maps[cache.next_victim] = map;
+    cache.next_victim = (cache.next_victim + 1) % EXTENT_CACHE_SLOTS;
+  }
+  pthread_mutex_unlock(&cache.lock);
+  return map;
+}
+
+void extent_map_put(const ExtentMap_t* map) {
+
+  pthread_mutex_lock(&cache.lock);
+  map_unref((ExtentMap_t*)map);
+  pthread_mutex_unlock(&cache.lock);
+}
+
+// Binary search for the extent holding file_cluster; run_left is the number
+// of clusters that can be read contiguously from disk_cluster on
+int extent_map_lookup(const ExtentMap_t* map, uint32_t file_cluster, uint32_t* disk_cluster,
+                      uint32_t* run_left) {
+
+  if (file_cluster >= map->total_clusters) {
+
+    return 1;
+  }
+  uint32_t lo = 0, hi = map->count;
+  while (hi - lo > 1) {
+
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (map->extents[mid].file_cluster <= file_cluster) {
+
+      lo = mid;
+    } else {
+
+      hi = mid;
+    }
+  }
+  const Extent_t* extent = &map->extents[lo];
+  uint32_t delta = file_cluster - extent->file_cluster;
+  *disk_cluster = extent->disk_cluster + delta;
+  *run_left = extent->length - delta;
+  return 0;
+}
+
+// chain_next_fn adapter for readahead over a map. Walking forward, the answer
+// is in the cursor's extent or the one after it; anything else is searched.
+uint32_t extent_map_chain_next(void* cursor, uint32_t cluster) {
+
+  ExtentCursor_t* at = cursor;
+  const ExtentMap_t* map = at->map;
+  for (uint32_t n = 0; n < map->count; n++) {
+
+    uint32_t i = (at->index + n) % map->count;
+    const Extent_t* extent = &map->extents[i];
+    if (cluster >= extent->disk_cluster && cluster - extent->disk_cluster < extent->length) {
+
+      at->index = i;
+      if (cluster - extent->disk_cluster + 1 < extent->length) {
+
+        return cluster + 1;
+      }
+      return (i + 1 < map->count) ? map->extents[i + 1].disk_cluster : EOC;
+    }
+  }
+  return EOC;
+}
+
+void extent_cache_invalidate(uint32_t first_cluster) {
+
+  pthread_mutex_lock(&cache.lock);
+  cache.generation++;
+  for (uint32_t i = 0; i < EXTENT_CACHE_SLOTS; i++) {
+
+    if (cache.maps[i] && cache.maps[i]->first_cluster == first_cluster) {
+
+      slot_release(i);
+    }
+  }
+  pthread_mutex_unlock(&cache.lock);
+}
+
+void extent_cache_clear(void) {
+
+  pthread_mutex_lock(&cache.lock);
+  cache.generation++;
+  for (uint32_t i = 0; i < EXTENT_CACHE_SLOTS; i++) {
+
+    slot_release(i);
+  }
+  pthread_mutex_unlock(&cache.lock);
+}
@@ -0,0 +1,43 @@
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bootsec.h"
+
+#define EXTENT_CACHE_SLOTS 64
+
+// Run of length clusters that are contiguous both in the file and on disk
+typedef struct {
+
+  uint32_t file_cluster;
+  uint32_t disk_cluster;
+  uint32_t length;
+} Extent_t;
+
+typedef struct {
+
+  uint32_t first_cluster; // key: a chain is identified by its first cluster
+  uint32_t count;
+  uint32_t total_clusters;
+  Extent_t* extents;
+  uint32_t refs;
+} ExtentMap_t;
+
+// Position in a map for following the chain by disk cluster
+typedef struct {
+
+  const ExtentMap_t* map;
+  uint32_t index; // extent the last answer came from
+} ExtentCursor_t;
+
+const ExtentMap_t* extent_map_get(FILE* disk, BootSec_t* boot_sec, uint32_t first_cluster);
+void extent_map_put(const ExtentMap_t* map);
+int extent_map_lookup(const ExtentMap_t* map, uint32_t file_cluster, uint32_t* disk_cluster,
+                      uint32_t* run_left);
+uint32_t extent_map_chain_next(void* cursor, uint32_t cluster);
+void extent_cache_invalidate(uint32_t first_cluster);
+void extent_cache_clear(void);
+
+#endif // EXTENT_H
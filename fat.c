@@ -0,0 +1,393 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "directory.h"
+#include "extent.h"
+#include "fat.h"
+#include "journal.h"
+#include "overlay.h"
+#include "shortname.h"
+#include "usage.h"
+#include "utility.h"
+
+#define FREE_BATCH_MAX_RUN 128 // FAT sectors rewritten per write
+#define FAT_COUNT_MAX_RUN 128  // FAT sectors read per recount
+
+uint32_t cluster_count(const BootSec_t* boot_sec) {
+
+  uint32_t fat_size = (boot_sec->BPB_FATSz16 == 0) ? boot_sec->BPB_FATSz32 : boot_sec->BPB_FATSz16;
+  uint32_t tot_sec =
+      (boot_sec->BPB_TotSec32 == 0) ? boot_sec->BPB_TotSec16 : boot_sec->BPB_TotSec32;
+  uint32_t data_sec = tot_sec - boot_sec->BPB_RsvdSecCnt - (boot_sec->BPB_NumFATs * fat_size);
+  uint32_t count = data_sec / boot_sec->BPB_SecPerClus + 2;
+
+  // the FAT itself may be too small to describe every data cluster
+  uint32_t fat_entries = fat_size * (boot_sec->BPB_BytsPerSec / FAT_ELEM_SIZE);
+  return (count < fat_entries) ? count : fat_entries;
+}
+
+int fat_view_load(FILE* disk, BootSec_t* boot_sec, FatView_t* view) {
+
+  view->count = cluster_count(boot_sec);
+  view->entries = malloc((size_t)view->count * FAT_ELEM_SIZE);
+  if (!view->entries) {
+
+    fprintf(cmd_err(), "Failed to allocate memory for FAT\n");
+    return 1;
+  }
+
+  off_t offset = (off_t)boot_sec->BPB_RsvdSecCnt * boot_sec->BPB_BytsPerSec;
+  size_t size = (size_t)view->count * FAT_ELEM_SIZE;
+  if (image_pread(disk, view->entries, size, offset) != (ssize_t)size) {
+
+    fprintf(cmd_err(), "Failed to read FAT\n");
+    free(view->entries);
+    view->entries = NULL;
+    return 1;
+  }
+  // entries this command or its group changed are still in the log
+  journal_read_range(boot_sec->BPB_RsvdSecCnt, (uint8_t*)view->entries, size,
+                     boot_sec->BPB_BytsPerSec);
+  return 0;
+}
+
+void fat_view_free(FatView_t* view) {
+
+  free(view->entries);
+  view->entries = NULL;
+  view->count = 0;
+}
+
+uint32_t fat_view_next(const FatView_t* view, uint32_t cluster) {
+
+  if (cluster >= view->count) {
+
+    return EOC;
+  }
+  return view->entries[cluster] & 0x0FFFFFFF;
+}
+
+// chain_next_fn adapter for readahead over the view
+uint32_t fat_view_chain_next(void* view, uint32_t cluster) {
+
+  return fat_view_next((const FatView_t*)view, cluster);
+}
+
+uint32_t fat_view_chain_length(const FatView_t* view, uint32_t cluster) {
+
+  uint32_t length = 0;
+  while (cluster >= 2 && cluster < EOC && length < view->count) {
+
+    length++;
+    cluster = fat_view_next(view, cluster);
+  }
+  return length;
+}
+
+// Stores the view's entries for clusters first..last into every FAT copy,
+// rewriting only the sectors that cover that range
+int fat_view_write_range(const FatView_t* view, FILE* disk, BootSec_t* boot_sec, uint32_t first,
+                         uint32_t last) {
+
+  uint16_t sector_size = boot_sec->BPB_BytsPerSec;
+  uint32_t per_sector = sector_size / FAT_ELEM_SIZE;
+  uint32_t fat_size = (boot_sec->BPB_FATSz16 == 0) ? boot_sec->BPB_FATSz32 : boot_sec->BPB_FATSz16;
+  uint32_t first_sector = first / per_sector;
+  uint32_t count = last / per_sector - first_sector + 1;
+
+  uint8_t* buffer = malloc((size_t)count * sector_size);
+  if (!buffer) {
+
+    fprintf(cmd_err(), "Memory allocation failed\n");
+    return 1;
+  }
+
+  // the view stops at the last real cluster; the rest of its sector comes from disk
+  read_sectors(disk, boot_sec->BPB_RsvdSecCnt + first_sector, count, buffer, sector_size);
+  uint32_t first_entry = first_sector * per_sector;
+  uint32_t entries = count * per_sector;
+  if (first_entry + entries > view->count) {
+
+    entries = view->count - first_entry;
+  }
+  const uint32_t* old = (const uint32_t*)buffer;
+  int64_t used_delta = 0;
+  for (uint32_t i = 0; i < entries; i++) {
+
+    used_delta += (view->entries[first_entry + i] & 0x0FFFFFFF) != 0;
+    used_delta -= (old[i] & 0x0FFFFFFF) != 0;
+  }
+  usage_note_fat(used_delta);
+  memcpy(buffer, view->entries + first_entry, (size_t)entries * FAT_ELEM_SIZE);
+
+  for (uint32_t f = 0; f < boot_sec->BPB_NumFATs; f++) {
+
+    write_sectors(disk, boot_sec->BPB_RsvdSecCnt + f * fat_size + first_sector, count, buffer,
+                  sector_size);
+  }
+  free(buffer);
+  return 0;
+}
+
+void free_batch_init(FreeBatch_t* batch) {
+
+  batch->clusters = NULL;
+  batch->count = 0;
+  batch->capacity = 0;
+}
+
+int free_batch_add_chain(FreeBatch_t* batch, FILE* disk, BootSec_t* boot_sec, uint32_t cluster) {
+
+  uint32_t limit = cluster_count(boot_sec);
+  uint32_t length = 0;
+  extent_cache_invalidate(cluster); // the chain is about to go away
+  while (cluster >= 2 && cluster < limit && length++ < limit) {
+
+    if (batch->count == batch->capacity) {
+
+      uint32_t capacity = batch->capacity ? batch->capacity * 2 : 256;
+      uint32_t* grown = realloc(batch->clusters, capacity * sizeof(uint32_t));
+      if (!grown) {
+
+        fprintf(cmd_err(), "Memory allocation failed\n");
+        return 1;
+      }
+      batch->clusters = grown;
+      batch->capacity = capacity;
+    }
+    batch->clusters[batch->count++] = cluster;
+    cluster = get_next_cluster(disk, cluster, boot_sec->BPB_BytsPerSec, boot_sec->BPB_RsvdSecCnt);
+  }
+  return 0;
+}
+
+static int cluster_compare(const void* a, const void* b) {
+
+  uint32_t cluster_a = *(const uint32_t*)a;
+  uint32_t cluster_b = *(const uint32_t*)b;
+  return (cluster_a > cluster_b) - (cluster_a < cluster_b);
+}
+
+static void punch_runs(FILE* disk, BootSec_t* boot_sec, const uint32_t* clusters, uint32_t count) {
+
+  uint32_t cluster_size = boot_sec->BPB_BytsPerSec * boot_sec->BPB_SecPerClus;
+  uint32_t start = 0;
+  while (start < count) {
+
+    uint32_t run = 1;
+    while (start + run < count && clusters[start + run] == clusters[start] + run) {
+
+      run++;
+    }
+    off_t offset =
+        (off_t)first_sector_of_cluster(boot_sec, clusters[start]) * boot_sec->BPB_BytsPerSec;
+    if (fallocate(fileno(disk), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                  (off_t)run * cluster_size) != 0) {
+
+      if (errno == EOPNOTSUPP) {
+
+        fprintf(cmd_err(), "Hole punching is not supported for this image\n");
+        return;
+      }
+      fprintf(cmd_err(), "Failed to punch hole at cluster %u: %s\n", clusters[start],
+              strerror(errno));
+    }
+    start += run;
+  }
+}
+
+// Zeroes the FAT entries of every batched cluster. Clusters are sorted so each
+// FAT sector is read once and every run of touched sectors is written once per
+// FAT copy, instead of one read-modify-write per cluster.
+uint32_t free_batch_flush(FreeBatch_t* batch, FILE* disk, BootSec_t* boot_sec, uint8_t punch) {
+
+  if (batch->count == 0) {
+
+    return 0;
+  }
+  short_name_cache_invalidate(); // a freed cluster may come back as another directory
+  qsort(batch->clusters, batch->count, sizeof(uint32_t), cluster_compare);
+  uint32_t unique = 1;
+  for (uint32_t i = 1; i < batch->count; i++) {
+
+    if (batch->clusters[i] != batch->clusters[unique - 1]) {
+
+      batch->clusters[unique++] = batch->clusters[i];
+    }
+  }
+  batch->count = unique;
+
+  uint16_t sector_size = boot_sec->BPB_BytsPerSec;
+  uint32_t per_sector = sector_size / FAT_ELEM_SIZE;
+  uint32_t fat_size = (boot_sec->BPB_FATSz16 == 0) ? boot_sec->BPB_FATSz32 : boot_sec->BPB_FATSz16;
+  uint8_t* buffer = malloc((size_t)FREE_BATCH_MAX_RUN * sector_size);
+  if (!buffer) {
+
+    fprintf(cmd_err(), "Memory allocation failed\n");
+    return 0;
+  }
+
+  uint32_t i = 0;
+  while (i < batch->count) {
+
+    uint32_t first = batch->clusters[i] / per_sector;
+    uint32_t last = first;
+    uint32_t j = i;
+    while (j < batch->count) {
+
+      uint32_t sector = batch->clusters[j] / per_sector;
+      if (sector > last + 1 || sector - first >= FREE_BATCH_MAX_RUN) {
+
+        break;
+      }
+      last = sector;
+      j++;
+    }
+
+    uint32_t count = last - first + 1;
+    read_sectors(disk, boot_sec->BPB_RsvdSecCnt + first, count, buffer, sector_size);
+    uint32_t* entries = (uint32_t*)buffer;
+    for (uint32_t k = i; k < j; k++) {
+
+      uint32_t index = batch->clusters[k] - first * per_sector;
+      if (entries[index] & 0x0FFFFFFF) {
+
+        usage_note_fat(-1);
+      }
+      entries[index] &= 0xF0000000; // keep the reserved high bits
+    }
+    for (uint32_t f = 0; f < boot_sec->BPB_NumFATs; f++) {
+
+      write_sectors(disk, boot_sec->BPB_RsvdSecCnt + f * fat_size + first, count, buffer,
+                    sector_size);
+    }
+    i = j;
+  }
+  free(buffer);
+
+  if (punch && !overlay_active()) { // the base of an overlay is never modified
+
+    // the entry and FAT updates must be durable before the data behind them
+    // disappears: through the log when there is one, else in the image itself.
+    // Clusters that cannot be made safe keep their data.
+    int synced = journal_active() ? journal_sync(disk) : fdatasync(fileno(disk));
+    if (synced == 0) {
+
+      punch_runs(disk, boot_sec, batch->clusters, batch->count);
+    } else {
+
+      fprintf(cmd_err(), "Failed to sync the image, no holes were punched\n");
+    }
+  }
+
+  uint32_t freed = batch->count;
+  batch->count = 0;
+  return freed;
+}
+
+void free_batch_release(FreeBatch_t* batch) {
+
+  free(batch->clusters);
+  free_batch_init(batch);
+}
+
+// Allocated clusters per sector of the first FAT, so that a count after a
+// write reads only the sectors written since the last one
+static struct {
+
+  pthread_mutex_t lock;
+  uint32_t* used;  // per FAT sector
+  uint8_t* stale;  // per FAT sector: written since it was counted
+  uint32_t sectors;
+  uint64_t fat_start; // byte offset of the first FAT
+  uint16_t sector_size;
+} fat_count = {PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0, 0, 0};
+
+// Writers hold the image to themselves, so no count runs alongside
+void fat_note_write(off_t offset, size_t size) {
+
+  uint64_t start = offset;
+  uint64_t end = start + size;
+  uint64_t fat_end = fat_count.fat_start + (uint64_t)fat_count.sectors * fat_count.sector_size;
+  if (!fat_count.stale || start >= fat_end || end <= fat_count.fat_start) {
+
+    return;
+  }
+  uint64_t first = ((start > fat_count.fat_start) ? start : fat_count.fat_start) -
+                   fat_count.fat_start;
+  uint64_t last = ((end < fat_end) ? end : fat_end) - fat_count.fat_start;
+  for (uint64_t sector = first / fat_count.sector_size; sector * fat_count.sector_size < last;
+       sector++) {
+
+    fat_count.stale[sector] = 1;
+  }
+}
+
+// Clusters allocated anywhere on the volume; 0 when they cannot be counted
+uint64_t fat_used_clusters(FILE* disk, BootSec_t* boot_sec) {
+
+  uint16_t sector_size = boot_sec->BPB_BytsPerSec;
+  uint32_t count = cluster_count(boot_sec);
+  uint32_t per_sector = sector_size / FAT_ELEM_SIZE;
+  uint32_t sectors = (count + per_sector - 1) / per_sector;
+  uint64_t fat_start = (uint64_t)boot_sec->BPB_RsvdSecCnt * sector_size;
+
+  pthread_mutex_lock(&fat_count.lock);
+  if (fat_count.sectors != sectors || fat_count.fat_start != fat_start ||
+      fat_count.sector_size != sector_size) {
+
+    free(fat_count.used);
+    free(fat_count.stale);
+    fat_count.used = calloc(sectors, sizeof(uint32_t));
+    fat_count.stale = malloc(sectors);
+    fat_count.sectors = sectors;
+    fat_count.fat_start = fat_start;
+    fat_count.sector_size = sector_size;
+    if (fat_count.stale) {
+
+      memset(fat_count.stale, 1, sectors);
+    }
+  }
+  uint8_t* buffer = malloc((size_t)FAT_COUNT_MAX_RUN * sector_size);
+  if (!fat_count.used || !fat_count.stale || !buffer) {
+
+    free(buffer);
+    pthread_mutex_unlock(&fat_count.lock);
+    return 0;
+  }
+
+  uint64_t total = 0;
+  for (uint32_t sector = 0; sector < sectors; sector++) {
+
+    if (fat_count.stale[sector]) {
+
+      uint32_t run = 1;
+      while (run < FAT_COUNT_MAX_RUN && sector + run < sectors && fat_count.stale[sector + run]) {
+
+        run++;
+      }
+      read_sectors(disk, boot_sec->BPB_RsvdSecCnt + sector, run, buffer, sector_size);
+      for (uint32_t i = 0; i < run; i++) {
+
+        const uint32_t* entries = (const uint32_t*)(buffer + (size_t)i * sector_size);
+        uint32_t used = 0;
+        for (uint32_t j = 0; j < per_sector; j++) {
+
+          uint32_t cluster = (sector + i) * per_sector + j;
+          used += cluster >= 2 && cluster < count && (entries[j] & 0x0FFFFFFF) != 0;
+        }
+        fat_count.used[sector + i] = used;
+        fat_count.stale[sector + i] = 0;
+      }
+    }
+    total += fat_count.used[sector];
+  }
+  free(buffer);
+  pthread_mutex_unlock(&fat_count.lock);
+  return total;
+}
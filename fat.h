@@ -0,0 +1,40 @@
+#ifndef FAT_VIEW_H
+#define FAT_VIEW_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "bootsec.h"
+
+// Read-only in-memory copy of the first FAT, shared between threads
+typedef struct {
+
+  uint32_t* entries;
+  uint32_t count; // number of FAT entries, including the two reserved ones
+} FatView_t;
+
+// Clusters waiting to be released; flushed with one FAT write per run of sectors
+typedef struct {
+
+  uint32_t* clusters;
+  uint32_t count;
+  uint32_t capacity;
+} FreeBatch_t;
+
+int fat_view_load(FILE* disk, BootSec_t* boot_sec, FatView_t* view);
+void fat_view_free(FatView_t* view);
+uint32_t fat_view_next(const FatView_t* view, uint32_t cluster);
+uint32_t fat_view_chain_next(void* view, uint32_t cluster);
+uint32_t fat_view_chain_length(const FatView_t* view, uint32_t cluster);
+uint32_t cluster_count(const BootSec_t* boot_sec);
+int fat_view_write_range(const FatView_t* view, FILE* disk, BootSec_t* boot_sec, uint32_t first,
+                         uint32_t last);
+void free_batch_init(FreeBatch_t* batch);
+int free_batch_add_chain(FreeBatch_t* batch, FILE* disk, BootSec_t* boot_sec, uint32_t cluster);
+uint32_t free_batch_flush(FreeBatch_t* batch, FILE* disk, BootSec_t* boot_sec, uint8_t punch);
+void free_batch_release(FreeBatch_t* batch);
+void fat_note_write(off_t offset, size_t size);
+uint64_t fat_used_clusters(FILE* disk, BootSec_t* boot_sec);
+
+#endif // FAT_VIEW_H
@@ -0,0 +1,44 @@
+#include <fnmatch.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bootsec.h"
+#include "utility.h"
+#include "walk.h"
+
+static int match_name(const EntrSt_t* entry, void* ctx) {
+
+  return fnmatch((const char*)ctx, entry->name, 0) == 0;
+}
+
+static int entry_compare(const void* a, const void* b) {
+
+  return walk_path_compare(((const WalkEntry_t*)a)->path, ((const WalkEntry_t*)b)->path);
+}
+
+void find(FILE* disk, BootSec_t* boot_sec, const char* args, uint32_t current_clus) {
+
+  uint32_t nthreads = walk_parse_threads(&args);
+  const char* pattern = (*args != '\0') ? args : NULL;
+
+  WalkResult_t result;
+  if (parallel_walk(disk, boot_sec, current_clus, nthreads, WALK_EMIT_ENTRIES,
+                    pattern ? match_name : NULL, (void*)pattern, &result) != 0) {
+
+    return;
+  }
+
+  qsort(result.entries, result.entry_count, sizeof(WalkEntry_t), entry_compare);
+  if (!pattern) {
+
+    fprintf(cmd_out(), ".\n");
+  }
+  for (uint32_t i = 0; i < result.entry_count; i++) {
+
+    fprintf(cmd_out(), "%s\n", result.entries[i].path);
+  }
+  fflush(cmd_out());
+  walk_result_free(&result);
+}
@@ -7,6 +7,7 @@
 
 #include "bootsec.h"
 #include "fsinfo.h"
+#include "utility.h"
 
 #define BYTS_PER_SEC 512
 #define NUM_FATS 2
@@ -45,14 +46,14 @@ static int write_check(const void* data, uint32_t offset, size_t data_size, size
 
   if (fseek(file, offset, SEEK_SET) == -1) {
 
-    fprintf(stderr, "Failed to find position at %d to file %d: %s\n", offset, errno,
+    fprintf(cmd_err(), "Failed to find position at %d to file %d: %s\n", offset, errno,
             strerror(errno));
     return -1;
   }
   size_t res = fwrite(data, data_size, count, file);
   if (res != count) {
 
-    fprintf(stderr, "Failed to write to file %d: %s\n", errno, strerror(errno));
+    fprintf(cmd_err(), "Failed to write to file %d: %s\n", errno, strerror(errno));
     return -1;
   }
   return 0;
@@ -63,7 +64,7 @@ int format_disk(const char* filename) {
   FILE* disk = fopen(filename, "r");
   if (!disk) {
 
-    fprintf(stderr, "File open failed %d: %s.\n", errno, strerror(errno));
+    fprintf(cmd_err(), "File open failed %d: %s.\n", errno, strerror(errno));
     return -1;
   }
 
@@ -76,7 +77,7 @@ int format_disk(const char* filename) {
   BootSec_t* boot_sec = (BootSec_t*)malloc(sizeof(BootSec_t));
   if (!boot_sec) {
 
-    fprintf(stderr, "Failed to allocate memory for BootSector.\n");
+    fprintf(cmd_err(), "Failed to allocate memory for BootSector.\n");
     fclose(disk);
     return -1;
   }
@@ -120,7 +121,7 @@ int format_disk(const char* filename) {
   FSInfo_t* fsinfo = (FSInfo_t*)malloc(sizeof(FSInfo_t));
   if (!fsinfo) {
 
-    fprintf(stderr, "Failed to allocate memory for fsinfo.\n");
+    fprintf(cmd_err(), "Failed to allocate memory for fsinfo.\n");
     free(boot_sec);
     fclose(disk);
     return -1;
@@ -136,7 +137,7 @@ int format_disk(const char* filename) {
   uint32_t* rsrvd_fat_sec = (uint32_t*)malloc(BYTS_PER_SEC);
   if (!rsrvd_fat_sec) {
 
-    fprintf(stderr, "Failed to allocate memory for FAT.\n");
+    fprintf(cmd_err(), "Failed to allocate memory for FAT.\n");
     free(boot_sec);
     free(fsinfo);
     fclose(disk);
@@ -188,7 +189,7 @@ int format_disk(const char* filename) {
   }
 
   fclose(disk);
-  printf("Disk was formatted\n");
+  fprintf(cmd_out(), "Disk was formatted\n");
 
   free(boot_sec);
   free(fsinfo);
@@ -0,0 +1,13 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+// Sizes the hot directory loops are instantiated for, so their bounds are
+// compile-time constants; geometry_select picks the instance at mount. X is
+// called once per distinct size, any other size takes the generic loop with
+// a runtime bound. The cluster sizes are 512 or 4096 byte sectors times 1, 8
+// or 64 sectors per cluster: 4096 is 512 x 8 or 4096 x 1, 32768 is 512 x 64
+// or 4096 x 8.
+#define GEOMETRY_SECTOR_SIZES(X) X(512) X(4096)
+#define GEOMETRY_CLUSTER_SIZES(X) X(512) X(4096) X(32768) X(262144)
+
+#endif // GEOMETRY_H
@@ -0,0 +1,488 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "integrity.h"
+#include "journal.h"
+#include "utility.h"
+
+#define CRC_MAGIC 0x43524346 // "FCRC"
+#define CRC_VERSION 1
+#define CRC_PATH_MAX 512
+#define CRC_SCAN_BYTES (1024 * 1024)
+
+// The sidecar is this header followed by one CRC-32C per cluster, indexed by
+// cluster number. It describes the image as of the last finished command.
+typedef struct {
+
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+  uint32_t cluster_size;
+  uint32_t cluster_count;
+} __attribute__((packed)) CrcHeader_t;
+
+static struct {
+
+  int active;
+  int fd;
+  char path[CRC_PATH_MAX];
+  const BootSec_t* boot_sec;
+  off_t data_start;
+  uint32_t cluster_size;
+  uint32_t cluster_count;
+  uint32_t* crcs;
+  uint8_t* dirty_map; // one bit per cluster written since the last flush
+  uint32_t* dirty;
+  uint32_t dirty_count;
+  uint32_t dirty_capacity;
+} crc_state = {0, -1, {0}, NULL, 0, 0, 0, NULL, NULL, NULL, 0, 0};
+
+typedef struct {
+
+  FILE* disk;
+  const FatView_t* fat; // NULL: every cluster
+  uint8_t rebuild;
+  uint32_t chunk_clusters;
+  uint32_t next_chunk; // taken with an atomic add
+  uint32_t chunk_count;
+} ScanShared_t;
+
+typedef struct {
+
+  ScanShared_t* shared;
+  uint64_t clusters;
+  uint32_t* mismatches;
+  uint32_t mismatch_count;
+  uint32_t mismatch_capacity;
+  int failed;
+} ScanWorker_t;
+
+static int is_dirty(uint32_t cluster) {
+
+  return (crc_state.dirty_map[cluster / 8] >> (cluster % 8)) & 1;
+}
+
+static int write_table(uint32_t first, uint32_t count) {
+
+  size_t size = (size_t)count * sizeof(uint32_t);
+  off_t offset = sizeof(CrcHeader_t) + (off_t)first * sizeof(uint32_t);
+  return pwrite(crc_state.fd, crc_state.crcs + first, size, offset) == (ssize_t)size ? 0 : 1;
+}
+
+// Replaces the whole table. The header goes last, after the table is on disk,
+// so a table cut short by a crash never carries a valid header.
+static int write_whole_table(void) {
+
+  CrcHeader_t header = {CRC_MAGIC, CRC_VERSION, 0, crc_state.cluster_size,
+                        crc_state.cluster_count};
+  CrcHeader_t none;
+  memset(&none, 0, sizeof(none));
+  if (pwrite(crc_state.fd, &none, sizeof(none), 0) != sizeof(none) ||
+      fdatasync(crc_state.fd) != 0 || write_table(0, crc_state.cluster_count) != 0 ||
+      fdatasync(crc_state.fd) != 0 ||
+      pwrite(crc_state.fd, &header, sizeof(header), 0) != sizeof(header) ||
+      fdatasync(crc_state.fd) != 0) {
+
+    return 1;
+  }
+  return 0;
+}
+
+static uint8_t is_scanned(const ScanShared_t* shared, uint32_t cluster) {
+
+  if (!shared->fat) {
+
+    return 1;
+  }
+  uint32_t value = shared->fat->entries[cluster] & 0x0FFFFFFF;
+  return value != 0 && value != 0x0FFFFFF7; // bad clusters hold nothing worth checking
+}
+
+static int add_mismatch(ScanWorker_t* worker, uint32_t cluster) {
+
+  if (worker->mismatch_count == worker->mismatch_capacity) {
+
+    uint32_t capacity = worker->mismatch_capacity ? worker->mismatch_capacity * 2 : 64;
+    uint32_t* grown = realloc(worker->mismatches, capacity * sizeof(uint32_t));
+    if (!grown) {
+
+      return 1;
+    }
+    worker->mismatches = grown;
+    worker->mismatch_capacity = capacity;
+  }
+  worker->mismatches[worker->mismatch_count++] = cluster;
+  return 0;
+}
+
+// Reads one run of clusters in a single call and checks or records each CRC
+static void scan_run(ScanWorker_t* worker, uint8_t* buffer, uint32_t first, uint32_t run) {
+
+  size_t size = (size_t)run * crc_state.cluster_size;
+  off_t offset = crc_state.data_start + (off_t)(first - 2) * crc_state.cluster_size;
+  ssize_t got = image_pread(worker->shared->disk, buffer, size, offset);
+  size_t valid = (got > 0) ? (size_t)got : 0;
+  memset(buffer + valid, 0, size - valid); // past the end of the file reads as zeros
+  for (uint32_t i = 0; i < run; i++) {
+
+    uint32_t crc = crc32c(0, buffer + (size_t)i * crc_state.cluster_size, crc_state.cluster_size);
+    if (worker->shared->rebuild) {
+
+      crc_state.crcs[first + i] = crc;
+    } else if (crc != crc_state.crcs[first + i] && add_mismatch(worker, first + i) != 0) {
+
+      worker->failed = 1;
+    }
+  }
+  worker->clusters += run;
+}
+
+static void* scan_worker(void* arg) {
+
+  ScanWorker_t* worker = arg;
+  ScanShared_t* shared = worker->shared;
+  uint8_t* buffer = malloc((size_t)shared->chunk_clusters * crc_state.cluster_size);
+  if (!buffer) {
+
+    worker->failed = 1;
+    return NULL;
+  }
+
+  while (!worker->failed) {
+
+    uint32_t chunk = __atomic_fetch_add(&shared->next_chunk, 1, __ATOMIC_RELAXED);
+    if (chunk >= shared->chunk_count) {
+
+      break;
+    }
+    uint32_t cluster = 2 + chunk * shared->chunk_clusters;
+    uint32_t end = cluster + shared->chunk_clusters;
+    if (end > crc_state.cluster_count) {
+
+      end = crc_state.cluster_count;
+    }
+    while (cluster < end) {
+
+      if (!is_scanned(shared, cluster)) {
+
+        cluster++;
+        continue;
+      }
+      uint32_t run = 1;
+      while (cluster + run < end && is_scanned(shared, cluster + run)) {
+
+        run++;
+      }
+      scan_run(worker, buffer, cluster, run);
+      cluster += run;
+    }
+  }
+  free(buffer);
+  return NULL;
+}
+
+static int cluster_compare(const void* a, const void* b) {
+
+  uint32_t cluster_a = *(const uint32_t*)a;
+  uint32_t cluster_b = *(const uint32_t*)b;
+  return (cluster_a > cluster_b) - (cluster_a < cluster_b);
+}
+
+// Checks the image against the table, or recomputes the whole table. The
+// clusters are handed out in chunks so that uneven allocation still keeps
+// every thread busy.
+int integrity_scan(FILE* disk, const FatView_t* fat, uint32_t nthreads, uint8_t rebuild,
+                   IntegrityReport_t* report) {
+
+  memset(report, 0, sizeof(*report));
+  if (!crc_state.active) {
+
+    return 1;
+  }
+  if (integrity_flush(disk) != 0) {
+
+    return 1;
+  }
+  journal_sync(disk); // workers read the image directly
+
+  ScanShared_t shared = {disk, fat, rebuild, 0, 0, 0};
+  shared.chunk_clusters = CRC_SCAN_BYTES / crc_state.cluster_size;
+  if (shared.chunk_clusters == 0) {
+
+    shared.chunk_clusters = 1;
+  }
+  shared.chunk_count = (crc_state.cluster_count - 2 + shared.chunk_clusters - 1) /
+                       shared.chunk_clusters;
+  if (nthreads > shared.chunk_count) {
+
+    nthreads = shared.chunk_count ? shared.chunk_count : 1;
+  }
+
+  ScanWorker_t* workers = calloc(nthreads, sizeof(ScanWorker_t));
+  pthread_t* threads = calloc(nthreads, sizeof(pthread_t));
+  if (!workers || !threads) {
+
+    fprintf(cmd_err(), "Memory allocation failed\n");
+    free(workers);
+    free(threads);
+    return 1;
+  }
+  uint32_t started = 0;
+  for (uint32_t i = 0; i < nthreads; i++) {
+
+    workers[i].shared = &shared;
+    if (i > 0 && pthread_create(&threads[i], NULL, scan_worker, &workers[i]) != 0) {
+
+      break;
+    }
+    started++;
+  }
+  scan_worker(&workers[0]);
+  for (uint32_t i = 1; i < started; i++) {
+
+    pthread_join(threads[i], NULL);
+  }
+
+  int failed = 0;
+  for (uint32_t i = 0; i < started; i++) {
+
+    failed |= workers[i].failed;
+    report->clusters += workers[i].clusters;
+    report->mismatch_count += workers[i].mismatch_count;
+  }
+  report->bytes = report->clusters * crc_state.cluster_size;
+  if (report->mismatch_count > 0) {
+
+    report->mismatches = malloc(report->mismatch_count * sizeof(uint32_t));
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < started && report->mismatches; i++) {
+
+      memcpy(report->mismatches + count, workers[i].mismatches,
+             workers[i].mismatch_count * sizeof(uint32_t));
+      count += workers[i].mismatch_count;
+    }
+    if (report->mismatches) {
+
+      qsort(report->mismatches, count, sizeof(uint32_t), cluster_compare);
+    } else {
+
+      report->mismatch_count = 0;
+      failed = 1;
+    }
+  }
+  for (uint32_t i = 0; i < started; i++) {
+
+    free(workers[i].mismatches);
+  }
+  free(workers);
+  free(threads);
+
+  if (failed) {
+
+    fprintf(cmd_err(), "Checksum scan failed\n");
+    return 1;
+  }
+  if (rebuild && write_whole_table() != 0) {
+
+    fprintf(cmd_err(), "Failed to write checksum table %s\n", crc_state.path);
+    return 1;
+  }
+  return 0;
+}
+
+void integrity_report_free(IntegrityReport_t* report) {
+
+  free(report->mismatches);
+  report->mismatches = NULL;
+  report->mismatch_count = 0;
+}
+
+static int load_table(void) {
+
+  CrcHeader_t header;
+  if (pread(crc_state.fd, &header, sizeof(header), 0) != sizeof(header) ||
+      header.magic != CRC_MAGIC || header.version != CRC_VERSION ||
+      header.cluster_size != crc_state.cluster_size ||
+      header.cluster_count != crc_state.cluster_count) {
+
+    return 1;
+  }
+  size_t size = (size_t)crc_state.cluster_count * sizeof(uint32_t);
+  return pread(crc_state.fd, crc_state.crcs, size, sizeof(header)) == (ssize_t)size ? 0 : 1;
+}
+
+int integrity_open(FILE* disk, const char* disk_name, BootSec_t* boot_sec) {
+
+  snprintf(crc_state.path, sizeof(crc_state.path), "%s.crc", disk_name);
+  crc_state.boot_sec = boot_sec;
+  crc_state.cluster_size = boot_sec->BPB_BytsPerSec * boot_sec->BPB_SecPerClus;
+  crc_state.cluster_count = cluster_count(boot_sec);
+  crc_state.data_start = (off_t)first_sector_of_cluster(boot_sec, 2) * boot_sec->BPB_BytsPerSec;
+  if (crc_state.cluster_size == 0 || crc_state.cluster_count <= 2) {
+
+    fprintf(cmd_err(), "Volume geometry does not allow a checksum table\n");
+    return 1;
+  }
+  crc_state.crcs = calloc(crc_state.cluster_count, sizeof(uint32_t));
+  crc_state.dirty_map = calloc((crc_state.cluster_count + 7) / 8, 1);
+  crc_state.fd = open(crc_state.path, O_RDWR | O_CREAT, 0644);
+  if (!crc_state.crcs || !crc_state.dirty_map || crc_state.fd < 0) {
+
+    fprintf(cmd_err(), "Failed to open checksum table %s\n", crc_state.path);
+    integrity_close(disk);
+    return 1;
+  }
+  crc_state.active = 1;
+
+  if (load_table() != 0) {
+
+    // missing or made for another geometry: checksum what the image holds now;
+    // the scan writes the table and then its header
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    IntegrityReport_t report;
+    if (ftruncate(crc_state.fd, 0) != 0 ||
+        integrity_scan(disk, NULL, online > 0 ? online : 1, 1, &report) != 0) {
+
+      fprintf(cmd_err(), "Failed to build checksum table %s\n", crc_state.path);
+      integrity_close(disk);
+      return 1;
+    }
+    fprintf(cmd_out(), "Built checksum table %s for %u clusters\n", crc_state.path,
+            crc_state.cluster_count - 2);
+  }
+  return 0;
+}
+
+void integrity_close(FILE* disk) {
+
+  if (crc_state.active) {
+
+    integrity_flush(disk);
+    fdatasync(crc_state.fd);
+  }
+  if (crc_state.fd >= 0) {
+
+    close(crc_state.fd);
+  }
+  free(crc_state.crcs);
+  free(crc_state.dirty_map);
+  free(crc_state.dirty);
+  crc_state.fd = -1;
+  crc_state.active = 0;
+  crc_state.crcs = NULL;
+  crc_state.dirty_map = NULL;
+  crc_state.dirty = NULL;
+  crc_state.dirty_count = crc_state.dirty_capacity = 0;
+}
+
+int integrity_active(void) {
+
+  return crc_state.active;
+}
+
+// Marks the clusters under a write; their checksums are recomputed at the
+// end of the command, once, however often they were written
+void integrity_note_write(off_t offset, size_t size) {
+
+  if (!crc_state.active || size == 0 || offset + (off_t)size <= crc_state.data_start) {
+
+    return;
+  }
+  if (offset < crc_state.data_start) {
+
+    size -= crc_state.data_start - offset;
+    offset = crc_state.data_start;
+  }
+  uint64_t first = 2 + (offset - crc_state.data_start) / crc_state.cluster_size;
+  uint64_t last = 2 + (offset + size - 1 - crc_state.data_start) / crc_state.cluster_size;
+  for (uint64_t cluster = first; cluster <= last && cluster < crc_state.cluster_count; cluster++) {
+
+    if (is_dirty(cluster)) {
+
+      continue;
+    }
+    if (crc_state.dirty_count == crc_state.dirty_capacity) {
+
+      uint32_t capacity = crc_state.dirty_capacity ? crc_state.dirty_capacity * 2 : 256;
+      uint32_t* grown = realloc(crc_state.dirty, capacity * sizeof(uint32_t));
+      if (!grown) {
+
+        fprintf(cmd_err(), "Checksum tracking lost cluster %llu\n", (unsigned long long)cluster);
+        return;
+      }
+      crc_state.dirty = grown;
+      crc_state.dirty_capacity = capacity;
+    }
+    crc_state.dirty_map[cluster / 8] |= 1 << (cluster % 8);
+    crc_state.dirty[crc_state.dirty_count++] = cluster;
+  }
+}
+
+// Recomputes the checksums of every cluster written since the last flush,
+// reading through the write-ahead log so pending sectors are seen
+int integrity_flush(FILE* disk) {
+
+  if (!crc_state.active || crc_state.dirty_count == 0) {
+
+    return 0;
+  }
+  uint8_t* buffer = malloc(crc_state.cluster_size);
+  if (!buffer) {
+
+    fprintf(cmd_err(), "Memory allocation failed\n");
+    return 1;
+  }
+  qsort(crc_state.dirty, crc_state.dirty_count, sizeof(uint32_t), cluster_compare);
+
+  int failed = 0;
+  uint32_t start = 0;
+  for (uint32_t i = 0; i < crc_state.dirty_count; i++) {
+
+    uint32_t cluster = crc_state.dirty[i];
+    read_clusters(disk, crc_state.boot_sec, cluster, 1, buffer);
+    crc_state.crcs[cluster] = crc32c(0, buffer, crc_state.cluster_size);
+    crc_state.dirty_map[cluster / 8] &= ~(1 << (cluster % 8));
+
+    // one table write per run of neighbouring clusters
+    if (i + 1 == crc_state.dirty_count || crc_state.dirty[i + 1] != cluster + 1) {
+
+      failed |= write_table(crc_state.dirty[start], cluster - crc_state.dirty[start] + 1);
+      start = i + 1;
+    }
+  }
+  crc_state.dirty_count = 0;
+  free(buffer);
+  if (failed) {
+
+    fprintf(cmd_err(), "Failed to update checksum table %s\n", crc_state.path);
+  }
+  return failed;
+}
+
+// Whether one cluster just read differs from its checksum, without a report;
+// clusters written in the running command are not checked, their entry is
+// only refreshed at the next flush
+int integrity_check(uint32_t cluster, const uint8_t* data) {
+
+  if (!crc_state.active || cluster < 2 || cluster >= crc_state.cluster_count ||
+      is_dirty(cluster)) {
+
+    return 0;
+  }
+  return crc32c(0, data, crc_state.cluster_size) != crc_state.crcs[cluster];
+}
+
+// Checks one cluster just read and reports a mismatch
+int integrity_verify(uint32_t cluster, const uint8_t* data) {
+
+  if (integrity_check(cluster, data) != 0) {
+
+    fprintf(cmd_err(), "Checksum mismatch in cluster %u\n", cluster);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef INTEGRITY_H
+#define INTEGRITY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "bootsec.h"
+#include "fat.h"
+
+// Outcome of a whole-image pass over the checksum table
+typedef struct {
+
+  uint64_t clusters;
+  uint64_t bytes;
+  uint32_t* mismatches; // cluster numbers, ascending
+  uint32_t mismatch_count;
+} IntegrityReport_t;
+
+int integrity_open(FILE* disk, const char* disk_name, BootSec_t* boot_sec);
+void integrity_close(FILE* disk);
+int integrity_active(void);
+void integrity_note_write(off_t offset, size_t size);
+int integrity_flush(FILE* disk);
+int integrity_check(uint32_t cluster, const uint8_t* data);
+int integrity_verify(uint32_t cluster, const uint8_t* data);
+int integrity_scan(FILE* disk, const FatView_t* fat, uint32_t nthreads, uint8_t rebuild,
+                   IntegrityReport_t* report);
+void integrity_report_free(IntegrityReport_t* report);
+
+#endif // INTEGRITY_H
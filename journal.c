@@ -0,0 +1,505 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "utility.h"
+
+#define WAL_MAGIC 0x4C415746   // "FWAL"
+#define WAL_TRAILER 0x444E4557 // "WEND"
+#define WAL_PATH_MAX 512
+
+// A batch is one group commit: header, sector numbers, sector images, trailer.
+// Replay applies a batch only when its trailer and checksum are intact.
+typedef struct {
+
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t count;
+  uint16_t sector_size;
+  uint16_t reserved;
+} __attribute__((packed)) WalHeader_t;
+
+typedef struct {
+
+  uint32_t magic;
+  uint32_t seq;
+  uint64_t checksum;
+} __attribute__((packed)) WalTrailer_t;
+
+typedef struct {
+
+  uint32_t sector;
+  uint8_t* data;
+} WalPending_t;
+
+static struct {
+
+  int active;
+  int log_fd;
+  char path[WAL_PATH_MAX];
+  uint16_t sector_size;
+  WalPending_t* pending;
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t* slots; // open addressing, pending index + 1, 0 for empty
+  uint32_t slot_count;
+  uint32_t txns;
+  uint32_t seq;
+  uint64_t log_size;
+  pthread_mutex_t lock; // pending sectors are shared by every thread reading the image
+} wal = {0, -1, {0}, 0, NULL, 0, 0, NULL, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t size) {
+
+  const uint8_t* bytes = data;
+  for (size_t i = 0; i < size; i++) {
+
+    hash ^= bytes[i];
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+static uint32_t slot_of(uint32_t sector) {
+
+  return (sector * 0x9E3779B1u) & (wal.slot_count - 1);
+}
+
+static int find_pending(uint32_t sector) {
+
+  if (wal.slot_count == 0) {
+
+    return -1;
+  }
+  for (uint32_t slot = slot_of(sector);; slot = (slot + 1) & (wal.slot_count - 1)) {
+
+    if (wal.slots[slot] == 0) {
+
+      return -1;
+    }
+    if (wal.pending[wal.slots[slot] - 1].sector == sector) {
+
+      return wal.slots[slot] - 1;
+    }
+  }
+}
+
+static void rebuild_slots(void) {
+
+  memset(wal.slots, 0, wal.slot_count * sizeof(uint32_t));
+  for (uint32_t i = 0; i < wal.count; i++) {
+
+    uint32_t slot = slot_of(wal.pending[i].sector);
+    while (wal.slots[slot] != 0) {
+
+      slot = (slot + 1) & (wal.slot_count - 1);
+    }
+    wal.slots[slot] = i + 1;
+  }
+}
+
+static int grow_pending(void) {
+
+  uint32_t capacity = wal.capacity ? wal.capacity * 2 : 256;
+  WalPending_t* pending = realloc(wal.pending, capacity * sizeof(WalPending_t));
+  uint32_t* slots = calloc(capacity * 2, sizeof(uint32_t));
+  if (!pending || !slots) {
+
+    free(slots);
+    if (pending) {
+
+      wal.pending = pending;
+    }
+    return 1;
+  }
+  free(wal.slots);
+  wal.pending = pending;
+  wal.capacity = capacity;
+  wal.slots = slots;
+  wal.slot_count = capacity * 2;
+
+  rebuild_slots();
+  return 0;
+}
+
+static void clear_pending(void) {
+
+  for (uint32_t i = 0; i < wal.count; i++) {
+
+    free(wal.pending[i].data);
+  }
+  wal.count = 0;
+  wal.txns = 0;
+  if (wal.slots) {
+
+    memset(wal.slots, 0, wal.slot_count * sizeof(uint32_t));
+  }
+}
+
+static int pending_compare(const void* a, const void* b) {
+
+  uint32_t sector_a = ((const WalPending_t*)a)->sector;
+  uint32_t sector_b = ((const WalPending_t*)b)->sector;
+  return (sector_a > sector_b) - (sector_a < sector_b);
+}
+
+static int write_all(int fd, const void* data, size_t size, off_t offset) {
+
+  const uint8_t* bytes = data;
+  while (size > 0) {
+
+    ssize_t res = pwrite(fd, bytes, size, offset);
+    if (res <= 0) {
+
+      return 1;
+    }
+    bytes += res;
+    size -= res;
+    offset += res;
+  }
+  return 0;
+}
+
+static void build_path(const char* disk_name) {
+
+  snprintf(wal.path, sizeof(wal.path), "%s.wal", disk_name);
+}
+
+static int checkpoint(int image_fd) {
+
+  // image writes of every logged batch must be durable before the log is dropped
+  if (fsync(image_fd) != 0 || ftruncate(wal.log_fd, 0) != 0 || fsync(wal.log_fd) != 0) {
+
+    fprintf(cmd_err(), "Failed to checkpoint write-ahead log\n");
+    return 1;
+  }
+  wal.log_size = 0;
+  return 0;
+}
+
+int journal_replay(FILE* disk, const char* disk_name) {
+
+  build_path(disk_name);
+  int fd = open(wal.path, O_RDWR);
+  if (fd < 0) {
+
+    return 0; // no log, nothing to recover
+  }
+
+  int image_fd = fileno(disk);
+  off_t offset = 0;
+  uint32_t batches = 0;
+  WalHeader_t header;
+  while (pread(fd, &header, sizeof(header), offset) == sizeof(header) &&
+         header.magic == WAL_MAGIC && header.sector_size > 0) {
+
+    size_t payload = (size_t)header.count * (sizeof(uint32_t) + header.sector_size);
+    uint8_t* buffer = malloc(payload + sizeof(WalTrailer_t));
+    if (!buffer) {
+
+      break;
+    }
+    if (pread(fd, buffer, payload + sizeof(WalTrailer_t), offset + sizeof(header)) !=
+        (ssize_t)(payload + sizeof(WalTrailer_t))) {
+
+      free(buffer);
+      break; // torn tail: the batch was never acknowledged
+    }
+    WalTrailer_t trailer;
+    memcpy(&trailer, buffer + payload, sizeof(trailer));
+    uint64_t checksum =
+        fnv1a(fnv1a(0xCBF29CE484222325ULL, &header, sizeof(header)), buffer, payload);
+    if (trailer.magic != WAL_TRAILER || trailer.seq != header.seq || trailer.checksum != checksum) {
+
+      free(buffer);
+      break;
+    }
+
+    const uint32_t* sectors = (const uint32_t*)buffer;
+    const uint8_t* data = buffer + (size_t)header.count * sizeof(uint32_t);
+    for (uint32_t i = 0; i < header.count; i++) {
+
+      write_all(image_fd, data + (size_t)i * header.sector_size, header.sector_size,
+                (off_t)sectors[i] * header.sector_size);
+    }
+    free(buffer);
+    offset += sizeof(header) + payload + sizeof(WalTrailer_t);
+    batches++;
+  }
+
+  if (fsync(image_fd) != 0 || ftruncate(fd, 0) != 0 || fsync(fd) != 0) {
+
+    fprintf(cmd_err(), "Failed to finish write-ahead log recovery\n");
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  unlink(wal.path);
+  if (batches > 0) {
+
+    fprintf(cmd_out(), "Recovered %u batches from %s\n", batches, wal.path);
+  }
+  return (int)batches;
+}
+
+int journal_open(FILE* disk, const char* disk_name) {
+
+  (void)disk;
+  build_path(disk_name);
+  wal.log_fd = open(wal.path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (wal.log_fd < 0) {
+
+    fprintf(cmd_err(), "Failed to open write-ahead log %s\n", wal.path);
+    return 1;
+  }
+  wal.active = 1;
+  wal.log_size = 0;
+  wal.seq = 0;
+  wal.sector_size = 0;
+  return 0;
+}
+
+void journal_close(FILE* disk) {
+
+  if (!wal.active) {
+
+    return;
+  }
+  if (journal_sync(disk) == 0 && checkpoint(fileno(disk)) == 0) {
+
+    unlink(wal.path);
+  }
+  close(wal.log_fd);
+  wal.log_fd = -1;
+  wal.active = 0;
+  clear_pending();
+  free(wal.pending);
+  free(wal.slots);
+  wal.pending = NULL;
+  wal.slots = NULL;
+  wal.capacity = wal.slot_count = 0;
+}
+
+int journal_active(void) {
+
+  return wal.active;
+}
+
+// Logs and applies the pending group; called with the lock held
+static int sync_pending(FILE* disk) {
+
+  if (wal.count == 0) {
+
+    return 0;
+  }
+
+  size_t payload = (size_t)wal.count * (sizeof(uint32_t) + wal.sector_size);
+  size_t size = sizeof(WalHeader_t) + payload + sizeof(WalTrailer_t);
+  uint8_t* batch = malloc(size);
+  if (!batch) {
+
+    fprintf(cmd_err(), "Failed to allocate write-ahead log batch\n");
+    return 1;
+  }
+
+  // sorted order lets the image writes below go out front to back
+  qsort(wal.pending, wal.count, sizeof(WalPending_t), pending_compare);
+  rebuild_slots();
+
+  WalHeader_t header = {WAL_MAGIC, ++wal.seq, wal.count, wal.sector_size, 0};
+  memcpy(batch, &header, sizeof(header));
+  uint32_t* sectors = (uint32_t*)(batch + sizeof(header));
+  uint8_t* data = batch + sizeof(header) + (size_t)wal.count * sizeof(uint32_t);
+  for (uint32_t i = 0; i < wal.count; i++) {
+
+    sectors[i] = wal.pending[i].sector;
+    memcpy(data + (size_t)i * wal.sector_size, wal.pending[i].data, wal.sector_size);
+  }
+  WalTrailer_t trailer = {WAL_TRAILER, header.seq,
+                          fnv1a(fnv1a(0xCBF29CE484222325ULL, &header, sizeof(header)),
+                                batch + sizeof(header), payload)};
+  memcpy(batch + sizeof(header) + payload, &trailer, sizeof(trailer));
+
+  // one write and one fsync for the whole group
+  if (write_all(wal.log_fd, batch, size, wal.log_size) != 0 || fdatasync(wal.log_fd) != 0) {
+
+    fprintf(cmd_err(), "Failed to write write-ahead log\n");
+    free(batch);
+    return 1;
+  }
+  wal.log_size += size;
+
+  // the batch is durable; the image can now be updated without syncing
+  int image_fd = fileno(disk);
+  uint32_t start = 0;
+  while (start < wal.count) {
+
+    uint32_t run = 1;
+    while (start + run < wal.count && sectors[start + run] == sectors[start] + run) {
+
+      run++;
+    }
+    write_all(image_fd, data + (size_t)start * wal.sector_size, (size_t)run * wal.sector_size,
+              (off_t)sectors[start] * wal.sector_size);
+    start += run;
+  }
+  free(batch);
+  clear_pending();
+
+  if (wal.log_size >= JOURNAL_CHECKPOINT_BYTES) {
+
+    return checkpoint(image_fd);
+  }
+  return 0;
+}
+
+// Ends one command's transaction. Its sectors stay pending with the rest of the
+// group, which is logged as a single atomic batch.
+void journal_commit(FILE* disk) {
+
+  if (!wal.active) {
+
+    return;
+  }
+  pthread_mutex_lock(&wal.lock);
+  wal.txns++;
+  if (wal.txns >= JOURNAL_GROUP_TXNS ||
+      (uint64_t)wal.count * wal.sector_size >= JOURNAL_GROUP_BYTES) {
+
+    sync_pending(disk);
+  }
+  pthread_mutex_unlock(&wal.lock);
+}
+
+int journal_sync(FILE* disk) {
+
+  if (!wal.active) {
+
+    return 0;
+  }
+  pthread_mutex_lock(&wal.lock);
+  int res = sync_pending(disk);
+  pthread_mutex_unlock(&wal.lock);
+  return res;
+}
+
+int journal_read(uint32_t sector, uint8_t* buffer, uint16_t sector_size) {
+
+  if (!wal.active || sector_size != wal.sector_size) {
+
+    return 0;
+  }
+  pthread_mutex_lock(&wal.lock);
+  int index = find_pending(sector);
+  if (index >= 0) {
+
+    memcpy(buffer, wal.pending[index].data, sector_size);
+  }
+  pthread_mutex_unlock(&wal.lock);
+  return index >= 0;
+}
+
+static void patch_pending(uint32_t index, uint32_t sector, uint8_t* buffer, size_t size) {
+
+  size_t offset = (size_t)(wal.pending[index].sector - sector) * wal.sector_size;
+  size_t part = (size - offset < wal.sector_size) ? size - offset : wal.sector_size;
+  memcpy(buffer + offset, wal.pending[index].data, part);
+}
+
+// Brings size bytes read straight from the image, starting at sector, up to
+// date with the sectors among them still waiting for their group commit
+void journal_read_range(uint32_t sector, uint8_t* buffer, size_t size, uint16_t sector_size) {
+
+  if (!wal.active || sector_size != wal.sector_size || size == 0) {
+
+    return;
+  }
+  uint64_t sectors = (size + sector_size - 1) / sector_size;
+  pthread_mutex_lock(&wal.lock);
+  if (sectors <= wal.count) {
+
+    for (uint32_t i = 0; i < sectors; i++) {
+
+      int index = find_pending(sector + i);
+      if (index >= 0) {
+
+        patch_pending(index, sector, buffer, size);
+      }
+    }
+  } else {
+
+    // a large range: cheaper to look at each pending sector once
+    for (uint32_t i = 0; i < wal.count; i++) {
+
+      if (wal.pending[i].sector >= sector && wal.pending[i].sector - sector < sectors) {
+
+        patch_pending(i, sector, buffer, size);
+      }
+    }
+  }
+  pthread_mutex_unlock(&wal.lock);
+}
+
+// Adds one sector to the pending group; called with the lock held. A group
+// that cannot take the sector (another sector size, or no memory to grow) is
+// logged first so the sector starts the next one; the image is written
+// directly only when even an empty group cannot hold it, and then nothing is
+// left pending that the write could overtake.
+static int log_sector(FILE* disk, uint32_t sector, const uint8_t* buffer, uint16_t sector_size) {
+
+  if (wal.sector_size != sector_size) {
+
+    if (wal.count > 0 && sync_pending(disk) != 0) {
+
+      return -1;
+    }
+    wal.sector_size = sector_size;
+  }
+
+  int index = find_pending(sector);
+  if (index < 0) {
+
+    uint8_t* data = NULL;
+    if ((wal.count == wal.capacity && grow_pending() != 0) || !(data = malloc(sector_size))) {
+
+      if (wal.count == 0) {
+
+        return 0;
+      }
+      if (sync_pending(disk) != 0) {
+
+        return -1;
+      }
+      return log_sector(disk, sector, buffer, sector_size);
+    }
+    index = wal.count++;
+    wal.pending[index].sector = sector;
+    wal.pending[index].data = data;
+
+    uint32_t slot = slot_of(sector);
+    while (wal.slots[slot] != 0) {
+
+      slot = (slot + 1) & (wal.slot_count - 1);
+    }
+    wal.slots[slot] = index + 1;
+  }
+  memcpy(wal.pending[index].data, buffer, sector_size);
+  return 1;
+}
+
+// 1 when the sector went to the log, 0 when the caller should write it to the
+// image itself, -1 when it could be written neither way
+int journal_write(FILE* disk, uint32_t sector, const uint8_t* buffer, uint16_t sector_size) {
+
+  if (!wal.active) {
+
+    return 0;
+  }
+  pthread_mutex_lock(&wal.lock);
+  int res = log_sector(disk, sector, buffer, sector_size);
+  pthread_mutex_unlock(&wal.lock);
+  return res;
+}
@@ -0,0 +1,21 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define JOURNAL_GROUP_TXNS 32                   // commands per group commit
+#define JOURNAL_GROUP_BYTES (4 * 1024 * 1024)   // pending sector bytes per group commit
+#define JOURNAL_CHECKPOINT_BYTES (64 * 1024 * 1024) // log size that forces a checkpoint
+
+int journal_replay(FILE* disk, const char* disk_name);
+int journal_open(FILE* disk, const char* disk_name);
+void journal_close(FILE* disk);
+int journal_active(void);
+void journal_commit(FILE* disk);
+int journal_sync(FILE* disk);
+int journal_read(uint32_t sector, uint8_t* buffer, uint16_t sector_size);
+void journal_read_range(uint32_t sector, uint8_t* buffer, size_t size, uint16_t sector_size);
+int journal_write(FILE* disk, uint32_t sector, const uint8_t* buffer, uint16_t sector_size);
+
+#endif // JOURNAL_H
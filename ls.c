@@ -1,16 +1,122 @@
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "arena.h"
 #include "bootsec.h"
 #include "directory.h"
+#include "dirsort.h"
+#include "fat.h"
+#include "usage.h"
+#include "utility.h"
+#include "walk.h"
 
-static void format_with_spaces(char* buffer, uint32_t num) {
+#define LS_LONG 0x01
+#define LS_UNSORTED 0x02
+#define LS_BY_SIZE 0x04
+#define LS_BY_TIME 0x08
+#define LS_BY_CLUSTER 0x10
+#define LS_OUT_BUF_SIZE (64 * 1024)
+
+// Output is formatted into one large buffer and handed to stdout with a single
+// write whenever it fills up, instead of a printf call per entry
+typedef struct {
+
+  char* data;
+  size_t len;
+} OutBuf_t;
+
+typedef struct {
+
+  OutBuf_t* out;
+  uint64_t actual_files_size;
+  uint32_t entry_count;
+} LongCtx_t;
+
+static void out_flush(OutBuf_t* out) {
+
+  if (out->len > 0) {
+
+    fwrite(out->data, 1, out->len, cmd_out());
+    out->len = 0;
+  }
+  fflush(cmd_out());
+}
+
+static void out_printf(OutBuf_t* out, const char* fmt, ...) {
+
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(out->data + out->len, LS_OUT_BUF_SIZE - out->len, fmt, args);
+  va_end(args);
+
+  if (len < 0) {
+
+    return;
+  }
+  if ((size_t)len >= LS_OUT_BUF_SIZE - out->len) {
+
+    // did not fit: flush what we have and format again into the empty buffer
+    out_flush(out);
+    va_start(args, fmt);
+    len = vsnprintf(out->data, LS_OUT_BUF_SIZE, fmt, args);
+    va_end(args);
+    if (len < 0) {
+
+      return;
+    }
+    if ((size_t)len >= LS_OUT_BUF_SIZE) {
+
+      len = LS_OUT_BUF_SIZE - 1;
+    }
+  }
+  out->len += len;
+}
+
+static uint8_t parse_ls_flags(const char* args) {
+
+  uint8_t flags = 0;
+  while (args && *args) {
+
+    if (*args == '-') {
+
+      for (args++; *args && *args != ' '; args++) {
+
+        if (*args == 'l') {
+
+          flags |= LS_LONG;
+        } else if (*args == 'U') {
+
+          flags |= LS_UNSORTED;
+        } else if (*args == 'S') {
+
+          flags |= LS_BY_SIZE;
+        } else if (*args == 't') {
+
+          flags |= LS_BY_TIME;
+        } else if (*args == 'K') {
+
+          flags |= LS_BY_CLUSTER;
+        } else {
+
+          fprintf(cmd_err(), "ls: unknown option -%c\n", *args);
+        }
+      }
+    } else {
+
+      args++;
+    }
+  }
+  return flags;
+}
+
+static void format_with_spaces(char* buffer, uint64_t num) {
 
   char temp[30];
-  sprintf(temp, "%u", num);
+  sprintf(temp, "%llu", (unsigned long long)num);
 
   int len = strlen(temp);
   int ws_count = (len - 1) / 3;
@@ -30,127 +136,202 @@ static void format_with_spaces(char* buffer, uint32_t num) {
   }
 }
 
-static int entries_compare(const void* a, const void* b) {
+static void print_short_entry(OutBuf_t* out, const char* name, uint8_t attr) {
+
+  if (attr & ATTR_DIRECTORY) {
+
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+
+      out_printf(out, "%s  ", name);
+    } else {
+
+      out_printf(out, "%s/  ", name);
+    }
+  } else {
+
+    out_printf(out, "%s  ", name);
+  }
+}
+
+static int print_short_cb(const EntrSt_t* entry, const DIRStr_t* raw, const EntrLoc_t* loc,
+                          void* ctx) {
+
+  (void)raw;
+  (void)loc;
+  print_short_entry(ctx, entry->name, entry->attr);
+  return 0;
+}
+
+static int print_long_cb(const EntrSt_t* entry, const DIRStr_t* raw, const EntrLoc_t* loc,
+                         void* ctx) {
+
+  (void)loc;
+  LongCtx_t* long_ctx = ctx;
+
+  // Convert date and time
+  uint16_t date = entry->date;
+  uint16_t time = entry->time;
+  struct tm tm;
+  memset(&tm, 0, sizeof(struct tm));
+  tm.tm_year = ((date >> 9) & 0x7F) + 80;
+  tm.tm_mon = ((date >> 5) & 0x0F) - 1;
+  tm.tm_mday = date & 0x1F;
+  tm.tm_hour = (time >> 11) & 0x1F;
+  tm.tm_min = (time >> 5) & 0x3F;
+  tm.tm_sec = (time & 0x1F) * 2;
+  char date_str[11];
+  char time_str[6];
+  strftime(date_str, sizeof(date_str), "%Y-%m-%d", &tm);
+  strftime(time_str, sizeof(time_str), "%H:%M", &tm);
+
+  // 8.3 base name for the DOS-style first column
+  char short_name[9];
+  memcpy(short_name, raw->DIR_Name, 8);
+  short_name[8] = '\0';
+  for (int i = 7; i >= 0 && short_name[i] == ' '; i--) {
+
+    short_name[i] = '\0';
+  }
+
+  if (entry->attr & ATTR_DIRECTORY) {
 
-  const EntrSt_t* entry_a = (const EntrSt_t*)a;
-  const EntrSt_t* entry_b = (const EntrSt_t*)b;
+    char dir_label[] = "<DIR>";
+    out_printf(long_ctx->out, "%-8s  %-3s %19s %s  %s\n", short_name, dir_label, date_str,
+               time_str, entry->name);
+  } else {
 
-  // skip leading dot
-  const char* name_a = (entry_a->name[0] == '.') ? entry_a->name + 1 : entry_a->name;
-  const char* name_b = (entry_b->name[0] == '.') ? entry_b->name + 1 : entry_b->name;
+    uint32_t file_size = entry->size;
+    out_printf(long_ctx->out, "%-8s %-3s %10u %s %s  %s\n", short_name, entry->ext, file_size,
+               date_str, time_str, entry->name);
+    long_ctx->actual_files_size += file_size;
+  }
+  if (strcmp(entry->name, ".") != 0 && strcmp(entry->name, "..") != 0) {
 
-  return strcasecmp(name_a, name_b);
+    long_ctx->entry_count++;
+  }
+  return 0;
 }
 
-void list_dir(FILE* disk, BootSec_t* boot_sec, uint32_t cluster) {
+// Clusters allocated anywhere on the volume, from the usage table or the FAT
+// count, which rereads only what was written since the last listing
+static uint64_t used_clusters(FILE* disk, BootSec_t* boot_sec) {
 
-  EntrSt_t* entries = NULL;
-  uint32_t entry_count = 0;
+  if (usage_active()) {
 
-  if (read_dir_entries(disk, boot_sec, cluster, &entries, &entry_count) == 1) {
+    return usage_used_clusters();
+  }
+  return fat_used_clusters(disk, boot_sec);
+}
+
+static void list_dir_long(FILE* disk, BootSec_t* boot_sec, uint32_t cluster, OutBuf_t* out) {
+
+  LongCtx_t ctx = {out, 0, 0};
 
-    fprintf(stderr, "Failed to read directory entries\n");
+  out_printf(out, "Directory for ::/\n\n");
+  if (walk_dir(disk, boot_sec, cluster, print_long_cb, &ctx) == 1) {
+
+    fprintf(cmd_err(), "Failed to read directory entries\n");
     return;
   }
 
-  // Check if the current cluster is the root directory
-  if (cluster == 2) {
+  // the table's totals are those the listing just added up, when it has them
+  UsageTotals_t totals;
+  if (usage_dir(cluster, &totals) == 0) {
 
-    printf(".  ..  ");
+    ctx.entry_count = totals.files + totals.subdirs;
+    ctx.actual_files_size = totals.bytes;
   }
+  uint64_t cluster_size = boot_sec->BPB_BytsPerSec * boot_sec->BPB_SecPerClus;
+  uint64_t data_clusters = cluster_count(boot_sec) - 2;
+  uint64_t used = used_clusters(disk, boot_sec);
+  uint64_t free_byts = (used < data_clusters) ? (data_clusters - used) * cluster_size : 0;
 
-  qsort(entries, entry_count, sizeof(EntrSt_t), entries_compare);
-  for (size_t i = 0; i < entry_count; ++i) {
+  char formatted_free_byts[30];
+  char formatted_files_size[30];
+  format_with_spaces(formatted_free_byts, free_byts);
+  format_with_spaces(formatted_files_size, ctx.actual_files_size);
 
-    if (entries[i].attr & ATTR_DIRECTORY) {
+  out_printf(out, "%8u files %21s bytes\n", ctx.entry_count, formatted_files_size);
+  out_printf(out, "%36s bytes free\n", formatted_free_byts);
+}
 
-      if (strncmp(entries[i].name, ".", 1) == 0 || strncmp(entries[i].name, "..", 2) == 0) {
+static void list_dir_sorted(FILE* disk, BootSec_t* boot_sec, uint32_t cluster, uint8_t flags,
+                            uint32_t nthreads, OutBuf_t* out) {
 
-        printf("%s  ", entries[i].name);
-      } else {
+  DirList_t list;
+  if (dir_list_load(disk, boot_sec, cluster, &list) == 1) {
 
-        printf("%s/  ", entries[i].name);
-      }
-    } else {
+    fprintf(cmd_err(), "Failed to read directory entries\n");
+    dir_list_free(&list);
+    return;
+  }
+
+  uint8_t sort = DIR_SORT_NAME;
+  if (flags & LS_BY_SIZE) {
+
+    sort = DIR_SORT_SIZE;
+  } else if (flags & LS_BY_TIME) {
+
+    sort = DIR_SORT_DATE;
+  } else if (flags & LS_BY_CLUSTER) {
+
+    sort = DIR_SORT_CLUSTER;
+  }
 
-      printf("%s  ", entries[i].name);
+  // sort indices, not entries: the columns stay where they are
+  uint32_t* order = arena_alloc((list.count ? list.count : 1) * sizeof(uint32_t));
+  if (!order || dir_list_sort(&list, sort, nthreads, order) != 0) {
+
+    if (!order) {
+
+      fprintf(cmd_err(), "Memory allocation failed\n");
     }
+    dir_list_free(&list);
+    return;
   }
+  for (uint32_t i = 0; i < list.count; ++i) {
 
-  putchar('\n');
+    print_short_entry(out, dir_list_name(&list, order[i]), list.attr[order[i]]);
+  }
 
-  free(entries);
+  dir_list_free(&list);
 }
 
-void list_dir_long(FILE* disk, BootSec_t* boot_sec, uint32_t cluster) {
-
-  EntrSt_t* entries = NULL;
-  uint32_t local_entry_count = 0;
+void list_dir(FILE* disk, BootSec_t* boot_sec, uint32_t cluster, const char* args) {
 
-  if (read_dir_entries(disk, boot_sec, cluster, &entries, &local_entry_count) == 1) {
+  uint32_t nthreads = walk_parse_threads(&args);
+  uint8_t flags = parse_ls_flags(args);
+  OutBuf_t out = {arena_alloc(LS_OUT_BUF_SIZE), 0};
+  if (!out.data) {
 
-    fprintf(stderr, "Failed to read directory entries\n");
+    fprintf(cmd_err(), "Memory allocation failed\n");
     return;
   }
 
-  printf("Directory for ::/\n\n");
-  uint32_t byts_in_use = 0;
-  uint32_t actual_files_size = 0;
-  uint32_t entry_count = 0;
-
-  for (uint32_t i = 0; i < local_entry_count; i++) {
-
-    // Convert date and time
-    uint16_t date = entries[i].date;
-    uint16_t time = entries[i].time;
-    struct tm tm;
-    memset(&tm, 0, sizeof(struct tm));
-    tm.tm_year = ((date >> 9) & 0x7F) + 80;
-    tm.tm_mon = ((date >> 5) & 0x0F) - 1;
-    tm.tm_mday = date & 0x1F;
-    tm.tm_hour = (time >> 11) & 0x1F;
-    tm.tm_min = (time >> 5) & 0x3F;
-    tm.tm_sec = (time & 0x1F) * 2;
-    char date_str[11];
-    char time_str[6];
-    strftime(date_str, sizeof(date_str), "%Y-%m-%d", &tm);
-    strftime(time_str, sizeof(time_str), "%H:%M", &tm);
-
-    if (entries[i].attr & ATTR_DIRECTORY) {
-
-      char dir_label[] = "<DIR>";
-      printf("%-8s  %-3s %19s %s  %s\n", entries[i].name, dir_label, date_str, time_str,
-             entries[i].name);
-      byts_in_use += boot_sec->BPB_SecPerClus * boot_sec->BPB_BytsPerSec;
-    } else {
+  if (flags & LS_LONG) {
 
-      uint32_t file_size = entries[i].size;
-      uint32_t integer_part = file_size / boot_sec->BPB_BytsPerSec;
-      uint32_t float_part = file_size % boot_sec->BPB_BytsPerSec;
-      uint32_t sectors = (float_part == 0) ? integer_part : integer_part + 1;
-      byts_in_use += sectors * boot_sec->BPB_BytsPerSec;
-      printf("%-8s %-3s %10u %s %s  %s\n", entries[i].name, entries[i].ext, file_size, date_str,
-             time_str, entries[i].name);
-      actual_files_size += file_size;
+    list_dir_long(disk, boot_sec, cluster, &out);
+  } else {
+
+    // Check if the current cluster is the root directory
+    if (cluster == boot_sec->BPB_RootClus) {
+
+      out_printf(&out, ".  ..  ");
     }
-    entry_count++;
-  }
 
-  free(entries);
+    if (flags & LS_UNSORTED) {
 
-  uint32_t fat_size = (boot_sec->BPB_FATSz32 == 0) ? boot_sec->BPB_FATSz16 : boot_sec->BPB_FATSz32;
-  uint32_t tot_sec =
-      (boot_sec->BPB_TotSec32 == 0) ? boot_sec->BPB_TotSec16 : boot_sec->BPB_TotSec32;
-  uint32_t user_area = tot_sec - boot_sec->BPB_RsvdSecCnt - (boot_sec->BPB_NumFATs * fat_size);
-  uint32_t free_byts =
-      ((user_area - 1) / boot_sec->BPB_SecPerClus) * boot_sec->BPB_BytsPerSec; // initial free space
+      // stream entries straight from the directory clusters
+      if (walk_dir(disk, boot_sec, cluster, print_short_cb, &out) == 1) {
 
-  free_byts -= byts_in_use; // substract space occupied by files
-  char formatted_free_byts[30];
-  char formatted_files_size[30];
-  format_with_spaces(formatted_free_byts, free_byts);
-  format_with_spaces(formatted_files_size, actual_files_size);
+        fprintf(cmd_err(), "Failed to read directory entries\n");
+      }
+    } else {
+
+      list_dir_sorted(disk, boot_sec, cluster, flags, nthreads, &out);
+    }
+    out_printf(&out, "\n");
+  }
 
-  printf("%8u files %21s bytes\n", entry_count, formatted_files_size);
-  printf("%36s bytes free\n", formatted_free_byts);
+  out_flush(&out);
 }
@@ -1,32 +1,239 @@
+#include <ctype.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "arena.h"
 #include "bootsec.h"
+#include "integrity.h"
+#include "journal.h"
+#include "overlay.h"
+#include "pathindex.h"
+#include "prefetch.h"
+#include "trace.h"
+#include "usage.h"
+#include "utility.h"
+
+#define USAGE                                                                                      \
+  "Usage: %s [-w] [-c] [-u] [-p] [-i] [-t trace] [-b base_image] [-S socket] <disk_image>\n"       \
+  "       %s [-w] [-c] [-u] [-p] [-i] [-b base_image] -T trace [-O] <disk_image>\n"                \
+  "       %s -m <host_dir|manifest> [-s size[K|M|G]] <output_image|->\n"                           \
+  "       %s -C <socket>\n"
 
 extern int create_disk(FILE* disk, const char* disk_name, uint32_t disk_size, char modifier);
+extern int build_image(const char* source, const char* output, uint64_t size);
+extern int serve(FILE* disk, const char* disk_name, BootSec_t* boot_sec, uint8_t is_fat32,
+                 const char* socket_path, uint32_t nthreads);
+extern int client_run(const char* socket_path);
 extern void handle_command(FILE* disk, const char* disk_name, BootSec_t* boot_sec,
                            uint8_t* is_fat32, uint32_t* current_clus, char* cwd, char* command);
+extern uint32_t defrag_relocated(uint32_t cluster);
+
+// Where one recorded session stands during a replay: 0 is the prompt, the
+// rest are server clients
+typedef struct {
+
+  uint32_t id;
+  uint32_t current_clus;
+  char cwd[512];
+} ReplaySession_t;
+
+typedef struct {
+
+  FILE* disk;
+  const char* disk_name;
+  BootSec_t* boot_sec;
+  uint8_t* is_fat32;
+  ReplaySession_t* sessions;
+  uint32_t count;
+} Replay_t;
+
+// One command and the flushes that follow it; non-zero when it reported an error
+static int run_command(FILE* disk, const char* disk_name, BootSec_t* boot_sec, uint8_t* is_fat32,
+                       uint32_t* current_clus, char* cwd, char* command) {
+
+  uint32_t errors = cmd_error_count();
+  prefetch_hold();
+  handle_command(disk, disk_name, boot_sec, is_fat32, current_clus, cwd, command);
+  usage_flush(disk);
+  integrity_flush(disk);
+  journal_commit(disk);
+  prefetch_release();
+  arena_reset(); // the command's temporaries go in one step
+  return cmd_error_count() != errors;
+}
+
+static int replay_command(uint32_t session, char* command, void* ctx) {
+
+  Replay_t* replay = ctx;
+  ReplaySession_t* state = NULL;
+  for (uint32_t i = 0; i < replay->count && !state; i++) {
+
+    state = (replay->sessions[i].id == session) ? &replay->sessions[i] : NULL;
+  }
+  if (!state) {
+
+    ReplaySession_t* grown =
+        realloc(replay->sessions, (replay->count + 1) * sizeof(ReplaySession_t));
+    if (!grown) {
+
+      fprintf(cmd_err(), "Failed to allocate memory\n");
+      return 1;
+    }
+    replay->sessions = grown;
+    state = &replay->sessions[replay->count++];
+    state->id = session;
+    state->current_clus = replay->boot_sec->BPB_RootClus;
+    strcpy(state->cwd, "/");
+  }
+  int compacting = strncmp(command, "defrag", 6) == 0 && (command[6] == '\0' || command[6] == ' ');
+  int failed = run_command(replay->disk, replay->disk_name, replay->boot_sec, replay->is_fat32,
+                           &state->current_clus, state->cwd, command);
+  for (uint32_t i = 0; compacting && i < replay->count; i++) {
+
+    // the other recorded sessions follow directories the compaction moved
+    replay->sessions[i].current_clus = defrag_relocated(replay->sessions[i].current_clus);
+  }
+  return failed;
+}
 
 int main(int argc, char** argv) {
 
-  if (argc < 2) {
+  uint8_t use_wal = 0;
+  uint8_t use_crc = 0;
+  uint8_t use_usage = 0;
+  uint8_t use_prefetch = 0;
+  uint8_t use_index = 0;
+  uint8_t replay_timed = 0;
+  const char* record_name = NULL;
+  const char* replay_name = NULL;
+  const char* base_name = NULL;
+  const char* build_source = NULL;
+  const char* serve_socket = NULL;
+  const char* client_socket = NULL;
+  uint64_t build_size = 0;
+  int size_given = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "wcupiOt:T:b:m:s:S:C:")) != -1) {
+
+    switch (opt) {
+
+    case 'w':
+      use_wal = 1;
+      break;
+    case 'c':
+      use_crc = 1;
+      break;
+    case 'u':
+      use_usage = 1;
+      break;
+    case 'p':
+      use_prefetch = 1;
+      break;
+    case 'i':
+      use_index = 1;
+      break;
+    case 't':
+      record_name = optarg;
+      break;
+    case 'T':
+      replay_name = optarg;
+      break;
+    case 'O':
+      replay_timed = 1;
+      break;
+    case 'b':
+      base_name = optarg;
+      break;
+    case 'm':
+      build_source = optarg;
+      break;
+    case 'S':
+      serve_socket = optarg;
+      break;
+    case 'C':
+      client_socket = optarg;
+      break;
+    case 's': {
+
+      char* unit;
+      size_given = 1;
+      build_size = strtoull(optarg, &unit, 10);
+      build_size *= (toupper(*unit) == 'G')   ? 1000ULL * 1000 * 1000
+                    : (toupper(*unit) == 'M') ? 1000ULL * 1000
+                    : (toupper(*unit) == 'K') ? 1000ULL
+                                              : 1;
+      break;
+    }
+    default:
+      fprintf(stderr, USAGE, argv[0], argv[0], argv[0], argv[0]);
+      return -1;
+    }
+  }
+  if (size_given && !build_source) {
+
+    fprintf(stderr, "-s only sizes an image built with -m\n");
+    return -1;
+  }
+  if (client_socket) {
+
+    // the server owns the image, nothing is opened here
+    return client_run(client_socket) == 0 ? 0 : -1;
+  }
+  if (optind >= argc) {
 
-    fprintf(stderr, "Usage: %s <disk_image>\n", argv[0]);
+    fprintf(stderr, USAGE, argv[0], argv[0], argv[0], argv[0]);
     return -1;
   }
-  const char* disk_name = argv[1];
+  const char* disk_name = argv[optind];
+  if (build_source) {
+
+    // offline: lay out and stream a whole image, "-" writes it to stdout
+    return build_image(build_source, disk_name, build_size) == 0 ? 0 : -1;
+  }
   uint8_t is_fat32 = 0;
-  FILE* disk = fopen(disk_name, "r+b");
-  if (!disk) {
+  FILE* disk;
+  if (base_name) {
 
-    if (create_disk(disk, disk_name, 20, 'M') != 0) {
+    // overlay: disk_name is the delta, every change lands there
+    if (use_wal) {
+
+      fprintf(stderr, "-w cannot be combined with -b\n");
+      return -1;
+    }
+    disk = fopen(base_name, "rb");
+    if (!disk) {
 
+      fprintf(stderr, "Failed to open base image %s\n", base_name);
       return -1;
-    } else {
+    }
+    if (overlay_open(disk, base_name, disk_name) != 0) {
+
+      fclose(disk);
+      return -1;
+    }
+  } else {
+
+    disk = fopen(disk_name, "r+b");
+    if (!disk) {
 
-      disk = fopen(disk_name, "r+b");
+      if (create_disk(disk, disk_name, 20, 'M') != 0) {
+
+        return -1;
+      } else {
+
+        disk = fopen(disk_name, "r+b");
+      }
+    }
+
+    // finish whatever an interrupted session logged before looking at the volume
+    journal_replay(disk, disk_name);
+    if (use_wal && journal_open(disk, disk_name) != 0) {
+
+      fclose(disk);
+      return -1;
     }
   }
 
@@ -40,26 +247,109 @@ int main(int argc, char** argv) {
       current_clus = boot_sec.BPB_RootClus;
     }
   }
+  if (use_crc) {
 
-  char cwd[512] = "/"; // Initialize with the root directory path
-  char command[256];
+    // per-cluster checksums, kept in <disk_image>.crc
+    if (!is_fat32) {
 
-  while (1) {
+      fprintf(stderr, "Checksums need a FAT32 volume, format it first\n");
+    } else if (integrity_open(disk, disk_name, &boot_sec) != 0) {
 
-    printf("%s> ", cwd);
-    if (fgets(command, sizeof(command), stdin) == NULL) {
+      journal_close(disk);
+      overlay_close();
+      fclose(disk);
+      return -1;
+    }
+  }
+  if (use_usage) {
 
-      break;
+    // per-directory usage totals, kept in <disk_image>.usage
+    if (!is_fat32) {
+
+      fprintf(stderr, "Usage accounting needs a FAT32 volume, format it first\n");
+    } else if (usage_open(disk, disk_name, &boot_sec) != 0) {
+
+      integrity_close(disk);
+      journal_close(disk);
+      overlay_close();
+      fclose(disk);
+      return -1;
     }
+  }
+  if (use_index) {
 
-    command[strcspn(command, "\n")] = '\0'; // Remove the newline character
-    if (strncmp(command, "exit", 4) == 0 || strncmp(command, "q", 1) == 0) {
+    // path lookups and the free-cluster summary, kept in <disk_image>.idx
+    if (!is_fat32) {
 
-      break;
+      fprintf(stderr, "The path index needs a FAT32 volume, format it first\n");
+    } else if (path_index_open(disk, disk_name, &boot_sec) != 0) {
+
+      usage_close(disk);
+      integrity_close(disk);
+      journal_close(disk);
+      overlay_close();
+      fclose(disk);
+      return -1;
+    }
+  }
+  if (use_prefetch && is_fat32) {
+
+    // warm the directory and FAT caches while no command is running
+    prefetch_start(disk, &boot_sec);
+  }
+
+  if (record_name && !replay_name && trace_open(record_name) != 0) {
+
+    record_name = NULL;
+  }
+
+  if (replay_name) {
+
+    // a recorded workload against this image, then a latency report
+    Replay_t replay = {disk, disk_name, &boot_sec, &is_fat32, NULL, 0};
+    trace_replay(replay_name, replay_timed, replay_command, &replay);
+    free(replay.sessions);
+  } else if (serve_socket) {
+
+    // one mount shared by every client instead of one process per job
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    serve(disk, disk_name, &boot_sec, is_fat32, serve_socket, (online > 2) ? online : 2);
+  } else {
+
+    char cwd[512] = "/"; // Initialize with the root directory path
+    char command[256];
+
+    while (1) {
+
+      printf("%s> ", cwd);
+      if (fgets(command, sizeof(command), stdin) == NULL) {
+
+        break;
+      }
+
+      command[strcspn(command, "\n")] = '\0'; // Remove the newline character
+      if (strncmp(command, "exit", 4) == 0 || strncmp(command, "q", 1) == 0) {
+
+        break;
+      }
+      // commands are tokenized in place, so the trace keeps the text as typed
+      char recorded[sizeof(command)];
+      memcpy(recorded, command, sizeof(command));
+      uint64_t start = trace_now();
+      int failed = run_command(disk, disk_name, &boot_sec, &is_fat32, &current_clus, cwd, command);
+      trace_command(0, recorded, start, trace_now(), failed);
     }
-    handle_command(disk, disk_name, &boot_sec, &is_fat32, &current_clus, cwd, command);
   }
 
+  trace_close();
+  prefetch_stop();
+  // the log lands first, so the sidecars are saved against the final image
+  journal_close(disk);
+  path_index_close(disk);
+  usage_close(disk);
+  integrity_close(disk);
+  overlay_close();
   fclose(disk);
+  arena_release();
   return 0;
 }
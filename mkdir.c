@@ -4,8 +4,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
 #include "bootsec.h"
 #include "directory.h"
+#include "unicode.h"
+#include "usage.h"
 #include "utility.h"
 
 static void generate_short_dirname(const char* dir_name, char* short_name, uint8_t* nt_res) {
@@ -13,27 +16,42 @@ static void generate_short_dirname(const char* dir_name, char* short_name, uint8
   memset(short_name, 0x20, 11); // 0x20 for whitespace
   *nt_res = 0;
 
-  int i = 0, j = 0;
-  while (i < 8 && dir_name[j]) {
+  // one basis character per code point, as touch builds it
+  const char* end = dir_name + strlen(dir_name);
+  int i = 0;
+  for (const char* p = dir_name; i < 8 && p < end;) {
 
-    if (islower(dir_name[j])) {
+    uint32_t cp = utf8_next(&p, end);
+    if (cp == ' ' || cp == '.') {
+
+      continue;
+    }
+    if (cp >= 0x80) {
+
+      short_name[i++] = '_';
+      continue;
+    }
+    if (islower((unsigned char)cp)) {
 
       *nt_res |= NT_RES_LOWER_CASE_BASE;
     }
-    short_name[i++] = toupper(dir_name[j++]);
+    short_name[i++] = (char)toupper((unsigned char)cp);
   }
 }
 
-static void create_directory_entry(FILE* disk, uint32_t parent_cluster, const char* dir_name,
-                                   uint32_t new_cluster, BootSec_t* boot_sec) {
+// Returns non-zero when no entry was written, so that the caller can give
+// new_cluster back
+static int create_directory_entry(FILE* disk, uint32_t parent_cluster, const char* dir_name,
+                                  uint32_t new_cluster, BootSec_t* boot_sec) {
 
   uint16_t sector_size = boot_sec->BPB_BytsPerSec;
-  uint16_t rsrvd_sec = boot_sec->BPB_RsvdSecCnt;
-  uint8_t* sector_buffer = malloc(sector_size);
-  if (!sector_buffer) {
+  size_t cluster_size = (size_t)sector_size * boot_sec->BPB_SecPerClus;
+  uint8_t* cluster_buffer = buffer_take(cluster_size);
+  uint8_t* sector_buffer = cluster_buffer;
+  if (!cluster_buffer) {
 
-    fprintf(stderr, "Memory allocation failed\n");
-    return;
+    fprintf(cmd_err(), "Memory allocation failed\n");
+    return 1;
   }
 
   memset(sector_buffer, 0, sector_size);
@@ -45,12 +63,18 @@ static void create_directory_entry(FILE* disk, uint32_t parent_cluster, const ch
   uint8_t fat_time_tenth;
   get_fat_time_date(&fat_date, &fat_time, &fat_time_tenth);
 
+  // the new name's 8.3 form is checked against the ones the parent holds
+  ShortNameSet_t* names = short_name_set_get(disk, boot_sec, parent_cluster);
+  if (!names) {
+
+    fprintf(cmd_err(), "Failed to read directory entries\n");
+    buffer_give(cluster_buffer, cluster_size);
+    return 1;
+  }
+  uint32_t slots = dir_slots_needed(dir_name, names);
+
   // Initialize the new directory with "." and ".." entries
-  current_sector =
-      boot_sec->BPB_HiddSec + rsrvd_sec +
-      (boot_sec->BPB_NumFATs *
-       ((boot_sec->BPB_FATSz16 == 0) ? boot_sec->BPB_FATSz32 : boot_sec->BPB_FATSz16)) +
-      (new_cluster - 2) * boot_sec->BPB_SecPerClus;
+  current_sector = first_sector_of_cluster(boot_sec, new_cluster);
 
   // Read the first sector of the new directory cluster
   read_sector(disk, current_sector, sector_buffer, sector_size);
@@ -88,67 +112,86 @@ static void create_directory_entry(FILE* disk, uint32_t parent_cluster, const ch
 
   while (1) {
 
-    uint32_t fat_size =
-        (boot_sec->BPB_FATSz16 == 0) ? boot_sec->BPB_FATSz32 : boot_sec->BPB_FATSz16;
-    current_sector = boot_sec->BPB_HiddSec + rsrvd_sec + (boot_sec->BPB_NumFATs * fat_size) +
-                     (current_clus - 2) * boot_sec->BPB_SecPerClus;
+    // one read for the whole cluster; only a modified sector goes back
+    current_sector = first_sector_of_cluster(boot_sec, current_clus);
+    read_clusters(disk, boot_sec, current_clus, 1, cluster_buffer);
 
     for (uint32_t i = 0; i < boot_sec->BPB_SecPerClus; i++) {
 
-      read_sector(disk, current_sector + i, sector_buffer, sector_size);
+      sector_buffer = cluster_buffer + i * sector_size;
 
-      for (uint32_t j = 0; j < sector_size; j += sizeof(DIRStr_t)) {
+      // only free and end slots are candidates; the scan is sized per geometry
+      for (uint32_t j = dir_next_free(sector_buffer, 0, sector_size); j < sector_size;
+           j = dir_next_free(sector_buffer, j + sizeof(DIRStr_t), sector_size)) {
 
         dir_entry = (DIRStr_t*)(sector_buffer + j);
 
-        if (dir_entry->DIR_Name[0] == 0x00 || dir_entry->DIR_Name[0] == 0xE5) {
+        // the LFN run and the 8.3 entry must land in free slots of this sector
+        if (!dir_slots_fit(sector_buffer, j, sector_size, slots)) {
 
-          // Create LFN entries
-          int lfn_entries = 0;
-          size_t dir_len = strlen(dir_name);
-          uint8_t nt_res = 0;
-          char short_name[11];
+          if (dir_entry->DIR_Name[0] == 0x00) {
 
-          if (dir_len > 8) {
-
-            lfn_entries = create_lfn_entries(dir_name, dir_len, sector_buffer + j, short_name,
-                                             &nt_res, generate_short_dirname);
-            j += lfn_entries * sizeof(LFNStr_t);
+            dir_seal_tail(sector_buffer, j, sector_size);
+            write_sector(disk, current_sector + i, sector_buffer, sector_size);
+            break;
           }
+          continue;
+        }
 
-          // Create the 8.3 entry
-          dir_entry = (DIRStr_t*)(sector_buffer + j);
-          memset(dir_entry, 0, sizeof(DIRStr_t));
-          if (!lfn_entries) {
+        // Create LFN entries
+        int lfn_entries = 0;
+        size_t dir_len = strlen(dir_name);
+        uint8_t nt_res = 0;
+        char short_name[11];
 
-            generate_short_dirname(dir_name, short_name, &nt_res);
+        if (slots > 1) {
+
+          lfn_entries = create_lfn_entries(dir_name, dir_len, sector_buffer + j, short_name,
+                                           &nt_res, generate_short_dirname, names);
+          if (lfn_entries < 0) {
+
+            fprintf(cmd_err(), "No unique short name left for %s\n", dir_name);
+            buffer_give(cluster_buffer, cluster_size);
+            return 1;
           }
+          j += lfn_entries * sizeof(LFNStr_t);
+        }
+
+        // Create the 8.3 entry
+        dir_entry = (DIRStr_t*)(sector_buffer + j);
+        memset(dir_entry, 0, sizeof(DIRStr_t));
+        if (!lfn_entries) {
 
-          memcpy(dir_entry->DIR_Name, short_name, 11);
-          dir_entry->DIR_NTRes = nt_res;
-          dir_entry->DIR_Attr = ATTR_DIRECTORY;
-          dir_entry->DIR_FstClusLO = (uint16_t)(new_cluster & 0xFFFF);
-          dir_entry->DIR_FstClusHI = (uint16_t)((new_cluster >> 16) & 0xFFFF);
-          // Set creation time and date
-          dir_entry->DIR_CrtTimeTenth = fat_time_tenth;
-          dir_entry->DIR_CrtTime = fat_time;
-          dir_entry->DIR_CrtDate = fat_date;
-          dir_entry->DIR_WrtTime = fat_time;
-          dir_entry->DIR_WrtDate = fat_date;
-          dir_entry->DIR_LstAccDate = fat_date;
-
-          write_sector(disk, current_sector + i, sector_buffer, sector_size);
-          free(sector_buffer);
-          return;
+          short_name_from_83(dir_name, short_name, &nt_res);
+          short_name_cache_note(parent_cluster, short_name);
         }
+
+        memcpy(dir_entry->DIR_Name, short_name, 11);
+        dir_entry->DIR_NTRes = nt_res;
+        dir_entry->DIR_Attr = ATTR_DIRECTORY;
+        dir_entry->DIR_FstClusLO = (uint16_t)(new_cluster & 0xFFFF);
+        dir_entry->DIR_FstClusHI = (uint16_t)((new_cluster >> 16) & 0xFFFF);
+        // Set creation time and date
+        dir_entry->DIR_CrtTimeTenth = fat_time_tenth;
+        dir_entry->DIR_CrtTime = fat_time;
+        dir_entry->DIR_CrtDate = fat_date;
+        dir_entry->DIR_WrtTime = fat_time;
+        dir_entry->DIR_WrtDate = fat_date;
+        dir_entry->DIR_LstAccDate = fat_date;
+
+        write_sector(disk, current_sector + i, sector_buffer, sector_size);
+        usage_note_dir_added(parent_cluster, new_cluster, dir_name, 1);
+        buffer_give(cluster_buffer, cluster_size);
+        return 0;
       }
     }
-    uint32_t next_cluster = get_next_cluster(disk, current_clus, sector_size, rsrvd_sec);
+    uint32_t next_cluster =
+        get_next_cluster(disk, current_clus, sector_size, boot_sec->BPB_RsvdSecCnt);
     if (next_cluster >= EOC) {
 
-      fprintf(stderr, "No free directory entry found\n");
-      free(sector_buffer);
-      return;
+      fprintf(cmd_err(), "No free directory entry found\n");
+      buffer_give(cluster_buffer, cluster_size);
+      return 1;
     }
     current_clus = next_cluster;
   }
@@ -164,11 +207,15 @@ void mkdir(FILE* disk, BootSec_t* boot_sec, char* path, uint32_t current_clus) {
   uint32_t new_cluster = get_free_cluster(disk, boot_sec);
   if (new_cluster == 0) {
 
-    fprintf(stderr, "No free clusters available\n");
+    fprintf(cmd_err(), "No free clusters available\n");
     exit(EXIT_FAILURE);
   }
 
   update_fat(disk, new_cluster, EOC, boot_sec->BPB_BytsPerSec, boot_sec->BPB_RsvdSecCnt);
   clear_cluster(disk, new_cluster, boot_sec);
-  create_directory_entry(disk, parent_cluster, dir_name, new_cluster, boot_sec);
+  if (create_directory_entry(disk, parent_cluster, dir_name, new_cluster, boot_sec) != 0) {
+
+    // no entry refers to the cluster, it goes back to the free pool
+    update_fat(disk, new_cluster, 0, boot_sec->BPB_BytsPerSec, boot_sec->BPB_RsvdSecCnt);
+  }
 }
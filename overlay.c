@@ -0,0 +1,428 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bootsec.h"
+#include "overlay.h"
+#include "utility.h"
+
+#define OVL_MAGIC 0x4C564F46 // "FOVL"
+#define OVL_VERSION 1
+#define OVL_PATH_MAX 512
+
+// Delta layout, in blocks of the base volume's cluster size:
+//   block 0            header
+//   map blocks         one uint32_t per base block, delta slot + 1 or 0
+//   data blocks        copies of modified base blocks, in allocation order
+// Untouched parts of the map are holes, so the delta stays proportional to
+// what changed. A slot is written before its map entry.
+typedef struct {
+
+  uint32_t magic;
+  uint32_t version;
+  uint32_t block_size;
+  uint32_t map_blocks;
+  uint64_t base_size;
+} __attribute__((packed)) OverlayHeader_t;
+
+static struct {
+
+  int active;
+  char base_name[OVL_PATH_MAX];
+  int base_fd;
+  int delta_fd;
+  uint32_t block_size;
+  uint64_t base_size;
+  uint32_t block_count;
+  uint32_t map_blocks;
+  uint32_t* map; // base block -> delta slot + 1
+  uint32_t slots;
+} ovl = {0, {0}, -1, -1, 0, 0, 0, 0, NULL, 0};
+
+static off_t map_offset(void) {
+
+  return ovl.block_size;
+}
+
+static off_t slot_offset(uint32_t slot) {
+
+  return (off_t)(1 + ovl.map_blocks + slot) * ovl.block_size;
+}
+
+static int full_pread(int fd, void* buffer, size_t size, off_t offset) {
+
+  uint8_t* bytes = buffer;
+  while (size > 0) {
+
+    ssize_t res = pread(fd, bytes, size, offset);
+    if (res < 0) {
+
+      return 1;
+    }
+    if (res == 0) {
+
+      memset(bytes, 0, size); // past the end of a sparse file
+      return 0;
+    }
+    bytes += res;
+    size -= res;
+    offset += res;
+  }
+  return 0;
+}
+
+static int full_pwrite(int fd, const void* buffer, size_t size, off_t offset) {
+
+  const uint8_t* bytes = buffer;
+  while (size > 0) {
+
+    ssize_t res = pwrite(fd, bytes, size, offset);
+    if (res <= 0) {
+
+      return 1;
+    }
+    bytes += res;
+    size -= res;
+    offset += res;
+  }
+  return 0;
+}
+
+static int write_header(void) {
+
+  uint8_t* block = calloc(1, ovl.block_size);
+  if (!block) {
+
+    return 1;
+  }
+  OverlayHeader_t header = {OVL_MAGIC, OVL_VERSION, ovl.block_size, ovl.map_blocks, ovl.base_size};
+  memcpy(block, &header, sizeof(header));
+  int res = full_pwrite(ovl.delta_fd, block, ovl.block_size, 0);
+  free(block);
+  return res;
+}
+
+static int load_map(void) {
+
+  if (full_pread(ovl.delta_fd, ovl.map, (size_t)ovl.block_count * sizeof(uint32_t),
+                 map_offset()) != 0) {
+
+    return 1;
+  }
+  ovl.slots = 0;
+  for (uint32_t i = 0; i < ovl.block_count; i++) {
+
+    if (ovl.map[i] > ovl.slots) {
+
+      ovl.slots = ovl.map[i];
+    }
+  }
+  return 0;
+}
+
+// Opens delta_name on top of base, creating an empty delta if it is missing.
+// The base is only ever read until commit.
+int overlay_open(FILE* base, const char* base_name, const char* delta_name) {
+
+  BootSec_t boot_sec;
+  struct stat st;
+  int base_fd = fileno(base);
+  if (pread(base_fd, &boot_sec, sizeof(boot_sec), 0) != sizeof(boot_sec) ||
+      fstat(base_fd, &st) != 0) {
+
+    fprintf(cmd_err(), "Failed to read base image\n");
+    return 1;
+  }
+  uint32_t block_size = (uint32_t)boot_sec.BPB_BytsPerSec * boot_sec.BPB_SecPerClus;
+  if (block_size == 0 || (block_size & (block_size - 1)) != 0) {
+
+    fprintf(cmd_err(), "Base image has no valid cluster size\n");
+    return 1;
+  }
+
+  int delta_fd = open(delta_name, O_RDWR | O_CREAT, 0644);
+  if (delta_fd < 0) {
+
+    fprintf(cmd_err(), "Failed to open delta %s\n", delta_name);
+    return 1;
+  }
+
+  snprintf(ovl.base_name, sizeof(ovl.base_name), "%s", base_name);
+  ovl.base_fd = base_fd;
+  ovl.delta_fd = delta_fd;
+  ovl.block_size = block_size;
+  ovl.base_size = st.st_size;
+  ovl.block_count = (st.st_size + block_size - 1) / block_size;
+  ovl.map_blocks = ((uint64_t)ovl.block_count * sizeof(uint32_t) + block_size - 1) / block_size;
+  ovl.map = calloc(ovl.block_count, sizeof(uint32_t));
+  if (!ovl.map) {
+
+    fprintf(cmd_err(), "Failed to allocate overlay map\n");
+    close(delta_fd);
+    return 1;
+  }
+
+  OverlayHeader_t header;
+  if (pread(delta_fd, &header, sizeof(header), 0) == sizeof(header)) {
+
+    if (header.magic != OVL_MAGIC || header.version != OVL_VERSION ||
+        header.block_size != block_size || header.base_size != ovl.base_size) {
+
+      fprintf(cmd_err(), "%s is not a delta of this base image\n", delta_name);
+      overlay_close();
+      return 1;
+    }
+    if (load_map() != 0) {
+
+      fprintf(cmd_err(), "Failed to read overlay map\n");
+      overlay_close();
+      return 1;
+    }
+  } else if (write_header() != 0) {
+
+    fprintf(cmd_err(), "Failed to initialize delta %s\n", delta_name);
+    overlay_close();
+    return 1;
+  }
+  ovl.active = 1;
+  return 0;
+}
+
+void overlay_close(void) {
+
+  if (ovl.delta_fd >= 0) {
+
+    fsync(ovl.delta_fd);
+    close(ovl.delta_fd);
+  }
+  free(ovl.map);
+  ovl.map = NULL;
+  ovl.delta_fd = -1;
+  ovl.base_fd = -1;
+  ovl.active = 0;
+}
+
+int overlay_active(void) {
+
+  return ovl.active;
+}
+
+// Only the base the overlay was opened on is redirected, other images
+// opened next to it are read as they are
+int overlay_covers(FILE* disk) {
+
+  return ovl.active && fileno(disk) == ovl.base_fd;
+}
+
+// The file that writes to a covered image land in
+int overlay_delta_fd(void) {
+
+  return ovl.delta_fd;
+}
+
+// Reads fall through to the base for every block the delta does not hold
+ssize_t overlay_pread(void* buffer, size_t size, off_t offset) {
+
+  uint8_t* bytes = buffer;
+  size_t done = 0;
+  while (done < size) {
+
+    uint64_t position = (uint64_t)offset + done;
+    uint32_t block = position / ovl.block_size;
+    uint32_t within = position % ovl.block_size;
+    size_t chunk = ovl.block_size - within;
+    if (chunk > size - done) {
+
+      chunk = size - done;
+    }
+
+    int res;
+    if (block < ovl.block_count && ovl.map[block] != 0) {
+
+      res = full_pread(ovl.delta_fd, bytes + done, chunk, slot_offset(ovl.map[block] - 1) + within);
+    } else {
+
+      // unmodified blocks are usually adjacent: read the whole clean run at once
+      while (done + chunk < size && block + 1 < ovl.block_count && ovl.map[block + 1] == 0) {
+
+        size_t more = size - done - chunk;
+        chunk += (more < ovl.block_size) ? more : ovl.block_size;
+        block++;
+      }
+      res = full_pread(ovl.base_fd, bytes + done, chunk, position);
+    }
+    if (res != 0) {
+
+      return -1;
+    }
+    done += chunk;
+  }
+  return size;
+}
+
+// Copy on write: the first write to a block copies it from the base into a
+// new delta slot, later writes go to that slot
+ssize_t overlay_pwrite(const void* buffer, size_t size, off_t offset) {
+
+  const uint8_t* bytes = buffer;
+  size_t done = 0;
+  uint8_t* block_buffer = NULL;
+  while (done < size) {
+
+    uint64_t position = (uint64_t)offset + done;
+    uint32_t block = position / ovl.block_size;
+    uint32_t within = position % ovl.block_size;
+    size_t chunk = ovl.block_size - within;
+    if (chunk > size - done) {
+
+      chunk = size - done;
+    }
+    if (block >= ovl.block_count) {
+
+      free(block_buffer);
+      return -1; // the volume cannot grow past its base
+    }
+
+    if (ovl.map[block] == 0) {
+
+      if (!block_buffer && !(block_buffer = malloc(ovl.block_size))) {
+
+        return -1;
+      }
+      if (chunk < ovl.block_size &&
+          full_pread(ovl.base_fd, block_buffer, ovl.block_size,
+                     (off_t)block * ovl.block_size) != 0) {
+
+        free(block_buffer);
+        return -1;
+      }
+      memcpy(block_buffer + within, bytes + done, chunk);
+      uint32_t slot = ovl.slots;
+      uint32_t entry = slot + 1;
+      if (full_pwrite(ovl.delta_fd, block_buffer, ovl.block_size, slot_offset(slot)) != 0 ||
+          full_pwrite(ovl.delta_fd, &entry, sizeof(entry),
+                      map_offset() + (off_t)block * sizeof(uint32_t)) != 0) {
+
+        free(block_buffer);
+        return -1;
+      }
+      ovl.map[block] = entry;
+      ovl.slots++;
+    } else if (full_pwrite(ovl.delta_fd, bytes + done, chunk,
+                           slot_offset(ovl.map[block] - 1) + within) != 0) {
+
+      free(block_buffer);
+      return -1;
+    }
+    done += chunk;
+  }
+  free(block_buffer);
+  return size;
+}
+
+static int block_is_zero(const uint8_t* block, uint32_t size) {
+
+  for (uint32_t i = 0; i < size; i++) {
+
+    if (block[i] != 0) {
+
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Flattens base plus delta. Without an output the modified blocks are
+// written back into the base and the delta is emptied; with one, a new
+// standalone image is written, leaving holes where blocks are all zero.
+int overlay_commit(const char* output_name) {
+
+  if (!ovl.active) {
+
+    fprintf(cmd_err(), "No overlay is open\n");
+    return 1;
+  }
+  uint8_t* block = malloc(ovl.block_size);
+  if (!block) {
+
+    fprintf(cmd_err(), "Memory allocation failed\n");
+    return 1;
+  }
+
+  int failed = 0;
+  uint32_t written = 0;
+  if (output_name) {
+
+    int out_fd = open(output_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0 || ftruncate(out_fd, ovl.base_size) != 0) {
+
+      fprintf(cmd_err(), "Failed to create %s\n", output_name);
+      free(block);
+      if (out_fd >= 0) {
+
+        close(out_fd);
+      }
+      return 1;
+    }
+    for (uint32_t i = 0; i < ovl.block_count && !failed; i++) {
+
+      uint64_t position = (uint64_t)i * ovl.block_size;
+      size_t size = (ovl.base_size - position < ovl.block_size) ? ovl.base_size - position
+                                                               : ovl.block_size;
+      if (overlay_pread(block, size, position) < 0) {
+
+        failed = 1;
+      } else if (!block_is_zero(block, size)) {
+
+        failed = full_pwrite(out_fd, block, size, position);
+        written++;
+      }
+    }
+    failed |= fsync(out_fd) != 0;
+    close(out_fd);
+  } else {
+
+    int rw_fd = open(ovl.base_name, O_WRONLY);
+    if (rw_fd < 0) {
+
+      fprintf(cmd_err(), "Base image %s cannot be opened for writing\n", ovl.base_name);
+      free(block);
+      return 1;
+    }
+    for (uint32_t i = 0; i < ovl.block_count && !failed; i++) {
+
+      if (ovl.map[i] == 0) {
+
+        continue;
+      }
+      uint64_t position = (uint64_t)i * ovl.block_size;
+      size_t size = (ovl.base_size - position < ovl.block_size) ? ovl.base_size - position
+                                                               : ovl.block_size;
+      failed = full_pread(ovl.delta_fd, block, size, slot_offset(ovl.map[i] - 1)) ||
+               full_pwrite(rw_fd, block, size, position);
+      written++;
+    }
+    failed |= fsync(rw_fd) != 0;
+    close(rw_fd);
+
+    // the base now holds everything: start over with an empty delta
+    if (!failed) {
+
+      memset(ovl.map, 0, (size_t)ovl.block_count * sizeof(uint32_t));
+      ovl.slots = 0;
+      failed = ftruncate(ovl.delta_fd, ovl.block_size) != 0 || fsync(ovl.delta_fd) != 0;
+    }
+  }
+  free(block);
+
+  if (failed) {
+
+    fprintf(cmd_err(), "Commit failed\n");
+    return 1;
+  }
+  fprintf(cmd_out(), "Committed %u blocks to %s\n", written,
+          output_name ? output_name : "base image");
+  return 0;
+}
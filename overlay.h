@@ -0,0 +1,17 @@
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+int overlay_open(FILE* base, const char* base_name, const char* delta_name);
+void overlay_close(void);
+int overlay_active(void);
+int overlay_covers(FILE* disk);
+int overlay_delta_fd(void);
+ssize_t overlay_pread(void* buffer, size_t size, off_t offset);
+ssize_t overlay_pwrite(const void* buffer, size_t size, off_t offset);
+int overlay_commit(const char* output_name);
+
+#endif // OVERLAY_H
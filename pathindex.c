@@ -0,0 +1,848 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fat.h"
+#include "pathindex.h"
+#include "stamp.h"
+#include "unicode.h"
+#include "utility.h"
+
+#define PATH_INDEX_MAGIC 0x58444946 // "FIDX"
+#define PATH_INDEX_VERSION 2
+#define PATH_INDEX_PATH_MAX 512
+
+// The index file is this header followed by its sections, each starting on an
+// 8-byte boundary: entries grouped by directory, the entry hash slots,
+// directories, directory chains, the chain owner slots, the free-cluster
+// summary and the name pool. It is mapped as is and only trusted while its
+// generation is non-zero, which a write to the image clears, and the image
+// still matches its stamp.
+typedef struct {
+
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+  uint32_t cluster_size;
+  uint32_t cluster_count;
+  uint64_t generation;
+  ImageStamp_t stamp;
+  uint32_t entry_count;
+  uint32_t entry_slots; // power of two
+  uint32_t dir_count;
+  uint32_t chain_count; // clusters of all directory chains together
+  uint32_t owner_slots; // power of two
+  uint32_t block_count;
+  uint64_t names_size;
+} __attribute__((packed)) PathIndexHeader_t;
+
+typedef struct {
+
+  uint32_t parent; // first cluster of the directory holding the entry
+  uint32_t hash;   // utf8_casehash of the name
+  uint32_t name_off;
+  uint16_t name_len;
+  uint8_t attr;
+  uint8_t lfn_count;
+  uint32_t cluster;
+  uint32_t size;
+  uint16_t date;
+  uint16_t time;
+  uint32_t loc_cluster;
+  uint32_t loc_offset;
+  uint32_t lfn_cluster;
+  uint32_t lfn_offset;
+  char ext[4];
+} __attribute__((packed)) IndexEntry_t;
+
+typedef struct {
+
+  uint32_t cluster;
+  uint32_t first_entry;
+  uint32_t entry_count;
+  uint32_t first_chain;
+  uint32_t chain_len;
+} __attribute__((packed)) IndexDir_t;
+
+// Chain cluster to the directory owning it
+typedef struct {
+
+  uint32_t cluster;
+  uint32_t dir; // index into the directories + 1, 0 when empty
+} __attribute__((packed)) IndexOwner_t;
+
+typedef struct {
+
+  uint64_t entries;
+  uint64_t entry_slots;
+  uint64_t dirs;
+  uint64_t chains;
+  uint64_t owners;
+  uint64_t blocks;
+  uint64_t names;
+  uint64_t total;
+} IndexLayout_t;
+
+// A new index being put together in memory
+typedef struct {
+
+  IndexEntry_t* entries;
+  size_t entry_count;
+  size_t entry_cap;
+  IndexDir_t* dirs;
+  size_t dir_count;
+  size_t dir_cap;
+  uint32_t* chains;
+  size_t chain_count;
+  size_t chain_cap;
+  char* names;
+  size_t names_size;
+  size_t names_cap;
+  uint32_t parent; // directory being read
+  int failed;      // an entry of it could not be added
+} IndexBuild_t;
+
+static struct {
+
+  int active;
+  FILE* disk;
+  int fd;
+  char path[PATH_INDEX_PATH_MAX];
+  BootSec_t* boot_sec;
+  uint32_t cluster_size;
+  uint32_t cluster_count;
+  uint64_t generation;
+  uint8_t written; // the image changed since the index was saved
+  uint8_t* map;
+  size_t map_size;
+  const PathIndexHeader_t* header;
+  const IndexEntry_t* entries;
+  const uint32_t* entry_slots; // index into entries + 1, 0 when empty
+  const IndexDir_t* dirs;
+  const uint32_t* chains;
+  const IndexOwner_t* owners;
+  const uint32_t* blocks; // free clusters per PATH_INDEX_BLOCK_SECTORS FAT sectors
+  const char* names;
+  uint8_t* dir_dirty;   // per directory: written this session
+  uint8_t* block_dirty; // per summary block: FAT written this session
+} pindex = {0, NULL, -1, {0}, NULL, 0, 0, 0, 0, NULL, 0, NULL, NULL, NULL,
+            NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+
+static uint64_t align8(uint64_t size) {
+
+  return (size + 7) & ~(uint64_t)7;
+}
+
+static void layout(const PathIndexHeader_t* header, IndexLayout_t* out) {
+
+  out->entries = align8(sizeof(PathIndexHeader_t));
+  out->entry_slots = out->entries + align8((uint64_t)header->entry_count * sizeof(IndexEntry_t));
+  out->dirs = out->entry_slots + align8((uint64_t)header->entry_slots * sizeof(uint32_t));
+  out->chains = out->dirs + align8((uint64_t)header->dir_count * sizeof(IndexDir_t));
+  out->owners = out->chains + align8((uint64_t)header->chain_count * sizeof(uint32_t));
+  out->blocks = out->owners + align8((uint64_t)header->owner_slots * sizeof(IndexOwner_t));
+  out->names = out->blocks + align8((uint64_t)header->block_count * sizeof(uint32_t));
+  out->total = out->names + align8(header->names_size);
+}
+
+static uint32_t entry_home(uint32_t parent, uint32_t hash, uint32_t mask) {
+
+  return ((parent * 2654435761u) ^ hash) & mask;
+}
+
+static uint32_t owner_home(uint32_t cluster, uint32_t mask) {
+
+  return (cluster * 2654435761u) & mask;
+}
+
+// Summary blocks covering the FAT entries of every cluster
+static uint32_t block_count(void) {
+
+  uint32_t sector_size = pindex.boot_sec->BPB_BytsPerSec;
+  uint64_t fat_sectors = ((uint64_t)pindex.cluster_count * FAT_ELEM_SIZE + sector_size - 1) /
+                         sector_size;
+  return (fat_sectors + PATH_INDEX_BLOCK_SECTORS - 1) / PATH_INDEX_BLOCK_SECTORS;
+}
+
+static uint32_t clusters_per_block(void) {
+
+  return PATH_INDEX_BLOCK_SECTORS * (pindex.boot_sec->BPB_BytsPerSec / FAT_ELEM_SIZE);
+}
+
+// Index of the mapped directory owning cluster, or -1
+static int64_t owner_of(uint32_t cluster) {
+
+  if (!pindex.map || pindex.header->owner_slots == 0) {
+
+    return -1;
+  }
+  uint32_t mask = pindex.header->owner_slots - 1;
+  for (uint32_t slot = owner_home(cluster, mask), probes = 0; probes <= mask;
+       slot = (slot + 1) & mask, probes++) {
+
+    const IndexOwner_t* owner = &pindex.owners[slot];
+    if (owner->dir == 0 || owner->dir > pindex.header->dir_count) {
+
+      return -1;
+    }
+    if (owner->cluster == cluster) {
+
+      return owner->dir - 1;
+    }
+  }
+  return -1;
+}
+
+// Index of the mapped directory starting at cluster, or -1
+static int64_t dir_of(uint32_t cluster) {
+
+  int64_t dir = owner_of(cluster);
+  return (dir >= 0 && pindex.dirs[dir].cluster == cluster) ? dir : -1;
+}
+
+// A mapped directory whose entries and chain all lie inside the file
+static int dir_sane(const IndexDir_t* dir) {
+
+  return (uint64_t)dir->first_entry + dir->entry_count <= pindex.header->entry_count &&
+         (uint64_t)dir->first_chain + dir->chain_len <= pindex.header->chain_count;
+}
+
+static int entry_sane(const IndexEntry_t* entry) {
+
+  return entry->name_len < MAX_NAME_BYTES &&
+         (uint64_t)entry->name_off + entry->name_len < pindex.header->names_size &&
+         pindex.names[entry->name_off + entry->name_len] == '\0';
+}
+
+static void unmap(void) {
+
+  if (pindex.map) {
+
+    munmap(pindex.map, pindex.map_size);
+  }
+  free(pindex.dir_dirty);
+  free(pindex.block_dirty);
+  pindex.map = NULL;
+  pindex.map_size = 0;
+  pindex.header = NULL;
+  pindex.dir_dirty = pindex.block_dirty = NULL;
+}
+
+// Maps the index file and checks it belongs to this volume as it is now
+static int map_index(FILE* disk) {
+
+  struct stat st;
+  PathIndexHeader_t header;
+  ImageStamp_t stamp;
+  if (image_stamp(disk, pindex.boot_sec, &stamp) != 0 || fstat(pindex.fd, &st) != 0 ||
+      (uint64_t)st.st_size < sizeof(header) ||
+      pread(pindex.fd, &header, sizeof(header), 0) != sizeof(header) ||
+      header.magic != PATH_INDEX_MAGIC || header.version != PATH_INDEX_VERSION ||
+      header.cluster_size != pindex.cluster_size ||
+      header.cluster_count != pindex.cluster_count || header.generation == 0 ||
+      memcmp(&header.stamp, &stamp, sizeof(stamp)) != 0 ||
+      header.dir_count == 0 || header.block_count != block_count() ||
+      (header.entry_slots & (header.entry_slots - 1)) != 0 ||
+      (header.owner_slots & (header.owner_slots - 1)) != 0) {
+
+    return 1;
+  }
+  IndexLayout_t at;
+  layout(&header, &at);
+  if (at.total != (uint64_t)st.st_size) {
+
+    return 1;
+  }
+  uint8_t* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, pindex.fd, 0);
+  if (map == MAP_FAILED) {
+
+    return 1;
+  }
+  pindex.map = map;
+  pindex.map_size = st.st_size;
+  pindex.header = (const PathIndexHeader_t*)map;
+  pindex.entries = (const IndexEntry_t*)(map + at.entries);
+  pindex.entry_slots = (const uint32_t*)(map + at.entry_slots);
+  pindex.dirs = (const IndexDir_t*)(map + at.dirs);
+  pindex.chains = (const uint32_t*)(map + at.chains);
+  pindex.owners = (const IndexOwner_t*)(map + at.owners);
+  pindex.blocks = (const uint32_t*)(map + at.blocks);
+  pindex.names = (const char*)(map + at.names);
+  pindex.dir_dirty = calloc(header.dir_count, 1);
+  pindex.block_dirty = calloc(header.block_count ? header.block_count : 1, 1);
+  pindex.generation = header.generation;
+  if (!pindex.dir_dirty || !pindex.block_dirty) {
+
+    unmap();
+    return 1;
+  }
+  return 0;
+}
+
+static int grow(void** array, size_t* capacity, size_t needed, size_t width) {
+
+  if (needed <= *capacity) {
+
+    return 0;
+  }
+  size_t grown_cap = *capacity ? *capacity : 64;
+  while (grown_cap < needed) {
+
+    grown_cap *= 2;
+  }
+  void* grown = realloc(*array, grown_cap * width);
+  if (!grown) {
+
+    return 1;
+  }
+  *array = grown;
+  *capacity = grown_cap;
+  return 0;
+}
+
+static int add_name(IndexBuild_t* build, const char* name, size_t len, uint32_t* name_off) {
+
+  if (build->names_size + len + 1 > UINT32_MAX ||
+      grow((void**)&build->names, &build->names_cap, build->names_size + len + 1, 1) != 0) {
+
+    return 1;
+  }
+  *name_off = build->names_size;
+  memcpy(build->names + build->names_size, name, len);
+  build->names[build->names_size + len] = '\0';
+  build->names_size += len + 1;
+  return 0;
+}
+
+static int build_entry(const EntrSt_t* entry, const DIRStr_t* raw, const EntrLoc_t* loc,
+                       void* ctx) {
+
+  (void)raw;
+  IndexBuild_t* build = ctx;
+  IndexEntry_t* indexed = NULL;
+  size_t len = strlen(entry->name);
+  if (grow((void**)&build->entries, &build->entry_cap, build->entry_count + 1,
+           sizeof(IndexEntry_t)) == 0) {
+
+    indexed = &build->entries[build->entry_count];
+  }
+  uint32_t name_off;
+  if (!indexed || add_name(build, entry->name, len, &name_off) != 0) {
+
+    build->failed = 1;
+    return 1;
+  }
+  indexed->name_off = name_off;
+  indexed->parent = build->parent;
+  indexed->hash = utf8_casehash(entry->name);
+  indexed->name_len = len;
+  indexed->attr = entry->attr;
+  indexed->lfn_count = loc->lfn_count;
+  indexed->cluster = entry->cluster;
+  indexed->size = entry->size;
+  indexed->date = entry->date;
+  indexed->time = entry->time;
+  indexed->loc_cluster = loc->cluster;
+  indexed->loc_offset = loc->offset;
+  indexed->lfn_cluster = loc->lfn_cluster;
+  indexed->lfn_offset = loc->lfn_offset;
+  memcpy(indexed->ext, entry->ext, sizeof(indexed->ext));
+  build->entry_count++;
+  return 0;
+}
+
+// Reads one directory from the volume: its chain and its entries
+static int read_dir(FILE* disk, IndexBuild_t* build, IndexDir_t* dir) {
+
+  uint16_t sector_size = pindex.boot_sec->BPB_BytsPerSec;
+  uint32_t cluster = dir->cluster;
+  while (cluster >= 2 && cluster < pindex.cluster_count && dir->chain_len < pindex.cluster_count) {
+
+    if (grow((void**)&build->chains, &build->chain_cap, build->chain_count + 1,
+             sizeof(uint32_t)) != 0) {
+
+      return 1;
+    }
+    build->chains[build->chain_count++] = cluster;
+    dir->chain_len++;
+    cluster = get_next_cluster(disk, cluster, sector_size, pindex.boot_sec->BPB_RsvdSecCnt);
+  }
+  build->parent = dir->cluster;
+  return walk_dir(disk, pindex.boot_sec, dir->cluster, build_entry, build) != 0 ||
+         build->failed;
+}
+
+// Copies a directory unchanged since the mapped index was saved
+static int reuse_dir(IndexBuild_t* build, IndexDir_t* dir, const IndexDir_t* old) {
+
+  if (grow((void**)&build->chains, &build->chain_cap, build->chain_count + old->chain_len,
+           sizeof(uint32_t)) != 0 ||
+      grow((void**)&build->entries, &build->entry_cap, build->entry_count + old->entry_count,
+           sizeof(IndexEntry_t)) != 0) {
+
+    return 1;
+  }
+  memcpy(build->chains + build->chain_count, pindex.chains + old->first_chain,
+         old->chain_len * sizeof(uint32_t));
+  build->chain_count += old->chain_len;
+  dir->chain_len = old->chain_len;
+  for (uint32_t i = 0; i < old->entry_count; i++) {
+
+    const IndexEntry_t* entry = &pindex.entries[old->first_entry + i];
+    IndexEntry_t* copy = &build->entries[build->entry_count];
+    if (!entry_sane(entry)) {
+
+      return 1;
+    }
+    uint32_t name_off;
+    if (add_name(build, pindex.names + entry->name_off, entry->name_len, &name_off) != 0) {
+
+      return 1;
+    }
+    *copy = *entry;
+    copy->name_off = name_off;
+    build->entry_count++;
+  }
+  return 0;
+}
+
+// Walks the tree from the root breadth first. Directories the session left
+// alone come from the mapped index; the rest are read from the volume.
+static int collect(FILE* disk, IndexBuild_t* build) {
+
+  uint8_t* seen = calloc(((size_t)pindex.cluster_count + 7) / 8, 1);
+  if (!seen || grow((void**)&build->dirs, &build->dir_cap, 1, sizeof(IndexDir_t)) != 0) {
+
+    free(seen);
+    return 1;
+  }
+  uint32_t root = pindex.boot_sec->BPB_RootClus;
+  memset(&build->dirs[0], 0, sizeof(IndexDir_t));
+  build->dirs[0].cluster = root;
+  build->dir_count = 1;
+  if (root < pindex.cluster_count) {
+
+    seen[root / 8] |= 1 << (root % 8);
+  }
+
+  int failed = 0;
+  for (size_t d = 0; d < build->dir_count && !failed; d++) {
+
+    IndexDir_t* dir = &build->dirs[d];
+    dir->first_entry = build->entry_count;
+    dir->first_chain = build->chain_count;
+    dir->chain_len = 0;
+    int64_t old = dir_of(dir->cluster);
+    if (old >= 0 && !pindex.dir_dirty[old] && dir_sane(&pindex.dirs[old])) {
+
+      failed = reuse_dir(build, dir, &pindex.dirs[old]);
+    } else {
+
+      failed = read_dir(disk, build, dir);
+    }
+    dir->entry_count = build->entry_count - dir->first_entry;
+
+    for (size_t i = dir->first_entry; i < build->entry_count && !failed; i++) {
+
+      const IndexEntry_t* entry = &build->entries[i];
+      const char* name = build->names + entry->name_off;
+      uint32_t cluster = entry->cluster;
+      if (!(entry->attr & ATTR_DIRECTORY) || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+          cluster < 2 || cluster >= pindex.cluster_count ||
+          (seen[cluster / 8] & (1 << (cluster % 8)))) {
+
+        continue;
+      }
+      seen[cluster / 8] |= 1 << (cluster % 8);
+      if (grow((void**)&build->dirs, &build->dir_cap, build->dir_count + 1,
+               sizeof(IndexDir_t)) != 0) {
+
+        failed = 1;
+        break;
+      }
+      memset(&build->dirs[build->dir_count], 0, sizeof(IndexDir_t));
+      build->dirs[build->dir_count++].cluster = cluster;
+    }
+  }
+  free(seen);
+  return failed || build->entry_count > UINT32_MAX || build->chain_count > UINT32_MAX;
+}
+
+// Free clusters per summary block; blocks whose FAT the session did not write
+// keep their mapped count
+static int count_free(FILE* disk, uint32_t* blocks, uint32_t count) {
+
+  uint16_t sector_size = pindex.boot_sec->BPB_BytsPerSec;
+  uint32_t per_block = clusters_per_block();
+  uint32_t* fat = malloc((size_t)PATH_INDEX_BLOCK_SECTORS * sector_size);
+  if (!fat) {
+
+    return 1;
+  }
+  for (uint32_t b = 0; b < count; b++) {
+
+    if (pindex.map && !pindex.block_dirty[b]) {
+
+      blocks[b] = pindex.blocks[b];
+      continue;
+    }
+    uint64_t first = (uint64_t)b * per_block;
+    uint64_t end = first + per_block;
+    end = (end > pindex.cluster_count) ? pindex.cluster_count : end;
+    uint32_t sectors = ((end - first) * FAT_ELEM_SIZE + sector_size - 1) / sector_size;
+    read_sectors(disk, pindex.boot_sec->BPB_RsvdSecCnt + b * PATH_INDEX_BLOCK_SECTORS, sectors,
+                 (uint8_t*)fat, sector_size);
+    blocks[b] = 0;
+    for (uint64_t cluster = (first < 2) ? 2 : first; cluster < end; cluster++) {
+
+      blocks[b] += (fat[cluster - first] & 0x0FFFFFFF) == 0;
+    }
+  }
+  free(fat);
+  return 0;
+}
+
+static uint32_t slot_capacity(size_t count) {
+
+  uint32_t capacity = 64;
+  while (capacity < count * 2) {
+
+    capacity *= 2;
+  }
+  return capacity;
+}
+
+static int write_section(int fd, const void* data, uint64_t size, uint64_t offset) {
+
+  const uint8_t* bytes = data;
+  while (size > 0) {
+
+    ssize_t done = pwrite(fd, bytes, size, offset);
+    if (done <= 0) {
+
+      return 1;
+    }
+    bytes += done;
+    size -= done;
+    offset += done;
+  }
+  return 0;
+}
+
+// Writes the collected index to <path>.tmp and renames it over the old one,
+// so readers only ever map a complete file
+static int save_index(FILE* disk, const IndexBuild_t* build, const uint32_t* blocks,
+                      uint64_t generation) {
+
+  ImageStamp_t stamp;
+  if (image_stamp(disk, pindex.boot_sec, &stamp) != 0) {
+
+    return 1;
+  }
+  PathIndexHeader_t header = {PATH_INDEX_MAGIC,
+                              PATH_INDEX_VERSION,
+                              0,
+                              pindex.cluster_size,
+                              pindex.cluster_count,
+                              generation,
+                              stamp,
+                              build->entry_count,
+                              slot_capacity(build->entry_count),
+                              build->dir_count,
+                              build->chain_count,
+                              slot_capacity(build->chain_count),
+                              block_count(),
+                              build->names_size};
+  uint32_t* entry_slots = calloc(header.entry_slots, sizeof(uint32_t));
+  IndexOwner_t* owners = calloc(header.owner_slots, sizeof(IndexOwner_t));
+  if (!entry_slots || !owners) {
+
+    free(entry_slots);
+    free(owners);
+    return 1;
+  }
+  uint32_t mask = header.entry_slots - 1;
+  for (uint32_t i = 0; i < header.entry_count; i++) {
+
+    uint32_t slot = entry_home(build->entries[i].parent, build->entries[i].hash, mask);
+    while (entry_slots[slot] != 0) {
+
+      slot = (slot + 1) & mask;
+    }
+    entry_slots[slot] = i + 1;
+  }
+  // a cluster claimed by two chains keeps its first owner
+  mask = header.owner_slots - 1;
+  for (uint32_t d = 0; d < header.dir_count; d++) {
+
+    const IndexDir_t* dir = &build->dirs[d];
+    for (uint32_t c = dir->first_chain; c < dir->first_chain + dir->chain_len; c++) {
+
+      uint32_t slot = owner_home(build->chains[c], mask);
+      while (owners[slot].dir != 0 && owners[slot].cluster != build->chains[c]) {
+
+        slot = (slot + 1) & mask;
+      }
+      if (owners[slot].dir == 0) {
+
+        owners[slot].cluster = build->chains[c];
+        owners[slot].dir = d + 1;
+      }
+    }
+  }
+
+  char tmp_path[PATH_INDEX_PATH_MAX + 4];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", pindex.path);
+  int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  IndexLayout_t at;
+  layout(&header, &at);
+  int failed =
+      fd < 0 || ftruncate(fd, at.total) != 0 ||
+      write_section(fd, &header, sizeof(header), 0) ||
+      write_section(fd, build->entries, (uint64_t)header.entry_count * sizeof(IndexEntry_t),
+                    at.entries) ||
+      write_section(fd, entry_slots, (uint64_t)header.entry_slots * sizeof(uint32_t),
+                    at.entry_slots) ||
+      write_section(fd, build->dirs, (uint64_t)header.dir_count * sizeof(IndexDir_t), at.dirs) ||
+      write_section(fd, build->chains, (uint64_t)header.chain_count * sizeof(uint32_t),
+                    at.chains) ||
+      write_section(fd, owners, (uint64_t)header.owner_slots * sizeof(IndexOwner_t), at.owners) ||
+      write_section(fd, blocks, (uint64_t)header.block_count * sizeof(uint32_t), at.blocks) ||
+      write_section(fd, build->names, header.names_size, at.names) || fdatasync(fd) != 0 ||
+      rename(tmp_path, pindex.path) != 0;
+  free(entry_slots);
+  free(owners);
+  if (failed) {
+
+    if (fd >= 0) {
+
+      close(fd);
+    }
+    unlink(tmp_path);
+    return 1;
+  }
+
+  // the new file replaces the mapping of the old one
+  unmap();
+  close(pindex.fd);
+  pindex.fd = fd;
+  return 0;
+}
+
+static void build_free(IndexBuild_t* build) {
+
+  free(build->entries);
+  free(build->dirs);
+  free(build->chains);
+  free(build->names);
+}
+
+// Brings the index up to date with the volume under a new generation
+static int refresh(FILE* disk) {
+
+  IndexBuild_t build;
+  memset(&build, 0, sizeof(build));
+  uint32_t count = block_count();
+  uint32_t* blocks = malloc(((size_t)count + 1) * sizeof(uint32_t));
+  uint64_t generation = pindex.generation + 1;
+  generation = (generation == 0) ? 1 : generation;
+  int failed = !blocks || collect(disk, &build) != 0 || count_free(disk, blocks, count) != 0 ||
+               save_index(disk, &build, blocks, generation) != 0;
+  build_free(&build);
+  free(blocks);
+  if (failed) {
+
+    return 1;
+  }
+  pindex.generation = generation;
+  pindex.written = 0;
+  return map_index(disk);
+}
+
+// Opens <disk_image>.idx, building it from the volume when it is missing or
+// the image changed since it was saved
+int path_index_open(FILE* disk, const char* disk_name, BootSec_t* boot_sec) {
+
+  snprintf(pindex.path, sizeof(pindex.path), "%s.idx", disk_name);
+  pindex.disk = disk;
+  pindex.boot_sec = boot_sec;
+  pindex.cluster_size = boot_sec->BPB_BytsPerSec * boot_sec->BPB_SecPerClus;
+  pindex.cluster_count = cluster_count(boot_sec);
+  pindex.fd = open(pindex.path, O_RDWR | O_CREAT, 0644);
+  if (pindex.fd < 0) {
+
+    fprintf(cmd_err(), "Failed to open path index %s\n", pindex.path);
+    return 1;
+  }
+  pindex.active = 1;
+
+  if (map_index(disk) != 0) {
+
+    if (refresh(disk) != 0) {
+
+      fprintf(cmd_err(), "Failed to build path index %s\n", pindex.path);
+      path_index_close(disk);
+      return 1;
+    }
+    fprintf(cmd_out(), "Built path index %s for %u entries\n", pindex.path,
+            pindex.header->entry_count);
+  }
+  return 0;
+}
+
+// Saves what the session changed; an index that cannot be refreshed keeps
+// the cleared generation and is rebuilt by the next open
+void path_index_close(FILE* disk) {
+
+  if (pindex.active && pindex.written && refresh(disk) != 0) {
+
+    fprintf(cmd_err(), "Failed to update path index %s\n", pindex.path);
+  }
+  unmap();
+  if (pindex.fd >= 0) {
+
+    close(pindex.fd);
+  }
+  pindex.fd = -1;
+  pindex.disk = NULL;
+  pindex.boot_sec = NULL;
+  pindex.active = 0;
+  pindex.written = 0;
+}
+
+static void mark_owner(uint32_t cluster) {
+
+  int64_t dir = owner_of(cluster);
+  if (dir >= 0) {
+
+    pindex.dir_dirty[dir] = 1;
+  }
+}
+
+// The first write clears the saved generation, so a session that dies before
+// its refresh leaves an index that is rebuilt. Later writes mark the
+// directories whose clusters or FAT entries they touch.
+void path_index_note_write(off_t offset, size_t size) {
+
+  if (!pindex.active || !pindex.map || size == 0) {
+
+    return;
+  }
+  if (!pindex.written) {
+
+    pindex.written = 1;
+    uint64_t none = 0;
+    if (pwrite(pindex.fd, &none, sizeof(none), offsetof(PathIndexHeader_t, generation)) !=
+        sizeof(none)) {
+
+      fprintf(cmd_err(), "Failed to retire path index %s\n", pindex.path);
+    }
+  }
+
+  const BootSec_t* boot_sec = pindex.boot_sec;
+  uint64_t sector_size = boot_sec->BPB_BytsPerSec;
+  uint64_t fat_start = (uint64_t)boot_sec->BPB_RsvdSecCnt * sector_size;
+  uint64_t fat_end = fat_start + (uint64_t)boot_sec->BPB_FATSz32 * sector_size;
+  uint64_t data_start = fat_start + (uint64_t)boot_sec->BPB_NumFATs * boot_sec->BPB_FATSz32 *
+                                        sector_size;
+  uint64_t start = offset;
+  uint64_t end = start + size;
+
+  if (start < fat_end && end > fat_start) {
+
+    uint64_t first = ((start > fat_start) ? start : fat_start) - fat_start;
+    uint64_t last = ((end < fat_end) ? end : fat_end) - fat_start;
+    for (uint64_t sector = first / sector_size; sector * sector_size < last; sector++) {
+
+      if (sector / PATH_INDEX_BLOCK_SECTORS < pindex.header->block_count) {
+
+        pindex.block_dirty[sector / PATH_INDEX_BLOCK_SECTORS] = 1;
+      }
+    }
+    for (uint64_t cluster = first / FAT_ELEM_SIZE;
+         cluster * FAT_ELEM_SIZE < last && cluster < pindex.cluster_count; cluster++) {
+
+      mark_owner(cluster);
+    }
+  }
+  if (end > data_start) {
+
+    uint64_t from = ((start > data_start) ? start : data_start) - data_start;
+    uint64_t to = end - data_start;
+    for (uint64_t cluster = from / pindex.cluster_size + 2;
+         (cluster - 2) * pindex.cluster_size < to && cluster < pindex.cluster_count; cluster++) {
+
+      mark_owner(cluster);
+    }
+  }
+}
+
+// 1 with the entry when name is in directory parent, 0 when the index knows
+// it is not, -1 when the index cannot tell and the directory must be read
+int path_index_find(uint32_t parent, const char* name, EntrSt_t* entry, EntrLoc_t* loc) {
+
+  int64_t dir = pindex.active ? dir_of(parent) : -1;
+  if (dir < 0 || pindex.dir_dirty[dir] || pindex.header->entry_slots == 0) {
+
+    return -1;
+  }
+  uint32_t hash = utf8_casehash(name);
+  uint32_t mask = pindex.header->entry_slots - 1;
+  for (uint32_t slot = entry_home(parent, hash, mask), probes = 0; probes <= mask;
+       slot = (slot + 1) & mask, probes++) {
+
+    uint32_t index = pindex.entry_slots[slot];
+    if (index == 0) {
+
+      return 0;
+    }
+    if (index > pindex.header->entry_count || !entry_sane(&pindex.entries[index - 1])) {
+
+      return -1;
+    }
+    const IndexEntry_t* found = &pindex.entries[index - 1];
+    if (found->parent != parent || found->hash != hash ||
+        utf8_casecmp(pindex.names + found->name_off, name) != 0) {
+
+      continue;
+    }
+    memcpy(entry->name, pindex.names + found->name_off, found->name_len + 1);
+    entry->cluster = found->cluster;
+    entry->size = found->size;
+    entry->date = found->date;
+    entry->time = found->time;
+    entry->attr = found->attr;
+    memcpy(entry->ext, found->ext, sizeof(entry->ext));
+    loc->cluster = found->loc_cluster;
+    loc->offset = found->loc_offset;
+    loc->lfn_cluster = found->lfn_cluster;
+    loc->lfn_offset = found->lfn_offset;
+    loc->lfn_count = found->lfn_count;
+    return 1;
+  }
+  return -1;
+}
+
+// Clusters from cluster to the end of its summary block when the index knows
+// all of them are allocated, else 0
+uint32_t path_index_full_run(uint32_t cluster) {
+
+  if (!pindex.active || !pindex.map || cluster >= pindex.cluster_count) {
+
+    return 0;
+  }
+  uint32_t per_block = clusters_per_block();
+  uint32_t block = cluster / per_block;
+  if (block >= pindex.header->block_count || pindex.block_dirty[block] ||
+      pindex.blocks[block] != 0) {
+
+    return 0;
+  }
+  uint64_t end = (uint64_t)(block + 1) * per_block;
+  end = (end > pindex.cluster_count) ? pindex.cluster_count : end;
+  return end - cluster;
+}
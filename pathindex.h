@@ -0,0 +1,19 @@
+#ifndef PATHINDEX_H
+#define PATHINDEX_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "bootsec.h"
+#include "directory.h"
+
+#define PATH_INDEX_BLOCK_SECTORS 64 // FAT sectors per free-cluster summary block
+
+int path_index_open(FILE* disk, const char* disk_name, BootSec_t* boot_sec);
+void path_index_close(FILE* disk);
+void path_index_note_write(off_t offset, size_t size);
+int path_index_find(uint32_t parent, const char* name, EntrSt_t* entry, EntrLoc_t* loc);
+uint32_t path_index_full_run(uint32_t cluster);
+
+#endif // PATHINDEX_H
@@ -0,0 +1,606 @@
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bootsec.h"
+#include "directory.h"
+#include "fat.h"
+#include "journal.h"
+#include "shortname.h"
+#include "usage.h"
+#include "utility.h"
+
+#define POP_BATCH_CLUSTERS 64
+#define POP_FIXED_DATE ((40 << 9) | (1 << 5) | 1) // 2020-01-01, keeps images reproducible
+#define POP_MAX_LFN 120
+
+// Shape of the generated tree; every directory derives its own counts from a
+// per-directory seed, so the same parameters always produce the same image
+typedef struct {
+
+  uint64_t seed;
+  uint32_t depth;
+  uint32_t subdirs;
+  uint32_t files;
+  uint32_t lfn_percent;
+  uint32_t max_file_size;
+} PopParams_t;
+
+typedef struct {
+
+  uint64_t seed;
+  uint32_t depth;
+  uint32_t nsub;
+  uint32_t nfiles;
+} DirSpec_t;
+
+typedef struct {
+
+  char name[POP_MAX_LFN + 1];
+  char short_name[11];
+  uint8_t nt_res;
+  uint8_t is_lfn;
+  uint8_t is_dir;
+  uint32_t size;
+  uint64_t child_seed;
+} GenEntry_t;
+
+typedef struct {
+
+  FILE* disk;
+  BootSec_t* boot_sec;
+  PopParams_t params;
+  FatView_t fat;
+  uint32_t cluster_size;
+  uint32_t next_free;
+  uint32_t dirty_min;
+  uint32_t dirty_max;
+  uint64_t dirs_written;
+  uint64_t files_written;
+  int failed;
+} PopCtx_t;
+
+// Batches directory clusters and writes each contiguous run with one write
+typedef struct {
+
+  PopCtx_t* ctx;
+  uint8_t* buffer;
+  uint32_t clusters[POP_BATCH_CLUSTERS];
+  uint32_t used;   // clusters referenced by the buffer
+  uint32_t offset; // byte position inside the buffer
+  uint32_t next_cluster;
+} DirWriter_t;
+
+static const char* const syllables[] = {"ar", "ba", "co", "de", "el", "fo", "ga", "hi",
+                                        "in", "jo", "ka", "lu", "me", "no", "or", "pi",
+                                        "qu", "ra", "si", "to", "un", "ve", "wo", "xi",
+                                        "yo", "ze", "log", "dat", "rep", "sum", "img", "arc"};
+static const char* const extensions[] = {"txt", "dat", "log", "json", "html", "jpeg", "bin", ""};
+
+static uint64_t splitmix64(uint64_t* state) {
+
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+static uint64_t mix_seed(uint64_t seed, uint64_t value) {
+
+  uint64_t state = seed ^ (value * 0xD1B54A32D192ED03ULL);
+  return splitmix64(&state);
+}
+
+static void dir_spec(const PopParams_t* params, uint64_t seed, uint32_t depth, DirSpec_t* spec) {
+
+  uint64_t state = seed;
+  spec->seed = seed;
+  spec->depth = depth;
+  spec->nsub = (depth < params->depth) ? splitmix64(&state) % (2 * params->subdirs + 1) : 0;
+  spec->nfiles = splitmix64(&state) % (2 * params->files + 1);
+}
+
+static uint32_t file_size(const PopParams_t* params, uint64_t* state) {
+
+  uint32_t bucket = splitmix64(state) % 100;
+  uint64_t size;
+  if (bucket < 50) {
+
+    size = splitmix64(state) % 4096;
+  } else if (bucket < 85) {
+
+    size = 4096 + splitmix64(state) % (60 * 1024);
+  } else {
+
+    size = splitmix64(state) % ((uint64_t)params->max_file_size + 1);
+  }
+  return (size > params->max_file_size) ? params->max_file_size : (uint32_t)size;
+}
+
+static void gen_entry(const PopParams_t* params, const DirSpec_t* spec, uint32_t index,
+                      GenEntry_t* entry) {
+
+  uint64_t state = mix_seed(spec->seed, index + 1);
+  entry->is_dir = index < spec->nsub;
+  entry->is_lfn = (splitmix64(&state) % 100) < params->lfn_percent;
+  entry->size = entry->is_dir ? 0 : file_size(params, &state);
+  entry->child_seed = splitmix64(&state);
+
+  // short names encode the index, which keeps them unique inside the directory
+  char base[9];
+  snprintf(base, sizeof(base), "%c%07X", entry->is_lfn ? 'L' : (entry->is_dir ? 'D' : 'F'),
+           index & 0x0FFFFFFF);
+  memset(entry->short_name, ' ', 11);
+  memcpy(entry->short_name, base, 8);
+  entry->nt_res = 0;
+
+  if (entry->is_lfn) {
+
+    size_t len = 0;
+    uint32_t words = 1 + splitmix64(&state) % 4;
+    for (uint32_t w = 0; w < words && len < POP_MAX_LFN - 40; w++) {
+
+      uint32_t nsyl = 2 + splitmix64(&state) % 4;
+      for (uint32_t s = 0; s < nsyl; s++) {
+
+        const char* syl = syllables[splitmix64(&state) % (sizeof(syllables) / sizeof(*syllables))];
+        size_t syl_len = strlen(syl);
+        memcpy(entry->name + len, syl, syl_len);
+        len += syl_len;
+      }
+      entry->name[len++] = (w + 1 < words) ? " _-"[splitmix64(&state) % 3] : '-';
+    }
+    len += snprintf(entry->name + len, POP_MAX_LFN + 1 - len, "%u", index);
+    if (!entry->is_dir) {
+
+      const char* ext = extensions[splitmix64(&state) % (sizeof(extensions) / sizeof(*extensions))];
+      if (*ext) {
+
+        snprintf(entry->name + len, POP_MAX_LFN + 1 - len, ".%s", ext);
+      }
+    }
+  } else {
+
+    // plain 8.3 name stored upper case, shown lower case through DIR_NTRes
+    if (!entry->is_dir) {
+
+      memcpy(entry->short_name + 8, "DAT", 3);
+      entry->nt_res = NT_RES_LOWER_CASE_BASE | NT_RES_LOWER_CASE_EXT;
+    } else {
+
+      entry->nt_res = NT_RES_LOWER_CASE_BASE;
+    }
+    entry->name[0] = '\0';
+  }
+}
+
+static uint32_t entry_slots(const GenEntry_t* entry) {
+
+  return entry->is_lfn ? (strlen(entry->name) + 12) / 13 + 1 : 1;
+}
+
+static uint32_t clusters_for(uint64_t bytes, uint32_t cluster_size) {
+
+  return (bytes + cluster_size - 1) / cluster_size;
+}
+
+// Directory size in bytes, including "." and ".."
+static uint64_t dir_bytes(const PopParams_t* params, const DirSpec_t* spec) {
+
+  uint64_t slots = 2;
+  GenEntry_t entry;
+  for (uint32_t i = 0; i < spec->nsub + spec->nfiles; i++) {
+
+    gen_entry(params, spec, i, &entry);
+    slots += entry_slots(&entry);
+  }
+  return slots * sizeof(DIRStr_t);
+}
+
+// Clusters needed by the entries of a directory and everything below them
+static uint64_t plan_clusters(const PopParams_t* params, const DirSpec_t* spec,
+                              uint32_t cluster_size) {
+
+  uint64_t total = 0;
+  GenEntry_t entry;
+  for (uint32_t i = 0; i < spec->nsub + spec->nfiles; i++) {
+
+    gen_entry(params, spec, i, &entry);
+    if (entry.is_dir) {
+
+      DirSpec_t child;
+      dir_spec(params, entry.child_seed, spec->depth + 1, &child);
+      total += clusters_for(dir_bytes(params, &child), cluster_size);
+      total += plan_clusters(params, &child, cluster_size);
+    } else {
+
+      total += clusters_for(entry.size, cluster_size);
+    }
+  }
+  return total;
+}
+
+static void mark_dirty(PopCtx_t* ctx, uint32_t cluster) {
+
+  if (cluster < ctx->dirty_min) {
+
+    ctx->dirty_min = cluster;
+  }
+  if (cluster > ctx->dirty_max) {
+
+    ctx->dirty_max = cluster;
+  }
+}
+
+// Links count free clusters into a chain; consecutive free clusters are taken
+// in order, so chains are contiguous on a fresh image
+static uint32_t allocate_chain(PopCtx_t* ctx, uint32_t count, uint32_t prev) {
+
+  uint32_t first = 0;
+  while (count > 0) {
+
+    while (ctx->next_free < ctx->fat.count && ctx->fat.entries[ctx->next_free] != 0) {
+
+      ctx->next_free++;
+    }
+    if (ctx->next_free >= ctx->fat.count) {
+
+      ctx->failed = 1;
+      return 0;
+    }
+    uint32_t cluster = ctx->next_free++;
+    ctx->fat.entries[cluster] = 0x0FFFFFFF;
+    mark_dirty(ctx, cluster);
+    if (prev) {
+
+      ctx->fat.entries[prev] = cluster;
+      mark_dirty(ctx, prev);
+    }
+    if (!first) {
+
+      first = cluster;
+    }
+    prev = cluster;
+    count--;
+  }
+  return first;
+}
+
+static void writer_flush(DirWriter_t* writer) {
+
+  PopCtx_t* ctx = writer->ctx;
+  uint32_t start = 0;
+  while (start < writer->used) {
+
+    uint32_t run = 1;
+    while (start + run < writer->used &&
+           writer->clusters[start + run] == writer->clusters[start] + run) {
+
+      run++;
+    }
+    off_t offset = (off_t)first_sector_of_cluster(ctx->boot_sec, writer->clusters[start]) *
+                   ctx->boot_sec->BPB_BytsPerSec;
+    size_t size = (size_t)run * ctx->cluster_size;
+    const uint8_t* data = writer->buffer + (size_t)start * ctx->cluster_size;
+    if (journal_active()) {
+
+      // the log needs its own image of every sector
+      write_clusters(ctx->disk, ctx->boot_sec, writer->clusters[start], run, data);
+    } else if (image_pwrite(ctx->disk, data, size, offset) != (ssize_t)size) {
+
+      ctx->failed = 1;
+    }
+    start += run;
+  }
+  memset(writer->buffer, 0, (size_t)POP_BATCH_CLUSTERS * ctx->cluster_size);
+  writer->used = 0;
+  writer->offset = 0;
+}
+
+static void writer_put(DirWriter_t* writer, const void* slot) {
+
+  PopCtx_t* ctx = writer->ctx;
+  if (writer->offset == writer->used * ctx->cluster_size) {
+
+    if (writer->used == POP_BATCH_CLUSTERS) {
+
+      writer_flush(writer);
+    }
+    // the chain was sized up front, so running past its end is a planning bug
+    if (writer->next_cluster < 2 || writer->next_cluster >= EOC) {
+
+      ctx->failed = 1;
+      return;
+    }
+    writer->clusters[writer->used++] = writer->next_cluster;
+    writer->next_cluster = fat_view_next(&ctx->fat, writer->next_cluster);
+  }
+  memcpy(writer->buffer + writer->offset, slot, sizeof(DIRStr_t));
+  writer->offset += sizeof(DIRStr_t);
+}
+
+static void fill_dir_entry(DIRStr_t* dir_entry, const char* short_name, uint8_t nt_res,
+                           uint8_t attr, uint32_t cluster, uint32_t size) {
+
+  memset(dir_entry, 0, sizeof(DIRStr_t));
+  memcpy(dir_entry->DIR_Name, short_name, 11);
+  dir_entry->DIR_Attr = attr;
+  dir_entry->DIR_NTRes = nt_res;
+  dir_entry->DIR_FstClusLO = (uint16_t)(cluster & 0xFFFF);
+  dir_entry->DIR_FstClusHI = (uint16_t)((cluster >> 16) & 0xFFFF);
+  dir_entry->DIR_CrtDate = POP_FIXED_DATE;
+  dir_entry->DIR_WrtDate = POP_FIXED_DATE;
+  dir_entry->DIR_LstAccDate = POP_FIXED_DATE;
+  dir_entry->DIR_FileSize = size;
+}
+
+// Emits every entry of spec into writer, then descends into the subdirectories
+static void populate_dir(PopCtx_t* ctx, const DirSpec_t* spec, uint32_t dir_cluster,
+                         DirWriter_t* writer) {
+
+  uint32_t count = spec->nsub + spec->nfiles;
+  uint32_t* child_clusters = malloc((spec->nsub ? spec->nsub : 1) * sizeof(uint32_t));
+  if (!child_clusters) {
+
+    ctx->failed = 1;
+    return;
+  }
+
+  uint8_t lfn_slots[MAX_LFN_ENTRIES * sizeof(LFNStr_t)];
+  GenEntry_t entry;
+  DIRStr_t dir_entry;
+  for (uint32_t i = 0; i < count && !ctx->failed; i++) {
+
+    gen_entry(&ctx->params, spec, i, &entry);
+    uint32_t cluster = 0;
+    if (entry.is_dir) {
+
+      DirSpec_t child;
+      dir_spec(&ctx->params, entry.child_seed, spec->depth + 1, &child);
+      uint32_t clusters = clusters_for(dir_bytes(&ctx->params, &child), ctx->cluster_size);
+      cluster = allocate_chain(ctx, clusters, 0);
+      child_clusters[i] = cluster;
+      ctx->dirs_written++;
+
+      // the usage table keeps the name a directory walk reports
+      char short_dir[9];
+      for (int c = 0; c < 8; c++) {
+
+        short_dir[c] = tolower(entry.short_name[c]);
+      }
+      short_dir[8] = '\0';
+      usage_note_dir_added(dir_cluster, cluster, entry.is_lfn ? entry.name : short_dir, clusters);
+    } else {
+
+      uint32_t clusters = clusters_for(entry.size, ctx->cluster_size);
+      if (entry.size > 0) {
+
+        cluster = allocate_chain(ctx, clusters, 0);
+      }
+      ctx->files_written++;
+      usage_note_entry(dir_cluster, entry.size, clusters, 1);
+    }
+
+    if (entry.is_lfn) {
+
+      int lfn_count =
+          write_lfn_entries(entry.name, strlen(entry.name), lfn_slots, entry.short_name);
+      for (int j = 0; j < lfn_count; j++) {
+
+        writer_put(writer, lfn_slots + j * sizeof(LFNStr_t));
+      }
+    }
+    fill_dir_entry(&dir_entry, entry.short_name, entry.nt_res,
+                   entry.is_dir ? ATTR_DIRECTORY : ATTR_ARCHIVE, cluster, entry.size);
+    writer_put(writer, &dir_entry);
+  }
+  writer_flush(writer);
+
+  for (uint32_t i = 0; i < spec->nsub && !ctx->failed; i++) {
+
+    gen_entry(&ctx->params, spec, i, &entry);
+    DirSpec_t child;
+    dir_spec(&ctx->params, entry.child_seed, spec->depth + 1, &child);
+
+    DirWriter_t child_writer = {ctx, writer->buffer, {0}, 0, 0, child_clusters[i]};
+    fill_dir_entry(&dir_entry, ".          ", 0, ATTR_DIRECTORY, child_clusters[i], 0);
+    writer_put(&child_writer, &dir_entry);
+    fill_dir_entry(&dir_entry, "..         ", 0, ATTR_DIRECTORY, dir_cluster, 0);
+    writer_put(&child_writer, &dir_entry);
+    populate_dir(ctx, &child, child_clusters[i], &child_writer);
+  }
+  free(child_clusters);
+}
+
+typedef struct {
+
+  uint32_t count;
+  uint32_t parent;
+} TargetInfo_t;
+
+static int inspect_target(const EntrSt_t* entry, const DIRStr_t* raw, const EntrLoc_t* loc,
+                          void* ctx) {
+
+  (void)raw;
+  (void)loc;
+  TargetInfo_t* info = ctx;
+  if (strcmp(entry->name, "..") == 0) {
+
+    info->parent = entry->cluster;
+  } else if (strcmp(entry->name, ".") != 0) {
+
+    info->count++;
+  }
+  return 0;
+}
+
+static int parse_params(const char* args, PopParams_t* params) {
+
+  params->seed = 1;
+  params->depth = 3;
+  params->subdirs = 4;
+  params->files = 16;
+  params->lfn_percent = 50;
+  params->max_file_size = 64 * 1024;
+
+  while (*args) {
+
+    while (*args == ' ') {
+
+      args++;
+    }
+    if (*args == '\0') {
+
+      break;
+    }
+    if (args[0] != '-' || args[1] == '\0') {
+
+      return 1;
+    }
+    char opt = args[1];
+    char* end;
+    unsigned long long value = strtoull(args + 2, &end, 10);
+    if (end == args + 2) {
+
+      return 1;
+    }
+    switch (opt) {
+
+    case 's':
+      params->seed = value;
+      break;
+    case 'd':
+      params->depth = (uint32_t)value;
+      break;
+    case 'w':
+      params->subdirs = (uint32_t)value;
+      break;
+    case 'f':
+      params->files = (uint32_t)value;
+      break;
+    case 'l':
+      params->lfn_percent = (value > 100) ? 100 : (uint32_t)value;
+      break;
+    case 'm':
+      params->max_file_size = (uint32_t)value;
+      break;
+    default:
+      return 1;
+    }
+    args = end;
+  }
+  return 0;
+}
+
+void populate(FILE* disk, BootSec_t* boot_sec, const char* args, uint32_t current_clus) {
+
+  PopCtx_t ctx;
+  memset(&ctx, 0, sizeof(PopCtx_t));
+  if (parse_params(args, &ctx.params) != 0) {
+
+    fprintf(cmd_err(), "Usage: populate [-sSEED] [-dDEPTH] [-wSUBDIRS] [-fFILES] [-lLFN%%] "
+                    "[-mMAXSIZE]\n");
+    return;
+  }
+
+  TargetInfo_t target = {0, 0};
+  short_name_cache_invalidate(); // entries are written behind the cache's back
+  if (walk_dir(disk, boot_sec, current_clus, inspect_target, &target) != 0) {
+
+    fprintf(cmd_err(), "populate: failed to read the current directory\n");
+    return;
+  }
+  if (target.count > 0) {
+
+    fprintf(cmd_err(), "populate: current directory is not empty\n");
+    return;
+  }
+
+  ctx.disk = disk;
+  ctx.boot_sec = boot_sec;
+  ctx.cluster_size = boot_sec->BPB_BytsPerSec * boot_sec->BPB_SecPerClus;
+  ctx.next_free = 2;
+  ctx.dirty_min = UINT32_MAX;
+  if (fat_view_load(disk, boot_sec, &ctx.fat) != 0) {
+
+    return;
+  }
+
+  DirSpec_t spec;
+  dir_spec(&ctx.params, mix_seed(ctx.params.seed, 0), 0, &spec);
+
+  // size the whole tree first so a too-small image fails before anything is written
+  uint32_t start = (current_clus == boot_sec->BPB_RootClus) ? 0 : 2;
+  uint64_t own_bytes = dir_bytes(&ctx.params, &spec) - (2 - start) * sizeof(DIRStr_t);
+  uint32_t own_clusters = clusters_for(own_bytes, ctx.cluster_size);
+  uint32_t have_clusters = fat_view_chain_length(&ctx.fat, current_clus);
+  uint64_t needed = plan_clusters(&ctx.params, &spec, ctx.cluster_size);
+  needed += (own_clusters > have_clusters) ? own_clusters - have_clusters : 0;
+
+  uint64_t free_clusters = 0;
+  for (uint32_t i = 2; i < ctx.fat.count; i++) {
+
+    free_clusters += (ctx.fat.entries[i] & 0x0FFFFFFF) == 0;
+  }
+  if (needed > free_clusters) {
+
+    fprintf(cmd_err(), "populate: needs %llu clusters, only %llu free\n",
+            (unsigned long long)needed, (unsigned long long)free_clusters);
+    fat_view_free(&ctx.fat);
+    return;
+  }
+
+  uint8_t* buffer = calloc(POP_BATCH_CLUSTERS, ctx.cluster_size);
+  if (!buffer) {
+
+    fprintf(cmd_err(), "Memory allocation failed\n");
+    fat_view_free(&ctx.fat);
+    return;
+  }
+
+  if (own_clusters > have_clusters) {
+
+    uint32_t last = current_clus;
+    while (fat_view_next(&ctx.fat, last) >= 2 && fat_view_next(&ctx.fat, last) < EOC) {
+
+      last = fat_view_next(&ctx.fat, last);
+    }
+    allocate_chain(&ctx, own_clusters - have_clusters, last);
+    usage_note_entry(current_clus, 0, own_clusters - have_clusters, 0);
+  }
+
+  // keep "." and ".." of the target by starting from its current first cluster
+  DirWriter_t writer = {&ctx, buffer, {0}, 0, 0, current_clus};
+  if (start > 0) {
+
+    DIRStr_t dot[2];
+    uint32_t sector = first_sector_of_cluster(boot_sec, current_clus);
+    if (image_pread(ctx.disk, dot, sizeof(dot), (off_t)sector * boot_sec->BPB_BytsPerSec) !=
+        (ssize_t)sizeof(dot)) {
+
+      ctx.failed = 1;
+    }
+    journal_read_range(sector, (uint8_t*)dot, sizeof(dot), boot_sec->BPB_BytsPerSec);
+    writer_put(&writer, &dot[0]);
+    writer_put(&writer, &dot[1]);
+  }
+  populate_dir(&ctx, &spec, current_clus, &writer);
+
+  if (ctx.failed || (ctx.dirty_min <= ctx.dirty_max &&
+                     fat_view_write_range(&ctx.fat, disk, boot_sec, ctx.dirty_min,
+                                          ctx.dirty_max) != 0)) {
+
+    fprintf(cmd_err(), "populate: failed to write the generated tree\n");
+    usage_invalidate(); // some of the noted directories never made it to disk
+  } else {
+
+    fprintf(cmd_out(), "Populated %llu directories and %llu files\n",
+            (unsigned long long)ctx.dirs_written, (unsigned long long)ctx.files_written);
+  }
+
+  free(buffer);
+  fat_view_free(&ctx.fat);
+}
@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "directory.h"
+#include "fat.h"
+#include "prefetch.h"
+#include "utility.h"
+
+// A directory cluster warmed by the prefetch thread, with its FAT successor
+typedef struct {
+
+  uint32_t cluster; // 0 marks an empty slot
+  uint32_t next;
+  uint8_t* data;
+} PrefetchCluster_t;
+
+// Directories still to visit, in breadth-first order
+typedef struct {
+
+  uint32_t* clusters;
+  uint32_t head;
+  uint32_t count;
+  uint32_t capacity;
+} PrefetchQueue_t;
+
+// The thread touches the image only during its turns, and a turn never
+// overlaps a foreground command: a command holds the thread off and waits for
+// a turn in progress to end. Both caches are guarded by lock.
+static struct {
+
+  int active;
+  FILE* disk;
+  BootSec_t* boot_sec;
+  uint32_t cluster_size;
+  uint32_t cluster_count;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint32_t holds;  // foreground commands in progress
+  uint8_t in_turn; // the thread is reading the image
+  uint8_t stop;
+  PrefetchCluster_t* slots; // open addressing by cluster number
+  uint32_t slot_mask;
+  uint32_t cached;
+  uint32_t max_cached;
+  uint32_t* fat; // head of the first FAT, up to PREFETCH_FAT_MAX_BYTES
+  uint32_t fat_count;
+  uint8_t* fat_loaded; // one flag per FAT sector
+  uint32_t fat_sectors;
+} prefetch = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+static uint32_t slot_home(uint32_t cluster) {
+
+  return (cluster * 2654435761u) & prefetch.slot_mask;
+}
+
+// The slot holding cluster, or the empty slot where it would go
+static uint32_t slot_find(uint32_t cluster) {
+
+  uint32_t slot = slot_home(cluster);
+  while (prefetch.slots[slot].cluster != 0 && prefetch.slots[slot].cluster != cluster) {
+
+    slot = (slot + 1) & prefetch.slot_mask;
+  }
+  return slot;
+}
+
+// Forgets cluster, pulling later members of its probe run back so every
+// remaining cluster is still reachable from its home slot
+static void slot_drop(uint32_t cluster) {
+
+  uint32_t mask = prefetch.slot_mask;
+  uint32_t hole = slot_find(cluster);
+  if (prefetch.slots[hole].cluster == 0) {
+
+    return;
+  }
+  free(prefetch.slots[hole].data);
+  prefetch.cached--;
+  for (uint32_t next = (hole + 1) & mask; prefetch.slots[next].cluster != 0;
+       next = (next + 1) & mask) {
+
+    uint32_t home = slot_home(prefetch.slots[next].cluster);
+    if (((next - home) & mask) >= ((next - hole) & mask)) {
+
+      prefetch.slots[hole] = prefetch.slots[next];
+      hole = next;
+    }
+  }
+  memset(&prefetch.slots[hole], 0, sizeof(PrefetchCluster_t));
+}
+
+static void slots_clear(void) {
+
+  for (uint32_t i = 0; i <= prefetch.slot_mask; i++) {
+
+    free(prefetch.slots[i].data);
+  }
+  memset(prefetch.slots, 0, ((size_t)prefetch.slot_mask + 1) * sizeof(PrefetchCluster_t));
+  prefetch.cached = 0;
+}
+
+// Waits until no command runs, then claims the image. Returns 0 when the
+// thread is asked to stop instead.
+static int turn_begin(void) {
+
+  pthread_mutex_lock(&prefetch.lock);
+  while (prefetch.holds > 0 && !prefetch.stop) {
+
+    pthread_cond_wait(&prefetch.cond, &prefetch.lock);
+  }
+  int go = !prefetch.stop;
+  prefetch.in_turn = go;
+  pthread_mutex_unlock(&prefetch.lock);
+  return go;
+}
+
+static void turn_end(void) {
+
+  pthread_mutex_lock(&prefetch.lock);
+  prefetch.in_turn = 0;
+  pthread_cond_broadcast(&prefetch.cond);
+  pthread_mutex_unlock(&prefetch.lock);
+}
+
+// Reads the batch of FAT sectors holding sector; called during a turn
+static void load_fat(uint32_t sector) {
+
+  uint16_t sector_size = prefetch.boot_sec->BPB_BytsPerSec;
+  uint32_t first = sector - sector % PREFETCH_FAT_BATCH;
+  uint32_t count = prefetch.fat_sectors - first;
+  count = (count < PREFETCH_FAT_BATCH) ? count : PREFETCH_FAT_BATCH;
+  uint8_t* buffer = malloc((size_t)count * sector_size);
+  if (!buffer) {
+
+    return;
+  }
+  read_sectors(prefetch.disk, prefetch.boot_sec->BPB_RsvdSecCnt + first, count, buffer,
+               sector_size);
+
+  pthread_mutex_lock(&prefetch.lock);
+  for (uint32_t i = 0; i < count; i++) {
+
+    if (!prefetch.fat_loaded[first + i]) {
+
+      memcpy((uint8_t*)prefetch.fat + (size_t)(first + i) * sector_size,
+             buffer + (size_t)i * sector_size, sector_size);
+      prefetch.fat_loaded[first + i] = 1;
+    }
+  }
+  pthread_mutex_unlock(&prefetch.lock);
+  free(buffer);
+}
+
+// Successor of cluster, from the FAT cache when it covers it; called during a turn
+static uint32_t warm_next(uint32_t cluster) {
+
+  uint16_t sector_size = prefetch.boot_sec->BPB_BytsPerSec;
+  uint32_t sector = cluster * FAT_ELEM_SIZE / sector_size;
+  if (cluster < prefetch.fat_count && !prefetch.fat_loaded[sector]) {
+
+    load_fat(sector);
+  }
+  // get_next_cluster answers from the FAT cache once the sector is in
+  return get_next_cluster(prefetch.disk, cluster, sector_size, prefetch.boot_sec->BPB_RsvdSecCnt);
+}
+
+static int queue_push(PrefetchQueue_t* queue, uint32_t cluster) {
+
+  if (queue->count == queue->capacity) {
+
+    uint32_t capacity = queue->capacity ? queue->capacity * 2 : 256;
+    uint32_t* grown = realloc(queue->clusters, capacity * sizeof(uint32_t));
+    if (!grown) {
+
+      return 1;
+    }
+    queue->clusters = grown;
+    queue->capacity = capacity;
+  }
+  queue->clusters[queue->count++] = cluster;
+  return 0;
+}
+
+static int queue_subdir(const EntrSt_t* entry, const DIRStr_t* raw, const EntrLoc_t* loc,
+                        void* ctx) {
+
+  (void)raw;
+  (void)loc;
+  if (!(entry->attr & ATTR_DIRECTORY) || entry->cluster < 2 || strcmp(entry->name, ".") == 0 ||
+      strcmp(entry->name, "..") == 0) {
+
+    return 0;
+  }
+  return queue_push(ctx, entry->cluster);
+}
+
+// Reads one directory cluster into buffer and keeps a copy. Returns 1 when
+// it did, 0 when the cluster was cached already and -1 when the cache is full
+// or the thread has to stop.
+static int warm_cluster(uint32_t cluster, uint8_t* buffer, uint32_t* next) {
+
+  if (!turn_begin()) {
+
+    return -1;
+  }
+  pthread_mutex_lock(&prefetch.lock);
+  int result = 1;
+  if (prefetch.cached >= prefetch.max_cached) {
+
+    result = -1;
+  } else if (prefetch.slots[slot_find(cluster)].cluster != 0) {
+
+    result = 0;
+  }
+  pthread_mutex_unlock(&prefetch.lock);
+  uint8_t* copy = (result == 1) ? malloc(prefetch.cluster_size) : NULL;
+  if (copy) {
+
+    *next = warm_next(cluster);
+    read_clusters(prefetch.disk, prefetch.boot_sec, cluster, 1, buffer);
+    memcpy(copy, buffer, prefetch.cluster_size);
+
+    pthread_mutex_lock(&prefetch.lock);
+    prefetch.slots[slot_find(cluster)] = (PrefetchCluster_t){cluster, *next, copy};
+    prefetch.cached++;
+    pthread_mutex_unlock(&prefetch.lock);
+  } else if (result == 1) {
+
+    result = -1;
+  }
+  turn_end();
+  return result;
+}
+
+// Breadth first from the root: every directory cluster and the FAT sectors
+// describing it, then the rest of the FAT
+static void* prefetch_worker(void* arg) {
+
+  (void)arg;
+  struct sched_param param = {0};
+  pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+  PrefetchQueue_t queue = {NULL, 0, 0, 0};
+  uint8_t* buffer = malloc(prefetch.cluster_size);
+  int going = buffer && queue_push(&queue, prefetch.boot_sec->BPB_RootClus) == 0;
+
+  // a cluster limit keeps a cross-linked tree from looping
+  uint32_t budget = prefetch.cluster_count;
+  while (going && queue.head < queue.count) {
+
+    uint32_t cluster = queue.clusters[queue.head++];
+    DirParser_t parser;
+    dir_parser_init(&parser);
+    while (cluster >= 2 && cluster < EOC && budget > 0) {
+
+      uint32_t next;
+      budget--;
+      int warmed = warm_cluster(cluster, buffer, &next);
+      if (warmed <= 0) {
+
+        going = warmed == 0; // a directory seen before is skipped, not the walk
+        break;
+      }
+      if (parse_dir_cluster(&parser, buffer, prefetch.cluster_size, cluster, queue_subdir,
+                            &queue) != 0) {
+
+        going = 0;
+        break;
+      }
+      cluster = next;
+    }
+  }
+
+  for (uint32_t sector = 0; sector < prefetch.fat_sectors; sector += PREFETCH_FAT_BATCH) {
+
+    if (!turn_begin()) {
+
+      break;
+    }
+    load_fat(sector);
+    turn_end();
+  }
+  free(queue.clusters);
+  free(buffer);
+  return NULL;
+}
+
+// Starts warming the caches in the background; foreground commands must be
+// bracketed with prefetch_hold and prefetch_release from now on
+int prefetch_start(FILE* disk, BootSec_t* boot_sec) {
+
+  uint16_t sector_size = boot_sec->BPB_BytsPerSec;
+  prefetch.disk = disk;
+  prefetch.boot_sec = boot_sec;
+  prefetch.cluster_size = sector_size * boot_sec->BPB_SecPerClus;
+  prefetch.cluster_count = cluster_count(boot_sec);
+  prefetch.max_cached = PREFETCH_MAX_BYTES / prefetch.cluster_size;
+  if (prefetch.max_cached > prefetch.cluster_count) {
+
+    prefetch.max_cached = prefetch.cluster_count;
+  }
+  uint32_t slot_count = 64;
+  while (slot_count < prefetch.max_cached * 2) {
+
+    slot_count *= 2;
+  }
+  prefetch.slot_mask = slot_count - 1;
+  prefetch.fat_count = PREFETCH_FAT_MAX_BYTES / FAT_ELEM_SIZE;
+  if (prefetch.fat_count > prefetch.cluster_count) {
+
+    prefetch.fat_count = prefetch.cluster_count;
+  }
+  prefetch.fat_sectors = (prefetch.fat_count * FAT_ELEM_SIZE + sector_size - 1) / sector_size;
+  prefetch.slots = calloc(slot_count, sizeof(PrefetchCluster_t));
+  prefetch.fat = malloc((size_t)prefetch.fat_sectors * sector_size);
+  prefetch.fat_loaded = calloc(prefetch.fat_sectors, 1);
+  prefetch.cached = 0;
+  prefetch.holds = 0;
+  prefetch.in_turn = 0;
+  prefetch.stop = 0;
+  prefetch.active = 1;
+  if (!prefetch.slots || !prefetch.fat || !prefetch.fat_loaded ||
+      pthread_create(&prefetch.thread, NULL, prefetch_worker, NULL) != 0) {
+
+    fprintf(cmd_err(), "Failed to start the prefetch thread\n");
+    prefetch.active = 0;
+    free(prefetch.slots);
+    free(prefetch.fat);
+    free(prefetch.fat_loaded);
+    return 1;
+  }
+  return 0;
+}
+
+void prefetch_stop(void) {
+
+  if (!prefetch.active) {
+
+    return;
+  }
+  pthread_mutex_lock(&prefetch.lock);
+  prefetch.stop = 1;
+  pthread_cond_broadcast(&prefetch.cond);
+  pthread_mutex_unlock(&prefetch.lock);
+  pthread_join(prefetch.thread, NULL);
+
+  slots_clear();
+  free(prefetch.slots);
+  free(prefetch.fat);
+  free(prefetch.fat_loaded);
+  prefetch.slots = NULL;
+  prefetch.fat = NULL;
+  prefetch.fat_loaded = NULL;
+  prefetch.active = 0;
+}
+
+// Keeps the thread off the image until the matching prefetch_release
+void prefetch_hold(void) {
+
+  if (!prefetch.active) {
+
+    return;
+  }
+  pthread_mutex_lock(&prefetch.lock);
+  prefetch.holds++;
+  while (prefetch.in_turn) {
+
+    pthread_cond_wait(&prefetch.cond, &prefetch.lock);
+  }
+  pthread_mutex_unlock(&prefetch.lock);
+}
+
+void prefetch_release(void) {
+
+  if (!prefetch.active) {
+
+    return;
+  }
+  pthread_mutex_lock(&prefetch.lock);
+  if (--prefetch.holds == 0) {
+
+    pthread_cond_broadcast(&prefetch.cond);
+  }
+  pthread_mutex_unlock(&prefetch.lock);
+}
+
+int prefetch_fat_entry(uint32_t cluster, uint32_t* value) {
+
+  if (!prefetch.active) {
+
+    return 0;
+  }
+  pthread_mutex_lock(&prefetch.lock);
+  uint32_t sector = cluster * FAT_ELEM_SIZE / prefetch.boot_sec->BPB_BytsPerSec;
+  int hit = cluster < prefetch.fat_count && prefetch.fat_loaded[sector];
+  if (hit) {
+
+    *value = prefetch.fat[cluster] & 0x0FFFFFFF;
+  }
+  pthread_mutex_unlock(&prefetch.lock);
+  return hit;
+}
+
+// Copies a warmed directory cluster into buffer and gives its successor
+int prefetch_dir_cluster(uint32_t cluster, uint8_t* buffer, uint32_t* next) {
+
+  if (!prefetch.active) {
+
+    return 0;
+  }
+  pthread_mutex_lock(&prefetch.lock);
+  const PrefetchCluster_t* slot = &prefetch.slots[slot_find(cluster)];
+  int hit = slot->cluster == cluster;
+  if (hit) {
+
+    memcpy(buffer, slot->data, prefetch.cluster_size);
+    *next = slot->next;
+  }
+  pthread_mutex_unlock(&prefetch.lock);
+  return hit;
+}
+
+// Every write to the image passes through here: FAT sectors it covers are
+// reloaded on demand, and so are directory clusters it covers or whose FAT
+// entry it covers
+void prefetch_note_write(off_t offset, size_t size) {
+
+  if (!prefetch.active || size == 0) {
+
+    return;
+  }
+  BootSec_t* boot_sec = prefetch.boot_sec;
+  uint16_t sector_size = boot_sec->BPB_BytsPerSec;
+  uint32_t per_sector = sector_size / FAT_ELEM_SIZE;
+  uint32_t fat_size = (boot_sec->BPB_FATSz16 == 0) ? boot_sec->BPB_FATSz32 : boot_sec->BPB_FATSz16;
+  off_t fat_start = (off_t)boot_sec->BPB_RsvdSecCnt * sector_size;
+  off_t fat_end = fat_start + (off_t)fat_size * sector_size;
+  off_t data_start = (off_t)first_sector_of_cluster(boot_sec, 2) * sector_size;
+  off_t end = offset + (off_t)size;
+
+  pthread_mutex_lock(&prefetch.lock);
+  if (offset < fat_end && end > fat_start) {
+
+    uint32_t first = ((offset > fat_start ? offset : fat_start) - fat_start) / sector_size;
+    uint32_t last = ((end < fat_end ? end : fat_end) - 1 - fat_start) / sector_size;
+    for (uint32_t sector = first; sector <= last; sector++) {
+
+      if (sector < prefetch.fat_sectors) {
+
+        prefetch.fat_loaded[sector] = 0;
+      }
+      for (uint32_t i = 0; i < per_sector && prefetch.cached > 0; i++) {
+
+        slot_drop(sector * per_sector + i);
+      }
+    }
+  }
+  if (end > data_start && prefetch.cached > 0) {
+
+    uint32_t first = 2 + ((offset > data_start ? offset : data_start) - data_start) /
+                             prefetch.cluster_size;
+    uint32_t last = 2 + (end - 1 - data_start) / prefetch.cluster_size;
+    if (last - first >= prefetch.max_cached) {
+
+      slots_clear();
+    }
+    for (uint32_t cluster = first; cluster <= last && prefetch.cached > 0; cluster++) {
+
+      slot_drop(cluster);
+    }
+  }
+  pthread_mutex_unlock(&prefetch.lock);
+}
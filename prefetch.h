@@ -0,0 +1,22 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "bootsec.h"
+
+#define PREFETCH_MAX_BYTES (256 * 1024 * 1024)    // directory clusters kept in memory
+#define PREFETCH_FAT_MAX_BYTES (64 * 1024 * 1024) // FAT bytes kept in memory
+#define PREFETCH_FAT_BATCH 64                     // FAT sectors read per turn
+
+int prefetch_start(FILE* disk, BootSec_t* boot_sec);
+void prefetch_stop(void);
+void prefetch_hold(void);
+void prefetch_release(void);
+int prefetch_fat_entry(uint32_t cluster, uint32_t* value);
+int prefetch_dir_cluster(uint32_t cluster, uint8_t* buffer, uint32_t* next);
+void prefetch_note_write(off_t offset, size_t size);
+
+#endif // PREFETCH_H
@@ -0,0 +1,135 @@
+#include <fcntl.h>
+
+#include "directory.h"
+#include "readahead.h"
+#include "utility.h"
+
+void readahead_init(Readahead_t* ra, int fd, const BootSec_t* boot_sec, chain_next_fn next,
+                    void* next_ctx) {
+
+  uint32_t cluster_size = boot_sec->BPB_BytsPerSec * boot_sec->BPB_SecPerClus;
+  ra->fd = fd;
+  ra->boot_sec = boot_sec;
+  ra->next = next;
+  ra->next_ctx = next_ctx;
+  ra->window = READAHEAD_MIN_CLUSTERS;
+  ra->max_window = READAHEAD_MAX_BYTES / cluster_size;
+  if (ra->max_window < READAHEAD_MIN_CLUSTERS) {
+
+    ra->max_window = READAHEAD_MIN_CLUSTERS;
+  }
+  if (ra->max_window > READAHEAD_RING) {
+
+    ra->max_window = READAHEAD_RING;
+  }
+  ra->head = 0;
+  ra->ahead = 0;
+  ra->last = 0;
+  ra->cursor = 0;
+  ra->end = EOC;
+  ra->at_end = 0;
+}
+
+static void advise_run(Readahead_t* ra, uint32_t first, uint32_t count) {
+
+  off_t cluster_size = (off_t)ra->boot_sec->BPB_BytsPerSec * ra->boot_sec->BPB_SecPerClus;
+  off_t offset = (off_t)first_sector_of_cluster(ra->boot_sec, first) * ra->boot_sec->BPB_BytsPerSec;
+  posix_fadvise(ra->fd, offset, count * cluster_size, POSIX_FADV_WILLNEED);
+}
+
+// Drops the prefetched clusters up to and including cluster; 1 when cluster
+// is not among them
+static int consume(Readahead_t* ra, uint32_t cluster) {
+
+  for (uint32_t i = 0; i < ra->ahead; i++) {
+
+    if (ra->ring[(ra->head + i) % READAHEAD_RING] == cluster) {
+
+      ra->head = (ra->head + i + 1) % READAHEAD_RING;
+      ra->ahead -= i + 1;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Called right before cluster is read synchronously. Once half of the
+// prefetched clusters are consumed, the chain is followed further and every
+// contiguous run of the next window is announced with a single hint.
+void readahead_step(Readahead_t* ra, uint32_t cluster) {
+
+  int prefetched = ra->ahead > 0;
+  if (prefetched && consume(ra, cluster) == 0) {
+
+    ra->last = cluster;
+    if (ra->at_end || ra->ahead > ra->window / 2) {
+
+      return;
+    }
+    if (ra->window < ra->max_window) {
+
+      ra->window *= 2; // the reader keeps going: trust the chain further
+    }
+  } else {
+
+    if (prefetched && ra->window / 2 >= READAHEAD_MIN_CLUSTERS) {
+
+      ra->window /= 2; // the reader left the chain it was warmed for
+    }
+    ra->head = 0;
+    ra->ahead = 0;
+    ra->last = cluster;
+    ra->cursor = cluster;
+    ra->at_end = 0;
+  }
+
+  uint32_t want = ra->window - ra->ahead;
+  uint32_t run_first = 0, run_count = 0;
+  uint32_t current = ra->cursor;
+  while (want > 0) {
+
+    current = ra->next(ra->next_ctx, current);
+    if (current < 2 || current >= EOC) {
+
+      ra->at_end = 1;
+      ra->end = current;
+      break;
+    }
+    if (run_count > 0 && current == run_first + run_count) {
+
+      run_count++;
+    } else {
+
+      if (run_count > 0) {
+
+        advise_run(ra, run_first, run_count);
+      }
+      run_first = current;
+      run_count = 1;
+    }
+    ra->ring[(ra->head + ra->ahead) % READAHEAD_RING] = current;
+    ra->cursor = current;
+    ra->ahead++;
+    want--;
+  }
+  if (run_count > 0) {
+
+    advise_run(ra, run_first, run_count);
+  }
+}
+
+// The cluster after cluster, which the reader stepped to last. It comes from
+// the clusters already looked up when there are any, so the chain is walked
+// once for both.
+uint32_t readahead_next(Readahead_t* ra, uint32_t cluster) {
+
+  if (cluster == ra->last && ra->ahead > 0) {
+
+    return ra->ring[ra->head];
+  }
+  if (cluster == ra->cursor && ra->at_end) {
+
+    return ra->end;
+  }
+  return ra->next(ra->next_ctx, cluster);
+}
@@ -0,0 +1,42 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <stdint.h>
+
+#include "bootsec.h"
+
+#define READAHEAD_MIN_CLUSTERS 2
+#define READAHEAD_MAX_BYTES (1024 * 1024)
+#define READAHEAD_RING 2048 // clusters looked up ahead at most: 1M of 512-byte clusters
+
+typedef uint32_t (*chain_next_fn)(void* ctx, uint32_t cluster);
+
+// Per-chain readahead state. The window starts small and doubles every time
+// the reader catches up with it, so short chains cost one hint and long
+// sequential walks end up prefetching a full READAHEAD_MAX_BYTES ahead. A
+// reader that goes somewhere else halves it again. The clusters looked up
+// ahead are kept, so the reader follows the chain through readahead_next
+// instead of looking each link up a second time.
+typedef struct {
+
+  int fd;
+  const BootSec_t* boot_sec;
+  chain_next_fn next;
+  void* next_ctx;
+  uint32_t window;
+  uint32_t max_window;
+  uint32_t ring[READAHEAD_RING]; // prefetched clusters, in chain order from head
+  uint32_t head;
+  uint32_t ahead;  // prefetched clusters not consumed yet
+  uint32_t last;   // cluster the reader stepped to last
+  uint32_t cursor; // last cluster handed to the kernel
+  uint32_t end;    // what follows cursor once at_end is set
+  uint8_t at_end;  // cursor reached the end of the chain
+} Readahead_t;
+
+void readahead_init(Readahead_t* ra, int fd, const BootSec_t* boot_sec, chain_next_fn next,
+                    void* next_ctx);
+void readahead_step(Readahead_t* ra, uint32_t cluster);
+uint32_t readahead_next(Readahead_t* ra, uint32_t cluster);
+
+#endif // READAHEAD_H
@@ -0,0 +1,245 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bootsec.h"
+#include "directory.h"
+#include "fat.h"
+#include "usage.h"
+#include "utility.h"
+
+#define RM_RECURSIVE 0x01
+#define RM_PUNCH 0x02 // -P or --punch: holes over the freed clusters
+#define RM_USAGE "Usage: rm [-r] [-P|--punch] <name>\n"
+#define RMDIR_USAGE "Usage: rmdir [-P|--punch] <name>\n"
+#define RM_MAX_DEPTH 256
+
+typedef struct {
+
+  uint32_t* clusters;
+  uint8_t* attrs;
+  uint32_t count;
+  uint32_t capacity;
+  int failed;
+} ChildList_t;
+
+static int collect_child(const EntrSt_t* entry, const DIRStr_t* raw, const EntrLoc_t* loc,
+                         void* ctx) {
+
+  (void)raw;
+  (void)loc;
+  ChildList_t* list = ctx;
+  if (strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) {
+
+    return 0;
+  }
+  if (list->count == list->capacity) {
+
+    uint32_t capacity = list->capacity ? list->capacity * 2 : 32;
+    uint32_t* clusters = realloc(list->clusters, capacity * sizeof(uint32_t));
+    if (clusters) {
+
+      list->clusters = clusters;
+    }
+    uint8_t* attrs = realloc(list->attrs, capacity);
+    if (attrs) {
+
+      list->attrs = attrs;
+    }
+    if (!clusters || !attrs) {
+
+      list->failed = 1;
+      return 1;
+    }
+    list->capacity = capacity;
+  }
+  list->clusters[list->count] = entry->cluster;
+  list->attrs[list->count] = entry->attr;
+  list->count++;
+  return 0;
+}
+
+// Queues the chains of everything below cluster; the directory's own chain is
+// left to the caller
+static int free_tree(FILE* disk, BootSec_t* boot_sec, FreeBatch_t* batch, uint32_t cluster,
+                     uint32_t depth) {
+
+  if (depth > RM_MAX_DEPTH) {
+
+    fprintf(cmd_err(), "rm: directory tree too deep\n");
+    return 1;
+  }
+
+  ChildList_t list = {NULL, NULL, 0, 0, 0};
+  int res = walk_dir(disk, boot_sec, cluster, collect_child, &list) != 0 || list.failed;
+  if (res) {
+
+    fprintf(cmd_err(), "rm: cannot read directory at cluster %u\n", cluster);
+  }
+  for (uint32_t i = 0; i < list.count && res == 0; i++) {
+
+    if ((list.attrs[i] & ATTR_DIRECTORY) && list.clusters[i] >= 2 && list.clusters[i] != cluster) {
+
+      res = free_tree(disk, boot_sec, batch, list.clusters[i], depth + 1);
+    }
+    if (res == 0) {
+
+      res = free_batch_add_chain(batch, disk, boot_sec, list.clusters[i]);
+    }
+  }
+  free(list.clusters);
+  free(list.attrs);
+  return res;
+}
+
+static int count_children(const EntrSt_t* entry, const DIRStr_t* raw, const EntrLoc_t* loc,
+                          void* ctx) {
+
+  (void)raw;
+  (void)loc;
+  if (strcmp(entry->name, ".") != 0 && strcmp(entry->name, "..") != 0) {
+
+    (*(uint32_t*)ctx)++;
+    return 1;
+  }
+  return 0;
+}
+
+// Returns where the name starts, or NULL after a usage message for a flag
+// that is not known
+static const char* parse_rm_flags(const char* args, uint8_t* flags, uint8_t dir_only) {
+
+  while (*args == ' ' || *args == '-') {
+
+    size_t len = strcspn(args, " ");
+    if (len == 7 && strncmp(args, "--punch", 7) == 0) {
+
+      *flags |= RM_PUNCH;
+      args += len;
+    } else if (*args == '-') {
+
+      for (args++; *args && *args != ' '; args++) {
+
+        if (*args == 'r' && !dir_only) {
+
+          *flags |= RM_RECURSIVE;
+        } else if (*args == 'P') {
+
+          *flags |= RM_PUNCH;
+        } else {
+
+          fprintf(cmd_err(), "%s: unknown option -%c\n%s", dir_only ? "rmdir" : "rm", *args,
+                  dir_only ? RMDIR_USAGE : RM_USAGE);
+          return NULL;
+        }
+      }
+    } else {
+
+      args++;
+    }
+  }
+  return args;
+}
+
+static void remove_common(FILE* disk, BootSec_t* boot_sec, const char* name, uint8_t flags,
+                          uint8_t dir_only, uint32_t current_clus) {
+
+  EntrSt_t entry;
+  EntrLoc_t loc;
+  if (*name == '\0') {
+
+    fprintf(cmd_err(), "%s: missing operand\n%s", dir_only ? "rmdir" : "rm",
+            dir_only ? RMDIR_USAGE : RM_USAGE);
+    return;
+  }
+  if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+
+    fprintf(cmd_err(), "rm: refusing to remove '%s'\n", name);
+    return;
+  }
+  int found = find_dir_entry(disk, boot_sec, current_clus, name, &entry, &loc);
+  if (found < 0) {
+
+    fprintf(cmd_err(), "rm: cannot remove '%s': Failed to read directory entries\n", name);
+    return;
+  }
+  if (!found) {
+
+    fprintf(cmd_err(), "rm: cannot remove '%s': No such file or directory\n", name);
+    return;
+  }
+
+  FreeBatch_t batch;
+  free_batch_init(&batch);
+
+  if (entry.attr & ATTR_DIRECTORY) {
+
+    if (dir_only) {
+
+      uint32_t children = 0;
+      if (walk_dir(disk, boot_sec, entry.cluster, count_children, &children) != 0) {
+
+        fprintf(cmd_err(), "rmdir: failed to remove '%s': Cannot read directory\n", name);
+        return;
+      }
+      if (children > 0) {
+
+        fprintf(cmd_err(), "rmdir: failed to remove '%s': Directory not empty\n", name);
+        return;
+      }
+    } else if (!(flags & RM_RECURSIVE)) {
+
+      fprintf(cmd_err(), "rm: cannot remove '%s': Is a directory\n", name);
+      return;
+    } else if (free_tree(disk, boot_sec, &batch, entry.cluster, 0) != 0) {
+
+      free_batch_release(&batch);
+      return;
+    }
+  } else if (dir_only) {
+
+    fprintf(cmd_err(), "rmdir: failed to remove '%s': Not a directory\n", name);
+    return;
+  }
+
+  if (free_batch_add_chain(&batch, disk, boot_sec, entry.cluster) != 0) {
+
+    free_batch_release(&batch);
+    return;
+  }
+
+  // unlink first: a crash between the two steps leaks clusters instead of
+  // leaving an entry that points at freed ones
+  dir_mark_deleted(disk, boot_sec, &loc);
+  if (entry.attr & ATTR_DIRECTORY) {
+
+    usage_note_dir_removed(current_clus, entry.cluster);
+  } else {
+
+    // the batch holds only this file's chain
+    usage_note_entry(current_clus, -(int64_t)entry.size, -(int64_t)batch.count, -1);
+  }
+  free_batch_flush(&batch, disk, boot_sec, flags & RM_PUNCH);
+  free_batch_release(&batch);
+}
+
+void remove_entry(FILE* disk, BootSec_t* boot_sec, const char* args, uint32_t current_clus) {
+
+  uint8_t flags = 0;
+  const char* name = parse_rm_flags(args, &flags, 0);
+  if (name) {
+
+    remove_common(disk, boot_sec, name, flags, 0, current_clus);
+  }
+}
+
+void remove_dir(FILE* disk, BootSec_t* boot_sec, const char* args, uint32_t current_clus) {
+
+  uint8_t flags = 0;
+  const char* name = parse_rm_flags(args, &flags, 1);
+  if (name) {
+
+    remove_common(disk, boot_sec, name, flags, 1, current_clus);
+  }
+}
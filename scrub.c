@@ -0,0 +1,76 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "bootsec.h"
+#include "crc32c.h"
+#include "fat.h"
+#include "integrity.h"
+#include "utility.h"
+#include "walk.h"
+
+#define SCRUB_LIST_MAX 20
+
+static double elapsed_since(const struct timespec* start) {
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Verifies every allocated cluster against the checksum table, or with -r
+// recomputes the table from the image as it is now
+void scrub(FILE* disk, BootSec_t* boot_sec, const char* args, uint32_t current_clus) {
+
+  (void)current_clus;
+  if (!integrity_active()) {
+
+    fprintf(cmd_err(), "No checksum table, open the image with -c\n");
+    return;
+  }
+  uint32_t nthreads = walk_parse_threads(&args);
+  uint8_t rebuild = 0;
+  if (strcmp(args, "-r") == 0) {
+
+    rebuild = 1;
+  } else if (*args != '\0') {
+
+    fprintf(cmd_err(), "Usage: scrub [-jN] [-r]\n");
+    return;
+  }
+
+  FatView_t fat = {NULL, 0};
+  if (!rebuild && fat_view_load(disk, boot_sec, &fat) != 0) {
+
+    return;
+  }
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  IntegrityReport_t report;
+  int failed = integrity_scan(disk, rebuild ? NULL : &fat, nthreads, rebuild, &report);
+  double seconds = elapsed_since(&start);
+  fat_view_free(&fat);
+  if (failed) {
+
+    return;
+  }
+
+  double mib = report.bytes / (1024.0 * 1024.0);
+  fprintf(cmd_out(), "%s %llu clusters (%.1f MiB) in %.3f s, %.0f MiB/s, %u threads, %s\n",
+          rebuild ? "Rebuilt checksums of" : "Scrubbed", (unsigned long long)report.clusters, mib,
+          seconds, seconds > 0 ? mib / seconds : 0.0, nthreads, crc32c_kernel());
+  for (uint32_t i = 0; i < report.mismatch_count && i < SCRUB_LIST_MAX; i++) {
+
+    fprintf(cmd_out(), "  checksum mismatch in cluster %u\n", report.mismatches[i]);
+  }
+  if (report.mismatch_count > SCRUB_LIST_MAX) {
+
+    fprintf(cmd_out(), "  ... %u more\n", report.mismatch_count - SCRUB_LIST_MAX);
+  }
+  if (!rebuild) {
+
+    fprintf(cmd_out(), "%u mismatches\n", report.mismatch_count);
+  }
+  integrity_report_free(&report);
+}
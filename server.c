@@ -0,0 +1,624 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "bootsec.h"
+#include "integrity.h"
+#include "journal.h"
+#include "prefetch.h"
+#include "trace.h"
+#include "usage.h"
+#include "utility.h"
+
+#define SERVER_LINE_MAX 1024
+#define SERVER_CWD_MAX 512
+#define SERVER_BACKLOG 64
+
+extern void handle_command(FILE* disk, const char* disk_name, BootSec_t* boot_sec,
+                           uint8_t* is_fat32, uint32_t* current_clus, char* cwd, char* command);
+extern uint32_t defrag_relocated(uint32_t cluster);
+
+// One client connection. Its requests run one at a time, in order; while one
+// is running the connection is "busy" and not polled.
+typedef struct {
+
+  int fd;
+  uint32_t id; // names the client in a recorded trace
+  uint8_t busy;
+  char cwd[SERVER_CWD_MAX];
+  uint32_t current_clus;
+  char buffer[SERVER_LINE_MAX];
+  size_t used;
+} Session_t;
+
+typedef struct ServerJob {
+
+  Session_t* session;
+  char* command;
+  struct ServerJob* next;
+} ServerJob_t;
+
+typedef struct {
+
+  FILE* disk;
+  const char* disk_name;
+  BootSec_t* boot_sec;
+  uint8_t is_fat32;
+  pthread_rwlock_t image_lock; // readers share it, anything that writes holds it alone
+  pthread_mutex_t queue_lock;
+  pthread_cond_t queue_ready;
+  ServerJob_t* head;
+  ServerJob_t* tail;
+  Session_t** sessions; // every connection; the poll loop adds and removes them
+  uint32_t session_count;
+  uint32_t session_capacity;
+  pthread_mutex_t session_lock; // held to change the set or reach into other sessions
+  int stopping;
+  int wake[2]; // workers hand finished sessions back to the poll loop through it
+} Server_t;
+
+static volatile sig_atomic_t stop_requested;
+static int stop_fd = -1;
+
+static void on_stop_signal(int sig) {
+
+  (void)sig;
+  Session_t* none = NULL;
+  stop_requested = 1;
+  if (write(stop_fd, &none, sizeof(none)) < 0) {
+
+    // the poll loop still sees stop_requested on its next wakeup
+  }
+}
+
+static int write_all(int fd, const void* data, size_t size) {
+
+  const uint8_t* bytes = data;
+  while (size > 0) {
+
+    ssize_t res = write(fd, bytes, size);
+    if (res < 0 && errno == EINTR) {
+
+      continue;
+    }
+    if (res <= 0) {
+
+      return 1;
+    }
+    bytes += res;
+    size -= res;
+  }
+  return 0;
+}
+
+static int word_is(const char* command, const char* word) {
+
+  size_t len = strlen(word);
+  return strncmp(command, word, len) == 0 && (command[len] == '\0' || command[len] == ' ');
+}
+
+// Commands that only read the image may run side by side
+static int is_read_only(const char* command) {
+
+  if (word_is(command, "scrub")) {
+
+    return strstr(command, "-r") == NULL;
+  }
+  if (word_is(command, "export-sparse")) {
+
+    return strstr(command, "-i") == NULL;
+  }
+  return word_is(command, "ls") || word_is(command, "cd") || word_is(command, "find") ||
+         word_is(command, "du") || word_is(command, "tree") || word_is(command, "cat") ||
+         word_is(command, "read") || word_is(command, "diff");
+}
+
+// Runs one request with its output captured, then answers with
+// "<length> <cwd>\n" followed by the output
+static void run_request(Server_t* server, Session_t* session, char* command) {
+
+  char* output = NULL;
+  size_t size = 0;
+  FILE* stream = open_memstream(&output, &size);
+  if (!stream) {
+
+    write_all(session->fd, "0 /\n", 4);
+    return;
+  }
+  cmd_set_output(stream, stream);
+  uint32_t errors = cmd_error_count();
+  // commands are tokenized in place, so the trace keeps the text as received
+  char recorded[SERVER_LINE_MAX];
+  snprintf(recorded, sizeof(recorded), "%s", command);
+  uint64_t start = trace_now();
+
+  if (word_is(command, "format")) {
+
+    fprintf(cmd_err(), "format is not available in server mode\n");
+  } else if (is_read_only(command)) {
+
+    pthread_rwlock_rdlock(&server->image_lock);
+    prefetch_hold();
+    handle_command(server->disk, server->disk_name, server->boot_sec, &server->is_fat32,
+                   &session->current_clus, session->cwd, command);
+    prefetch_release();
+    pthread_rwlock_unlock(&server->image_lock);
+  } else {
+
+    pthread_rwlock_wrlock(&server->image_lock);
+    prefetch_hold();
+    int compacting = word_is(command, "defrag");
+    handle_command(server->disk, server->disk_name, server->boot_sec, &server->is_fat32,
+                   &session->current_clus, session->cwd, command);
+    if (compacting) {
+
+      // directories may have moved under other clients; none of them is running
+      pthread_mutex_lock(&server->session_lock);
+      for (uint32_t i = 0; i < server->session_count; i++) {
+
+        Session_t* other = server->sessions[i];
+        other->current_clus = defrag_relocated(other->current_clus);
+      }
+      pthread_mutex_unlock(&server->session_lock);
+    }
+    usage_flush(server->disk);
+    integrity_flush(server->disk);
+    journal_commit(server->disk);
+    prefetch_release();
+    pthread_rwlock_unlock(&server->image_lock);
+  }
+
+  trace_command(session->id, recorded, start, trace_now(), cmd_error_count() != errors);
+  arena_reset();
+  cmd_set_output(NULL, NULL);
+  fclose(stream);
+  char header[SERVER_CWD_MAX + 32];
+  int len = snprintf(header, sizeof(header), "%zu %s\n", size, session->cwd);
+  if (write_all(session->fd, header, len) == 0) {
+
+    write_all(session->fd, output, size);
+  }
+  free(output);
+}
+
+static void* server_worker(void* arg) {
+
+  Server_t* server = arg;
+  while (1) {
+
+    pthread_mutex_lock(&server->queue_lock);
+    while (!server->head && !server->stopping) {
+
+      pthread_cond_wait(&server->queue_ready, &server->queue_lock);
+    }
+    ServerJob_t* job = server->head;
+    if (!job) {
+
+      pthread_mutex_unlock(&server->queue_lock);
+      break;
+    }
+    server->head = job->next;
+    if (!server->head) {
+
+      server->tail = NULL;
+    }
+    pthread_mutex_unlock(&server->queue_lock);
+
+    run_request(server, job->session, job->command);
+    write_all(server->wake[1], &job->session, sizeof(Session_t*));
+    free(job->command);
+    free(job);
+  }
+  arena_release();
+  return NULL;
+}
+
+static void close_session(Server_t* server, uint32_t index) {
+
+  pthread_mutex_lock(&server->session_lock);
+  Session_t* session = server->sessions[index];
+  server->sessions[index] = server->sessions[--server->session_count];
+  pthread_mutex_unlock(&server->session_lock);
+  close(session->fd);
+  free(session);
+}
+
+// Hands the next complete line of an idle session to the workers. Returns 1
+// when the session has to be closed.
+static int dispatch(Server_t* server, Session_t* session) {
+
+  char* newline = memchr(session->buffer, '\n', session->used);
+  if (!newline) {
+
+    return session->used == sizeof(session->buffer); // no room left for the end of the line
+  }
+  size_t len = newline - session->buffer;
+  char* command = strndup(session->buffer, len);
+  session->used -= len + 1;
+  memmove(session->buffer, newline + 1, session->used);
+  if (!command) {
+
+    return 1;
+  }
+  command[strcspn(command, "\r")] = '\0';
+  if (strcmp(command, "exit") == 0 || strcmp(command, "q") == 0) {
+
+    free(command);
+    return 1;
+  }
+
+  ServerJob_t* job = malloc(sizeof(ServerJob_t));
+  if (!job) {
+
+    free(command);
+    return 1;
+  }
+  *job = (ServerJob_t){session, command, NULL};
+  session->busy = 1;
+  pthread_mutex_lock(&server->queue_lock);
+  if (server->tail) {
+
+    server->tail->next = job;
+  } else {
+
+    server->head = job;
+  }
+  server->tail = job;
+  pthread_cond_signal(&server->queue_ready);
+  pthread_mutex_unlock(&server->queue_lock);
+  return 0;
+}
+
+static int open_listener(const char* socket_path) {
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+
+    fprintf(stderr, "Socket path too long: %s\n", socket_path);
+    return -1;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+
+    fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+    return -1;
+  }
+  unlink(socket_path); // left over from a server that did not shut down
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SERVER_BACKLOG) != 0) {
+
+    fprintf(stderr, "Failed to listen on %s: %s\n", socket_path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Serves the mounted image to local clients until SIGINT or SIGTERM. The
+// calling thread polls the connections; nthreads workers run the requests
+// against the one set of caches this process holds.
+int serve(FILE* disk, const char* disk_name, BootSec_t* boot_sec, uint8_t is_fat32,
+          const char* socket_path, uint32_t nthreads) {
+
+  Server_t server;
+  memset(&server, 0, sizeof(server));
+  server.disk = disk;
+  server.disk_name = disk_name;
+  server.boot_sec = boot_sec;
+  server.is_fat32 = is_fat32;
+  if (!is_fat32) {
+
+    fprintf(stderr, "The image has to be formatted before it can be served\n");
+    return 1;
+  }
+
+  int listen_fd = open_listener(socket_path);
+  if (listen_fd < 0) {
+
+    return 1;
+  }
+  if (pipe2(server.wake, O_CLOEXEC) != 0) {
+
+    close(listen_fd);
+    return 1;
+  }
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&server.image_lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+  pthread_mutex_init(&server.queue_lock, NULL);
+  pthread_cond_init(&server.queue_ready, NULL);
+  pthread_mutex_init(&server.session_lock, NULL);
+
+  stop_fd = server.wake[1];
+  signal(SIGPIPE, SIG_IGN); // a client that hangs up only loses its answer
+  signal(SIGINT, on_stop_signal);
+  signal(SIGTERM, on_stop_signal);
+
+  pthread_t* threads = calloc(nthreads, sizeof(pthread_t));
+  uint32_t started = 0;
+  while (threads && started < nthreads &&
+         pthread_create(&threads[started], NULL, server_worker, &server) == 0) {
+
+    started++;
+  }
+  printf("Serving %s on %s with %u threads\n", disk_name, socket_path, started);
+  fflush(stdout);
+
+  uint32_t session_ids = 0; // the prompt is session 0 in a trace
+  struct pollfd* fds = NULL;
+  Session_t** polled = NULL;
+  while (started > 0 && !stop_requested) {
+
+    // the listener, the wakeup pipe, then every session without a request in flight
+    uint32_t session_count = server.session_count;
+    struct pollfd* grown_fds = realloc(fds, (session_count + 2) * sizeof(struct pollfd));
+    Session_t** grown_polled = realloc(polled, (session_count + 2) * sizeof(Session_t*));
+    if (!grown_fds || !grown_polled) {
+
+      fds = grown_fds ? grown_fds : fds;
+      polled = grown_polled ? grown_polled : polled;
+      break;
+    }
+    fds = grown_fds;
+    polled = grown_polled;
+    fds[0] = (struct pollfd){listen_fd, POLLIN, 0};
+    fds[1] = (struct pollfd){server.wake[0], POLLIN, 0};
+    nfds_t nfds = 2;
+    for (uint32_t i = 0; i < session_count; i++) {
+
+      if (!server.sessions[i]->busy) {
+
+        polled[nfds] = server.sessions[i];
+        fds[nfds++] = (struct pollfd){server.sessions[i]->fd, POLLIN, 0};
+      }
+    }
+    if (poll(fds, nfds, -1) < 0) {
+
+      if (errno == EINTR) {
+
+        continue;
+      }
+      break;
+    }
+
+    if (fds[1].revents & POLLIN) {
+
+      Session_t* done;
+      if (read(server.wake[0], &done, sizeof(done)) == sizeof(done) && done) {
+
+        done->busy = 0;
+        for (uint32_t i = 0; i < server.session_count; i++) {
+
+          if (server.sessions[i] == done && dispatch(&server, done) != 0) {
+
+            close_session(&server, i);
+            break;
+          }
+        }
+      }
+      continue; // the set of polled sessions changed
+    }
+
+    for (nfds_t k = 2; k < nfds; k++) {
+
+      if (!fds[k].revents) {
+
+        continue;
+      }
+      Session_t* session = polled[k];
+      ssize_t got = read(session->fd, session->buffer + session->used,
+                         sizeof(session->buffer) - session->used);
+      int closing = got <= 0;
+      if (!closing) {
+
+        session->used += got;
+        closing = dispatch(&server, session);
+      }
+      if (closing) {
+
+        for (uint32_t i = 0; i < server.session_count; i++) {
+
+          if (server.sessions[i] == session) {
+
+            close_session(&server, i);
+            break;
+          }
+        }
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+
+      int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      if (fd < 0) {
+
+        continue;
+      }
+      Session_t* session = calloc(1, sizeof(Session_t));
+      if (!session) {
+
+        close(fd);
+        continue;
+      }
+      session->fd = fd;
+      session->id = ++session_ids;
+      session->current_clus = boot_sec->BPB_RootClus;
+      strcpy(session->cwd, "/");
+      pthread_mutex_lock(&server.session_lock);
+      if (server.session_count == server.session_capacity) {
+
+        uint32_t capacity = server.session_capacity ? server.session_capacity * 2 : 16;
+        Session_t** grown = realloc(server.sessions, capacity * sizeof(Session_t*));
+        if (grown) {
+
+          server.sessions = grown;
+          server.session_capacity = capacity;
+        }
+      }
+      int added = server.session_count < server.session_capacity;
+      if (added) {
+
+        server.sessions[server.session_count++] = session;
+      }
+      pthread_mutex_unlock(&server.session_lock);
+      if (!added) {
+
+        close(fd);
+        free(session);
+      }
+    }
+  }
+
+  // let the workers finish what is queued, then drop every connection
+  pthread_mutex_lock(&server.queue_lock);
+  server.stopping = 1;
+  pthread_cond_broadcast(&server.queue_ready);
+  pthread_mutex_unlock(&server.queue_lock);
+  for (uint32_t i = 0; i < started; i++) {
+
+    pthread_join(threads[i], NULL);
+  }
+  while (server.session_count > 0) {
+
+    close_session(&server, 0);
+  }
+  free(server.sessions);
+  free(fds);
+  free(polled);
+  free(threads);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  stop_fd = -1;
+  close(server.wake[0]);
+  close(server.wake[1]);
+  close(listen_fd);
+  unlink(socket_path);
+  pthread_rwlock_destroy(&server.image_lock);
+  pthread_mutex_destroy(&server.queue_lock);
+  pthread_cond_destroy(&server.queue_ready);
+  pthread_mutex_destroy(&server.session_lock);
+  printf("Server on %s stopped\n", socket_path);
+  return 0;
+}
+
+static int read_header(int fd, size_t* size, char* cwd, size_t cwd_size) {
+
+  char header[SERVER_CWD_MAX + 32];
+  size_t len = 0;
+  while (len + 1 < sizeof(header)) {
+
+    ssize_t res = read(fd, header + len, 1);
+    if (res <= 0) {
+
+      return 1;
+    }
+    if (header[len] == '\n') {
+
+      break;
+    }
+    len++;
+  }
+  header[len] = '\0';
+  char* end;
+  *size = strtoull(header, &end, 10);
+  if (end == header || *end != ' ') {
+
+    return 1;
+  }
+  snprintf(cwd, cwd_size, "%s", end + 1);
+  return 0;
+}
+
+// Line-by-line client: sends each command read from stdin and prints the answer
+int client_run(const char* socket_path) {
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+
+    fprintf(stderr, "Failed to connect to %s: %s\n", socket_path, strerror(errno));
+    if (fd >= 0) {
+
+      close(fd);
+    }
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  int interactive = isatty(STDIN_FILENO);
+  char cwd[SERVER_CWD_MAX] = "/";
+  char command[SERVER_LINE_MAX];
+  char buffer[64 * 1024];
+  int failed = 0;
+  while (1) {
+
+    if (interactive) {
+
+      printf("%s> ", cwd);
+      fflush(stdout);
+    }
+    if (fgets(command, sizeof(command) - 1, stdin) == NULL) {
+
+      break;
+    }
+    if (!strchr(command, '\n')) {
+
+      strcat(command, "\n");
+    }
+    if (write_all(fd, command, strlen(command)) != 0) {
+
+      failed = 1;
+      break;
+    }
+    command[strcspn(command, "\r\n")] = '\0';
+    if (strcmp(command, "exit") == 0 || strcmp(command, "q") == 0) {
+
+      break;
+    }
+
+    size_t size;
+    if (read_header(fd, &size, cwd, sizeof(cwd)) != 0) {
+
+      fprintf(stderr, "Connection to %s lost\n", socket_path);
+      failed = 1;
+      break;
+    }
+    while (size > 0) {
+
+      ssize_t got = read(fd, buffer, size < sizeof(buffer) ? size : sizeof(buffer));
+      if (got <= 0) {
+
+        failed = 1;
+        break;
+      }
+      fwrite(buffer, 1, got, stdout);
+      size -= got;
+    }
+    fflush(stdout);
+    if (failed) {
+
+      break;
+    }
+  }
+  close(fd);
+  return failed;
+}
@@ -0,0 +1,253 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "directory.h"
+#include "shortname.h"
+
+// The set of the directory last written to, so that a run of creations in
+// one directory scans it only once
+static struct {
+
+  int valid;
+  uint32_t dir_cluster;
+  ShortNameSet_t set;
+} cache;
+
+static uint32_t name_hash(const uint8_t* name) {
+
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < SHORT_NAME_LEN; i++) {
+
+    hash = (hash ^ name[i]) * 16777619u;
+  }
+  return hash;
+}
+
+int short_name_set_init(ShortNameSet_t* set, uint32_t expected) {
+
+  uint32_t capacity = 64;
+  while (capacity < expected * 2) {
+
+    capacity *= 2;
+  }
+  set->names = calloc(capacity, SHORT_NAME_LEN);
+  set->count = 0;
+  set->capacity = set->names ? capacity : 0;
+  return set->names ? 0 : 1;
+}
+
+void short_name_set_free(ShortNameSet_t* set) {
+
+  free(set->names);
+  set->names = NULL;
+  set->count = set->capacity = 0;
+}
+
+static uint32_t find_slot(const ShortNameSet_t* set, const uint8_t* name) {
+
+  uint32_t slot = name_hash(name) & (set->capacity - 1);
+  while (set->names[slot][0] != 0 && memcmp(set->names[slot], name, SHORT_NAME_LEN) != 0) {
+
+    slot = (slot + 1) & (set->capacity - 1);
+  }
+  return slot;
+}
+
+int short_name_set_contains(const ShortNameSet_t* set, const char* name) {
+
+  return set->capacity && set->names[find_slot(set, (const uint8_t*)name)][0] != 0;
+}
+
+int short_name_set_add(ShortNameSet_t* set, const char* name) {
+
+  if ((set->count + 1) * 2 > set->capacity) {
+
+    ShortNameSet_t grown;
+    if (short_name_set_init(&grown, set->count + 1) != 0) {
+
+      return 1;
+    }
+    for (uint32_t i = 0; i < set->capacity; i++) {
+
+      if (set->names[i][0] != 0) {
+
+        memcpy(grown.names[find_slot(&grown, set->names[i])], set->names[i], SHORT_NAME_LEN);
+        grown.count++;
+      }
+    }
+    short_name_set_free(set);
+    *set = grown;
+  }
+  uint32_t slot = find_slot(set, (const uint8_t*)name);
+  if (set->names[slot][0] == 0) {
+
+    memcpy(set->names[slot], name, SHORT_NAME_LEN);
+    set->count++;
+  }
+  return 0;
+}
+
+static int collect_short_name(const EntrSt_t* entry, const DIRStr_t* raw, const EntrLoc_t* loc,
+                              void* ctx) {
+
+  (void)entry;
+  (void)loc;
+  return short_name_set_add(ctx, (const char*)raw->DIR_Name);
+}
+
+// Returns the set for dir_cluster, parsing the directory only on a cache miss
+ShortNameSet_t* short_name_set_get(FILE* disk, BootSec_t* boot_sec, uint32_t dir_cluster) {
+
+  if (cache.valid && cache.dir_cluster == dir_cluster) {
+
+    return &cache.set;
+  }
+  short_name_cache_invalidate();
+  if (short_name_set_init(&cache.set, 0) != 0) {
+
+    return NULL;
+  }
+  if (walk_dir(disk, boot_sec, dir_cluster, collect_short_name, &cache.set) != 0) {
+
+    short_name_set_free(&cache.set);
+    return NULL;
+  }
+  cache.valid = 1;
+  cache.dir_cluster = dir_cluster;
+  return &cache.set;
+}
+
+// Keeps the cached set current when an 8.3 name is written without a tail
+void short_name_cache_note(uint32_t dir_cluster, const char* name) {
+
+  if (cache.valid && cache.dir_cluster == dir_cluster) {
+
+    short_name_set_add(&cache.set, name);
+  }
+}
+
+void short_name_cache_invalidate(void) {
+
+  if (cache.valid) {
+
+    short_name_set_free(&cache.set);
+    cache.valid = 0;
+  }
+}
+
+// Copies one part of a name that is 8.3 as written into dst, upper case;
+// returns its NTRes case flag, or -1 when the part mixes cases or holds a
+// character an 8.3 name cannot
+static int plain_part(const char* src, size_t len, char* dst, uint8_t lower_flag) {
+
+  int upper = 0, lower = 0;
+  for (size_t i = 0; i < len; i++) {
+
+    uint8_t c = (uint8_t)src[i];
+    if (c <= ' ' || c >= 0x7F || c == '.' || strchr("\"*+,/:;<=>?[\\]|", c)) {
+
+      return -1;
+    }
+    upper |= (c >= 'A' && c <= 'Z');
+    lower |= (c >= 'a' && c <= 'z');
+    dst[i] = (char)((c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c);
+  }
+  return (upper && lower) ? -1 : (lower ? lower_flag : 0);
+}
+
+// Fills short_name and nt_res when name is already a valid 8.3 name, one
+// whose case NTRes can carry; 1 when it needs an LFN run to be kept as is
+int short_name_from_83(const char* name, char* short_name, uint8_t* nt_res) {
+
+  const char* dot = strchr(name, '.');
+  size_t base_len = dot ? (size_t)(dot - name) : strlen(name);
+  size_t ext_len = dot ? strlen(dot + 1) : 0;
+  if (base_len == 0 || base_len > 8 || (dot && (ext_len == 0 || ext_len > 3))) {
+
+    return 1;
+  }
+  memset(short_name, ' ', SHORT_NAME_LEN);
+  int base_case = plain_part(name, base_len, short_name, NT_RES_LOWER_CASE_BASE);
+  int ext_case = dot ? plain_part(dot + 1, ext_len, short_name + 8, NT_RES_LOWER_CASE_EXT) : 0;
+  if (base_case < 0 || ext_case < 0) {
+
+    return 1;
+  }
+  *nt_res = (uint8_t)(base_case | ext_case);
+  return 0;
+}
+
+// Copies one part of the basis name, dropping spaces and turning each
+// character that is not allowed in an 8.3 name into a single '_'
+static int clean_part(const char* src, int len, char* dst) {
+
+  int out = 0;
+  for (int i = 0; i < len; i++) {
+
+    uint8_t c = (uint8_t)src[i];
+    if (c == ' ' || (c >= 0x80 && c < 0xC0)) {
+
+      continue;
+    }
+    if (c >= 0x80 || c == '.' || strchr("\"*+,/:;<=>?[\\]|", c)) {
+
+      c = '_';
+    }
+    dst[out++] = (char)c;
+  }
+  return out;
+}
+
+// Turns the basis name in short_name into a name not yet in set: BASIS~1
+// through BASIS~4, then two basis characters, four hex digits of a hash of
+// the long name and a tail, so that each insert probes only a few names
+int short_name_make_unique(ShortNameSet_t* set, const char* lfn, char* short_name) {
+
+  char base[8], ext[3];
+  int base_len = clean_part(short_name, 8, base);
+  int ext_len = clean_part(short_name + 8, 3, ext);
+  if (base_len == 0) {
+
+    base[0] = '_';
+    base_len = 1;
+  }
+
+  uint32_t hash = 2166136261u;
+  for (const char* p = lfn; *p; p++) {
+
+    hash = (hash ^ (uint8_t)*p) * 16777619u;
+  }
+  char hashed[6];
+  int hashed_len = (base_len < 2) ? base_len : 2;
+  memcpy(hashed, base, hashed_len);
+  static const char hex[] = "0123456789ABCDEF";
+  for (int i = 0; i < 4; i++) {
+
+    hashed[hashed_len + i] = hex[((hash ^ (hash >> 16)) >> (12 - 4 * i)) & 0xF];
+  }
+  hashed_len += 4;
+
+  for (uint32_t n = 1; n < 1000000; n++) {
+
+    char tail[8];
+    int tail_len = snprintf(tail, sizeof(tail), "~%u", n);
+    const char* prefix = (n <= SHORT_NAME_PLAIN_TAILS) ? base : hashed;
+    int prefix_len = (n <= SHORT_NAME_PLAIN_TAILS) ? base_len : hashed_len;
+    if (prefix_len > 8 - tail_len) {
+
+      prefix_len = 8 - tail_len;
+    }
+
+    char candidate[SHORT_NAME_LEN];
+    memset(candidate, ' ', SHORT_NAME_LEN);
+    memcpy(candidate, prefix, prefix_len);
+    memcpy(candidate + prefix_len, tail, tail_len);
+    memcpy(candidate + 8, ext, ext_len);
+    if (!short_name_set_contains(set, candidate)) {
+
+      memcpy(short_name, candidate, SHORT_NAME_LEN);
+      return short_name_set_add(set, candidate);
+    }
+  }
+  return 1;
+}
@@ -0,0 +1,30 @@
+#ifndef SHORTNAME_H
+#define SHORTNAME_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bootsec.h"
+
+#define SHORT_NAME_LEN 11
+#define SHORT_NAME_PLAIN_TAILS 4 // ~1..~4 before switching to hashed names
+
+// Open addressing set of the 8.3 names in one directory
+typedef struct {
+
+  uint8_t (*names)[SHORT_NAME_LEN]; // a leading 0x00 marks an empty slot
+  uint32_t count;
+  uint32_t capacity;
+} ShortNameSet_t;
+
+int short_name_set_init(ShortNameSet_t* set, uint32_t expected);
+void short_name_set_free(ShortNameSet_t* set);
+int short_name_set_contains(const ShortNameSet_t* set, const char* name);
+int short_name_set_add(ShortNameSet_t* set, const char* name);
+ShortNameSet_t* short_name_set_get(FILE* disk, BootSec_t* boot_sec, uint32_t dir_cluster);
+void short_name_cache_note(uint32_t dir_cluster, const char* name);
+void short_name_cache_invalidate(void);
+int short_name_from_83(const char* name, char* short_name, uint8_t* nt_res);
+int short_name_make_unique(ShortNameSet_t* set, const char* lfn, char* short_name);
+
+#endif // SHORTNAME_H
@@ -0,0 +1,249 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bootsec.h"
+#include "fat.h"
+#include "journal.h"
+#include "overlay.h"
+#include "utility.h"
+
+#define SPARSE_COPY_BYTES (1024 * 1024)
+#define FAT_BAD_CLUSTER 0x0FFFFFF7
+
+typedef struct {
+
+  FILE* disk;
+  int in_fd;      // -1 when holes of the input cannot be asked for (overlay)
+  int out_fd;
+  uint32_t block; // zero detection granularity, one cluster
+  uint8_t* buffer;
+  uint64_t written;
+  int failed;
+} SparseCtx_t;
+
+static int is_zero(const uint8_t* data, size_t size) {
+
+  const uint64_t* words = (const uint64_t*)data;
+  for (size_t i = 0; i < size / sizeof(uint64_t); i++) {
+
+    if (words[i] != 0) {
+
+      return 0;
+    }
+  }
+  for (size_t i = size - size % sizeof(uint64_t); i < size; i++) {
+
+    if (data[i] != 0) {
+
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Copies [offset, end) to the output, skipping holes of the input and
+// leaving a hole for every all-zero block
+static void copy_range(SparseCtx_t* ctx, off_t offset, off_t end) {
+
+  while (offset < end && !ctx->failed) {
+
+    if (ctx->in_fd >= 0) {
+
+      off_t data = lseek(ctx->in_fd, offset, SEEK_DATA);
+      if (data < 0 || data >= end) {
+
+        return; // ENXIO: nothing but holes up to the end of the file
+      }
+      offset = data;
+    }
+    off_t stop = end;
+    if (ctx->in_fd >= 0) {
+
+      off_t hole = lseek(ctx->in_fd, offset, SEEK_HOLE);
+      if (hole > offset && hole < stop) {
+
+        stop = hole;
+      }
+    }
+    size_t size = (stop - offset < SPARSE_COPY_BYTES) ? stop - offset : SPARSE_COPY_BYTES;
+    if (image_pread(ctx->disk, ctx->buffer, size, offset) != (ssize_t)size) {
+
+      ctx->failed = 1;
+      return;
+    }
+    for (size_t done = 0; done < size; done += ctx->block) {
+
+      size_t piece = (size - done < ctx->block) ? size - done : ctx->block;
+      if (is_zero(ctx->buffer + done, piece)) {
+
+        continue;
+      }
+      if (pwrite(ctx->out_fd, ctx->buffer + done, piece, offset + done) != (ssize_t)piece) {
+
+        ctx->failed = 1;
+        return;
+      }
+      ctx->written += piece;
+    }
+    offset += size;
+  }
+}
+
+static uint8_t is_allocated(const FatView_t* fat, uint32_t cluster) {
+
+  uint32_t value = fat->entries[cluster] & 0x0FFFFFFF;
+  return value != 0 && value != FAT_BAD_CLUSTER;
+}
+
+static int export_image(FILE* disk, BootSec_t* boot_sec, const FatView_t* fat,
+                        const char* output_name) {
+
+  uint16_t sector_size = boot_sec->BPB_BytsPerSec;
+  uint32_t tot_sec =
+      (boot_sec->BPB_TotSec32 == 0) ? boot_sec->BPB_TotSec16 : boot_sec->BPB_TotSec32;
+  SparseCtx_t ctx = {disk, overlay_active() ? -1 : fileno(disk), -1,
+                     sector_size * boot_sec->BPB_SecPerClus, NULL, 0, 0};
+
+  // the image file may run past the last sector the volume uses
+  off_t size = (off_t)tot_sec * sector_size;
+  struct stat st;
+  if (fstat(fileno(disk), &st) == 0 && st.st_size > size) {
+
+    size = st.st_size;
+  }
+  ctx.out_fd = open(output_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (ctx.out_fd < 0 || ftruncate(ctx.out_fd, size) != 0) {
+
+    fprintf(cmd_err(), "Failed to create %s\n", output_name);
+    if (ctx.out_fd >= 0) {
+
+      close(ctx.out_fd);
+    }
+    return 1;
+  }
+  ctx.buffer = malloc(SPARSE_COPY_BYTES);
+  if (!ctx.buffer) {
+
+    fprintf(cmd_err(), "Memory allocation failed\n");
+    close(ctx.out_fd);
+    return 1;
+  }
+
+  // reserved sectors and every FAT copy, then the allocated clusters run by run
+  copy_range(&ctx, 0, (off_t)first_sector_of_cluster(boot_sec, 2) * sector_size);
+  uint32_t allocated = 0;
+  uint32_t cluster = 2;
+  while (cluster < fat->count && !ctx.failed) {
+
+    if (!is_allocated(fat, cluster)) {
+
+      cluster++;
+      continue;
+    }
+    uint32_t run = 1;
+    while (cluster + run < fat->count && is_allocated(fat, cluster + run)) {
+
+      run++;
+    }
+    off_t offset = (off_t)first_sector_of_cluster(boot_sec, cluster) * sector_size;
+    copy_range(&ctx, offset, offset + (off_t)run * ctx.block);
+    allocated += run;
+    cluster += run;
+  }
+
+  if (fsync(ctx.out_fd) != 0) {
+
+    ctx.failed = 1;
+  }
+  close(ctx.out_fd);
+  free(ctx.buffer);
+  if (ctx.failed) {
+
+    fprintf(cmd_err(), "Failed to export to %s\n", output_name);
+    return 1;
+  }
+  fprintf(cmd_out(), "Exported %u of %u clusters, %llu KiB of data written to %s\n", allocated,
+          fat->count - 2, (unsigned long long)(ctx.written / 1024), output_name);
+  return 0;
+}
+
+// Deallocates the storage behind every run of free clusters of the image
+static int punch_free(FILE* disk, BootSec_t* boot_sec, const FatView_t* fat) {
+
+  if (overlay_active()) {
+
+    fprintf(cmd_err(), "Cannot punch holes through an overlay\n");
+    return 1;
+  }
+  int fd = fileno(disk);
+  uint32_t cluster_size = boot_sec->BPB_BytsPerSec * boot_sec->BPB_SecPerClus;
+  struct stat before, after;
+  fstat(fd, &before);
+
+  uint32_t runs = 0;
+  uint32_t cluster = 2;
+  while (cluster < fat->count) {
+
+    if ((fat->entries[cluster] & 0x0FFFFFFF) != 0) {
+
+      cluster++;
+      continue;
+    }
+    uint32_t run = 1;
+    while (cluster + run < fat->count && (fat->entries[cluster + run] & 0x0FFFFFFF) == 0) {
+
+      run++;
+    }
+    off_t offset = (off_t)first_sector_of_cluster(boot_sec, cluster) * boot_sec->BPB_BytsPerSec;
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                  (off_t)run * cluster_size) != 0) {
+
+      fprintf(cmd_err(), "Failed to punch holes: %s\n", strerror(errno));
+      return 1;
+    }
+    runs++;
+    cluster += run;
+  }
+
+  fstat(fd, &after);
+  long long reclaimed = ((long long)before.st_blocks - after.st_blocks) * 512;
+  fprintf(cmd_out(), "Punched %u free runs, %lld KiB reclaimed\n", runs,
+          reclaimed > 0 ? reclaimed / 1024 : 0);
+  return 0;
+}
+
+void export_sparse(FILE* disk, BootSec_t* boot_sec, const char* args, uint32_t current_clus) {
+
+  (void)current_clus;
+  while (*args == ' ') {
+
+    args++;
+  }
+  if (*args == '\0') {
+
+    fprintf(cmd_err(), "Usage: export-sparse <output_image> | export-sparse -i\n");
+    return;
+  }
+
+  journal_sync(disk); // everything below reads and punches the image directly
+  FatView_t fat;
+  if (fat_view_load(disk, boot_sec, &fat) != 0) {
+
+    return;
+  }
+  if (strcmp(args, "-i") == 0) {
+
+    punch_free(disk, boot_sec, &fat);
+  } else {
+
+    export_image(disk, boot_sec, &fat, args);
+  }
+  fat_view_free(&fat);
+}
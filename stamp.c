@@ -0,0 +1,35 @@
+#include <string.h>
+#include <sys/stat.h>
+
+#include "fsinfo.h"
+#include "overlay.h"
+#include "stamp.h"
+#include "utility.h"
+
+// Sidecar files are trusted only while the image matches the stamp they were
+// saved with. Any write to the image, from this program or another, moves
+// its mtime; the serial and the FSInfo hints tell volumes apart.
+int image_stamp(FILE* disk, const BootSec_t* boot_sec, ImageStamp_t* stamp) {
+
+  struct stat st;
+  if (fstat(overlay_covers(disk) ? overlay_delta_fd() : fileno(disk), &st) != 0) {
+
+    return 1;
+  }
+  memset(stamp, 0, sizeof(ImageStamp_t));
+  stamp->mtime_ns = (uint64_t)st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec;
+  stamp->size = st.st_size;
+  stamp->volume_id = boot_sec->BS_VOlId;
+  uint16_t sector_size = boot_sec->BPB_BytsPerSec;
+  if (boot_sec->BPB_FSInfo != 0 && boot_sec->BPB_FSInfo < boot_sec->BPB_RsvdSecCnt &&
+      sector_size >= sizeof(FSInfo_t)) {
+
+    uint8_t sector[sector_size];
+    FSInfo_t fsinfo;
+    read_sector(disk, boot_sec->BPB_FSInfo, sector, sector_size);
+    memcpy(&fsinfo, sector, sizeof(fsinfo));
+    stamp->free_count = fsinfo.FSI_FreeCount;
+    stamp->next_free = fsinfo.FSI_Nxt_Free;
+  }
+  return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef STAMP_H
+#define STAMP_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bootsec.h"
+
+// What ties a sidecar file to the image as it was when the sidecar was saved
+typedef struct {
+
+  uint64_t mtime_ns; // of the file the writes land in
+  uint64_t size;
+  uint32_t volume_id;
+  uint32_t free_count; // FSInfo hints, 0 when the volume has no FSInfo sector
+  uint32_t next_free;
+} __attribute__((packed)) ImageStamp_t;
+
+int image_stamp(FILE* disk, const BootSec_t* boot_sec, ImageStamp_t* stamp);
+
+#endif // STAMP_H
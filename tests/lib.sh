@@ -0,0 +1,33 @@
+# Shared by the image round-trip checks. Each check runs in its own scratch
+# directory against the binary in $FAT32, and prints one line when it passes.
+FAT32=${FAT32:-$(cd "$(dirname "$0")/.." && pwd)/build/fat32}
+NAME=$(basename "$0" .sh)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+fail() {
+
+  echo "FAIL $NAME: $*"
+  exit 1
+}
+
+pass() {
+
+  echo "ok   $NAME"
+  exit 0
+}
+
+# run IMAGE [FLAGS...] runs the commands on stdin against IMAGE, then quits
+run() {
+
+  image=$1
+  shift
+  { cat; echo q; } | "$FAT32" "$@" "$image" 2>&1
+}
+
+# new_image IMAGE makes a freshly formatted 20M volume
+new_image() {
+
+  echo format | run "$1" > /dev/null || fail "cannot format $1"
+}
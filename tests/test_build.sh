@@ -0,0 +1,35 @@
+#!/bin/sh
+# -m lays a host tree out as a new image: every directory and file comes
+# across, long names included, file data reads back unchanged and .. leads
+# back up. A size given with -s that cannot hold a FAT32 volume is refused.
+. "$(dirname "$0")/lib.sh"
+
+mkdir -p src/docs/reports/2024 src/empty src/"a directory with spaces"
+awk 'BEGIN { for (i = 0; i < 3000; i++) printf "builder data line %05d\n", i }' \
+  > src/docs/reports/2024/annual_summary_report.txt
+echo "top level" > src/README.TXT
+echo "spaced" > src/"a directory with spaces"/inner_file_name.md
+: > src/docs/empty.txt
+
+"$FAT32" -m src built.img > build.txt 2>&1 || fail "cannot build the image"
+grep -q "^Built built.img" build.txt || fail "the builder did not report the image"
+
+echo find | run built.img | sed 's|^/> ||' | grep -v '^$' | LC_ALL=C sort > image.txt
+(cd src && find .) | LC_ALL=C sort > host.txt
+cmp -s host.txt image.txt || fail "the image does not list the source tree"
+
+printf 'cd docs/reports/2024\ncat annual_summary_report.txt\n' | run built.img |
+  sed 's|^.*> ||' | grep "builder data line" > data.txt
+cmp -s data.txt src/docs/reports/2024/annual_summary_report.txt || fail "file data changed"
+
+# ".." of a directory in root holds cluster 0, which is the root itself
+printf 'cd docs\ncd ..\nls\ncd docs/reports/../reports/2024\nls\n' | run built.img > up.txt
+grep -qF "README.TXT" up.txt || fail "cd .. from a directory in root did not reach root"
+grep -qF "annual_summary_report.txt" up.txt || fail "a path through .. went astray"
+
+"$FAT32" -m src -s 10M small.img > small.txt 2>&1 && fail "a 10M image was built"
+grep -q "needs at least" small.txt || fail "a too small -s was not explained"
+[ -e small.img ] && fail "a refused build left an image behind"
+"$FAT32" -m src -s 40M sized.img > /dev/null 2>&1 || fail "a 40M image was refused"
+[ "$(wc -c < sized.img)" -eq 40000000 ] || fail "-s 40M did not size the image"
+pass
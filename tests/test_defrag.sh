@@ -0,0 +1,45 @@
+#!/bin/sh
+# A directory moved by defrag -c takes along every session standing in it,
+# at the prompt and on the server.
+. "$(dirname "$0")/lib.sh"
+
+# populate grows a past b's cluster, so a's chain is in two pieces
+new_image prompt.img
+run prompt.img > /dev/null << 'CMDS'
+mkdir a
+mkdir b
+cd a
+populate -s1 -d1 -w1 -f40
+CMDS
+cp prompt.img served.img
+
+run prompt.img > prompt.txt << 'CMDS'
+cd a
+defrag -c
+touch after
+CMDS
+grep -q "^Moved 1 chains" prompt.txt || fail "defrag did not move the directory"
+printf 'cd a\nls\n' | run prompt.img | grep -q " after " || fail "the prompt lost its directory"
+
+"$FAT32" -S sock served.img > server.txt 2>&1 &
+server=$!
+for wait in 1 2 3 4 5 6 7 8 9 10; do
+
+  [ -S sock ] && break
+  sleep 0.2
+done
+mkfifo standing
+"$FAT32" -C sock < standing > standing.txt 2>&1 &
+client=$!
+exec 3> standing
+echo "cd a" >&3
+sleep 0.3
+echo "defrag -c" | "$FAT32" -C sock > moving.txt 2>&1
+echo "touch after" >&3
+exec 3>&-
+wait $client
+kill $server
+wait $server 2> /dev/null
+grep -q "^Moved 1 chains" moving.txt || fail "defrag did not move the directory on the server"
+printf 'cd a\nls\n' | run served.img | grep -q " after " || fail "a client lost its directory"
+pass
@@ -0,0 +1,28 @@
+#!/bin/sh
+# diff names an added file, a removed one, a size change and a content change
+# between two images, and nothing for files that match or an image and itself.
+. "$(dirname "$0")/lib.sh"
+
+mkdir -p old/docs new/docs
+echo "unchanged" > old/same.txt
+cp old/same.txt new/same.txt
+echo "short" > old/docs/grows.txt
+echo "a good deal longer now" > new/docs/grows.txt
+echo "aaaa" > old/flip.txt
+echo "bbbb" > new/flip.txt
+echo "gone" > old/docs/removed.txt
+echo "new" > new/docs/added_file.txt
+"$FAT32" -m old old.img > /dev/null 2>&1 || fail "cannot build the old image"
+"$FAT32" -m new new.img > /dev/null 2>&1 || fail "cannot build the new image"
+
+echo "diff new.img" | run old.img > diff.txt
+grep -qF "+ ./docs/added_file.txt" diff.txt || fail "the added file was not reported"
+grep -qF -- "- ./docs/removed.txt" diff.txt || fail "the removed file was not reported"
+grep -qF "M ./docs/grows.txt (size 6 -> 23)" diff.txt || fail "the size change was not reported"
+grep -qF "M ./flip.txt (content)" diff.txt || fail "the content change was not reported"
+grep -qF "same.txt" diff.txt && fail "a matching file was reported"
+grep -qF "1 added, 1 removed, 2 changed" diff.txt || fail "the totals are wrong"
+
+echo "diff old.img" | run old.img > self.txt
+grep -qF "0 added, 0 removed, 0 changed" self.txt || fail "an image differs from itself"
+pass
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Writes through -b land in the delta and leave the base untouched, and both
+# forms of commit give the same image as what the overlay shows.
+. "$(dirname "$0")/lib.sh"
+
+new_image base.img
+run base.img > /dev/null << 'CMDS'
+mkdir docs
+cd docs
+touch kept.txt
+touch dropped.txt
+CMDS
+cp base.img base.orig
+
+run delta.img -b base.img > first.txt << 'CMDS'
+mkdir added
+cd docs
+rm dropped.txt
+touch new.txt
+ls
+CMDS
+grep -qF "new.txt" first.txt || fail "a file created in the overlay is missing"
+grep -qF "dropped.txt" first.txt && fail "a file removed in the overlay is still listed"
+cmp -s base.img base.orig || fail "the base changed under the overlay"
+[ -s delta.img ] || fail "nothing went to the delta"
+
+echo "cd docs
+ls" | run base.img > base.txt
+grep -qF "dropped.txt" base.txt || fail "the base lost a file the overlay removed"
+grep -qF "new.txt" base.txt && fail "the base shows a file made in the overlay"
+
+run delta.img -b base.img > /dev/null << 'CMDS'
+commit flat.img
+commit
+CMDS
+cmp -s base.orig base.img && fail "commit did not write into the base"
+cmp -s flat.img base.img || fail "commit to a file and commit in place differ"
+printf 'ls\ncd docs\nls\n' | run flat.img > flat.txt
+grep -qF "added/" flat.txt || fail "the flattened image lacks the new directory"
+grep -qF "new.txt" flat.txt || fail "the flattened image lacks the new file"
+grep -qF "dropped.txt" flat.txt && fail "the flattened image kept a removed file"
+pass
@@ -0,0 +1,40 @@
+#!/bin/sh
+# The path index survives a clean session, is rebuilt after a session without
+# it wrote to the image, and answers lookups for what that session changed.
+# Neither the index nor the usage table writes into the FSInfo sector.
+. "$(dirname "$0")/lib.sh"
+
+new_image disk.img
+run disk.img > /dev/null << 'CMDS'
+mkdir docs
+cd docs
+touch early.txt
+touch gone.txt
+CMDS
+dd if=disk.img of=fsinfo.before bs=512 skip=1 count=1 2> /dev/null
+
+echo "cd docs" | run disk.img -i -u > first.txt
+grep -q "^Built path index" first.txt || fail "no index was built"
+echo "cd docs" | run disk.img -i -u > second.txt
+grep -q "^Built" second.txt && fail "an index of an unchanged image was rebuilt"
+dd if=disk.img of=fsinfo.after bs=512 skip=1 count=1 2> /dev/null
+cmp -s fsinfo.before fsinfo.after || fail "the FSInfo sector was written"
+
+# a session without the index changes the directory under it
+run disk.img > /dev/null << 'CMDS'
+cd docs
+touch late.txt
+rm gone.txt
+CMDS
+run disk.img -i > third.txt << 'CMDS'
+cd docs
+ls
+rm late.txt
+ls
+CMDS
+grep -q "^Built path index" third.txt || fail "a stale index was trusted"
+grep -q "gone.txt" third.txt && fail "a removed file is still listed"
+grep -q "cannot remove" third.txt && fail "the new file was not found"
+[ "$(grep -c "late.txt" third.txt)" -eq 1 ] || fail "rm did not find the new file"
+grep -q "early.txt" third.txt || fail "an untouched file went missing"
+pass
@@ -0,0 +1,54 @@
+#!/bin/sh
+# Checksums catch a flipped byte in file data and in a directory: scrub names
+# the cluster, and reads and walks that cross it fail instead of returning bad
+# data.
+. "$(dirname "$0")/lib.sh"
+
+awk 'BEGIN { for (i = 0; i < 400; i++) printf "payload line %05d of the scrub check\n", i }' \
+  > data.txt
+printf 'dir\tdocs\nfile\tdocs/data.txt\tdata.txt\n' > manifest
+"$FAT32" -m manifest clean.img > /dev/null 2>&1 || fail "cannot build the image"
+echo scrub | run clean.img -c > clean.txt
+grep -q "^Built checksum table" clean.txt || fail "no checksum table was built"
+grep -q "^0 mismatches" clean.txt || fail "a fresh table reports mismatches"
+
+# flip one byte of file data, well past the first cluster
+offset=$(grep -obaF "payload line 00200" clean.img | cut -d: -f1)
+[ -n "$offset" ] || fail "file data not found in the image"
+cp clean.img data.img
+cp clean.img.crc data.img.crc
+printf 'X' | dd of=data.img bs=1 seek="$offset" conv=notrunc 2> /dev/null
+run data.img -c > data.txt.out << 'CMDS'
+scrub
+cd docs
+cat data.txt
+read data.txt 0 20
+CMDS
+grep -q "^1 mismatches" data.txt.out || fail "scrub missed the flipped data byte"
+grep -q "data.txt: Read failed" data.txt.out || fail "cat returned a corrupt cluster"
+grep -q "payload line 00200" data.txt.out && fail "cat printed the corrupt line"
+grep -q "payload line 00000" data.txt.out || fail "a read before the bad cluster failed"
+
+# flip one byte of the directory holding the file
+offset=$(grep -obaF "DATA    TXT" clean.img | cut -d: -f1)
+cp clean.img dir.img
+cp clean.img.crc dir.img.crc
+printf 'Q' | dd of=dir.img bs=1 seek="$((offset + 20))" conv=notrunc 2> /dev/null
+run dir.img -c > dir.txt << 'CMDS'
+cd docs
+ls
+rm data.txt
+CMDS
+[ "$(grep -c "Checksum mismatch" dir.txt)" -ge 2 ] || fail "a corrupt directory was read"
+grep -q "Failed to read directory entries" dir.txt || fail "ls did not report the bad directory"
+grep -q "rm: cannot remove 'data.txt'" dir.txt || fail "rm went ahead in a bad directory"
+
+# the parallel walk checks the directories it reads too
+run dir.img -c > walk.txt << 'CMDS'
+find
+du
+tree
+CMDS
+[ "$(grep -c "Checksum mismatch in cluster" walk.txt)" -eq 3 ] || fail "a walk read a bad directory"
+grep -q "data.txt" walk.txt && fail "a walk listed an entry of a bad directory"
+pass
@@ -0,0 +1,49 @@
+#!/bin/sh
+# Two clients read a file through the server while a third one writes a tree
+# next to it; the readers get the data unchanged, the writer's tree is there
+# afterwards, and the server shuts down cleanly on SIGTERM.
+. "$(dirname "$0")/lib.sh"
+
+awk 'BEGIN { for (i = 0; i < 40000; i++) printf "served line %06d\n", i }' > big.txt
+printf 'file\tbig.txt\tbig.txt\n' > manifest
+"$FAT32" -m manifest disk.img > /dev/null 2>&1 || fail "cannot build the image"
+
+"$FAT32" -S "$WORK/sock" disk.img > server.txt 2>&1 &
+server=$!
+trap 'kill $server 2> /dev/null; rm -rf "$WORK"' EXIT
+tries=0
+while [ ! -S "$WORK/sock" ]; do
+
+  tries=$((tries + 1))
+  [ "$tries" -le 50 ] || fail "the server did not start"
+  sleep 0.1
+done
+
+client() {
+
+  "$FAT32" -C "$WORK/sock"
+}
+
+printf 'mkdir work\ncd work\npopulate -s7 -d2 -w4 -f40\nq\n' | client > writer.txt 2>&1 &
+writer=$!
+printf 'cat big.txt\ncat big.txt\ncat big.txt\nq\n' | client > reader1.txt 2>&1 &
+reader1=$!
+printf 'cat big.txt\nls\ncat big.txt\nq\n' | client > reader2.txt 2>&1 &
+reader2=$!
+wait $writer || fail "the writing client failed"
+wait $reader1 || fail "the first reading client failed"
+wait $reader2 || fail "the second reading client failed"
+
+cat big.txt big.txt big.txt > expected.txt
+cmp -s expected.txt reader1.txt || fail "the first reader got different data"
+grep "served line" reader2.txt > reader2_data.txt
+head -n 80000 expected.txt | cmp -s - reader2_data.txt ||
+  fail "the second reader got different data"
+
+printf 'cd work\nfind\nq\n' | client > after.txt 2>&1
+[ "$(grep -c "^\./" after.txt)" -gt 40 ] || fail "the written tree is not there"
+
+kill -TERM $server
+wait $server || fail "the server did not exit cleanly"
+[ -S "$WORK/sock" ] && fail "the server left its socket behind"
+pass
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Long names sharing a basis get BASIS~1 to BASIS~4, then hashed 8.3 names,
+# and every 8.3 name in the directory stays unique, also across sessions.
+. "$(dirname "$0")/lib.sh"
+
+new_image disk.img
+# 13 characters keep each name to one LFN slot, so seven fit in a sector
+run disk.img > /dev/null << 'CMDS'
+touch longnam_1.txt
+touch longnam_2.txt
+touch longnam_3.txt
+touch longnam_4.txt
+touch longnam_5.txt
+CMDS
+run disk.img > /dev/null << 'CMDS'
+touch longnam_6.txt
+touch longnam_7.txt
+CMDS
+
+grep -oaE '[A-Z0-9_]{1,6}~[0-9]+ *TXT' disk.img > short.txt
+[ "$(wc -l < short.txt)" -eq 7 ] || fail "expected seven 8.3 names, got $(wc -l < short.txt)"
+[ "$(sort -u short.txt | wc -l)" -eq 7 ] || fail "two entries share an 8.3 name"
+[ "$(grep -cE '^LONGNA~[1-4]TXT$' short.txt)" -eq 4 ] || fail "the plain tails were not used first"
+[ "$(grep -cE '^LO[0-9A-F]{4}~[0-9]TXT$' short.txt)" -eq 3 ] || fail "no switch to hashed names"
+
+echo ls | run disk.img > listing.txt
+for n in 1 2 3 4 5 6 7; do
+
+  grep -qF "longnam_$n.txt" listing.txt || fail "longnam_$n.txt is missing"
+done
+pass
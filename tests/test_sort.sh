@@ -0,0 +1,26 @@
+#!/bin/sh
+# ls orders names case-insensitively with a leading dot ignored; -S and -t
+# order by size and by time, newest and largest first, and keep equal values
+# in name order.
+. "$(dirname "$0")/lib.sh"
+
+mkdir src
+printf '%010d' 0 > src/a.txt
+printf '%010d' 1 > src/B.txt
+printf '%030d' 2 > src/C.txt
+printf '%030d' 3 > src/.C2
+printf '%050d' 4 > src/.hidden
+touch -d '2020-01-01 10:00:00' src/a.txt src/B.txt
+touch -d '2021-03-01 10:00:00' src/C.txt
+touch -d '2019-03-01 10:00:00' src/.C2
+touch -d '2022-06-01 10:00:00' src/.hidden
+"$FAT32" -m src disk.img > /dev/null 2>&1 || fail "cannot build the image"
+
+printf 'ls\nls -S\nls -t\n' | run disk.img | sed 's|^/> ||' > order.txt
+[ "$(sed -n 1p order.txt)" = ".  ..  a.txt  B.txt  C.txt  .C2  .hidden  " ] ||
+  fail "ls is not in name order: $(sed -n 1p order.txt)"
+[ "$(sed -n 2p order.txt)" = ".  ..  .hidden  C.txt  .C2  a.txt  B.txt  " ] ||
+  fail "ls -S is not in size order: $(sed -n 2p order.txt)"
+[ "$(sed -n 3p order.txt)" = ".  ..  .hidden  C.txt  a.txt  B.txt  .C2  " ] ||
+  fail "ls -t is not in time order: $(sed -n 3p order.txt)"
+pass
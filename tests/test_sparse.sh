@@ -0,0 +1,30 @@
+#!/bin/sh
+# export-sparse writes a copy that reads back byte for byte the same as the
+# image but takes less space on the host, and -i shrinks the image in place
+# without changing what it reads as.
+. "$(dirname "$0")/lib.sh"
+
+new_image built.img
+run built.img > /dev/null << 'CMDS'
+mkdir data
+cd data
+populate -s3 -d2 -w3 -f12 -m200000
+CMDS
+# every byte of the source is allocated on the host
+cp --sparse=never built.img full.img
+
+echo "export-sparse out.img" | run full.img > export.txt
+[ -f out.img ] || fail "no image was exported"
+cmp -s full.img out.img || fail "the export does not read back as the image"
+[ "$(du -k out.img | cut -f1)" -lt "$(du -k full.img | cut -f1)" ] ||
+  fail "the export is no smaller on the host"
+printf 'cd data\nfind\n' | run full.img > full_find.txt
+printf 'cd data\nfind\n' | run out.img > out_find.txt
+cmp -s full_find.txt out_find.txt || fail "the export lists a different tree"
+
+cp --sparse=never built.img punched.img
+echo "export-sparse -i" | run punched.img > /dev/null
+cmp -s full.img punched.img || fail "punching changed what the image reads as"
+[ "$(du -k punched.img | cut -f1)" -lt "$(du -k full.img | cut -f1)" ] ||
+  fail "punching freed no space"
+pass
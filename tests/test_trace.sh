@@ -0,0 +1,35 @@
+#!/bin/sh
+# A recorded session replayed against a fresh volume builds the same tree,
+# and every command is kept exactly as typed.
+. "$(dirname "$0")/lib.sh"
+
+new_image recorded.img
+new_image replayed.img
+run recorded.img -t session.trc > /dev/null <<'CMDS'
+mkdir a
+cd a
+mkdir b
+cd /
+cd a/b
+touch notes.txt
+cd missing
+cd /
+mkdir p
+cd p
+populate -s7 -d2 -w3 -f4
+cd /
+ls -l
+CMDS
+
+for text in "cd a/b" "touch notes.txt" "populate -s7 -d2 -w3 -f4"; do
+
+  grep -q "$text" session.trc || fail "trace lost '$text'"
+done
+run replayed.img -T session.trc < /dev/null > report.txt
+grep -q "^Replayed 13 commands" report.txt || fail "replay did not run every command"
+grep -q "ended differently" report.txt && fail "replayed commands changed outcome"
+
+echo tree | run recorded.img > before.txt
+echo tree | run replayed.img > after.txt
+cmp -s before.txt after.txt || fail "replayed tree differs from the recorded one"
+pass
@@ -0,0 +1,52 @@
+#!/bin/sh
+# Long names come back from the image as they were created: ASCII names long
+# enough for the vector paths, and names with 2, 3 and 4 byte characters, the
+# last needing surrogate pairs. Lookups fold Latin-1 and Cyrillic case.
+. "$(dirname "$0")/lib.sh"
+
+new_image disk.img
+# a new volume's directories are one sector and do not grow, so the names are
+# spread over two of them
+cat > names << 'NAMES'
+nine_char
+seventeen_chars_x
+an_ascii_name_long_enough_for_two_vector_blocks_and_a_tail.txt
+café_crème_brûlée.txt
+NAMES
+cat > more_names << 'NAMES'
+日本語のファイル名.txt
+Привет_мир.doc
+emoji_😀_and_𝄞_clef.txt
+NAMES
+{
+  sed 's/^/touch /' names
+  echo "mkdir more"
+  echo "cd more"
+  sed 's/^/touch /' more_names
+} | run disk.img > created.txt
+grep -q "No free directory entry" created.txt && fail "the test names did not fit"
+printf 'ls\ncd more\nls\n' | run disk.img > listing.txt
+cat names more_names | while read -r name; do
+
+  grep -qF "  $name  " listing.txt || fail "$name did not come back from the image"
+done || exit 1
+
+new_image cases.img
+run cases.img > cases.txt << 'CMDS'
+touch Été.txt
+mkdir Документы
+cd ДОКУМЕНТЫ
+touch Письмо.txt
+cat письмо.TXT
+cat absent.txt
+cd /
+cat ÉTÉ.TXT
+cat été.txt
+cd документы
+ls
+CMDS
+grep -q "absent.txt: No such file" cases.txt || fail "cat did not report a missing file"
+[ "$(grep -c "No such file" cases.txt)" -eq 1 ] || fail "cat did not fold a name"
+grep -q "Failed to change directory" cases.txt && fail "cd did not fold a Cyrillic name"
+grep -qF "Письмо.txt" cases.txt || fail "the folded lookups changed the stored name"
+pass
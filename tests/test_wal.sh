@@ -0,0 +1,63 @@
+#!/bin/sh
+# The write-ahead log alone rebuilds what a killed session synced, drops a
+# torn batch whole, and reads inside a group see the group's own writes.
+. "$(dirname "$0")/lib.sh"
+
+new_image before.img
+cp before.img live.img
+
+# a session killed after its sync: the image and the log both hold the batch
+mkfifo commands
+"$FAT32" -w live.img < commands > live.txt 2>&1 &
+pid=$!
+exec 3> commands
+printf 'mkdir a\ncd a\nmkdir b\ntouch c\ncd /\nmkdir d\nsync\nmkdir lost\n' >&3
+for wait in 1 2 3 4 5 6 7 8 9 10; do
+
+  grep -q "/> /> $" live.txt 2> /dev/null && break
+  sleep 0.2
+done
+sleep 0.2
+kill -9 $pid
+exec 3>&-
+wait $pid 2> /dev/null
+[ -s live.img.wal ] || fail "no log left behind by the killed session"
+cp live.img.wal logged.wal
+
+# reopening replays the log over the batch already applied, which changes nothing
+echo tree | run live.img > live_tree.txt
+grep -q lost live_tree.txt && fail "a command outside the synced group reached the image"
+grep -q " b" live_tree.txt || fail "the synced group is missing from the image"
+
+# the log replayed onto the untouched image gives the same tree
+cp before.img replayed.img
+cp logged.wal replayed.img.wal
+echo tree | run replayed.img > replayed_tree.txt
+grep -q "^Recovered 1 batches" replayed_tree.txt || fail "the log was not replayed"
+[ -e replayed.img.wal ] && fail "the log survived its replay"
+sed 1d live_tree.txt > live_only.txt
+sed 1d replayed_tree.txt | cmp -s - live_only.txt || fail "replayed tree differs"
+
+# a torn batch is not applied at all
+cp before.img torn.img
+head -c $(($(wc -c < logged.wal) - 3)) logged.wal > torn.img.wal
+echo tree | run torn.img > torn_tree.txt
+echo tree | run before.img > before_tree.txt
+grep -q Recovered torn_tree.txt && fail "a torn batch was applied"
+cmp -s torn_tree.txt before_tree.txt || fail "a torn batch changed the image"
+
+# inside one group, walks and populate see the pending sectors
+new_image group.img
+run group.img -w > group.txt << 'CMDS'
+mkdir p
+cd p
+populate -s5 -d3 -w4 -f5
+cd /
+du
+tree
+CMDS
+echo tree | run group.img > after.txt
+grep -q "p/" group.txt || fail "a walk inside the group missed its writes"
+[ "$(grep -c -- "-- " group.txt)" -eq "$(grep -c -- "-- " after.txt)" ] ||
+  fail "the tree inside the group differs from the committed one"
+pass
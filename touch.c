@@ -5,8 +5,11 @@
 #include <string.h>
 #include <time.h>
 
+#include "arena.h"
 #include "bootsec.h"
 #include "directory.h"
+#include "unicode.h"
+#include "usage.h"
 #include "utility.h"
 
 static void generate_short_filename(const char* file_name, char* short_name, uint8_t* nt_res) {
@@ -14,29 +17,55 @@ static void generate_short_filename(const char* file_name, char* short_name, uin
   memset(short_name, 0x20, 11); // 0x20 for whitespace
   *nt_res = 0;
 
-  int i = 0, j = 0;
-  while (i < 8 && file_name[j] && file_name[j] != '.') {
+  // the extension is whatever follows the last dot, a leading dot belongs to the name
+  const char* dot = strrchr(file_name, '.');
+  if (dot == file_name) {
 
-    if (islower(file_name[j])) {
+    dot = NULL;
+  }
+  const char* base_end = dot ? dot : file_name + strlen(file_name);
 
-      *nt_res |= NT_RES_LOWER_CASE_BASE;
+  // one basis character per code point; spaces and inner dots are dropped and
+  // a character outside ASCII becomes '_'
+  int i = 0;
+  for (const char* p = file_name; i < 8 && p < base_end;) {
+
+    uint32_t cp = utf8_next(&p, base_end);
+    if (cp == ' ' || cp == '.') {
+
+      continue;
     }
-    short_name[i++] = toupper(file_name[j++]);
-  }
+    if (cp >= 0x80) {
 
-  if (file_name[j] == '.') {
+      short_name[i++] = '_';
+      continue;
+    }
+    if (islower((unsigned char)cp)) {
 
-    j++;
+      *nt_res |= NT_RES_LOWER_CASE_BASE;
+    }
+    short_name[i++] = (char)toupper((unsigned char)cp);
   }
+
+  const char* end = file_name + strlen(file_name);
   i = 8; // pos of ext start
+  for (const char* p = dot ? dot + 1 : end; i < 11 && p < end;) {
+
+    uint32_t cp = utf8_next(&p, end);
+    if (cp == ' ') {
 
-  while (i < 11 && file_name[j]) {
+      continue;
+    }
+    if (cp >= 0x80) {
 
-    if (islower(file_name[j])) {
+      short_name[i++] = '_';
+      continue;
+    }
+    if (islower((unsigned char)cp)) {
 
       *nt_res |= NT_RES_LOWER_CASE_EXT;
     }
-    short_name[i++] = toupper(file_name[j++]);
+    short_name[i++] = (char)toupper((unsigned char)cp);
   }
 }
 
@@ -44,11 +73,12 @@ static void create_file_entry(FILE* disk, uint32_t parent_cluster, const char* f
                               BootSec_t* boot_sec) {
 
   uint16_t sector_size = boot_sec->BPB_BytsPerSec;
-  uint16_t rsrvd_sec = boot_sec->BPB_RsvdSecCnt;
-  uint8_t* sector_buffer = malloc(sector_size);
-  if (!sector_buffer) {
+  size_t cluster_size = (size_t)sector_size * boot_sec->BPB_SecPerClus;
+  uint8_t* cluster_buffer = buffer_take(cluster_size);
+  uint8_t* sector_buffer = cluster_buffer;
+  if (!cluster_buffer) {
 
-    fprintf(stderr, "Memory allocation failed\n");
+    fprintf(cmd_err(), "Memory allocation failed\n");
     return;
   }
 
@@ -62,97 +92,118 @@ static void create_file_entry(FILE* disk, uint32_t parent_cluster, const char* f
   get_fat_time_date(&fat_date, &fat_time, &fat_time_tenth);
 
   // check for existing file to update time
-  uint32_t entry_count = 0;
-  EntrSt_t* entries = NULL;
-  uint8_t is_exist = 0;
-  read_dir_entries(disk, boot_sec, parent_cluster, &entries, &entry_count);
-
-  for (size_t i = 0; i < entry_count; ++i) {
-
-    if (strcmp(entries[i].name, file_name) == 0) {
-
-      is_exist = 1;
-      free(entries);
-      entries = NULL;
-      break;
+  DirList_t list;
+  uint32_t index;
+  dir_list_load(disk, boot_sec, parent_cluster, &list);
+  uint8_t is_exist = dir_list_find(&list, file_name, &index);
+  dir_list_free(&list);
+
+  // a new name's 8.3 form is checked against the ones the directory holds
+  ShortNameSet_t* names = NULL;
+  uint32_t slots = 1;
+  if (!is_exist) {
+
+    names = short_name_set_get(disk, boot_sec, parent_cluster);
+    if (!names) {
+
+      fprintf(cmd_err(), "Failed to read directory entries\n");
+      buffer_give(cluster_buffer, cluster_size);
+      return;
     }
-  }
-  if (entries) {
-
-    free(entries);
-    entries = NULL;
+    slots = dir_slots_needed(file_name, names);
   }
 
   while (1) {
 
-    uint32_t fat_size =
-        (boot_sec->BPB_FATSz16 == 0) ? boot_sec->BPB_FATSz32 : boot_sec->BPB_FATSz16;
-    current_sector = boot_sec->BPB_HiddSec + rsrvd_sec + (boot_sec->BPB_NumFATs * fat_size) +
-                     (current_clus - 2) * boot_sec->BPB_SecPerClus;
+    // one read for the whole cluster; only a modified sector goes back
+    current_sector = first_sector_of_cluster(boot_sec, current_clus);
+    read_clusters(disk, boot_sec, current_clus, 1, cluster_buffer);
 
     for (uint32_t i = 0; i < boot_sec->BPB_SecPerClus; i++) {
 
-      read_sector(disk, current_sector + i, sector_buffer, sector_size);
+      sector_buffer = cluster_buffer + i * sector_size;
 
-      for (uint32_t j = 0; j < sector_size; j += sizeof(DIRStr_t)) {
+      if (is_exist) {
 
-        dir_entry = (DIRStr_t*)(sector_buffer + j);
+        // Update the timestamps
+        dir_entry = (DIRStr_t*)sector_buffer;
+        dir_entry->DIR_LstAccDate = fat_date;
 
-        if (is_exist) {
+        // Write the updated sector back to the disk
+        write_sector(disk, current_sector + i, sector_buffer, sector_size);
+        buffer_give(cluster_buffer, cluster_size);
+        return;
+      }
 
-          // Update the timestamps
-          dir_entry->DIR_LstAccDate = fat_date;
+      // only free and end slots are candidates; the scan is sized per geometry
+      for (uint32_t j = dir_next_free(sector_buffer, 0, sector_size); j < sector_size;
+           j = dir_next_free(sector_buffer, j + sizeof(DIRStr_t), sector_size)) {
 
-          // Write the updated sector back to the disk
-          write_sector(disk, current_sector + i, sector_buffer, sector_size);
-          free(sector_buffer);
-          return;
-        }
-        if (dir_entry->DIR_Name[0] == 0x00 || dir_entry->DIR_Name[0] == 0xE5) {
+        dir_entry = (DIRStr_t*)(sector_buffer + j);
 
-          // Create LFN entries
-          int lfn_entries = 0;
-          size_t dir_len = strlen(file_name);
-          uint8_t nt_res = 0;
-          char short_name[11];
+        // the LFN run and the 8.3 entry must land in free slots of this sector
+        if (!dir_slots_fit(sector_buffer, j, sector_size, slots)) {
 
-          if (dir_len > 8) {
+          if (dir_entry->DIR_Name[0] == 0x00) {
 
-            lfn_entries = create_lfn_entries(file_name, dir_len, sector_buffer + j, short_name,
-                                             &nt_res, generate_short_filename);
-            j += lfn_entries * sizeof(LFNStr_t);
+            dir_seal_tail(sector_buffer, j, sector_size);
+            write_sector(disk, current_sector + i, sector_buffer, sector_size);
+            break;
           }
+          continue;
+        }
+
+        // Create LFN entries
+        int lfn_entries = 0;
+        size_t dir_len = strlen(file_name);
+        uint8_t nt_res = 0;
+        char short_name[11];
 
-          // Create the 8.3 entry
-          dir_entry = (DIRStr_t*)(sector_buffer + j);
-          memset(dir_entry, 0, sizeof(DIRStr_t));
-          if (!lfn_entries) {
+        if (slots > 1) {
 
-            generate_short_filename(file_name, short_name, &nt_res);
+          lfn_entries = create_lfn_entries(file_name, dir_len, sector_buffer + j, short_name,
+                                           &nt_res, generate_short_filename, names);
+          if (lfn_entries < 0) {
+
+            fprintf(cmd_err(), "No unique short name left for %s\n", file_name);
+            buffer_give(cluster_buffer, cluster_size);
+            return;
           }
+          j += lfn_entries * sizeof(LFNStr_t);
+        }
+
+        // Create the 8.3 entry
+        dir_entry = (DIRStr_t*)(sector_buffer + j);
+        memset(dir_entry, 0, sizeof(DIRStr_t));
+        if (!lfn_entries) {
 
-          memcpy(dir_entry->DIR_Name, short_name, 11);
-          dir_entry->DIR_NTRes = nt_res;
-          dir_entry->DIR_Attr = ATTR_ARCHIVE;
-          // Set creation time and date
-          dir_entry->DIR_CrtTimeTenth = fat_time_tenth;
-          dir_entry->DIR_CrtTime = fat_time;
-          dir_entry->DIR_CrtDate = fat_date;
-          dir_entry->DIR_WrtTime = fat_time;
-          dir_entry->DIR_WrtDate = fat_date;
-          dir_entry->DIR_LstAccDate = fat_date;
-
-          write_sector(disk, current_sector + i, sector_buffer, sector_size);
-          free(sector_buffer);
-          return;
+          short_name_from_83(file_name, short_name, &nt_res);
+          short_name_cache_note(parent_cluster, short_name);
         }
+
+        memcpy(dir_entry->DIR_Name, short_name, 11);
+        dir_entry->DIR_NTRes = nt_res;
+        dir_entry->DIR_Attr = ATTR_ARCHIVE;
+        // Set creation time and date
+        dir_entry->DIR_CrtTimeTenth = fat_time_tenth;
+        dir_entry->DIR_CrtTime = fat_time;
+        dir_entry->DIR_CrtDate = fat_date;
+        dir_entry->DIR_WrtTime = fat_time;
+        dir_entry->DIR_WrtDate = fat_date;
+        dir_entry->DIR_LstAccDate = fat_date;
+
+        write_sector(disk, current_sector + i, sector_buffer, sector_size);
+        usage_note_entry(parent_cluster, 0, 0, 1);
+        buffer_give(cluster_buffer, cluster_size);
+        return;
       }
     }
-    uint32_t next_cluster = get_next_cluster(disk, current_clus, sector_size, rsrvd_sec);
+    uint32_t next_cluster =
+        get_next_cluster(disk, current_clus, sector_size, boot_sec->BPB_RsvdSecCnt);
     if (next_cluster >= EOC) {
 
-      fprintf(stderr, "No free directory entry found\n");
-      free(sector_buffer);
+      fprintf(cmd_err(), "No free directory entry found\n");
+      buffer_give(cluster_buffer, cluster_size);
       return;
     }
     current_clus = next_cluster;
@@ -166,14 +217,6 @@ void touch(FILE* disk, BootSec_t* boot_sec, char* path, uint32_t current_clus) {
   size_t size = strlen(path);
   file_name[size] = '\0';
 
-  uint32_t new_cluster = get_free_cluster(disk, boot_sec);
-  if (new_cluster == 0) {
-
-    fprintf(stderr, "No free clusters available\n");
-    exit(EXIT_FAILURE);
-  }
-
-  update_fat(disk, new_cluster, EOC, boot_sec->BPB_BytsPerSec, boot_sec->BPB_RsvdSecCnt);
-  clear_cluster(disk, new_cluster, boot_sec);
+  // an empty file has no clusters: its entry keeps first cluster 0
   create_file_entry(disk, parent_cluster, file_name, boot_sec);
 }
@@ -0,0 +1,314 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+#include "utility.h"
+
+#define TRACE_MAGIC 0x43525446 // "FTRC"
+#define TRACE_VERSION 1
+
+// A trace is this header and then one record per command, each followed by
+// the command's bytes without a terminator. Records are written as commands
+// finish, so concurrent server sessions may appear out of start order.
+typedef struct {
+
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+  uint64_t started; // wall clock of the recorded session, ns since the epoch
+} __attribute__((packed)) TraceHeader_t;
+
+typedef struct {
+
+  uint64_t start;    // ns since the recording began
+  uint64_t duration; // ns
+  uint32_t session;  // 0 for the interactive prompt, then one per server client
+  uint8_t failed;
+  uint16_t len;
+} __attribute__((packed)) TraceRecord_t;
+
+typedef struct {
+
+  TraceRecord_t record;
+  char* command;
+  uint64_t latency; // ns, measured by the replay
+  uint32_t verb;    // index into the replay's verbs
+} TraceEntry_t;
+
+static struct {
+
+  FILE* file;
+  uint64_t origin; // trace_now() when the recording began
+  pthread_mutex_t lock;
+} trace = {NULL, 0, PTHREAD_MUTEX_INITIALIZER};
+
+uint64_t trace_now(void) {
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Starts recording every command into path, replacing what it held
+int trace_open(const char* path) {
+
+  trace.file = fopen(path, "wb");
+  if (!trace.file) {
+
+    fprintf(cmd_err(), "Failed to open trace %s\n", path);
+    return 1;
+  }
+  struct timespec wall;
+  clock_gettime(CLOCK_REALTIME, &wall);
+  TraceHeader_t header = {TRACE_MAGIC, TRACE_VERSION, 0,
+                          (uint64_t)wall.tv_sec * 1000000000ull + wall.tv_nsec};
+  trace.origin = trace_now();
+  if (fwrite(&header, sizeof(header), 1, trace.file) != 1) {
+
+    fprintf(cmd_err(), "Failed to write trace %s\n", path);
+    trace_close();
+    return 1;
+  }
+  return 0;
+}
+
+void trace_close(void) {
+
+  if (trace.file) {
+
+    fclose(trace.file);
+  }
+  trace.file = NULL;
+}
+
+// Appends one finished command; start and end are trace_now() readings
+void trace_command(uint32_t session, const char* command, uint64_t start, uint64_t end,
+                   int failed) {
+
+  if (!trace.file) {
+
+    return;
+  }
+  size_t len = strnlen(command, TRACE_COMMAND_MAX);
+  TraceRecord_t record = {(start > trace.origin) ? start - trace.origin : 0,
+                          (end > start) ? end - start : 0, session, failed != 0, len};
+  pthread_mutex_lock(&trace.lock);
+  fwrite(&record, sizeof(record), 1, trace.file);
+  fwrite(command, 1, len, trace.file);
+  fflush(trace.file);
+  pthread_mutex_unlock(&trace.lock);
+}
+
+static void free_entries(TraceEntry_t* entries, size_t count) {
+
+  for (size_t i = 0; i < count; i++) {
+
+    free(entries[i].command);
+  }
+  free(entries);
+}
+
+static int load_trace(const char* path, TraceEntry_t** entries, size_t* count) {
+
+  *entries = NULL;
+  *count = 0;
+  FILE* file = fopen(path, "rb");
+  TraceHeader_t header;
+  if (!file || fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_MAGIC ||
+      header.version != TRACE_VERSION) {
+
+    fprintf(cmd_err(), "Not a trace: %s\n", path);
+    if (file) {
+
+      fclose(file);
+    }
+    return 1;
+  }
+
+  size_t capacity = 0;
+  TraceRecord_t record;
+  int failed = 0;
+  while (!failed && fread(&record, sizeof(record), 1, file) == 1) {
+
+    if (*count == capacity) {
+
+      capacity = capacity ? capacity * 2 : 256;
+      TraceEntry_t* grown = realloc(*entries, capacity * sizeof(TraceEntry_t));
+      if (!grown) {
+
+        failed = 1;
+        break;
+      }
+      *entries = grown;
+    }
+    TraceEntry_t* entry = &(*entries)[*count];
+    entry->record = record;
+    entry->command = malloc(record.len + 1);
+    if (!entry->command || record.len > TRACE_COMMAND_MAX ||
+        fread(entry->command, 1, record.len, file) != record.len) {
+
+      free(entry->command);
+      failed = 1;
+      break;
+    }
+    entry->command[record.len] = '\0';
+    (*count)++;
+  }
+  fclose(file);
+  if (failed) {
+
+    fprintf(cmd_err(), "Trace %s is damaged\n", path);
+    free_entries(*entries, *count);
+    *entries = NULL;
+    *count = 0;
+    return 1;
+  }
+  return 0;
+}
+
+static int by_start(const void* a, const void* b) {
+
+  uint64_t x = ((const TraceEntry_t*)a)->record.start;
+  uint64_t y = ((const TraceEntry_t*)b)->record.start;
+  return (x > y) - (x < y);
+}
+
+static int by_latency(const void* a, const void* b) {
+
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted latencies, in milliseconds
+static double percentile(const uint64_t* sorted, size_t count, double p) {
+
+  size_t rank = (size_t)(p / 100.0 * count + 0.999999);
+  rank = (rank < 1) ? 1 : (rank > count) ? count : rank;
+  return sorted[rank - 1] / 1e6;
+}
+
+static void report_line(const char* name, uint64_t* latencies, size_t count) {
+
+  qsort(latencies, count, sizeof(uint64_t), by_latency);
+  fprintf(cmd_out(), "%-16s %8zu %10.3f %10.3f %10.3f %10.3f\n", name, count,
+          percentile(latencies, count, 50), percentile(latencies, count, 90),
+          percentile(latencies, count, 99), latencies[count - 1] / 1e6);
+}
+
+// Latency percentiles per command word and over the whole replay
+static void report(TraceEntry_t* entries, size_t count, char (*verbs)[TRACE_VERB_MAX],
+                   uint32_t verb_count) {
+
+  uint64_t* latencies = malloc(count * sizeof(uint64_t));
+  if (!latencies) {
+
+    return;
+  }
+  fprintf(cmd_out(), "%-16s %8s %10s %10s %10s %10s\n", "command", "count", "p50 ms", "p90 ms",
+          "p99 ms", "max ms");
+  for (uint32_t v = 0; v < verb_count; v++) {
+
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+
+      if (entries[i].verb == v) {
+
+        latencies[n++] = entries[i].latency;
+      }
+    }
+    report_line(verbs[v], latencies, n);
+  }
+  for (size_t i = 0; i < count; i++) {
+
+    latencies[i] = entries[i].latency;
+  }
+  report_line("all", latencies, count);
+  free(latencies);
+}
+
+// Re-runs a recorded trace through run in start order, with its output
+// discarded. As fast as possible, or with timed at the recorded offsets.
+int trace_replay(const char* path, int timed, trace_run_cb run, void* ctx) {
+
+  TraceEntry_t* entries;
+  size_t count;
+  if (load_trace(path, &entries, &count) != 0) {
+
+    return 1;
+  }
+  if (count == 0) {
+
+    fprintf(cmd_out(), "Trace %s holds no commands\n", path);
+    free(entries);
+    return 0;
+  }
+  FILE* sink = fopen("/dev/null", "w");
+  char(*verbs)[TRACE_VERB_MAX] = malloc(count * TRACE_VERB_MAX);
+  if (!sink || !verbs) {
+
+    fprintf(cmd_err(), "Failed to set up the replay\n");
+    if (sink) {
+
+      fclose(sink);
+    }
+    free(verbs);
+    free_entries(entries, count);
+    return 1;
+  }
+  qsort(entries, count, sizeof(TraceEntry_t), by_start);
+
+  uint32_t verb_count = 0;
+  size_t differ = 0;
+  uint64_t begin = trace_now();
+  for (size_t i = 0; i < count; i++) {
+
+    TraceEntry_t* entry = &entries[i];
+    char verb[TRACE_VERB_MAX];
+    snprintf(verb, sizeof(verb), "%.*s", (int)strcspn(entry->command, " "), entry->command);
+    for (entry->verb = 0; entry->verb < verb_count; entry->verb++) {
+
+      if (strcmp(verbs[entry->verb], verb) == 0) {
+
+        break;
+      }
+    }
+    if (entry->verb == verb_count) {
+
+      strcpy(verbs[verb_count++], verb);
+    }
+
+    if (timed) {
+
+      uint64_t due = begin + entry->record.start;
+      struct timespec at = {due / 1000000000ull, due % 1000000000ull};
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) == EINTR) {
+
+        // interrupted; sleep for the rest
+      }
+    }
+    uint64_t start = trace_now();
+    cmd_set_output(sink, sink);
+    int failed = run(entry->record.session, entry->command, ctx) != 0;
+    cmd_set_output(NULL, NULL);
+    entry->latency = trace_now() - start;
+    differ += failed != entry->record.failed;
+  }
+  double seconds = (trace_now() - begin) / 1e9;
+
+  fprintf(cmd_out(), "Replayed %zu commands from %s in %.3f s (%.1f commands/s)\n", count, path,
+          seconds, (seconds > 0) ? count / seconds : 0.0);
+  if (differ > 0) {
+
+    fprintf(cmd_out(), "%zu commands ended differently than when recorded\n", differ);
+  }
+  report(entries, count, verbs, verb_count);
+  fclose(sink);
+  free(verbs);
+  free_entries(entries, count);
+  return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_COMMAND_MAX 1024 // longest command a trace keeps
+#define TRACE_VERB_MAX 16      // commands are grouped by their first word, cut to this
+
+// Runs one replayed command for session; returns non-zero when it reported an error
+typedef int (*trace_run_cb)(uint32_t session, char* command, void* ctx);
+
+int trace_open(const char* path);
+void trace_close(void);
+uint64_t trace_now(void);
+void trace_command(uint32_t session, const char* command, uint64_t start, uint64_t end,
+                   int failed);
+int trace_replay(const char* path, int timed, trace_run_cb run, void* ctx);
+
+#endif // TRACE_H
@@ -0,0 +1,81 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "bootsec.h"
+#include "utility.h"
+#include "walk.h"
+
+static int entry_compare(const void* a, const void* b) {
+
+  return walk_path_compare(((const WalkEntry_t*)a)->path, ((const WalkEntry_t*)b)->path);
+}
+
+void tree(FILE* disk, BootSec_t* boot_sec, const char* args, uint32_t current_clus) {
+
+  uint32_t nthreads = walk_parse_threads(&args);
+
+  WalkResult_t result;
+  if (parallel_walk(disk, boot_sec, current_clus, nthreads, WALK_EMIT_ENTRIES, NULL, NULL,
+                    &result) != 0) {
+
+    return;
+  }
+  qsort(result.entries, result.entry_count, sizeof(WalkEntry_t), entry_compare);
+
+  uint32_t max_depth = 0;
+  for (uint32_t i = 0; i < result.entry_count; i++) {
+
+    if (result.entries[i].depth > max_depth) {
+
+      max_depth = result.entries[i].depth;
+    }
+  }
+
+  // is_last[i]: no sibling of entry i follows it; computed back to front
+  uint8_t* is_last = arena_alloc(result.entry_count + 1);
+  uint8_t* sibling_follows = arena_calloc(max_depth + 2, 1);
+  uint8_t* open_levels = arena_calloc(max_depth + 2, 1);
+  if (!is_last || !sibling_follows || !open_levels) {
+
+    fprintf(cmd_err(), "Memory allocation failed\n");
+    walk_result_free(&result);
+    return;
+  }
+  for (uint32_t i = result.entry_count; i-- > 0;) {
+
+    uint32_t depth = result.entries[i].depth;
+    is_last[i] = !sibling_follows[depth];
+    sibling_follows[depth] = 1;
+    memset(sibling_follows + depth + 1, 0, max_depth - depth + 1);
+  }
+
+  uint32_t dirs = 0, files = 0;
+  fprintf(cmd_out(), ".\n");
+  for (uint32_t i = 0; i < result.entry_count; i++) {
+
+    WalkEntry_t* entry = &result.entries[i];
+    for (uint32_t level = 1; level < entry->depth; level++) {
+
+      fputs(open_levels[level] ? "|   " : "    ", cmd_out());
+    }
+    open_levels[entry->depth] = !is_last[i];
+
+    const char* name = strrchr(entry->path, '/');
+    name = name ? name + 1 : entry->path;
+    fprintf(cmd_out(), "%s %s%s\n", is_last[i] ? "`--" : "|--", name,
+            (entry->attr & ATTR_DIRECTORY) ? "/" : "");
+    if (entry->attr & ATTR_DIRECTORY) {
+
+      dirs++;
+    } else {
+
+      files++;
+    }
+  }
+  fprintf(cmd_out(), "\n%u directories, %u files\n", dirs, files);
+  fflush(cmd_out());
+  walk_result_free(&result);
+}
@@ -0,0 +1,335 @@
+#include <string.h>
+
+#include "unicode.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Decodes one code point and advances *src; malformed, overlong and surrogate
+// sequences decode to U+FFFD and consume a single byte
+static uint32_t utf8_decode(const uint8_t** src, const uint8_t* end) {
+
+  const uint8_t* s = *src;
+  uint8_t lead = s[0];
+  uint32_t cp;
+  uint32_t extra;
+  if (lead < 0x80) {
+
+    *src = s + 1;
+    return lead;
+  } else if ((lead & 0xE0) == 0xC0) {
+
+    cp = lead & 0x1F;
+    extra = 1;
+  } else if ((lead & 0xF0) == 0xE0) {
+
+    cp = lead & 0x0F;
+    extra = 2;
+  } else if ((lead & 0xF8) == 0xF0) {
+
+    cp = lead & 0x07;
+    extra = 3;
+  } else {
+
+    *src = s + 1;
+    return UNICODE_REPLACEMENT;
+  }
+
+  if ((size_t)(end - s) <= extra) {
+
+    *src = s + 1;
+    return UNICODE_REPLACEMENT;
+  }
+  for (uint32_t i = 1; i <= extra; i++) {
+
+    if ((s[i] & 0xC0) != 0x80) {
+
+      *src = s + 1;
+      return UNICODE_REPLACEMENT;
+    }
+    cp = (cp << 6) | (s[i] & 0x3F);
+  }
+  static const uint32_t min_cp[4] = {0, 0x80, 0x800, 0x10000};
+  if (cp < min_cp[extra] || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+
+    *src = s + 1;
+    return UNICODE_REPLACEMENT;
+  }
+  *src = s + extra + 1;
+  return cp;
+}
+
+// Decodes the code point at *src for callers outside this file, which walk a
+// name one character at a time
+uint32_t utf8_next(const char** src, const char* end) {
+
+  const uint8_t* s = (const uint8_t*)*src;
+  uint32_t cp = utf8_decode(&s, (const uint8_t*)end);
+  *src = (const char*)s;
+  return cp;
+}
+
+static size_t utf8_encode(uint32_t cp, char* dst) {
+
+  if (cp < 0x80) {
+
+    dst[0] = (char)cp;
+    return 1;
+  }
+  if (cp < 0x800) {
+
+    dst[0] = (char)(0xC0 | (cp >> 6));
+    dst[1] = (char)(0x80 | (cp & 0x3F));
+    return 2;
+  }
+  if (cp < 0x10000) {
+
+    dst[0] = (char)(0xE0 | (cp >> 12));
+    dst[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    dst[2] = (char)(0x80 | (cp & 0x3F));
+    return 3;
+  }
+  dst[0] = (char)(0xF0 | (cp >> 18));
+  dst[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+  dst[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+  dst[3] = (char)(0x80 | (cp & 0x3F));
+  return 4;
+}
+
+// Converts an LFN name to NUL-terminated UTF-8. Stops at the 0x0000
+// terminator or 0xFFFF padding; a character that does not fit whole is
+// dropped rather than split. Returns the number of bytes written.
+size_t utf16_to_utf8(const uint16_t* src, size_t units, char* dst, size_t dst_size) {
+
+  if (dst_size == 0) {
+
+    return 0;
+  }
+  size_t len = 0;
+  size_t i = 0;
+
+#ifdef __SSE2__
+  // eight units at a time while they are all printable ASCII
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i high = _mm_set1_epi16((short)0xFF80);
+  while (i + 8 <= units && len + 8 < dst_size) {
+
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i ascii = _mm_cmpeq_epi16(_mm_and_si128(v, high), zero);
+    __m128i nul = _mm_cmpeq_epi16(v, zero);
+    if (_mm_movemask_epi8(ascii) != 0xFFFF || _mm_movemask_epi8(nul) != 0) {
+
+      break;
+    }
+    _mm_storel_epi64((__m128i*)(dst + len), _mm_packus_epi16(v, v));
+    i += 8;
+    len += 8;
+  }
+#endif
+
+  for (; i < units; i++) {
+
+    uint32_t cp = src[i];
+    if (cp == 0x0000 || cp == 0xFFFF) {
+
+      break;
+    }
+    if (cp >= 0xD800 && cp <= 0xDBFF && i + 1 < units && src[i + 1] >= 0xDC00 &&
+        src[i + 1] <= 0xDFFF) {
+
+      cp = 0x10000 + ((cp - 0xD800) << 10) + (src[i + 1] - 0xDC00);
+      i++;
+    } else if (cp >= 0xD800 && cp <= 0xDFFF) {
+
+      cp = UNICODE_REPLACEMENT; // unpaired surrogate
+    }
+
+    char bytes[4];
+    size_t n = utf8_encode(cp, bytes);
+    if (len + n >= dst_size) {
+
+      break;
+    }
+    memcpy(dst + len, bytes, n);
+    len += n;
+  }
+  dst[len] = '\0';
+  return len;
+}
+
+// Converts len bytes of UTF-8 to UTF-16, writing at most dst_units units.
+// Like snprintf, returns the number of units the whole string needs; what is
+// written stops before the first code point that does not fit whole, so
+// utf8_utf16_fit tells how many units are valid.
+size_t utf8_to_utf16(const char* src, size_t len, uint16_t* dst, size_t dst_units) {
+
+  const uint8_t* s = (const uint8_t*)src;
+  const uint8_t* end = s + len;
+  size_t out = 0;
+
+#ifdef __SSE2__
+  // sixteen bytes at a time while they are all ASCII
+  const __m128i zero = _mm_setzero_si128();
+  while (end - s >= 16 && out + 16 <= dst_units) {
+
+    __m128i v = _mm_loadu_si128((const __m128i*)s);
+    if (_mm_movemask_epi8(v) != 0) {
+
+      break;
+    }
+    _mm_storeu_si128((__m128i*)(dst + out), _mm_unpacklo_epi8(v, zero));
+    _mm_storeu_si128((__m128i*)(dst + out + 8), _mm_unpackhi_epi8(v, zero));
+    s += 16;
+    out += 16;
+  }
+#endif
+
+  while (s < end) {
+
+    uint32_t cp = utf8_decode(&s, end);
+    if (cp >= 0x10000) {
+
+      if (out + 2 <= dst_units) {
+
+        dst[out] = (uint16_t)(0xD800 + ((cp - 0x10000) >> 10));
+        dst[out + 1] = (uint16_t)(0xDC00 + ((cp - 0x10000) & 0x3FF));
+      }
+      out += 2;
+    } else {
+
+      if (out < dst_units) {
+
+        dst[out] = (uint16_t)cp;
+      }
+      out++;
+    }
+  }
+  return out;
+}
+
+// Units of the longest prefix of complete code points that fits in dst_units:
+// a surrogate pair is never split
+size_t utf8_utf16_fit(const char* src, size_t len, size_t dst_units) {
+
+  const uint8_t* s = (const uint8_t*)src;
+  const uint8_t* end = s + len;
+  size_t out = 0;
+  while (s < end) {
+
+    size_t need = (utf8_decode(&s, end) >= 0x10000) ? 2 : 1;
+    if (out + need > dst_units) {
+
+      break;
+    }
+    out += need;
+  }
+  return out;
+}
+
+// Simple case folding for Latin, Greek and Cyrillic, enough for the
+// case-insensitive name matching FAT expects
+uint32_t unicode_fold(uint32_t cp) {
+
+  if (cp < 0x80) {
+
+    return (cp >= 'A' && cp <= 'Z') ? cp + 32 : cp;
+  }
+  if (cp >= 0xC0 && cp <= 0xDE && cp != 0xD7) {
+
+    return cp + 32;
+  }
+  if ((cp >= 0x100 && cp <= 0x12F) || (cp >= 0x132 && cp <= 0x137) ||
+      (cp >= 0x14A && cp <= 0x177)) {
+
+    return cp | 1;
+  }
+  if ((cp >= 0x139 && cp <= 0x148) || (cp >= 0x179 && cp <= 0x17E)) {
+
+    return (cp & 1) ? cp + 1 : cp;
+  }
+  if (cp == 0x178) {
+
+    return 0xFF;
+  }
+  if (cp >= 0x391 && cp <= 0x3A9 && cp != 0x3A2) {
+
+    return cp + 32;
+  }
+  if (cp >= 0x400 && cp <= 0x40F) {
+
+    return cp + 80;
+  }
+  if (cp >= 0x410 && cp <= 0x42F) {
+
+    return cp + 32;
+  }
+  return cp;
+}
+
+int utf8_casecmp(const char* a, const char* b) {
+
+  const uint8_t* s = (const uint8_t*)a;
+  const uint8_t* t = (const uint8_t*)b;
+  const uint8_t* s_end = s + strlen(a);
+  const uint8_t* t_end = t + strlen(b);
+
+  while (s < s_end && t < t_end) {
+
+    uint32_t cs, ct;
+    if (*s < 0x80 && *t < 0x80) {
+
+      cs = unicode_fold(*s++);
+      ct = unicode_fold(*t++);
+    } else {
+
+      cs = unicode_fold(utf8_decode(&s, s_end));
+      ct = unicode_fold(utf8_decode(&t, t_end));
+    }
+    if (cs != ct) {
+
+      return (cs < ct) ? -1 : 1;
+    }
+  }
+  return (s < s_end) - (t < t_end);
+}
+
+// FNV-1a over the folded code points, so names that utf8_casecmp treats as
+// equal always hash alike
+uint32_t utf8_casehash(const char* name) {
+
+  const uint8_t* s = (const uint8_t*)name;
+  const uint8_t* end = s + strlen(name);
+  uint32_t hash = 2166136261u;
+  while (s < end) {
+
+    uint32_t cp = unicode_fold((*s < 0x80) ? *s++ : utf8_decode(&s, end));
+    for (int i = 0; i < 4; i++) {
+
+      hash = (hash ^ ((cp >> (8 * i)) & 0xFF)) * 16777619u;
+    }
+  }
+  return hash;
+}
+
+// Writes the case-folded form of a name, NUL-terminated. Byte order of the
+// result is utf8_casecmp order, since UTF-8 preserves code point order. dst
+// needs room for three bytes per source byte plus the terminator.
+size_t utf8_casefold(const char* src, char* dst) {
+
+  const uint8_t* s = (const uint8_t*)src;
+  const uint8_t* end = s + strlen(src);
+  size_t len = 0;
+  while (s < end) {
+
+    if (*s < 0x80) {
+
+      dst[len++] = (char)unicode_fold(*s++);
+    } else {
+
+      len += utf8_encode(unicode_fold(utf8_decode(&s, end)), dst + len);
+    }
+  }
+  dst[len] = '\0';
+  return len;
+}
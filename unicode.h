@@ -0,0 +1,18 @@
+#ifndef UNICODE_H
+#define UNICODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define UNICODE_REPLACEMENT 0xFFFD
+
+uint32_t utf8_next(const char** src, const char* end);
+size_t utf16_to_utf8(const uint16_t* src, size_t units, char* dst, size_t dst_size);
+size_t utf8_to_utf16(const char* src, size_t len, uint16_t* dst, size_t dst_units);
+size_t utf8_utf16_fit(const char* src, size_t len, size_t dst_units);
+uint32_t unicode_fold(uint32_t cp);
+int utf8_casecmp(const char* a, const char* b);
+uint32_t utf8_casehash(const char* name);
+size_t utf8_casefold(const char* src, char* dst);
+
+#endif // UNICODE_H
@@ -0,0 +1,723 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "directory.h"
+#include "fat.h"
+#include "stamp.h"
+#include "usage.h"
+#include "utility.h"
+
+#define USAGE_MAGIC 0x47535546 // "FUSG"
+#define USAGE_VERSION 2
+#define USAGE_PATH_MAX 512
+
+// The sidecar is this header, one record per directory, then the directory
+// names back to back. It is only valid while its generation is non-zero, which
+// a write to the image clears, and the image still matches its stamp.
+typedef struct {
+
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+  uint32_t cluster_size;
+  uint32_t cluster_count;
+  uint64_t generation;
+  ImageStamp_t stamp;
+  uint64_t used_clusters;
+  uint32_t dir_count;
+  uint32_t names_size;
+} __attribute__((packed)) UsageHeader_t;
+
+typedef struct {
+
+  uint32_t cluster;
+  uint32_t parent; // 0 for the root
+  uint64_t bytes;
+  uint64_t clusters;
+  uint32_t files;
+  uint32_t subdirs;
+  uint32_t name_len;
+} __attribute__((packed)) UsageRecord_t;
+
+typedef struct {
+
+  UsageRecord_t record;
+  char* name;
+} UsageDir_t;
+
+static struct {
+
+  int active;
+  FILE* disk;
+  int fd;
+  char path[USAGE_PATH_MAX];
+  BootSec_t* boot_sec;
+  uint32_t cluster_size;
+  uint32_t cluster_count;
+  uint64_t generation;
+  ImageStamp_t stamp; // the one the table was last saved with
+  uint64_t used_clusters;
+  uint8_t dirty; // the image was written since the table was saved
+  uint8_t stale; // a change could not be followed, rebuild at the next flush
+  UsageDir_t* dirs;
+  uint32_t dir_count;
+  uint32_t dir_capacity;
+  uint32_t* slots; // open addressing by cluster: index into dirs + 1, 0 when empty
+  uint32_t slot_mask;
+} usage_state = {0, NULL, -1, {0}, NULL, 0, 0, 0, {0}, 0, 0, 0, NULL, 0, 0, NULL, 0};
+
+static uint32_t slot_home(uint32_t cluster) {
+
+  return (cluster * 2654435761u) & usage_state.slot_mask;
+}
+
+// The slot holding cluster, or the empty slot where it would go
+static uint32_t slot_find(uint32_t cluster) {
+
+  uint32_t slot = slot_home(cluster);
+  while (usage_state.slots[slot] != 0 &&
+         usage_state.dirs[usage_state.slots[slot] - 1].record.cluster != cluster) {
+
+    slot = (slot + 1) & usage_state.slot_mask;
+  }
+  return slot;
+}
+
+static int rehash(uint32_t capacity) {
+
+  uint32_t* slots = calloc(capacity, sizeof(uint32_t));
+  if (!slots) {
+
+    return 1;
+  }
+  free(usage_state.slots);
+  usage_state.slots = slots;
+  usage_state.slot_mask = capacity - 1;
+  for (uint32_t i = 0; i < usage_state.dir_count; i++) {
+
+    slots[slot_find(usage_state.dirs[i].record.cluster)] = i + 1;
+  }
+  return 0;
+}
+
+static UsageDir_t* find_dir(uint32_t cluster) {
+
+  if (!usage_state.slots) {
+
+    return NULL;
+  }
+  uint32_t index = usage_state.slots[slot_find(cluster)];
+  return index ? &usage_state.dirs[index - 1] : NULL;
+}
+
+static UsageDir_t* add_dir(uint32_t cluster, uint32_t parent, const char* name, size_t name_len) {
+
+  if (usage_state.dir_count == usage_state.dir_capacity) {
+
+    uint32_t capacity = usage_state.dir_capacity ? usage_state.dir_capacity * 2 : 64;
+    UsageDir_t* grown = realloc(usage_state.dirs, capacity * sizeof(UsageDir_t));
+    if (!grown) {
+
+      return NULL;
+    }
+    usage_state.dirs = grown;
+    usage_state.dir_capacity = capacity;
+  }
+  // at most half full, so probe runs stay short
+  uint32_t slot_capacity = usage_state.slots ? usage_state.slot_mask + 1 : 0;
+  if ((usage_state.dir_count + 1) * 2 > slot_capacity &&
+      rehash(slot_capacity ? slot_capacity * 2 : 128) != 0) {
+
+    return NULL;
+  }
+  char* copy = malloc(name_len + 1);
+  if (!copy) {
+
+    return NULL;
+  }
+  memcpy(copy, name, name_len);
+  copy[name_len] = '\0';
+
+  UsageDir_t* dir = &usage_state.dirs[usage_state.dir_count];
+  memset(dir, 0, sizeof(UsageDir_t));
+  dir->record.cluster = cluster;
+  dir->record.parent = parent;
+  dir->record.name_len = name_len;
+  dir->name = copy;
+  usage_state.slots[slot_find(cluster)] = ++usage_state.dir_count;
+  return dir;
+}
+
+// Empties the slot of cluster, pulling later members of its probe run back so
+// every remaining cluster is still reachable from its home slot
+static void unlink_slot(uint32_t cluster) {
+
+  uint32_t mask = usage_state.slot_mask;
+  uint32_t hole = slot_find(cluster);
+  for (uint32_t next = (hole + 1) & mask; usage_state.slots[next] != 0; next = (next + 1) & mask) {
+
+    uint32_t home = slot_home(usage_state.dirs[usage_state.slots[next] - 1].record.cluster);
+    if (((next - home) & mask) >= ((next - hole) & mask)) {
+
+      usage_state.slots[hole] = usage_state.slots[next];
+      hole = next;
+    }
+  }
+  usage_state.slots[hole] = 0;
+}
+
+static void remove_dir(UsageDir_t* dir) {
+
+  uint32_t index = dir - usage_state.dirs;
+  unlink_slot(dir->record.cluster);
+  free(dir->name);
+
+  // the last record fills the gap
+  uint32_t last = --usage_state.dir_count;
+  if (index != last) {
+
+    usage_state.dirs[index] = usage_state.dirs[last];
+    usage_state.slots[slot_find(usage_state.dirs[index].record.cluster)] = index + 1;
+  }
+}
+
+static void clear_dirs(void) {
+
+  for (uint32_t i = 0; i < usage_state.dir_count; i++) {
+
+    free(usage_state.dirs[i].name);
+  }
+  usage_state.dir_count = 0;
+  free(usage_state.slots);
+  usage_state.slots = NULL;
+  usage_state.slot_mask = 0;
+}
+
+// Recomputes every directory's totals and the allocated cluster count from
+// the volume itself
+static int rebuild(FILE* disk) {
+
+  BootSec_t* boot_sec = usage_state.boot_sec;
+  FatView_t fat;
+  if (fat_view_load(disk, boot_sec, &fat) != 0) {
+
+    return 1;
+  }
+  uint64_t used = 0;
+  for (uint32_t i = 2; i < fat.count; i++) {
+
+    used += (fat.entries[i] & 0x0FFFFFFF) != 0;
+  }
+  fat_view_free(&fat);
+
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  WalkResult_t result;
+  if (parallel_walk(disk, boot_sec, boot_sec->BPB_RootClus, (online > 0) ? online : 1, 0, NULL,
+                    NULL, &result) != 0) {
+
+    return 1;
+  }
+
+  // a parent is known by its walk id; map ids back to clusters
+  uint32_t max_id = 0;
+  for (uint32_t i = 0; i < result.dir_count; i++) {
+
+    max_id = (result.dirs[i].id > max_id) ? result.dirs[i].id : max_id;
+  }
+  uint32_t* cluster_of = malloc(((size_t)max_id + 1) * sizeof(uint32_t));
+  int failed = !cluster_of;
+  clear_dirs();
+  for (uint32_t i = 0; i < result.dir_count && !failed; i++) {
+
+    cluster_of[result.dirs[i].id] = result.dirs[i].cluster;
+  }
+  for (uint32_t i = 0; i < result.dir_count && !failed; i++) {
+
+    const WalkDir_t* walked = &result.dirs[i];
+    const char* slash = strrchr(walked->path, '/');
+    const char* name = slash ? slash + 1 : "";
+    uint32_t parent = (walked->depth > 0) ? cluster_of[walked->parent_id] : 0;
+    UsageDir_t* dir = add_dir(walked->cluster, parent, name, strlen(name));
+    if (!dir) {
+
+      failed = 1;
+      break;
+    }
+    dir->record.bytes = walked->bytes;
+    dir->record.clusters = walked->clusters;
+    dir->record.files = walked->files;
+  }
+  for (uint32_t i = 0; i < usage_state.dir_count && !failed; i++) {
+
+    UsageDir_t* parent = find_dir(usage_state.dirs[i].record.parent);
+    if (usage_state.dirs[i].record.parent != 0 && parent) {
+
+      parent->record.subdirs++;
+    }
+  }
+  free(cluster_of);
+  walk_result_free(&result);
+  if (failed) {
+
+    clear_dirs();
+    return 1;
+  }
+  usage_state.used_clusters = used;
+  usage_state.stale = 0;
+  usage_state.dirty = 1;
+  return 0;
+}
+
+static int load_table(FILE* disk) {
+
+  UsageHeader_t header;
+  ImageStamp_t stamp;
+  if (image_stamp(disk, usage_state.boot_sec, &stamp) != 0 ||
+      pread(usage_state.fd, &header, sizeof(header), 0) != sizeof(header) ||
+      header.magic != USAGE_MAGIC || header.version != USAGE_VERSION ||
+      header.cluster_size != usage_state.cluster_size ||
+      header.cluster_count != usage_state.cluster_count || header.dir_count == 0 ||
+      header.dir_count > usage_state.cluster_count || header.generation == 0 ||
+      memcmp(&header.stamp, &stamp, sizeof(stamp)) != 0) {
+
+    return 1;
+  }
+
+  size_t records_size = (size_t)header.dir_count * sizeof(UsageRecord_t);
+  uint8_t* body = malloc(records_size + header.names_size);
+  if (!body || pread(usage_state.fd, body, records_size + header.names_size, sizeof(header)) !=
+                   (ssize_t)(records_size + header.names_size)) {
+
+    free(body);
+    return 1;
+  }
+  clear_dirs();
+  const char* names = (const char*)body + records_size;
+  size_t offset = 0;
+  int failed = 0;
+  for (uint32_t i = 0; i < header.dir_count && !failed; i++) {
+
+    UsageRecord_t record;
+    memcpy(&record, body + i * sizeof(UsageRecord_t), sizeof(record));
+    UsageDir_t* dir = NULL;
+    if (record.name_len <= header.names_size - offset) {
+
+      dir = add_dir(record.cluster, record.parent, names + offset, record.name_len);
+    }
+    if (!dir) {
+
+      failed = 1;
+      break;
+    }
+    dir->record = record;
+    offset += record.name_len;
+  }
+  free(body);
+  if (failed) {
+
+    clear_dirs();
+    return 1;
+  }
+  usage_state.generation = header.generation;
+  usage_state.stamp = stamp;
+  usage_state.used_clusters = header.used_clusters;
+  return 0;
+}
+
+// Header and body first, generation last: a torn save is never trusted
+static int save_table(FILE* disk) {
+
+  if (image_stamp(disk, usage_state.boot_sec, &usage_state.stamp) != 0) {
+
+    return 1;
+  }
+  size_t names_size = 0;
+  for (uint32_t i = 0; i < usage_state.dir_count; i++) {
+
+    names_size += usage_state.dirs[i].record.name_len;
+  }
+  size_t records_size = (size_t)usage_state.dir_count * sizeof(UsageRecord_t);
+  uint8_t* body = malloc(records_size + names_size + 1);
+  if (!body) {
+
+    return 1;
+  }
+  size_t offset = records_size;
+  for (uint32_t i = 0; i < usage_state.dir_count; i++) {
+
+    const UsageDir_t* dir = &usage_state.dirs[i];
+    memcpy(body + i * sizeof(UsageRecord_t), &dir->record, sizeof(UsageRecord_t));
+    memcpy(body + offset, dir->name, dir->record.name_len);
+    offset += dir->record.name_len;
+  }
+
+  UsageHeader_t header = {USAGE_MAGIC,
+                          USAGE_VERSION,
+                          0,
+                          usage_state.cluster_size,
+                          usage_state.cluster_count,
+                          0, // the generation goes in last
+                          usage_state.stamp,
+                          usage_state.used_clusters,
+                          usage_state.dir_count,
+                          names_size};
+  int failed = pwrite(usage_state.fd, &header, sizeof(header), 0) != sizeof(header) ||
+               pwrite(usage_state.fd, body, offset, sizeof(header)) != (ssize_t)offset ||
+               ftruncate(usage_state.fd, sizeof(header) + offset) != 0 ||
+               pwrite(usage_state.fd, &usage_state.generation, sizeof(uint64_t),
+                      offsetof(UsageHeader_t, generation)) != sizeof(uint64_t);
+  free(body);
+  return failed;
+}
+
+// Opens <disk_image>.usage, rebuilding it from the volume when it is missing
+// or the image changed since it was saved
+int usage_open(FILE* disk, const char* disk_name, BootSec_t* boot_sec) {
+
+  snprintf(usage_state.path, sizeof(usage_state.path), "%s.usage", disk_name);
+  usage_state.disk = disk;
+  usage_state.boot_sec = boot_sec;
+  usage_state.cluster_size = boot_sec->BPB_BytsPerSec * boot_sec->BPB_SecPerClus;
+  usage_state.cluster_count = cluster_count(boot_sec);
+  usage_state.fd = open(usage_state.path, O_RDWR | O_CREAT, 0644);
+  if (usage_state.fd < 0) {
+
+    fprintf(cmd_err(), "Failed to open usage table %s\n", usage_state.path);
+    return 1;
+  }
+  usage_state.active = 1;
+
+  if (load_table(disk) != 0) {
+
+    if (rebuild(disk) != 0 || usage_flush(disk) != 0) {
+
+      fprintf(cmd_err(), "Failed to build usage table %s\n", usage_state.path);
+      usage_close(disk);
+      return 1;
+    }
+    fprintf(cmd_out(), "Built usage table %s for %u directories\n", usage_state.path,
+            usage_state.dir_count);
+  }
+  return 0;
+}
+
+void usage_close(FILE* disk) {
+
+  if (usage_state.active) {
+
+    // the log may have applied writes after the last save; the table has them
+    ImageStamp_t stamp;
+    if (image_stamp(disk, usage_state.boot_sec, &stamp) != 0 ||
+        memcmp(&stamp, &usage_state.stamp, sizeof(stamp)) != 0) {
+
+      usage_state.dirty = 1;
+    }
+    usage_flush(disk);
+    fdatasync(usage_state.fd);
+  }
+  if (usage_state.fd >= 0) {
+
+    close(usage_state.fd);
+  }
+  clear_dirs();
+  free(usage_state.dirs);
+  usage_state.dirs = NULL;
+  usage_state.dir_capacity = 0;
+  usage_state.fd = -1;
+  usage_state.disk = NULL;
+  usage_state.boot_sec = NULL;
+  usage_state.active = 0;
+  usage_state.dirty = usage_state.stale = 0;
+}
+
+int usage_active(void) {
+
+  return usage_state.active;
+}
+
+// The first write since the last save clears the saved generation, so a
+// session that dies before its flush leaves a table that is rebuilt
+void usage_note_write(void) {
+
+  if (!usage_state.active || usage_state.dirty) {
+
+    return;
+  }
+  usage_state.dirty = 1;
+  uint64_t none = 0;
+  if (pwrite(usage_state.fd, &none, sizeof(none), offsetof(UsageHeader_t, generation)) !=
+      sizeof(none)) {
+
+    usage_state.stale = 1;
+  }
+}
+
+// Change in the number of allocated clusters of the volume
+void usage_note_fat(int64_t clusters) {
+
+  if (usage_state.active) {
+
+    usage_state.used_clusters += clusters;
+  }
+}
+
+// Files added to or removed from dir, with their bytes and clusters
+void usage_note_entry(uint32_t dir, int64_t bytes, int64_t clusters, int32_t files) {
+
+  if (!usage_state.active) {
+
+    return;
+  }
+  UsageDir_t* found = find_dir(dir);
+  if (!found) {
+
+    usage_state.stale = 1;
+    return;
+  }
+  found->record.bytes += bytes;
+  found->record.clusters += clusters;
+  found->record.files += files;
+}
+
+void usage_note_dir_added(uint32_t parent, uint32_t cluster, const char* name, uint32_t clusters) {
+
+  if (!usage_state.active) {
+
+    return;
+  }
+  UsageDir_t* dir = find_dir(parent) ? add_dir(cluster, parent, name, strlen(name)) : NULL;
+  if (!dir) {
+
+    usage_state.stale = 1;
+    return;
+  }
+  dir->record.clusters = clusters;
+  find_dir(parent)->record.subdirs++; // add_dir may have moved the records
+}
+
+// Drops a directory and everything below it
+void usage_note_dir_removed(uint32_t parent, uint32_t cluster) {
+
+  if (!usage_state.active) {
+
+    return;
+  }
+  UsageDir_t* parent_dir = find_dir(parent);
+  UsageDir_t* dir = find_dir(cluster);
+  uint8_t* doomed = calloc(usage_state.dir_count + 1, 1);
+  uint32_t* clusters = malloc((usage_state.dir_count + 1) * sizeof(uint32_t));
+  if (!parent_dir || !dir || !doomed || !clusters) {
+
+    usage_state.stale = 1;
+    free(doomed);
+    free(clusters);
+    return;
+  }
+  parent_dir->record.subdirs--;
+
+  // one pass per level of the subtree marks the children of marked directories
+  doomed[dir - usage_state.dirs] = 1;
+  int changed = 1;
+  while (changed) {
+
+    changed = 0;
+    for (uint32_t i = 0; i < usage_state.dir_count; i++) {
+
+      UsageDir_t* up = doomed[i] ? NULL : find_dir(usage_state.dirs[i].record.parent);
+      if (up && doomed[up - usage_state.dirs]) {
+
+        doomed[i] = 1;
+        changed = 1;
+      }
+    }
+  }
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < usage_state.dir_count; i++) {
+
+    if (doomed[i]) {
+
+      clusters[count++] = usage_state.dirs[i].record.cluster;
+    }
+  }
+  for (uint32_t i = 0; i < count; i++) {
+
+    remove_dir(find_dir(clusters[i]));
+  }
+  free(doomed);
+  free(clusters);
+}
+
+// A directory chain now starts at another cluster
+void usage_note_dir_moved(uint32_t from, uint32_t to) {
+
+  if (!usage_state.active || from == to) {
+
+    return;
+  }
+  UsageDir_t* dir = find_dir(from);
+  if (!dir || find_dir(to)) {
+
+    usage_state.stale = 1;
+    return;
+  }
+  unlink_slot(from);
+  dir->record.cluster = to;
+  usage_state.slots[slot_find(to)] = dir - usage_state.dirs + 1;
+  for (uint32_t i = 0; i < usage_state.dir_count; i++) {
+
+    if (usage_state.dirs[i].record.parent == from) {
+
+      usage_state.dirs[i].record.parent = to;
+    }
+  }
+}
+
+void usage_invalidate(void) {
+
+  if (usage_state.active) {
+
+    usage_state.stale = 1;
+  }
+}
+
+// Saves the table after a command that wrote to the image, under a new
+// generation and the image's stamp as it is now
+int usage_flush(FILE* disk) {
+
+  if (!usage_state.active || (!usage_state.dirty && !usage_state.stale)) {
+
+    return 0;
+  }
+  if (usage_state.stale && rebuild(disk) != 0) {
+
+    fprintf(cmd_err(), "Failed to rebuild usage table %s\n", usage_state.path);
+    return 1;
+  }
+  usage_state.generation++;
+  if (save_table(disk) != 0) {
+
+    fprintf(cmd_err(), "Failed to update usage table %s\n", usage_state.path);
+    return 1;
+  }
+  usage_state.dirty = 0;
+  return 0;
+}
+
+int usage_dir(uint32_t cluster, UsageTotals_t* totals) {
+
+  UsageDir_t* dir = (usage_state.active && !usage_state.stale) ? find_dir(cluster) : NULL;
+  if (!dir) {
+
+    return 1;
+  }
+  totals->bytes = dir->record.bytes;
+  totals->clusters = dir->record.clusters;
+  totals->files = dir->record.files;
+  totals->subdirs = dir->record.subdirs;
+  return 0;
+}
+
+uint64_t usage_used_clusters(void) {
+
+  return usage_state.used_clusters;
+}
+
+// Fills result the way parallel_walk does for the tree below cluster, from
+// the table alone
+int usage_subtree(uint32_t cluster, WalkResult_t* result) {
+
+  memset(result, 0, sizeof(WalkResult_t));
+  UsageDir_t* start = (usage_state.active && !usage_state.stale) ? find_dir(cluster) : NULL;
+  if (!start) {
+
+    return 1;
+  }
+
+  // children grouped by parent: those of dir i are children[first[i]..first[i + 1])
+  uint32_t count = usage_state.dir_count;
+  uint32_t* first = calloc((size_t)count + 1, sizeof(uint32_t));
+  uint32_t* fill = malloc((size_t)count * sizeof(uint32_t));
+  uint32_t* children = malloc((size_t)count * sizeof(uint32_t));
+  uint32_t* order = malloc((size_t)count * sizeof(uint32_t)); // walk position -> dir index
+  result->dirs = malloc((size_t)count * sizeof(WalkDir_t));
+  int failed = !first || !fill || !children || !order || !result->dirs;
+  for (uint32_t i = 0; i < count && !failed; i++) {
+
+    UsageDir_t* up = find_dir(usage_state.dirs[i].record.parent);
+    fill[i] = up ? (uint32_t)(up - usage_state.dirs) : UINT32_MAX;
+    if (up) {
+
+      first[fill[i] + 1]++;
+    }
+  }
+  for (uint32_t i = 0; i < count && !failed; i++) {
+
+    first[i + 1] += first[i];
+  }
+  for (uint32_t i = 0; i < count && !failed; i++) {
+
+    if (fill[i] != UINT32_MAX) {
+
+      children[first[fill[i]]++] = i;
+    }
+  }
+  // the fill advanced each start to the next one; shift them back
+  for (uint32_t i = count; i > 0 && !failed; i--) {
+
+    first[i] = first[i - 1];
+  }
+  if (!failed) {
+
+    first[0] = 0;
+    order[0] = start - usage_state.dirs;
+    memset(&result->dirs[0], 0, sizeof(WalkDir_t));
+    result->dirs[0].path = strdup(".");
+    result->dir_count = 1;
+    failed = !result->dirs[0].path;
+  }
+
+  // breadth first, so a directory's position is its id
+  for (uint32_t pos = 0; pos < result->dir_count && !failed; pos++) {
+
+    uint32_t index = order[pos];
+    const UsageDir_t* dir = &usage_state.dirs[index];
+    WalkDir_t* walked = &result->dirs[pos];
+    walked->id = pos;
+    walked->cluster = dir->record.cluster;
+    walked->bytes = dir->record.bytes;
+    walked->clusters = dir->record.clusters;
+    walked->files = dir->record.files;
+    size_t len = strlen(walked->path);
+    for (uint32_t c = first[index]; c < first[index + 1] && result->dir_count < count; c++) {
+
+      const UsageDir_t* child = &usage_state.dirs[children[c]];
+      WalkDir_t* next = &result->dirs[result->dir_count];
+      memset(next, 0, sizeof(WalkDir_t));
+      next->path = malloc(len + child->record.name_len + 2);
+      if (!next->path) {
+
+        failed = 1;
+        break;
+      }
+      memcpy(next->path, walked->path, len);
+      next->path[len] = '/';
+      memcpy(next->path + len + 1, child->name, child->record.name_len + 1);
+      next->parent_id = pos;
+      next->depth = walked->depth + 1;
+      order[result->dir_count++] = children[c];
+    }
+  }
+  free(first);
+  free(fill);
+  free(children);
+  free(order);
+  if (failed) {
+
+    walk_result_free(result);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef USAGE_H
+#define USAGE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bootsec.h"
+#include "walk.h"
+
+// What one directory holds directly: its own chain plus its files' chains
+typedef struct {
+
+  uint64_t bytes;
+  uint64_t clusters;
+  uint32_t files;
+  uint32_t subdirs;
+} UsageTotals_t;
+
+int usage_open(FILE* disk, const char* disk_name, BootSec_t* boot_sec);
+void usage_close(FILE* disk);
+int usage_active(void);
+void usage_note_write(void);
+void usage_note_fat(int64_t clusters);
+void usage_note_entry(uint32_t dir, int64_t bytes, int64_t clusters, int32_t files);
+void usage_note_dir_added(uint32_t parent, uint32_t cluster, const char* name, uint32_t clusters);
+void usage_note_dir_removed(uint32_t parent, uint32_t cluster);
+void usage_note_dir_moved(uint32_t from, uint32_t to);
+void usage_invalidate(void);
+int usage_flush(FILE* disk);
+int usage_dir(uint32_t cluster, UsageTotals_t* totals);
+uint64_t usage_used_clusters(void);
+int usage_subtree(uint32_t cluster, WalkResult_t* result);
+
+#endif // USAGE_H
@@ -1,115 +1,315 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "directory.h"
+#include "extent.h"
+#include "fat.h"
+#include "integrity.h"
+#include "journal.h"
+#include "overlay.h"
+#include "pathindex.h"
+#include "prefetch.h"
+#include "shortname.h"
+#include "unicode.h"
+#include "usage.h"
 #include "utility.h"
 
 extern int format_disk(const char* filename);
-extern void list_dir(FILE* disk, BootSec_t* boot_sec, uint32_t cluster);
+extern void list_dir(FILE* disk, BootSec_t* boot_sec, uint32_t cluster, const char* args);
 extern void mkdir(FILE* disk, BootSec_t* boot_sec, const char* path, uint32_t current_clus);
 extern int change_dir(FILE* disk, BootSec_t* boot_sec, const char* path, uint32_t* current_clus);
 extern void touch(FILE* disk, BootSec_t* boot_sec, char* path, uint32_t current_clus);
+extern void find(FILE* disk, BootSec_t* boot_sec, const char* args, uint32_t current_clus);
+extern void du(FILE* disk, BootSec_t* boot_sec, const char* args, uint32_t current_clus);
+extern void tree(FILE* disk, BootSec_t* boot_sec, const char* args, uint32_t current_clus);
+extern void populate(FILE* disk, BootSec_t* boot_sec, const char* args, uint32_t current_clus);
+extern void remove_entry(FILE* disk, BootSec_t* boot_sec, const char* args, uint32_t current_clus);
+extern void remove_dir(FILE* disk, BootSec_t* boot_sec, const char* args, uint32_t current_clus);
+extern void defrag(FILE* disk, BootSec_t* boot_sec, const char* args, uint32_t* current_clus);
+extern void cat_file(FILE* disk, BootSec_t* boot_sec, const char* name, uint32_t current_clus);
+extern void read_file(FILE* disk, BootSec_t* boot_sec, const char* args, uint32_t current_clus);
+extern void export_sparse(FILE* disk, BootSec_t* boot_sec, const char* args, uint32_t current_clus);
+extern void scrub(FILE* disk, BootSec_t* boot_sec, const char* args, uint32_t current_clus);
+extern void diff_image(FILE* disk, BootSec_t* boot_sec, const char* args, uint32_t current_clus);
+
+#define ZERO_PAGE_BYTES 4096
+#define ZERO_IOV_MAX 256 // 1 MiB of zeroes per call
+
+static const uint8_t zero_page[ZERO_PAGE_BYTES];
+
+// Streams a command prints to. They are per thread so that the server (see
+// server.c) can run commands for several clients at once; everywhere else
+// they are stdout and stderr.
+static __thread FILE* thread_out;
+static __thread FILE* thread_err;
+static __thread uint32_t thread_errors; // every error a command reports goes through cmd_err
+
+FILE* cmd_out(void) {
+
+  return thread_out ? thread_out : stdout;
+}
 
-void read_sector(FILE* disk, uint32_t sector, uint8_t* buffer, uint16_t sector_size) {
+FILE* cmd_err(void) {
 
-  fseek(disk, sector * sector_size, SEEK_SET);
-  fread(buffer, 1, sector_size, disk);
+  thread_errors++;
+  return thread_err ? thread_err : stderr;
 }
 
-void write_sector(FILE* disk, uint32_t sector, const uint8_t* buffer, uint16_t sector_size) {
+// Errors reported on this thread so far; a command failed when it moved
+uint32_t cmd_error_count(void) {
 
-  fseek(disk, sector * sector_size, SEEK_SET);
-  fwrite(buffer, 1, sector_size, disk);
+  return thread_errors;
 }
 
-uint32_t get_next_cluster(FILE* disk, uint32_t cluster, uint16_t sector_size, uint16_t rsrvd_sec) {
+void cmd_set_output(FILE* out, FILE* err) {
 
-  uint32_t fat_sector = rsrvd_sec + (cluster * 4) / sector_size;
-  uint32_t offset = (cluster * 4) % sector_size;
-  uint8_t* sector_buffer = malloc(sector_size);
-  if (sector_buffer == NULL) {
+  thread_out = out;
+  thread_err = err;
+}
+
+// Positional I/O on the underlying descriptor: no shared file offset, so
+// concurrent readers (see walk.c) never race on a seek. With an overlay
+// open, the image is the base with the delta on top.
+ssize_t image_pread(FILE* disk, void* buffer, size_t size, off_t offset) {
 
-    fprintf(stderr, "Memory allocation failed\n");
-    return 1;
+  if (overlay_covers(disk)) {
+
+    return overlay_pread(buffer, size, offset);
   }
+  return pread(fileno(disk), buffer, size, offset);
+}
 
-  read_sector(disk, fat_sector, sector_buffer, sector_size);
-  uint32_t next_clus = *((uint32_t*)(sector_buffer + offset)) & 0x0FFFFFFF;
-  free(sector_buffer);
-  return next_clus;
+// Every write to the volume is announced here exactly once, before it lands
+// in the image or in the write-ahead log, to whatever keeps state about it
+static void note_image_write(off_t offset, size_t size) {
+
+  integrity_note_write(offset, size);
+  usage_note_write();
+  prefetch_note_write(offset, size);
+  path_index_note_write(offset, size);
+  fat_note_write(offset, size);
 }
 
-uint32_t get_free_cluster(FILE* disk, BootSec_t* boot_sec) {
+static ssize_t raw_pwrite(FILE* disk, const void* buffer, size_t size, off_t offset) {
 
-  for (uint32_t cluster = 2; cluster < (boot_sec->BPB_TotSec32 / boot_sec->BPB_SecPerClus);
-       cluster++) {
+  if (overlay_covers(disk)) {
 
-    if (get_next_cluster(disk, cluster, boot_sec->BPB_BytsPerSec, boot_sec->BPB_RsvdSecCnt) == 0) {
+    return overlay_pwrite(buffer, size, offset);
+  }
+  return pwrite(fileno(disk), buffer, size, offset);
+}
 
-      return cluster;
+ssize_t image_pwrite(FILE* disk, const void* buffer, size_t size, off_t offset) {
+
+  note_image_write(offset, size);
+  return raw_pwrite(disk, buffer, size, offset);
+}
+
+// Zeroes a byte range of the image. The file system does it without moving
+// any data where it can; otherwise one vectored write repeats a shared zero
+// page across the whole range.
+int image_zero(FILE* disk, off_t offset, size_t size) {
+
+  note_image_write(offset, size);
+  if (!overlay_covers(disk) &&
+      fallocate(fileno(disk), FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, size) == 0) {
+
+    return 0;
+  }
+  while (size > 0) {
+
+    struct iovec iov[ZERO_IOV_MAX];
+    int count = 0;
+    size_t chunk = 0;
+    while (count < ZERO_IOV_MAX && chunk < size) {
+
+      size_t piece = (size - chunk < ZERO_PAGE_BYTES) ? size - chunk : ZERO_PAGE_BYTES;
+      iov[count++] = (struct iovec){(void*)zero_page, piece};
+      chunk += piece;
+    }
+    ssize_t res;
+    if (overlay_covers(disk)) {
+
+      res = 0; // copy on write works block by block anyway
+      for (int i = 0; i < count && res >= 0; i++) {
+
+        ssize_t part = overlay_pwrite(zero_page, iov[i].iov_len, offset + res);
+        res = (part == (ssize_t)iov[i].iov_len) ? res + part : -1;
+      }
+    } else {
+
+      res = pwritev(fileno(disk), iov, count, offset);
     }
+    if (res <= 0) {
+
+      return 1;
+    }
+    offset += res;
+    size -= res;
   }
-  return 0; // No free clusters
+  return 0;
 }
 
-void update_fat(FILE* disk, uint32_t cluster, uint32_t value, uint16_t sector_size,
-                uint16_t rsrvd_sec) {
+void read_sector(FILE* disk, uint32_t sector, uint8_t* buffer, uint16_t sector_size) {
 
-  uint32_t fat_sector = rsrvd_sec + (cluster * 4) / sector_size;
-  uint32_t offset = (cluster * 4) % sector_size;
-  uint8_t* sector_buffer = malloc(sector_size);
-  if (!sector_buffer) {
+  if (journal_read(sector, buffer, sector_size)) {
+
+    return; // newer image still waiting for its group commit
+  }
+  if (image_pread(disk, buffer, sector_size, (off_t)sector * sector_size) != sector_size) {
+
+    memset(buffer, 0, sector_size);
+  }
+}
+
+void write_sector(FILE* disk, uint32_t sector, const uint8_t* buffer, uint16_t sector_size) {
+
+  note_image_write((off_t)sector * sector_size, sector_size);
+  int logged = journal_write(disk, sector, buffer, sector_size);
+  if (logged > 0) {
 
-    fprintf(stderr, "Memory allocation failed\n");
     return;
   }
+  if (logged < 0 ||
+      raw_pwrite(disk, buffer, sector_size, (off_t)sector * sector_size) != sector_size) {
 
-  read_sector(disk, fat_sector, sector_buffer, sector_size);
-  *((uint32_t*)(sector_buffer + offset)) = value; // cast new value to buffer
-  write_sector(disk, fat_sector, sector_buffer, sector_size);
-  free(sector_buffer);
+    fprintf(cmd_err(), "Failed to write sector %u\n", sector);
+  }
 }
 
-void clear_cluster(FILE* disk, uint32_t cluster, BootSec_t* boot_sec) {
+// Multi-sector variants: one system call for the whole range. Reads see
+// sectors still pending in the write-ahead log, writes go to the log one
+// sector at a time.
+void read_sectors(FILE* disk, uint32_t sector, uint32_t count, uint8_t* buffer,
+                  uint16_t sector_size) {
+
+  size_t size = (size_t)count * sector_size;
+  if (image_pread(disk, buffer, size, (off_t)sector * sector_size) != (ssize_t)size) {
+
+    memset(buffer, 0, size);
+  }
+  journal_read_range(sector, buffer, size, sector_size);
+}
+
+void write_sectors(FILE* disk, uint32_t sector, uint32_t count, const uint8_t* buffer,
+                   uint16_t sector_size) {
+
+  size_t size = (size_t)count * sector_size;
+  if (journal_active()) {
+
+    for (uint32_t i = 0; i < count; i++) {
+
+      write_sector(disk, sector + i, buffer + (size_t)i * sector_size, sector_size);
+    }
+  } else if (image_pwrite(disk, buffer, size, (off_t)sector * sector_size) != (ssize_t)size) {
+
+    fprintf(cmd_err(), "Failed to write sectors %u-%u\n", sector, sector + count - 1);
+  }
+}
+
+// Cluster-granular variants: a run of count clusters starting at cluster in
+// one I/O (the clusters must be contiguous on disk)
+void read_clusters(FILE* disk, const BootSec_t* boot_sec, uint32_t cluster, uint32_t count,
+                   uint8_t* buffer) {
+
+  read_sectors(disk, first_sector_of_cluster(boot_sec, cluster), count * boot_sec->BPB_SecPerClus,
+               buffer, boot_sec->BPB_BytsPerSec);
+}
+
+void write_clusters(FILE* disk, const BootSec_t* boot_sec, uint32_t cluster, uint32_t count,
+                    const uint8_t* buffer) {
+
+  write_sectors(disk, first_sector_of_cluster(boot_sec, cluster), count * boot_sec->BPB_SecPerClus,
+                buffer, boot_sec->BPB_BytsPerSec);
+}
+
+void zero_clusters(FILE* disk, const BootSec_t* boot_sec, uint32_t cluster, uint32_t count) {
 
   uint16_t sector_size = boot_sec->BPB_BytsPerSec;
-  uint8_t* buffer = malloc(sector_size);
-  if (!buffer) {
+  uint32_t sector = first_sector_of_cluster(boot_sec, cluster);
+  uint32_t sectors = count * boot_sec->BPB_SecPerClus;
+  if (journal_active() && sector_size <= ZERO_PAGE_BYTES) {
 
-    fprintf(stderr, "Memory allocation failed\n");
+    // the log needs an image of every sector, zeroes included
+    for (uint32_t i = 0; i < sectors; i++) {
+
+      write_sector(disk, sector + i, zero_page, sector_size);
+    }
     return;
   }
-  memset(buffer, 0, sector_size);
+  if (image_zero(disk, (off_t)sector * sector_size, (size_t)sectors * sector_size) != 0) {
+
+    fprintf(cmd_err(), "Failed to clear clusters %u-%u\n", cluster, cluster + count - 1);
+  }
+}
+
+uint32_t first_sector_of_cluster(const BootSec_t* boot_sec, uint32_t cluster) {
 
-  // compute first sector of the data region
   uint32_t fat_size = (boot_sec->BPB_FATSz16 == 0) ? boot_sec->BPB_FATSz32 : boot_sec->BPB_FATSz16;
-  uint32_t root_dir_sectors = ((boot_sec->BPB_RootEntCnt * 32) + (sector_size - 1)) / sector_size;
-  uint32_t first_data_sector =
-      boot_sec->BPB_RsvdSecCnt + (boot_sec->BPB_NumFATs * fat_size) + root_dir_sectors;
-  uint32_t first_sector_clus = ((cluster - 2) * boot_sec->BPB_SecPerClus) + first_data_sector;
+  uint32_t first_data_sector = boot_sec->BPB_RsvdSecCnt + (boot_sec->BPB_NumFATs * fat_size);
+  return first_data_sector + (cluster - 2) * boot_sec->BPB_SecPerClus;
+}
 
-  for (uint32_t i = 0; i < boot_sec->BPB_SecPerClus; i++) {
+uint32_t get_next_cluster(FILE* disk, uint32_t cluster, uint16_t sector_size, uint16_t rsrvd_sec) {
+
+  uint32_t next_clus;
+  if (prefetch_fat_entry(cluster, &next_clus)) {
 
-    write_sector(disk, first_sector_clus + i, buffer, sector_size);
+    return next_clus;
   }
+  uint32_t fat_sector = rsrvd_sec + (cluster * 4) / sector_size;
+  uint32_t offset = (cluster * 4) % sector_size;
+  uint8_t sector_buffer[sector_size];
 
-  free(buffer);
+  read_sector(disk, fat_sector, sector_buffer, sector_size);
+  memcpy(&next_clus, sector_buffer + offset, sizeof(next_clus));
+  return next_clus & 0x0FFFFFFF;
 }
 
-static void fill_idle(const char* src, size_t src_size, uint16_t* dst, size_t dst_size) {
+uint32_t get_free_cluster(FILE* disk, BootSec_t* boot_sec) {
 
-  for (size_t i = 0; i < dst_size; i++) {
+  for (uint32_t cluster = 2; cluster < (boot_sec->BPB_TotSec32 / boot_sec->BPB_SecPerClus);
+       cluster++) {
 
-    if (i > src_size) {
+    // runs the path index knows to be fully allocated are skipped unread
+    uint32_t full = path_index_full_run(cluster);
+    if (full > 0) {
 
-      dst[i] = 0xFFFF;
-    } else {
+      cluster += full - 1;
+      continue;
+    }
+    if (get_next_cluster(disk, cluster, boot_sec->BPB_BytsPerSec, boot_sec->BPB_RsvdSecCnt) == 0) {
 
-      dst[i] = (uint16_t)src[i];
+      return cluster;
     }
   }
+  return 0; // No free clusters
+}
+
+void update_fat(FILE* disk, uint32_t cluster, uint32_t value, uint16_t sector_size,
+                uint16_t rsrvd_sec) {
+
+  uint32_t fat_sector = rsrvd_sec + (cluster * 4) / sector_size;
+  uint32_t offset = (cluster * 4) % sector_size;
+  uint8_t sector_buffer[sector_size];
+
+  read_sector(disk, fat_sector, sector_buffer, sector_size);
+  uint32_t old;
+  memcpy(&old, sector_buffer + offset, sizeof(old));
+  usage_note_fat(((value & 0x0FFFFFFF) != 0) - ((old & 0x0FFFFFFF) != 0));
+  memcpy(sector_buffer + offset, &value, sizeof(value));
+  write_sector(disk, fat_sector, sector_buffer, sector_size);
+}
+
+void clear_cluster(FILE* disk, uint32_t cluster, BootSec_t* boot_sec) {
+
+  zero_clusters(disk, boot_sec, cluster, 1);
 }
 
 static uint8_t lfn_checksum(const uint8_t* name) {
@@ -125,40 +325,32 @@ static uint8_t lfn_checksum(const uint8_t* name) {
   return (sum);
 }
 
-static void generate_lfn_short_name(const char* lfn, char* short_name, uint8_t* nt_res,
-                                    void (*generate_short_name)(const char*, char*, uint8_t*)) {
+// Derives the basis name and gives it the first free numeric tail in names
+static int generate_lfn_short_name(const char* lfn, char* short_name, uint8_t* nt_res,
+                                   void (*generate_short_name)(const char*, char*, uint8_t*),
+                                   ShortNameSet_t* names) {
 
-  int count = 1;
   generate_short_name(lfn, short_name, nt_res);
-
-  if (count > 9) {
-
-    short_name[6] = '~';
-    short_name[7] = '1' + count % 10;
-  } else {
-
-    short_name[6] = '~';
-    short_name[7] = '0' + count;
-  }
-  count++;
+  *nt_res = 0; // the long name carries the case
+  return short_name_make_unique(names, lfn, short_name);
 }
 
-int create_lfn_entries(const char* lfn, size_t lfn_len, uint8_t* sector_buffer, char* short_name,
-                       uint8_t* nt_res, void (*generate_short_name)(const char*, char*, uint8_t*)) {
+int write_lfn_entries(const char* lfn, size_t lfn_len, uint8_t* sector_buffer,
+                      const char* short_name) {
 
-  int num_entries = (lfn_len + 12) / 13;
+  // a name longer than FAT allows is cut after its last whole code point
+  uint16_t units[MAX_LFN_ENTRIES * 13];
+  utf8_to_utf16(lfn, lfn_len, units, MAX_MAME_LEN);
+  size_t unit_count = utf8_utf16_fit(lfn, lfn_len, MAX_MAME_LEN);
 
-  generate_lfn_short_name(lfn, short_name, nt_res, generate_short_name);
-  uint8_t checksum = lfn_checksum((uint8_t*)short_name);
+  int num_entries = (unit_count + 12) / 13;
+  uint8_t checksum = lfn_checksum((const uint8_t*)short_name);
 
-  uint16_t name1[5] = {0};
-  uint16_t name2[6] = {0};
-  uint16_t name3[2] = {0};
+  // a name that does not fill its last entry is terminated, then padded
+  for (size_t i = unit_count; i < (size_t)num_entries * 13; i++) {
 
-  char src[num_entries * 13];
-  memset(src, '\0', num_entries * 13); // populate array with size of filled
-                                       // lfn entries with whitespaces
-  memcpy(src, lfn, lfn_len);
+    units[i] = (i == unit_count) ? 0x0000 : 0xFFFF;
+  }
 
   for (int i = 0; i < num_entries; i++) {
 
@@ -166,21 +358,10 @@ int create_lfn_entries(const char* lfn, size_t lfn_len, uint8_t* sector_buffer,
     LFNStr_t* lfn_entry = (LFNStr_t*)(sector_buffer + entry_idx * sizeof(LFNStr_t));
     memset(lfn_entry, 0, sizeof(LFNStr_t));
 
-    size_t src_size = 13;
-    const char* src_ptr = src + 13 * i;
-
-    if (i == num_entries - 1) {
-
-      src_size = lfn_len - 13 * (num_entries - 1);
-    }
-
-    fill_idle(src_ptr, src_size, name1, 5);
-    fill_idle(src_ptr + 5, src_size - 5, name2, 6);
-    fill_idle(src_ptr + 11, src_size - 11, name3, 2);
-
-    memcpy(lfn_entry->LDIR_Name1, name1, sizeof(name1));
-    memcpy(lfn_entry->LDIR_Name2, name2, sizeof(name2));
-    memcpy(lfn_entry->LDIR_Name3, name3, sizeof(name3));
+    const uint16_t* src = units + 13 * i;
+    memcpy(lfn_entry->LDIR_Name1, src, sizeof(lfn_entry->LDIR_Name1));
+    memcpy(lfn_entry->LDIR_Name2, src + 5, sizeof(lfn_entry->LDIR_Name2));
+    memcpy(lfn_entry->LDIR_Name3, src + 11, sizeof(lfn_entry->LDIR_Name3));
 
     lfn_entry->LDIR_Ord = i + 1;
     if (i == num_entries - 1) {
@@ -193,6 +374,18 @@ int create_lfn_entries(const char* lfn, size_t lfn_len, uint8_t* sector_buffer,
   return num_entries;
 }
 
+// Returns the number of LFN entries written, or -1 when no unique 8.3 name is left
+int create_lfn_entries(const char* lfn, size_t lfn_len, uint8_t* sector_buffer, char* short_name,
+                       uint8_t* nt_res, void (*generate_short_name)(const char*, char*, uint8_t*),
+                       ShortNameSet_t* names) {
+
+  if (generate_lfn_short_name(lfn, short_name, nt_res, generate_short_name, names) != 0) {
+
+    return -1;
+  }
+  return write_lfn_entries(lfn, lfn_len, sector_buffer, short_name);
+}
+
 void get_fat_time_date(uint16_t* fat_date, uint16_t* fat_time, uint8_t* fat_time_tenth) {
 
   time_t now = time(NULL);
@@ -214,7 +407,8 @@ static void update_cwd(char* cwd, char* path) {
     strcpy(temp_cwd, cwd);
   }
 
-  char* token = strtok(path, "/");
+  char* save;
+  char* token = strtok_r(path, "/", &save);
   while (token != NULL) {
 
     if (strncmp(token, "..", 2) == 0) {
@@ -235,7 +429,7 @@ static void update_cwd(char* cwd, char* path) {
       }
       strcat(temp_cwd, token);
     }
-    token = strtok(NULL, "/");
+    token = strtok_r(NULL, "/", &save);
   }
   strcpy(cwd, temp_cwd);
 }
@@ -245,14 +439,20 @@ void handle_command(FILE* disk, const char* disk_name, BootSec_t* boot_sec, uint
 
   if (!*is_fat32) {
 
-    if (strncmp(command, "format", 6) == 0) {
+    if (strncmp(command, "format", 6) == 0 && overlay_active()) {
 
+      fprintf(cmd_err(), "Cannot format through an overlay, format the base image instead\n");
+    } else if (strncmp(command, "format", 6) == 0) {
+
+      journal_sync(disk);
+      extent_cache_clear();
+      short_name_cache_invalidate();
       fclose(disk);
       format_disk(disk_name);
       disk = fopen(disk_name, "r+b");
       if (!disk) {
 
-        fprintf(stderr, "Failed to open disk image after formatting: %s\n", disk_name);
+        fprintf(cmd_err(), "Failed to open disk image after formatting: %s\n", disk_name);
         exit(-1);
       }
       read_boot_sector(disk, boot_sec);
@@ -260,17 +460,26 @@ void handle_command(FILE* disk, const char* disk_name, BootSec_t* boot_sec, uint
       *current_clus = boot_sec->BPB_RootClus;
     } else {
 
-      fprintf(stderr, "Unknown disk format\n");
+      fprintf(cmd_err(), "Unknown disk format\n");
     }
-  } else if (strncmp(command, "ls", 2) == 0) {
+  } else if (strcmp(command, "sync") == 0) {
+
+    journal_sync(disk);
+  } else if (strcmp(command, "commit") == 0) {
+
+    overlay_commit(NULL);
+  } else if (strncmp(command, "commit ", 7) == 0) {
+
+    overlay_commit(command + 7);
+  } else if (strncmp(command, "ls", 2) == 0 && (command[2] == '\0' || command[2] == ' ')) {
 
-    list_dir(disk, boot_sec, *current_clus);
+    list_dir(disk, boot_sec, *current_clus, command + 2);
   } else if (strncmp(command, "cd ", 3) == 0) {
 
     char* path = command + 3;
     if (change_dir(disk, boot_sec, path, current_clus) == 1) {
 
-      fprintf(stderr, "Failed to change directory: %s\n", path);
+      fprintf(cmd_err(), "Failed to change directory: %s\n", path);
     } else {
 
       update_cwd(cwd, path);
@@ -278,35 +487,60 @@ void handle_command(FILE* disk, const char* disk_name, BootSec_t* boot_sec, uint
   } else if (strncmp(command, "mkdir ", 6) == 0) {
 
     const char* path = command + 6;
-    EntrSt_t* entries = NULL;
-    uint32_t entry_count = 0;
-    read_dir_entries(disk, boot_sec, *current_clus, &entries, &entry_count);
-    uint8_t is_exist = 0;
-    for (size_t i = 0; i < entry_count; ++i) {
-
-      if (strcmp(entries[i].name, path) == 0) {
-
-        fprintf(stderr, "Directory %s already exists\n", path);
-        free(entries);
-        entries = NULL;
-        is_exist = 1;
-        break;
-      }
-    }
-    if (!is_exist) {
+    DirList_t list;
+    uint32_t index;
+    dir_list_load(disk, boot_sec, *current_clus, &list);
+    if (dir_list_find(&list, path, &index)) {
 
-      mkdir(disk, boot_sec, path, *current_clus);
-    }
-    if (entries) {
+      fprintf(cmd_err(), "Directory %s already exists\n", path);
+    } else {
 
-      free(entries);
+      mkdir(disk, boot_sec, path, *current_clus);
     }
+    dir_list_free(&list);
   } else if (strncmp(command, "touch ", 6) == 0) {
 
     char* path = command + 6;
     touch(disk, boot_sec, path, *current_clus);
+  } else if (strncmp(command, "find", 4) == 0 && (command[4] == '\0' || command[4] == ' ')) {
+
+    find(disk, boot_sec, command + 4, *current_clus);
+  } else if (strncmp(command, "du", 2) == 0 && (command[2] == '\0' || command[2] == ' ')) {
+
+    du(disk, boot_sec, command + 2, *current_clus);
+  } else if (strncmp(command, "tree", 4) == 0 && (command[4] == '\0' || command[4] == ' ')) {
+
+    tree(disk, boot_sec, command + 4, *current_clus);
+  } else if (strncmp(command, "populate", 8) == 0 && (command[8] == '\0' || command[8] == ' ')) {
+
+    populate(disk, boot_sec, command + 8, *current_clus);
+  } else if (strncmp(command, "rm ", 3) == 0) {
+
+    remove_entry(disk, boot_sec, command + 3, *current_clus);
+  } else if (strncmp(command, "rmdir ", 6) == 0) {
+
+    remove_dir(disk, boot_sec, command + 6, *current_clus);
+  } else if (strncmp(command, "defrag", 6) == 0 && (command[6] == '\0' || command[6] == ' ')) {
+
+    defrag(disk, boot_sec, command + 6, current_clus);
+  } else if (strncmp(command, "cat ", 4) == 0) {
+
+    cat_file(disk, boot_sec, command + 4, *current_clus);
+  } else if (strncmp(command, "read ", 5) == 0) {
+
+    read_file(disk, boot_sec, command + 5, *current_clus);
+  } else if (strncmp(command, "export-sparse", 13) == 0 &&
+             (command[13] == '\0' || command[13] == ' ')) {
+
+    export_sparse(disk, boot_sec, command + 13, *current_clus);
+  } else if (strncmp(command, "scrub", 5) == 0 && (command[5] == '\0' || command[5] == ' ')) {
+
+    scrub(disk, boot_sec, command + 5, *current_clus);
+  } else if (strncmp(command, "diff ", 5) == 0) {
+
+    diff_image(disk, boot_sec, command + 5, *current_clus);
   } else {
 
-    fprintf(stderr, "Unknown command: %s\n", command);
+    fprintf(cmd_err(), "Unknown command: %s\n", command);
   }
 }
@@ -3,17 +3,39 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 #include "bootsec.h"
+#include "shortname.h"
 
+FILE* cmd_out(void);
+FILE* cmd_err(void);
+uint32_t cmd_error_count(void);
+void cmd_set_output(FILE* out, FILE* err);
+ssize_t image_pread(FILE* disk, void* buffer, size_t size, off_t offset);
+ssize_t image_pwrite(FILE* disk, const void* buffer, size_t size, off_t offset);
+int image_zero(FILE* disk, off_t offset, size_t size);
 void read_sector(FILE* disk, uint32_t sector, uint8_t* buffer, uint16_t sector_size);
 void write_sector(FILE* disk, uint32_t sector, const uint8_t* buffer, uint16_t sector_size);
+void read_sectors(FILE* disk, uint32_t sector, uint32_t count, uint8_t* buffer,
+                  uint16_t sector_size);
+void write_sectors(FILE* disk, uint32_t sector, uint32_t count, const uint8_t* buffer,
+                   uint16_t sector_size);
+void read_clusters(FILE* disk, const BootSec_t* boot_sec, uint32_t cluster, uint32_t count,
+                   uint8_t* buffer);
+void write_clusters(FILE* disk, const BootSec_t* boot_sec, uint32_t cluster, uint32_t count,
+                    const uint8_t* buffer);
+void zero_clusters(FILE* disk, const BootSec_t* boot_sec, uint32_t cluster, uint32_t count);
+uint32_t first_sector_of_cluster(const BootSec_t* boot_sec, uint32_t cluster);
 uint32_t get_next_cluster(FILE* disk, uint32_t cluster, uint16_t sector_size, uint16_t rsrvd_sec);
 uint32_t get_free_cluster(FILE* disk, BootSec_t* boot_sec);
 void update_fat(FILE* disk, uint32_t cluster, uint32_t value, uint16_t sector_size,
                 uint16_t rsrvd_sec);
 void clear_cluster(FILE* disk, uint32_t cluster, BootSec_t* boot_sec);
+int write_lfn_entries(const char* lfn, size_t lfn_len, uint8_t* sector_buffer,
+                      const char* short_name);
 int create_lfn_entries(const char* lfn, size_t lfn_len, uint8_t* sector_buffer, char* short_name,
-                       uint8_t* nt_res, void (*generate_short_name)(const char*, char*, uint8_t*));
+                       uint8_t* nt_res, void (*generate_short_name)(const char*, char*, uint8_t*),
+                       ShortNameSet_t* names);
 void get_fat_time_date(uint16_t* fat_date, uint16_t* fat_time, uint8_t* fat_time_tenth);
 #endif // UTILITY_H
@@ -0,0 +1,578 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fat.h"
+#include "integrity.h"
+#include "journal.h"
+#include "readahead.h"
+#include "utility.h"
+#include "walk.h"
+
+#define WALK_MAX_THREADS 64
+
+typedef struct {
+
+  uint32_t cluster;
+  uint32_t id;
+  uint32_t parent_id;
+  uint32_t depth;
+  char* path;
+} WalkTask_t;
+
+// Owner pushes and pops at the tail, idle threads steal from the head
+typedef struct {
+
+  pthread_mutex_t lock;
+  WalkTask_t* tasks;
+  uint32_t head;
+  uint32_t tail;
+  uint32_t capacity;
+} WalkDeque_t;
+
+typedef struct {
+
+  FILE* disk;
+  int fd; // for readahead hints
+  BootSec_t* boot_sec;
+  FatView_t fat;
+  uint32_t cluster_size;
+  uint32_t nthreads;
+  WalkDeque_t* deques;
+  WalkResult_t* partial;
+  uint64_t pending;       // tasks queued or running; the walk ends at zero
+  pthread_mutex_t idle;   // guards posted and the sleep on wake
+  pthread_cond_t wake;    // a task was queued or the walk ended
+  uint64_t posted;        // tasks queued so far
+  uint32_t next_id;
+  uint8_t* visited;
+  uint8_t flags;
+  walk_filter_cb filter;
+  void* filter_ctx;
+  _Atomic int failed; // set by any worker
+} WalkShared_t;
+
+typedef struct {
+
+  WalkShared_t* shared;
+  uint32_t index;
+  uint8_t* buffer;
+  WalkTask_t* task;
+  WalkDir_t* dir;
+  uint32_t* bad; // directory clusters that failed their checksum
+  uint32_t bad_count;
+} WalkWorker_t;
+
+static int deque_push(WalkDeque_t* deque, const WalkTask_t* task) {
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->tail == deque->capacity) {
+
+    if (deque->head > 0) {
+
+      memmove(deque->tasks, deque->tasks + deque->head,
+              (deque->tail - deque->head) * sizeof(WalkTask_t));
+      deque->tail -= deque->head;
+      deque->head = 0;
+    } else {
+
+      uint32_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+      WalkTask_t* grown = realloc(deque->tasks, capacity * sizeof(WalkTask_t));
+      if (!grown) {
+
+        pthread_mutex_unlock(&deque->lock);
+        return 1;
+      }
+      deque->tasks = grown;
+      deque->capacity = capacity;
+    }
+  }
+  deque->tasks[deque->tail++] = *task;
+  pthread_mutex_unlock(&deque->lock);
+  return 0;
+}
+
+static int deque_pop(WalkDeque_t* deque, WalkTask_t* task, int steal) {
+
+  int found = 0;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->head < deque->tail) {
+
+    *task = steal ? deque->tasks[deque->head++] : deque->tasks[--deque->tail];
+    if (deque->head == deque->tail) {
+
+      deque->head = deque->tail = 0;
+    }
+    found = 1;
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return found;
+}
+
+static void* grow_array(void* array, uint32_t count, size_t elem_size) {
+
+  // capacity doubles at every power of two, so the count alone is enough
+  if (count == 0 || (count & (count - 1)) == 0) {
+
+    uint32_t capacity = count ? count * 2 : 16;
+    return realloc(array, capacity * elem_size);
+  }
+  return array;
+}
+
+static char* join_path(const char* parent, const char* name) {
+
+  size_t parent_len = strlen(parent);
+  size_t name_len = strlen(name);
+  char* path = malloc(parent_len + name_len + 2);
+  if (path) {
+
+    memcpy(path, parent, parent_len);
+    path[parent_len] = '/';
+    memcpy(path + parent_len + 1, name, name_len + 1);
+  }
+  return path;
+}
+
+// Queues a task on the worker's own deque and wakes one idle worker to steal it
+static int post_task(WalkShared_t* shared, uint32_t index, const WalkTask_t* task) {
+
+  if (deque_push(&shared->deques[index], task) != 0) {
+
+    return 1;
+  }
+  pthread_mutex_lock(&shared->idle);
+  __atomic_fetch_add(&shared->posted, 1, __ATOMIC_RELEASE);
+  pthread_cond_signal(&shared->wake);
+  pthread_mutex_unlock(&shared->idle);
+  return 0;
+}
+
+// One task fewer outstanding; the last one lets every idle worker go
+static void finish_task(WalkShared_t* shared) {
+
+  if (__atomic_sub_fetch(&shared->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+
+    pthread_mutex_lock(&shared->idle);
+    pthread_cond_broadcast(&shared->wake);
+    pthread_mutex_unlock(&shared->idle);
+  }
+}
+
+static int test_and_set_visited(WalkShared_t* shared, uint32_t cluster) {
+
+  uint8_t bit = 1 << (cluster & 7);
+  uint8_t old = __atomic_fetch_or(&shared->visited[cluster >> 3], bit, __ATOMIC_RELAXED);
+  return (old & bit) != 0;
+}
+
+static int visit_entry(const EntrSt_t* entry, const DIRStr_t* raw, const EntrLoc_t* loc,
+                       void* ctx) {
+
+  (void)raw;
+  (void)loc;
+  WalkWorker_t* worker = ctx;
+  WalkShared_t* shared = worker->shared;
+  WalkResult_t* partial = &shared->partial[worker->index];
+
+  if (strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) {
+
+    return 0;
+  }
+
+  char* path = NULL;
+  if (shared->flags & WALK_EMIT_ENTRIES &&
+      (!shared->filter || shared->filter(entry, shared->filter_ctx))) {
+
+    WalkEntry_t* entries = grow_array(partial->entries, partial->entry_count, sizeof(WalkEntry_t));
+    path = join_path(worker->task->path, entry->name);
+    if (!entries || !path) {
+
+      free(path);
+      shared->failed = 1;
+      return 1;
+    }
+    partial->entries = entries;
+    WalkEntry_t* record = &entries[partial->entry_count++];
+    record->path = path;
+    record->depth = worker->task->depth + 1;
+    record->size = entry->size;
+    record->cluster = entry->cluster;
+    record->attr = entry->attr;
+  }
+
+  if (entry->attr & ATTR_DIRECTORY) {
+
+    if (entry->cluster < 2 || entry->cluster >= shared->fat.count ||
+        test_and_set_visited(shared, entry->cluster)) {
+
+      return 0; // broken or already visited (cross-linked) directory
+    }
+    WalkTask_t task;
+    task.cluster = entry->cluster;
+    task.id = __atomic_fetch_add(&shared->next_id, 1, __ATOMIC_RELAXED);
+    task.parent_id = worker->task->id;
+    task.depth = worker->task->depth + 1;
+    task.path = join_path(worker->task->path, entry->name);
+    __atomic_fetch_add(&shared->pending, 1, __ATOMIC_ACQ_REL);
+    if (!task.path || post_task(shared, worker->index, &task) != 0) {
+
+      free(task.path);
+      finish_task(shared);
+      shared->failed = 1;
+      return 1;
+    }
+  } else {
+
+    worker->dir->bytes += entry->size;
+    worker->dir->clusters += fat_view_chain_length(&shared->fat, entry->cluster);
+    worker->dir->files++;
+  }
+  return 0;
+}
+
+static void process_task(WalkWorker_t* worker, WalkTask_t* task) {
+
+  WalkShared_t* shared = worker->shared;
+  WalkResult_t* partial = &shared->partial[worker->index];
+
+  WalkDir_t* dirs = grow_array(partial->dirs, partial->dir_count, sizeof(WalkDir_t));
+  if (!dirs) {
+
+    free(task->path);
+    shared->failed = 1;
+    return;
+  }
+  partial->dirs = dirs;
+
+  // only this function appends to dirs, so the pointer stays valid for the whole task
+  WalkDir_t* dir = &dirs[partial->dir_count++];
+  memset(dir, 0, sizeof(WalkDir_t));
+  dir->path = task->path;
+  dir->id = task->id;
+  dir->parent_id = task->parent_id;
+  dir->depth = task->depth;
+  dir->cluster = task->cluster;
+
+  worker->task = task;
+  worker->dir = dir;
+
+  DirParser_t parser;
+  dir_parser_init(&parser);
+  uint32_t cluster = task->cluster;
+  uint32_t visited = 0;
+  Readahead_t ra;
+  readahead_init(&ra, shared->fd, shared->boot_sec, fat_view_chain_next, &shared->fat);
+  while (cluster >= 2 && cluster < EOC && visited++ < shared->fat.count) {
+
+    readahead_step(&ra, cluster);
+    uint32_t sector = first_sector_of_cluster(shared->boot_sec, cluster);
+    off_t offset = (off_t)sector * shared->boot_sec->BPB_BytsPerSec;
+    if (image_pread(shared->disk, worker->buffer, shared->cluster_size, offset) !=
+        (ssize_t)shared->cluster_size) {
+
+      shared->failed = 1;
+      break;
+    }
+    journal_read_range(sector, worker->buffer, shared->cluster_size,
+                       shared->boot_sec->BPB_BytsPerSec);
+    dir->clusters++;
+    if (integrity_check(cluster, worker->buffer) != 0) {
+
+      // reported by the calling thread; nothing below this cluster is trusted
+      uint32_t* bad = grow_array(worker->bad, worker->bad_count, sizeof(uint32_t));
+      if (!bad) {
+
+        shared->failed = 1;
+        break;
+      }
+      worker->bad = bad;
+      worker->bad[worker->bad_count++] = cluster;
+      break;
+    }
+    if (parse_dir_cluster(&parser, worker->buffer, shared->cluster_size, cluster, visit_entry,
+                          worker) != 0) {
+
+      break;
+    }
+    cluster = readahead_next(&ra, cluster);
+  }
+}
+
+static void* walk_worker(void* arg) {
+
+  WalkWorker_t* worker = arg;
+  WalkShared_t* shared = worker->shared;
+  WalkTask_t task;
+
+  while (__atomic_load_n(&shared->pending, __ATOMIC_ACQUIRE) > 0) {
+
+    // anything posted after this reading wakes us, even between the scan and the wait
+    uint64_t seen = __atomic_load_n(&shared->posted, __ATOMIC_ACQUIRE);
+    int found = deque_pop(&shared->deques[worker->index], &task, 0);
+    for (uint32_t i = 1; !found && i < shared->nthreads; i++) {
+
+      found = deque_pop(&shared->deques[(worker->index + i) % shared->nthreads], &task, 1);
+    }
+    if (!found) {
+
+      pthread_mutex_lock(&shared->idle);
+      while (shared->posted == seen && __atomic_load_n(&shared->pending, __ATOMIC_ACQUIRE) > 0) {
+
+        pthread_cond_wait(&shared->wake, &shared->idle);
+      }
+      pthread_mutex_unlock(&shared->idle);
+      continue;
+    }
+    process_task(worker, &task);
+    finish_task(shared);
+  }
+  return NULL;
+}
+
+static int cluster_compare(const void* a, const void* b) {
+
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+// Workers have no command streams of their own, so their checksum failures
+// are reported here, in cluster order
+static void report_bad_clusters(WalkWorker_t* workers, uint32_t nthreads) {
+
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < nthreads; i++) {
+
+    count += workers[i].bad_count;
+  }
+  if (count == 0) {
+
+    return;
+  }
+  uint32_t* bad = malloc(count * sizeof(uint32_t));
+  if (!bad) {
+
+    fprintf(cmd_err(), "Checksum mismatch in %u directory clusters\n", count);
+    return;
+  }
+  count = 0;
+  for (uint32_t i = 0; i < nthreads; i++) {
+
+    memcpy(bad + count, workers[i].bad, workers[i].bad_count * sizeof(uint32_t));
+    count += workers[i].bad_count;
+  }
+  qsort(bad, count, sizeof(uint32_t), cluster_compare);
+  for (uint32_t i = 0; i < count; i++) {
+
+    fprintf(cmd_err(), "Checksum mismatch in cluster %u\n", bad[i]);
+  }
+  free(bad);
+}
+
+static int merge_results(WalkShared_t* shared, WalkResult_t* result) {
+
+  uint32_t dir_count = 0, entry_count = 0;
+  for (uint32_t i = 0; i < shared->nthreads; i++) {
+
+    dir_count += shared->partial[i].dir_count;
+    entry_count += shared->partial[i].entry_count;
+  }
+
+  result->dirs = malloc((dir_count ? dir_count : 1) * sizeof(WalkDir_t));
+  result->entries = malloc((entry_count ? entry_count : 1) * sizeof(WalkEntry_t));
+  if (!result->dirs || !result->entries) {
+
+    return 1;
+  }
+  for (uint32_t i = 0; i < shared->nthreads; i++) {
+
+    WalkResult_t* partial = &shared->partial[i];
+    memcpy(result->dirs + result->dir_count, partial->dirs, partial->dir_count * sizeof(WalkDir_t));
+    memcpy(result->entries + result->entry_count, partial->entries,
+           partial->entry_count * sizeof(WalkEntry_t));
+    result->dir_count += partial->dir_count;
+    result->entry_count += partial->entry_count;
+    free(partial->dirs);
+    free(partial->entries);
+    partial->dirs = NULL;
+    partial->entries = NULL;
+  }
+  return 0;
+}
+
+int parallel_walk(FILE* disk, BootSec_t* boot_sec, uint32_t root_cluster, uint32_t nthreads,
+                  uint8_t flags, walk_filter_cb filter, void* filter_ctx, WalkResult_t* result) {
+
+  memset(result, 0, sizeof(WalkResult_t));
+  if (nthreads == 0) {
+
+    nthreads = 1;
+  } else if (nthreads > WALK_MAX_THREADS) {
+
+    nthreads = WALK_MAX_THREADS;
+  }
+
+  WalkShared_t shared;
+  memset(&shared, 0, sizeof(WalkShared_t));
+  shared.disk = disk;
+  shared.fd = fileno(disk);
+  shared.boot_sec = boot_sec;
+  shared.cluster_size = boot_sec->BPB_BytsPerSec * boot_sec->BPB_SecPerClus;
+  shared.nthreads = nthreads;
+  shared.flags = flags;
+  shared.filter = filter;
+  shared.filter_ctx = filter_ctx;
+  shared.next_id = 1;
+  pthread_mutex_init(&shared.idle, NULL);
+  pthread_cond_init(&shared.wake, NULL);
+
+  if (fat_view_load(disk, boot_sec, &shared.fat) != 0) {
+
+    pthread_cond_destroy(&shared.wake);
+    pthread_mutex_destroy(&shared.idle);
+    return 1;
+  }
+
+  shared.visited = calloc(shared.fat.count / 8 + 1, 1);
+  shared.deques = calloc(nthreads, sizeof(WalkDeque_t));
+  shared.partial = calloc(nthreads, sizeof(WalkResult_t));
+  WalkWorker_t* workers = calloc(nthreads, sizeof(WalkWorker_t));
+  pthread_t* threads = calloc(nthreads, sizeof(pthread_t));
+  int failed = !shared.visited || !shared.deques || !shared.partial || !workers || !threads;
+
+  for (uint32_t i = 0; !failed && i < nthreads; i++) {
+
+    pthread_mutex_init(&shared.deques[i].lock, NULL);
+    workers[i].shared = &shared;
+    workers[i].index = i;
+    workers[i].buffer = malloc(shared.cluster_size);
+    failed = !workers[i].buffer;
+  }
+
+  if (!failed) {
+
+    WalkTask_t root = {root_cluster, 0, 0, 0, strdup(".")};
+    if (root_cluster < shared.fat.count) {
+
+      test_and_set_visited(&shared, root_cluster);
+    }
+    shared.pending = 1;
+    failed = !root.path || deque_push(&shared.deques[0], &root) != 0;
+  }
+
+  uint32_t started = 0;
+  for (; !failed && started < nthreads; started++) {
+
+    if (pthread_create(&threads[started], NULL, walk_worker, &workers[started]) != 0) {
+
+      break;
+    }
+  }
+  if (!failed && started == 0) {
+
+    walk_worker(&workers[0]); // could not spawn anything, walk inline
+  }
+  for (uint32_t i = 0; i < started; i++) {
+
+    pthread_join(threads[i], NULL);
+  }
+  report_bad_clusters(workers, failed ? 0 : nthreads);
+
+  if (!failed) {
+
+    failed = shared.failed || merge_results(&shared, result) != 0;
+  }
+
+  for (uint32_t i = 0; shared.deques && i < nthreads; i++) {
+
+    if (workers && workers[i].shared) {
+
+      pthread_mutex_destroy(&shared.deques[i].lock);
+    }
+    free(shared.deques[i].tasks);
+    if (workers) {
+
+      free(workers[i].buffer);
+      free(workers[i].bad);
+    }
+    if (shared.partial) {
+
+      free(shared.partial[i].dirs);
+      free(shared.partial[i].entries);
+    }
+  }
+  free(threads);
+  free(workers);
+  free(shared.partial);
+  free(shared.deques);
+  free(shared.visited);
+  fat_view_free(&shared.fat);
+  pthread_cond_destroy(&shared.wake);
+  pthread_mutex_destroy(&shared.idle);
+
+  if (failed) {
+
+    fprintf(cmd_err(), "Directory walk failed\n");
+    walk_result_free(result);
+    return 1;
+  }
+  return 0;
+}
+
+void walk_result_free(WalkResult_t* result) {
+
+  for (uint32_t i = 0; i < result->dir_count; i++) {
+
+    free(result->dirs[i].path);
+  }
+  for (uint32_t i = 0; i < result->entry_count; i++) {
+
+    free(result->entries[i].path);
+  }
+  free(result->dirs);
+  free(result->entries);
+  memset(result, 0, sizeof(WalkResult_t));
+}
+
+uint32_t walk_parse_threads(const char** args) {
+
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t nthreads = (online > 0) ? (uint32_t)online : 1;
+
+  const char* p = *args;
+  while (*p == ' ') {
+
+    p++;
+  }
+  if (strncmp(p, "-j", 2) == 0) {
+
+    char* end;
+    long value = strtol(p + 2, &end, 10);
+    if (value > 0) {
+
+      nthreads = (uint32_t)value;
+    }
+    p = end;
+    while (*p == ' ') {
+
+      p++;
+    }
+  }
+  *args = p;
+  return nthreads;
+}
+
+// Orders paths so that a directory is immediately followed by its subtree
+int walk_path_compare(const char* a, const char* b) {
+
+  while (*a && *a == *b) {
+
+    a++;
+    b++;
+  }
+  unsigned char ca = (*a == '/') ? 1 : (unsigned char)*a;
+  unsigned char cb = (*b == '/') ? 1 : (unsigned char)*b;
+  return (int)ca - (int)cb;
+}
@@ -0,0 +1,52 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bootsec.h"
+#include "directory.h"
+
+#define WALK_EMIT_ENTRIES 0x01 // record every entry, not only directory totals
+
+// One directory visited by the walk, with the sizes of its direct children
+typedef struct {
+
+  char* path;
+  uint32_t id;
+  uint32_t parent_id;
+  uint32_t depth;
+  uint32_t cluster;
+  uint64_t bytes;    // sum of file sizes directly inside
+  uint64_t clusters; // clusters allocated to the directory and its files
+  uint32_t files;
+} WalkDir_t;
+
+// One entry seen by the walk (only with WALK_EMIT_ENTRIES)
+typedef struct {
+
+  char* path;
+  uint32_t depth;
+  uint32_t size;
+  uint32_t cluster;
+  uint8_t attr;
+} WalkEntry_t;
+
+typedef struct {
+
+  WalkDir_t* dirs;
+  uint32_t dir_count;
+  WalkEntry_t* entries;
+  uint32_t entry_count;
+} WalkResult_t;
+
+// Called from worker threads; return 0 to drop the entry from the result
+typedef int (*walk_filter_cb)(const EntrSt_t* entry, void* ctx);
+
+int parallel_walk(FILE* disk, BootSec_t* boot_sec, uint32_t root_cluster, uint32_t nthreads,
+                  uint8_t flags, walk_filter_cb filter, void* filter_ctx, WalkResult_t* result);
+void walk_result_free(WalkResult_t* result);
+uint32_t walk_parse_threads(const char** args);
+int walk_path_compare(const char* a, const char* b);
+
+#endif // WALK_H